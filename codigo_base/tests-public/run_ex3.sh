@@ -0,0 +1,121 @@
+#!/bin/bash
+
+# Runs the cases in tests-public/jobs3, which restart the server on the same
+# directory once per run, killing it once the outputs of a run are all in.
+#
+# jobs3/<case>/server holds the arguments of the server, but for the jobs
+# directory and the fifo: "<max_threads> <max_backups> [options]", where
+# $WORK stands for a directory kept across the runs of the case.
+# jobs3/<case>/<run>/*.job are the jobs of a run, in the order of the runs,
+# and <run>/wait, if there, the seconds to wait before the kill.
+# <run>/*.client, if any, are fed to clients once the server is up; the cases
+# that have them are skipped unless the client is given.
+# results3/<case>/<run> holds the expected .result and .bck files.
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable> [client]"
+    exit 1
+fi
+executable=$1
+client=$2
+
+test_dir="tests-public/jobs3"
+results_dir="tests-public/results3"
+failed=0
+
+# Output file of the job directory an expected file is compared with
+output_of() {
+    local jobs=$1
+    local name
+    name=$(basename "$2")
+    if [[ $name == *.result ]]; then
+        echo "$jobs/${name%.result}.out"
+    else
+        echo "$jobs/$name"
+    fi
+}
+
+# Whether every expected file of a run matches its output
+outputs_match() {
+    local jobs=$1
+    local expected=$2
+    for result_file in "$expected"/*; do
+        cmp -s "$(output_of "$jobs" "$result_file")" "$result_file" || return 1
+    done
+}
+
+for case_dir in "$test_dir"/*/; do
+    case_name=$(basename "$case_dir")
+    work=$(mktemp -d)
+    jobs="$work/jobs"
+    mkdir "$jobs"
+    read -ra args < "${case_dir}server"
+    args=("${args[@]//\$WORK/$work}")
+
+    for run_dir in "$case_dir"*/; do
+        run=$(basename "$run_dir")
+        expected="$results_dir/$case_name/$run"
+        # Only the jobs of this run are run, the rest is kept
+        rm -f "$jobs"/*.job "$jobs"/*.out "$work/fifo"
+        cp "$run_dir"*.job "$jobs"
+
+        echo -e "\e[34mRunning $case_name/$run: $executable $jobs ${args[*]}\e[0m"
+        ./"$executable" "$jobs" "${args[0]}" "${args[1]}" "$work/fifo" \
+            "${args[@]:2}" >> "$work/log" 2>&1 &
+        pid=$!
+
+        clients=("$run_dir"*.client)
+        if [[ -e ${clients[0]} ]]; then
+            if [[ -z $client ]]; then
+                kill -9 $pid 2>/dev/null
+                wait $pid 2>/dev/null
+                echo -e "\e[33mSkipped $case_name: needs the client\e[0m"
+                break
+            fi
+            # The server makes the fifo once it is up
+            for ((i = 0; i < 100; i++)); do
+                [[ -p "$work/fifo" ]] && break
+                sleep 0.1
+            done
+            for client_file in "${clients[@]}"; do
+                timeout 10 ./"$client" "ex3-$$-$(basename "$client_file" .client)" \
+                    "$work/fifo" < "$client_file" >> "$work/log" 2>&1 &
+            done
+        fi
+
+        # The server never exits on its own
+        for ((i = 0; i < 100; i++)); do
+            outputs_match "$jobs" "$expected" && break
+            kill -0 $pid 2>/dev/null || break
+            sleep 0.1
+        done
+        if [[ -f "${run_dir}wait" ]]; then
+            sleep "$(cat "${run_dir}wait")"
+        else
+            sleep 0.2
+        fi
+        kill -9 $pid 2>/dev/null
+        wait $pid 2>/dev/null
+
+        if grep -q "keeps its tables in memory only" "$work/log"; then
+            echo -e "\e[33mSkipped $case_name: needs KVS_BACKEND=mmap\e[0m"
+            break
+        fi
+        for result_file in "$expected"/*; do
+            output_file=$(output_of "$jobs" "$result_file")
+            filename=$(basename "$output_file")
+            if [[ ! -f "$output_file" ]]; then
+                echo -e "\e[31mOutput file $output_file not found\e[0m"
+                failed=1
+            elif diff "$output_file" "$result_file"; then
+                echo -e "\e[32mTest passed for $filename in $case_name/$run\e[0m"
+            else
+                echo -e "\e[31mTest failed for $filename in $case_name/$run\e[0m"
+                failed=1
+            fi
+        done
+    done
+    rm -rf "$work"
+done
+
+exit $failed
@@ -58,13 +58,17 @@ void handle_response(int mode, int server_response) {
     case OP_CODE_UNSUBSCRIBE:
       print_server_response(server_response, "unsubscribe");
       break;
+    case OP_CODE_EXPIRE:
+      print_server_response(server_response, "expire");
+      break;
     default:
       printf("Unknown operation mode: %d\n", mode);
       break;
   }
 }
 
-int send_message(int mode, const char *key, bool use_req_fd) {
+int send_message(int mode, const char *key, uint32_t ttl_ms,
+                 bool use_req_fd) {
     int pipe_fd;
 
     if (use_req_fd) {
@@ -87,6 +91,11 @@ int send_message(int mode, const char *key, bool use_req_fd) {
           char notif_pipe[40];
         } connect;
         char key[40]; 
+        struct {
+          char key[40];
+          char resp_pipe[40];
+          uint32_t ttl_ms;
+        } expire;
       } data;
     } message;
 
@@ -103,7 +112,8 @@ int send_message(int mode, const char *key, bool use_req_fd) {
       strncpy(message.data.connect.notif_pipe, notif_pipe_path, 
           sizeof(message.data.connect.notif_pipe));
       message_size = sizeof(message);
-    } else if (mode == OP_CODE_SUBSCRIBE || mode == OP_CODE_UNSUBSCRIBE) {
+    } else if (mode == OP_CODE_SUBSCRIBE || mode == OP_CODE_UNSUBSCRIBE ||
+               mode == OP_CODE_EXPIRE) {
       // Subscribe or Unsubscribe Message
       message.opcode = mode;
       strncpy(message.data.connect.req_pipe, req_pipe_path, 
@@ -117,6 +127,10 @@ int send_message(int mode, const char *key, bool use_req_fd) {
           return 1;
       }
       strncpy(message.data.key, key, sizeof(message.data.key));
+      if (mode == OP_CODE_EXPIRE) {
+        // Overlaps the notification pipe, which expire does not need
+        message.data.expire.ttl_ms = ttl_ms;
+      }
       message_size = sizeof(message);
     } else {
       fprintf(stderr, "Invalid operation code\n");
@@ -221,7 +235,7 @@ int kvs_connect(char const *req_pipe_path_arg, char const *resp_pipe_path_arg,
     cleanup_pipes();
     return 1;
   }
-  if(send_message(OP_CODE_CONNECT,NULL,false) == 1){
+  if(send_message(OP_CODE_CONNECT,NULL,0,false) == 1){
     cleanup_pipes();
     return 1;
   }
@@ -232,7 +246,7 @@ int kvs_connect(char const *req_pipe_path_arg, char const *resp_pipe_path_arg,
 
 
 int kvs_disconnect(void) {
-  if (send_message(OP_CODE_DISCONNECT,NULL,true) == 1){
+  if (send_message(OP_CODE_DISCONNECT,NULL,0,true) == 1){
     return 1;
   }
   cleanup_pipes();
@@ -247,11 +261,17 @@ int kvs_disconnect(void) {
 int kvs_subscribe(const char *key) {
   // send subscribe message to request pipe and wait for response in response
   // pipe
-  return send_message(OP_CODE_SUBSCRIBE,key,true); 
+  return send_message(OP_CODE_SUBSCRIBE,key,0,true); 
 }
 
 int kvs_unsubscribe(const char *key) {
   // send unsubscribe message to request pipe and wait for response in response
   // pipe
-  return send_message(OP_CODE_UNSUBSCRIBE,key,true);
+  return send_message(OP_CODE_UNSUBSCRIBE,key,0,true);
+}
+
+int kvs_expire(const char *key, uint32_t ttl_ms) {
+  // send expire message to request pipe and wait for response in response
+  // pipe
+  return send_message(OP_CODE_EXPIRE,key,ttl_ms,true);
 }
@@ -2,6 +2,7 @@
 #define CLIENT_API_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "src/common/constants.h"
 #include <stdbool.h>
@@ -31,7 +32,13 @@ int kvs_subscribe(const char *key);
 
 int kvs_unsubscribe(const char *key);
 
-int send_message(int mode, const char *key, bool use_req_fd) ;
+/// Sets or clears the time to live of a key.
+/// @param key Key to expire
+/// @param ttl_ms Milliseconds until the server deletes the key, 0 to keep it
+/// @return 0 if the TTL was set (key existing), 1 otherwise.
+int kvs_expire(const char *key, uint32_t ttl_ms);
+
+int send_message(int mode, const char *key, uint32_t ttl_ms, bool use_req_fd) ;
 
 /// @brief Open Pipes 
 /// @param req_pipe_path 
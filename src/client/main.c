@@ -8,6 +8,7 @@
 #include "src/client/api.h"
 #include "src/common/constants.h"
 #include "src/common/io.h"
+#include "src/common/protocol.h"
 
 typedef struct {
   char notif_pipe_path[256];
@@ -26,32 +27,43 @@ void *notification_handler(void *arg) {
     return NULL;
   }
 
-  struct {
-    int opcode;
-    char key[MAX_STRING_SIZE];
-    char value[MAX_STRING_SIZE];
-  } message;
+  NotificationHeader header;
 
   while (1) {
-    ssize_t bytes_read = read(notif_fd, &message, sizeof(message));
-    if (bytes_read > 0) {
-      switch (message.opcode) {
-        case 5:
-          printf("(%s,%s)\n", message.key, message.value);
-          break;
-        case 6:
-          printf("(%s,DELETED)\n", message.key);
-          break;
-        default:
-          fprintf(stderr, "Unknown opcode: %d\n", message.opcode);
-          break;
-      }
-    } else if (bytes_read == 0) {
+    int result = read_all(notif_fd, &header, sizeof(header), NULL);
+    if (result == 0) {
       break;
-    } else {
+    } else if (result < 0) {
       perror("Error reading from notification pipe");
       break;
     }
+
+    char *key = malloc(header.key_len + 1);
+    char *value = malloc(header.value_len + 1);
+    if (key == NULL || value == NULL ||
+        read_all(notif_fd, key, header.key_len, NULL) != 1 ||
+        read_all(notif_fd, value, header.value_len, NULL) != 1) {
+      fprintf(stderr, "Failed to read notification\n");
+      free(key);
+      free(value);
+      break;
+    }
+    key[header.key_len] = '\0';
+    value[header.value_len] = '\0';
+
+    switch (header.opcode) {
+      case OP_CODE_NOTIFY_WRITE:
+        printf("(%s,%s)\n", key, value);
+        break;
+      case OP_CODE_NOTIFY_DELETE:
+        printf("(%s,DELETED)\n", key);
+        break;
+      default:
+        fprintf(stderr, "Unknown opcode: %d\n", header.opcode);
+        break;
+    }
+    free(key);
+    free(value);
   }
   close(notif_fd);
   free(notif_args);
@@ -75,6 +87,7 @@ int main(int argc, char *argv[]) {
 
   char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
   unsigned int delay_ms;
+  unsigned int ttl_ms;
   size_t num;
 
   strncat(req_pipe_path, argv[1], strlen(argv[1]) * sizeof(char));
@@ -154,6 +167,19 @@ int main(int argc, char *argv[]) {
 
       break;
 
+    case CMD_EXPIRE:
+      if (parse_expire(STDIN_FILENO, keys[0], MAX_STRING_SIZE - 1,
+                       &ttl_ms) != 0) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_expire(keys[0], ttl_ms)) {
+        fprintf(stderr, "Command expire failed\n");
+      }
+
+      break;
+
     case CMD_DELAY:
       if (parse_delay(STDIN_FILENO, &delay_ms) == -1) {
         fprintf(stderr, "Invalid command. See HELP for usage\n");
@@ -130,6 +130,14 @@ enum Command get_next(int fd) {
 
     return CMD_DELAY;
 
+  case 'E':
+    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "EXPIRE ", 7) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_EXPIRE;
+
   case '#':
     cleanup(fd);
     return CMD_EMPTY;
@@ -192,3 +200,30 @@ int parse_delay(int fd, unsigned int *delay) {
 
   return 0;
 }
+
+int parse_expire(int fd, char *key, size_t max_string_size,
+                 unsigned int *ttl_ms) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return -1;
+  }
+
+  if (read_string(fd, key, max_string_size) != 2 || key[0] == '\0') {
+    cleanup(fd);
+    return -1;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != ' ') {
+    cleanup(fd);
+    return -1;
+  }
+
+  if (read_uint(fd, ttl_ms, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return -1;
+  }
+
+  return 0;
+}
@@ -10,6 +10,7 @@ enum Command {
   CMD_SUBSCRIBE,
   CMD_UNSUBSCRIBE,
   CMD_DELAY,
+  CMD_EXPIRE,
   CMD_EMPTY,
   CMD_INVALID,
   EOC // End of commands
@@ -40,4 +41,13 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 // error.
 int parse_delay(int fd, unsigned int *delay);
 
+// Parses an EXPIRE command: EXPIRE [key] <ttl_ms>.
+// @param fd File descriptor to read from.
+// @param key Buffer to store the key in.
+// @param max_string_size Size of the key buffer.
+// @param ttl_ms Pointer to the variable to store the TTL in, 0 to clear it.
+// @return 0 if successful, -1 on error.
+int parse_expire(int fd, char *key, size_t max_string_size,
+                 unsigned int *ttl_ms);
+
 #endif // KVS_PARSER_H
@@ -1,6 +1,8 @@
 #ifndef COMMON_PROTOCOL_H
 #define COMMON_PROTOCOL_H
 
+#include <stdint.h>
+
 // Opcodes for client-server communication
 // estes opcodes sao usados num switch case para determinar o que fazer com a
 // mensagem recebida no server usam estes opcodes tambem nos clientes quando
@@ -10,7 +12,23 @@ enum {
   OP_CODE_DISCONNECT = 2,
   OP_CODE_SUBSCRIBE = 3,
   OP_CODE_UNSUBSCRIBE = 4,
+  OP_CODE_EXPIRE = 7, // After the notification opcodes, which clients see
   // TODO mais opcodes para cada operacao
 };
 
+// Opcodes of the notifications sent to the clients subscribed to a key
+enum {
+  OP_CODE_NOTIFY_WRITE = 5,
+  OP_CODE_NOTIFY_DELETE = 6,
+};
+
+// Header of a notification. It is followed by key_len bytes of key and
+// value_len bytes of value (no value for OP_CODE_NOTIFY_DELETE), without
+// '\0's, so keys and values of any length fit.
+typedef struct {
+  int opcode;
+  uint32_t key_len;
+  uint32_t value_len;
+} NotificationHeader;
+
 #endif // COMMON_PROTOCOL_H
@@ -0,0 +1,522 @@
+#include "backup_file.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "crc32c.h"
+
+#define FILE_MAGIC "KVSBCKUP"
+#define FILE_MAGIC_LEN 8
+#define FORMAT_VERSION 2
+#define BLOCK_MAGIC 0x4b4c4256u   // "VBLK"
+#define TRAILER_MAGIC 0x444e4556u // "VEND"
+
+#define HEADER_SIZE 40
+#define BLOCK_HEADER_SIZE 24
+#define ENTRY_HEADER_SIZE 7
+#define TRAILER_SIZE 32
+
+#define ENTRY_PAIR 1
+#define ENTRY_DELETION 2
+
+#define TEXT_SEAL_PREFIX "crc32c "
+#define TEXT_SEAL_PREFIX_LEN 7
+// Bytes backup_text_seal reads at a time
+#define SEAL_BUFFER_SIZE (64 * 1024)
+
+static inline void put_u16(unsigned char *p, uint16_t v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+static inline void put_u32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline uint16_t get_u16(const unsigned char *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static inline uint32_t get_u32(const unsigned char *p) {
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+static inline uint64_t get_u64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+// Writes out a set of buffers whole, going on after short writes.
+// @return 0 if successful, 1 otherwise.
+static int write_iov(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    size_t left = (size_t)written;
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return 0;
+}
+
+// Fills the header of a block.
+static void put_block_header(unsigned char *p, uint32_t count,
+                             uint64_t payload, uint32_t crc) {
+  put_u32(p, BLOCK_MAGIC);
+  put_u32(p + 4, count);
+  put_u64(p + 8, payload);
+  put_u32(p + 16, crc);
+  put_u32(p + 20, crc32c(0, p, 20));
+}
+
+// Counts a block as written at the current offset.
+static void add_block(BackupWriter *writer, uint64_t bytes) {
+  if (writer->blocks < writer->index_size)
+    writer->index[writer->blocks] = writer->offset;
+  writer->blocks++;
+  writer->offset += bytes;
+}
+
+// Writes out the block being filled, if it has any entry.
+static void flush_block(BackupWriter *writer) {
+  if (writer->count == 0)
+    return;
+  unsigned char *payload = writer->block + BLOCK_HEADER_SIZE;
+  put_block_header(writer->block, writer->count, writer->used,
+                   crc32c(0, payload, writer->used));
+  struct iovec iov = {writer->block, BLOCK_HEADER_SIZE + writer->used};
+  if (!writer->failed)
+    writer->failed = write_iov(writer->fd, &iov, 1) != 0;
+  add_block(writer, BLOCK_HEADER_SIZE + writer->used);
+  writer->used = 0;
+  writer->count = 0;
+}
+
+int backup_writer_open_segment(BackupWriter *writer, int fd,
+                               size_t size_hint) {
+  // Twice the blocks the hint calls for, in case the table grows meanwhile
+  writer->index_size = size_hint / BACKUP_BLOCK_SIZE * 2 + 64;
+  writer->block = malloc(BLOCK_HEADER_SIZE + BACKUP_BLOCK_SIZE);
+  writer->index = malloc(writer->index_size * sizeof(uint64_t));
+  if (writer->block == NULL || writer->index == NULL) {
+    backup_writer_free(writer);
+    return 1;
+  }
+  writer->fd = fd;
+  writer->used = 0;
+  writer->count = 0;
+  writer->offset = 0;
+  writer->entries = 0;
+  writer->blocks = 0;
+  writer->failed = false;
+  return 0;
+}
+
+int backup_writer_end_segment(BackupWriter *writer) {
+  flush_block(writer);
+  return writer->failed ? 1 : 0;
+}
+
+void backup_writer_join(BackupWriter *writer, const BackupWriter *segment,
+                        bool failed) {
+  // Without the offset of every block of the segment, the file goes
+  // without an index
+  if (segment->blocks > segment->index_size)
+    writer->index_size = 0;
+  for (size_t b = 0; b < segment->blocks; b++) {
+    if (writer->blocks < writer->index_size)
+      writer->index[writer->blocks] = writer->offset + segment->index[b];
+    writer->blocks++;
+  }
+  writer->offset += segment->offset;
+  writer->entries += segment->entries;
+  writer->failed = writer->failed || segment->failed || failed;
+}
+
+int backup_writer_open(BackupWriter *writer, int fd, uint32_t flags,
+                       uint64_t snapshot, uint64_t log_position,
+                       size_t size_hint) {
+  if (backup_writer_open_segment(writer, fd, size_hint) != 0)
+    return 1;
+
+  unsigned char header[HEADER_SIZE] = {0};
+  memcpy(header, FILE_MAGIC, FILE_MAGIC_LEN);
+  put_u32(header + 8, FORMAT_VERSION);
+  put_u32(header + 12, flags);
+  put_u64(header + 16, snapshot);
+  put_u64(header + 24, log_position);
+  put_u32(header + 36, crc32c(0, header, 36));
+  struct iovec iov = {header, HEADER_SIZE};
+  if (write_iov(fd, &iov, 1) != 0) {
+    backup_writer_free(writer);
+    return 1;
+  }
+  writer->offset = HEADER_SIZE;
+  return 0;
+}
+
+void backup_writer_add(BackupWriter *writer, const char *key,
+                       const char *value) {
+  size_t key_len = strlen(key);
+  size_t value_len = value != NULL ? strlen(value) : 0;
+  if (key_len > UINT16_MAX || value_len >= UINT32_MAX) {
+    writer->failed = true;
+    return;
+  }
+  size_t bytes = ENTRY_HEADER_SIZE + key_len + 1;
+  if (value != NULL)
+    bytes += value_len + 1;
+
+  unsigned char entry[ENTRY_HEADER_SIZE];
+  entry[0] = value != NULL ? ENTRY_PAIR : ENTRY_DELETION;
+  put_u16(entry + 1, (uint16_t)key_len);
+  put_u32(entry + 3, (uint32_t)value_len);
+  writer->entries++;
+
+  if (bytes > BACKUP_BLOCK_SIZE) {
+    // A block of its own, written straight from the strings
+    flush_block(writer);
+    uint32_t crc = crc32c(0, entry, ENTRY_HEADER_SIZE);
+    crc = crc32c(crc, key, key_len + 1);
+    crc = crc32c(crc, value, value_len + 1);
+    unsigned char header[BLOCK_HEADER_SIZE];
+    put_block_header(header, 1, bytes, crc);
+    struct iovec iov[] = {{header, BLOCK_HEADER_SIZE},
+                          {entry, ENTRY_HEADER_SIZE},
+                          {(char *)key, key_len + 1},
+                          {(char *)value, value_len + 1}};
+    if (!writer->failed)
+      writer->failed = write_iov(writer->fd, iov, 4) != 0;
+    add_block(writer, BLOCK_HEADER_SIZE + bytes);
+    return;
+  }
+
+  if (writer->used + bytes > BACKUP_BLOCK_SIZE)
+    flush_block(writer);
+  unsigned char *p = writer->block + BLOCK_HEADER_SIZE + writer->used;
+  memcpy(p, entry, ENTRY_HEADER_SIZE);
+  memcpy(p + ENTRY_HEADER_SIZE, key, key_len + 1);
+  if (value != NULL)
+    memcpy(p + ENTRY_HEADER_SIZE + key_len + 1, value, value_len + 1);
+  writer->used += bytes;
+  writer->count++;
+}
+
+int backup_writer_finish(BackupWriter *writer) {
+  flush_block(writer);
+
+  uint64_t index_offset = 0;
+  if (writer->blocks <= writer->index_size && writer->blocks > 0) {
+    index_offset = writer->offset;
+    // Encoded in place: the offsets are not needed past this
+    unsigned char *index = (unsigned char *)writer->index;
+    for (size_t b = 0; b < writer->blocks; b++)
+      put_u64(index + 8 * b, writer->index[b]);
+    size_t bytes = 8 * writer->blocks;
+    unsigned char crc[4];
+    put_u32(crc, crc32c(0, index, bytes));
+    struct iovec iov[] = {{index, bytes}, {crc, 4}};
+    if (!writer->failed)
+      writer->failed = write_iov(writer->fd, iov, 2) != 0;
+  }
+
+  unsigned char trailer[TRAILER_SIZE];
+  put_u64(trailer, writer->entries);
+  put_u64(trailer + 8, writer->blocks);
+  put_u64(trailer + 16, index_offset);
+  put_u32(trailer + 24, TRAILER_MAGIC);
+  put_u32(trailer + 28, crc32c(0, trailer, 28));
+  struct iovec iov = {trailer, TRAILER_SIZE};
+  if (!writer->failed)
+    writer->failed = write_iov(writer->fd, &iov, 1) != 0;
+  return writer->failed ? 1 : 0;
+}
+
+void backup_writer_free(BackupWriter *writer) {
+  free(writer->block);
+  free(writer->index);
+  writer->block = NULL;
+  writer->index = NULL;
+}
+
+bool backup_is_binary(const void *data, size_t size) {
+  return size >= FILE_MAGIC_LEN &&
+         memcmp(data, FILE_MAGIC, FILE_MAGIC_LEN) == 0;
+}
+
+// Checks the header of the block at a given offset.
+// @param image The backup.
+// @param offset Offset of the block.
+// @param end Where the block must end, 0 if anywhere before blocks_end.
+// @param payload Set to the bytes of its payload.
+// @return 0 if the header is sound, 1 otherwise.
+static int check_block_header(const BackupImage *image, uint64_t offset,
+                              uint64_t end, uint64_t *payload) {
+  if (offset > image->blocks_end ||
+      image->blocks_end - offset < BLOCK_HEADER_SIZE)
+    return 1;
+  const unsigned char *p = image->data + offset;
+  if (get_u32(p) != BLOCK_MAGIC || get_u32(p + 20) != crc32c(0, p, 20))
+    return 1;
+  *payload = get_u64(p + 8);
+  uint64_t room = image->blocks_end - offset - BLOCK_HEADER_SIZE;
+  if (*payload > room)
+    return 1;
+  return end != 0 && offset + BLOCK_HEADER_SIZE + *payload != end;
+}
+
+// Reads the block offsets from the index.
+// @return 0 if successful, 1 otherwise.
+static int read_index(BackupImage *image, uint64_t index_offset) {
+  uint64_t trailer = image->size - TRAILER_SIZE;
+  if (index_offset < HEADER_SIZE || index_offset > trailer - 4 ||
+      (trailer - index_offset - 4) / 8 != image->num_blocks ||
+      (trailer - index_offset - 4) % 8 != 0) {
+    fprintf(stderr, "%s: corrupt index\n", image->path);
+    return 1;
+  }
+  const unsigned char *index = image->data + index_offset;
+  size_t bytes = 8 * image->num_blocks;
+  if (get_u32(index + bytes) != crc32c(0, index, bytes)) {
+    fprintf(stderr, "%s: index checksum mismatch\n", image->path);
+    return 1;
+  }
+  image->blocks_end = index_offset;
+  uint64_t previous = HEADER_SIZE;
+  for (size_t b = 0; b < image->num_blocks; b++) {
+    uint64_t offset = get_u64(index + 8 * b);
+    // Blocks follow each other from the header on
+    if ((b == 0 ? offset != HEADER_SIZE : offset <= previous) ||
+        offset >= index_offset) {
+      fprintf(stderr, "%s: corrupt index\n", image->path);
+      return 1;
+    }
+    image->blocks[b] = previous = offset;
+  }
+  return 0;
+}
+
+// Finds the blocks by walking their headers, for files without an index.
+// @return 0 if successful, 1 otherwise.
+static int walk_blocks(BackupImage *image) {
+  image->blocks_end = image->size - TRAILER_SIZE;
+  uint64_t offset = HEADER_SIZE;
+  for (size_t b = 0; b < image->num_blocks; b++) {
+    uint64_t payload;
+    if (check_block_header(image, offset, 0, &payload) != 0) {
+      fprintf(stderr, "%s: corrupt block header at offset %llu\n",
+              image->path, (unsigned long long)offset);
+      return 1;
+    }
+    image->blocks[b] = offset;
+    offset += BLOCK_HEADER_SIZE + payload;
+  }
+  if (offset != image->blocks_end) {
+    fprintf(stderr, "%s: unexpected data after the last block\n",
+            image->path);
+    return 1;
+  }
+  return 0;
+}
+
+int backup_image_open(BackupImage *image, const char *path, const void *data,
+                      size_t size) {
+  image->path = path;
+  image->data = data;
+  image->size = size;
+  image->blocks = NULL;
+  const unsigned char *p = data;
+  if (size < HEADER_SIZE + TRAILER_SIZE || !backup_is_binary(data, size) ||
+      get_u32(p + 36) != crc32c(0, p, 36)) {
+    fprintf(stderr, "%s: not a binary backup, or a corrupt one\n", path);
+    return 1;
+  }
+  if (get_u32(p + 8) != FORMAT_VERSION) {
+    fprintf(stderr, "%s: unsupported format version %u\n", path,
+            get_u32(p + 8));
+    return 1;
+  }
+  image->flags = get_u32(p + 12);
+  image->snapshot = get_u64(p + 16);
+  image->log_position = get_u64(p + 24);
+
+  const unsigned char *trailer = p + size - TRAILER_SIZE;
+  if (get_u32(trailer + 24) != TRAILER_MAGIC ||
+      get_u32(trailer + 28) != crc32c(0, trailer, 28)) {
+    fprintf(stderr, "%s: truncated or corrupt trailer\n", path);
+    return 1;
+  }
+  image->entries = get_u64(trailer);
+  uint64_t num_blocks = get_u64(trailer + 8);
+  uint64_t index_offset = get_u64(trailer + 16);
+  uint64_t room = size - HEADER_SIZE - TRAILER_SIZE;
+  // Entries take a byte for each '\0' at the very least
+  if (num_blocks > room / BLOCK_HEADER_SIZE ||
+      image->entries > room / (ENTRY_HEADER_SIZE + 1)) {
+    fprintf(stderr, "%s: corrupt trailer\n", path);
+    return 1;
+  }
+  image->num_blocks = (size_t)num_blocks;
+  image->blocks = malloc((image->num_blocks + 1) * sizeof(uint64_t));
+  if (image->blocks == NULL) {
+    fprintf(stderr, "%s: out of memory\n", path);
+    return 1;
+  }
+  int result = index_offset != 0 ? read_index(image, index_offset)
+                                 : walk_blocks(image);
+  if (result != 0)
+    backup_image_close(image);
+  return result;
+}
+
+int backup_block_foreach(const BackupImage *image, size_t block,
+                         void (*visit)(const char *key, const char *value,
+                                       void *arg),
+                         void *arg) {
+  uint64_t offset = image->blocks[block];
+  uint64_t end = block + 1 < image->num_blocks ? image->blocks[block + 1]
+                                               : image->blocks_end;
+  uint64_t payload;
+  if (check_block_header(image, offset, end, &payload) != 0) {
+    fprintf(stderr, "%s: corrupt block header at offset %llu\n", image->path,
+            (unsigned long long)offset);
+    return 1;
+  }
+  const unsigned char *p = image->data + offset;
+  uint32_t count = get_u32(p + 4);
+  p += BLOCK_HEADER_SIZE;
+  if (get_u32(image->data + offset + 16) != crc32c(0, p, payload)) {
+    fprintf(stderr, "%s: checksum mismatch in block at offset %llu\n",
+            image->path, (unsigned long long)offset);
+    return 1;
+  }
+
+  // The checksum rules out damage, not a file that was never sound: the
+  // entries are checked before any is handed out
+  bool deletions = image->flags & BACKUP_FLAG_DELTA;
+  uint64_t at = 0;
+  uint32_t found = 0;
+  while (at < payload) {
+    if (payload - at < ENTRY_HEADER_SIZE)
+      break;
+    unsigned kind = p[at];
+    uint64_t key_len = get_u16(p + at + 1);
+    uint64_t value_len = get_u32(p + at + 3);
+    uint64_t bytes = ENTRY_HEADER_SIZE + key_len + 1;
+    if (kind == ENTRY_PAIR)
+      bytes += value_len + 1;
+    else if (kind != ENTRY_DELETION || !deletions || value_len != 0)
+      break;
+    if (bytes > payload - at ||
+        p[at + ENTRY_HEADER_SIZE + key_len] != '\0' ||
+        (kind == ENTRY_PAIR && p[at + bytes - 1] != '\0'))
+      break;
+    at += bytes;
+    found++;
+  }
+  if (at != payload || found != count) {
+    fprintf(stderr, "%s: malformed entries in block at offset %llu\n",
+            image->path, (unsigned long long)offset);
+    return 1;
+  }
+
+  for (at = 0; at < payload;) {
+    const char *key = (const char *)p + at + ENTRY_HEADER_SIZE;
+    size_t key_len = get_u16(p + at + 1);
+    const char *value = NULL;
+    size_t bytes = ENTRY_HEADER_SIZE + key_len + 1;
+    if (p[at] == ENTRY_PAIR) {
+      value = key + key_len + 1;
+      bytes += get_u32(p + at + 3) + 1u;
+    }
+    visit(key, value, arg);
+    at += bytes;
+  }
+  return 0;
+}
+
+void backup_image_close(BackupImage *image) {
+  free(image->blocks);
+  image->blocks = NULL;
+}
+
+int backup_text_seal(int fd, int seal_fd) {
+  unsigned char buffer[SEAL_BUFFER_SIZE];
+  uint32_t crc = 0;
+  off_t offset = 0;
+  while (1) {
+    ssize_t got = pread(fd, buffer, sizeof(buffer), offset);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      return 1;
+    if (got == 0)
+      break;
+    crc = crc32c(crc, buffer, (size_t)got);
+    offset += got;
+  }
+
+  // Spelled out by hand: snprintf is not async signal safe
+  char seal[BACKUP_TEXT_SEAL_SIZE];
+  memcpy(seal, TEXT_SEAL_PREFIX, TEXT_SEAL_PREFIX_LEN);
+  for (int i = 0; i < 8; i++)
+    seal[TEXT_SEAL_PREFIX_LEN + i] =
+        "0123456789abcdef"[(crc >> (28 - 4 * i)) & 0xf];
+  seal[BACKUP_TEXT_SEAL_SIZE - 1] = '\n';
+  for (size_t put = 0; put < sizeof(seal);) {
+    ssize_t written =
+        pwrite(seal_fd, seal + put, sizeof(seal) - put, (off_t)put);
+    if (written < 0 && errno != EINTR)
+      return 1;
+    if (written > 0)
+      put += (size_t)written;
+  }
+  return 0;
+}
+
+int backup_text_check(const char *data, size_t size, const char *seal,
+                      size_t seal_size) {
+  if (seal_size != BACKUP_TEXT_SEAL_SIZE ||
+      memcmp(seal, TEXT_SEAL_PREFIX, TEXT_SEAL_PREFIX_LEN) != 0 ||
+      seal[BACKUP_TEXT_SEAL_SIZE - 1] != '\n')
+    return 1;
+
+  uint32_t expected = 0;
+  for (int i = 0; i < 8; i++) {
+    char c = seal[TEXT_SEAL_PREFIX_LEN + i];
+    uint32_t digit;
+    if (c >= '0' && c <= '9')
+      digit = (uint32_t)(c - '0');
+    else if (c >= 'a' && c <= 'f')
+      digit = (uint32_t)(c - 'a' + 10);
+    else
+      return 1;
+    expected = expected << 4 | digit;
+  }
+  return crc32c(0, data, size) == expected ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+#ifndef KVS_BACKUP_FILE_H
+#define KVS_BACKUP_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Binary backup files: the same contents as the "(key, value)" text of
+/// kvs_backup, laid out to be read back fast. Numbers are little endian.
+///
+///   header   magic "KVSBCKUP", format version (u32), flags (u32, see
+///            BACKUP_FLAG_DELTA), snapshot (u64), log position (u64, see
+///            wal_position, 0 if no log was kept), reserved (u32), CRC (u32)
+///   blocks   each a header (magic, entries (u32), payload bytes (u64),
+///            payload CRC (u32), header CRC (u32)) and its entries
+///   index    file offset of every block (u64 each) and their CRC (u32);
+///            left out if the writer had no room for it
+///   trailer  entries (u64), blocks (u64), index offset (u64, 0 if none),
+///            magic (u32), CRC (u32)
+///
+/// An entry is its kind (u8, pair or deletion), key length (u16), value
+/// length (u32), the key and the value, each followed by a '\0': a reader
+/// that maps the file hands out the strings where they lie. Deletions, only
+/// found in deltas, have no value. Entries are sorted by key across blocks.
+///
+/// Every CRC is a CRC-32C (see crc32c.h). Blocks are checked on their own,
+/// so they can be read in parallel, in any order.
+
+/// Payload bytes a block holds at most, unless a single entry is larger, in
+/// which case it gets a block to itself.
+#define BACKUP_BLOCK_SIZE (256 * 1024)
+
+/// Flags of a backup file.
+#define BACKUP_FLAG_DELTA 1u // Holds what changed since the backup before
+
+/// Writes a binary backup, entry by entry. Past backup_writer_open, nothing
+/// is allocated and only write(2) and writev(2) are called, so a forked
+/// child can write the backup.
+typedef struct BackupWriter {
+  int fd;
+  unsigned char *block; // Block being filled, its header room included
+  size_t used;          // Payload bytes in block
+  uint32_t count;       // Entries in block
+  uint64_t offset;      // File offset of the next block
+  uint64_t entries;     // Entries written so far
+  uint64_t *index;      // Offset of every block written, while there is room
+  size_t index_size;
+  size_t blocks; // Blocks written so far
+  bool failed;   // Some write failed, or an entry was too large
+} BackupWriter;
+
+/// Starts a backup file: allocates the writer's buffers and writes the
+/// file header.
+/// @param writer The writer.
+/// @param fd File to write, empty.
+/// @param flags Flags of the backup.
+/// @param snapshot Snapshot the backup holds (see mvcc.h).
+/// @param log_position Position of the write-ahead log up to which the
+/// snapshot holds every change, 0 if none.
+/// @param size_hint Bytes the entries are expected to take; the index is
+/// left out of files much larger than this.
+/// @return 0 if successful, 1 otherwise (nothing is then held).
+int backup_writer_open(BackupWriter *writer, int fd, uint32_t flags,
+                       uint64_t snapshot, uint64_t log_position,
+                       size_t size_hint);
+
+/// Appends an entry. Entries must come in key order.
+/// @param writer The writer.
+/// @param key The key.
+/// @param value The value, NULL for a deletion.
+void backup_writer_add(BackupWriter *writer, const char *key,
+                       const char *value);
+
+/// Ends a backup file, writing its last block, the index and the trailer.
+/// @param writer The writer.
+/// @return 0 if the whole file was written, 1 otherwise.
+int backup_writer_finish(BackupWriter *writer);
+
+/// A backup file can be written in segments, by several writers at once,
+/// each with a range of the keys: a segment is a run of blocks in a file of
+/// its own, appended to the backup file once written, in key order.
+
+/// Starts a segment: allocates the writer's buffers, and writes nothing.
+/// @param writer The writer.
+/// @param fd File to write the segment to, empty.
+/// @param size_hint Bytes the entries of the whole backup are expected to
+/// take (see backup_writer_open).
+/// @return 0 if successful, 1 otherwise (nothing is then held).
+int backup_writer_open_segment(BackupWriter *writer, int fd,
+                               size_t size_hint);
+
+/// Writes out the block being filled, so that the file written so far ends
+/// on a block: that of a segment, to be appended to the backup file, or the
+/// backup file itself, before segments are appended to it.
+/// @param writer The writer.
+/// @return 0 if everything was written, 1 otherwise.
+int backup_writer_end_segment(BackupWriter *writer);
+
+/// Counts the blocks and entries of a segment, once appended to the backup
+/// file, in those of the backup.
+/// @param writer The writer of the backup file.
+/// @param segment The writer of the segment, ended.
+/// @param failed Whether the segment could not be appended whole.
+void backup_writer_join(BackupWriter *writer, const BackupWriter *segment,
+                        bool failed);
+
+/// Frees the buffers of a writer. The file is left open.
+/// @param writer The writer.
+void backup_writer_free(BackupWriter *writer);
+
+/// A binary backup read in memory, usually mapped. Only the header, the
+/// trailer and the index are checked when it is opened; blocks are checked
+/// as they are read.
+typedef struct BackupImage {
+  const char *path; // For errors
+  const unsigned char *data;
+  size_t size;
+  uint32_t flags;
+  uint64_t snapshot;
+  uint64_t log_position;
+  uint64_t entries;
+  size_t num_blocks;
+  uint64_t *blocks;    // File offset of every block
+  uint64_t blocks_end; // Where the last block ends
+} BackupImage;
+
+/// Tells whether a file is a binary backup, from its first bytes.
+/// @param data The file.
+/// @param size Its size.
+bool backup_is_binary(const void *data, size_t size);
+
+/// Opens a binary backup held in memory. Reports errors on stderr.
+/// @param image Filled with the backup.
+/// @param path Path of the file, for errors.
+/// @param data The file, which must outlive the image.
+/// @param size Its size.
+/// @return 0 if successful, 1 if the file is not a sound binary backup.
+int backup_image_open(BackupImage *image, const char *path, const void *data,
+                      size_t size);
+
+/// Checks a block and calls visit for each of its entries, in order. Safe
+/// to call from several threads at once, on different blocks or not.
+/// Reports errors on stderr.
+/// @param image The backup.
+/// @param block Index of the block, below image->num_blocks.
+/// @param visit Function called with each key, value (NULL for a deletion)
+/// and arg. The strings lie in the image.
+/// @param arg Argument passed to visit.
+/// @return 0 if successful, 1 if the block is corrupt (visit is then not
+/// called for any of its entries).
+int backup_block_foreach(const BackupImage *image, size_t block,
+                         void (*visit)(const char *key, const char *value,
+                                       void *arg),
+                         void *arg);
+
+/// Frees what backup_image_open allocated. The file itself is left alone.
+/// @param image The backup.
+void backup_image_close(BackupImage *image);
+
+/// The checksum of a text backup lies in a file of its own, named after the
+/// backup with this suffix, so that the backup itself reads as it did before
+/// backups had checksums.
+#define BACKUP_TEXT_SEAL_SUFFIX ".crc"
+
+/// Size of a checksum file: "crc32c " and the CRC-32C of every byte of the
+/// backup, as 8 lowercase hex digits, then '\n'.
+#define BACKUP_TEXT_SEAL_SIZE 16
+
+/// Writes the checksum file of a text backup, reading the backup back from
+/// its start. Allocates nothing and only calls pread(2) and pwrite(2), so a
+/// forked child can seal the backup it wrote, if crc32c was called before
+/// the fork.
+/// @param fd The backup, open for reading.
+/// @param seal_fd The checksum file, open for writing and empty.
+/// @return 0 if successful, 1 otherwise.
+int backup_text_seal(int fd, int seal_fd);
+
+/// Checks a text backup against the contents of its checksum file.
+/// @param data The backup.
+/// @param size Its size.
+/// @param seal The checksum file.
+/// @param seal_size Its size.
+/// @return 0 if the checksum matches, 1 if it does not or the checksum file
+/// is garbled.
+int backup_text_check(const char *data, size_t size, const char *seal,
+                      size_t seal_size);
+
+#endif // KVS_BACKUP_FILE_H
@@ -1,4 +1,6 @@
 #define MAX_WRITE_SIZE 256
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
-#define MANAGING_THREADS 8
\ No newline at end of file
+#define MANAGING_THREADS 8
+#define KVS_MAX_SHARDS 64
+#define KVS_MAX_BACKUP_THREADS 64
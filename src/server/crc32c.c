@@ -0,0 +1,82 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC-32C polynomial, bit reversed
+#define CRC32C_POLY 0x82f63b78u
+
+// tables[k][b] is the CRC of byte b followed by k zero bytes, so eight bytes
+// are folded in with eight lookups (slicing by 8)
+static uint32_t tables[8][256];
+static bool hardware = false;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void) {
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+    tables[0][b] = crc;
+  }
+  for (uint32_t b = 0; b < 256; b++) {
+    for (int k = 1; k < 8; k++) {
+      uint32_t prev = tables[k - 1][b];
+      tables[k][b] = (prev >> 8) ^ tables[0][prev & 0xff];
+    }
+  }
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// Folds bytes into a (non inverted) checksum with the tables.
+static uint32_t crc32c_tables(uint32_t crc, const unsigned char *p,
+                              size_t size) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = tables[7][word & 0xff] ^ tables[6][(word >> 8) & 0xff] ^
+          tables[5][(word >> 16) & 0xff] ^ tables[4][(word >> 24) & 0xff] ^
+          tables[3][(word >> 32) & 0xff] ^ tables[2][(word >> 40) & 0xff] ^
+          tables[1][(word >> 48) & 0xff] ^ tables[0][word >> 56];
+  }
+#endif
+  for (; size > 0; p++, size--)
+    crc = (crc >> 8) ^ tables[0][(crc ^ *p) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+// Folds bytes into a (non inverted) checksum with the crc32 instruction.
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, size_t size) {
+  uint64_t crc64 = crc;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  for (; size > 0; p++, size--)
+    crc = _mm_crc32_u8(crc, *p);
+  return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+  pthread_once(&init_once, crc32c_init);
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (hardware)
+    return ~crc32c_sse42(crc, data, size);
+#endif
+  return ~crc32c_tables(crc, data, size);
+}
@@ -0,0 +1,20 @@
+#ifndef KVS_CRC32C_H
+#define KVS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// CRC-32C (Castagnoli), the checksum of the binary backups. Computed with
+/// the SSE4.2 crc32 instruction where the CPU has it, with tables otherwise;
+/// both give the same result.
+
+/// Extends a checksum over more bytes. Allocates nothing and takes no lock
+/// once called a first time, so a forked child can call it if its parent
+/// did.
+/// @param crc Checksum of the bytes before, 0 to start.
+/// @param data The bytes.
+/// @param size Number of bytes.
+/// @return Checksum of the bytes before followed by data.
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+#endif // KVS_CRC32C_H
@@ -0,0 +1,165 @@
+#include "deletions.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Deletion {
+  uint64_t version;
+  char *key;
+} Deletion;
+
+// Deletions logged, in no particular order: commits log them as they go.
+// Everything below is protected by log_lock.
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static Deletion *entries = NULL;
+static size_t used = 0;
+static size_t capacity = 0;
+static DeletionReader *readers = NULL;
+// Readers open, read without the lock by deletions_wanted
+static atomic_size_t open_readers = 0;
+
+// Frees the deletions every reader read past. The caller holds log_lock.
+static void trim(void) {
+  uint64_t oldest = UINT64_MAX;
+  for (DeletionReader *r = readers; r != NULL; r = r->next) {
+    if (r->version < oldest)
+      oldest = r->version;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < used; i++) {
+    if (entries[i].version > oldest)
+      entries[kept++] = entries[i];
+    else
+      free(entries[i].key);
+  }
+  used = kept;
+  if (used == 0) {
+    free(entries);
+    entries = NULL;
+    capacity = 0;
+  }
+}
+
+void deletions_open(DeletionReader *reader) {
+  reader->version = 0;
+  reader->lost = false;
+  pthread_mutex_lock(&log_lock);
+  reader->next = readers;
+  readers = reader;
+  atomic_fetch_add(&open_readers, 1);
+  pthread_mutex_unlock(&log_lock);
+}
+
+void deletions_close(DeletionReader *reader) {
+  pthread_mutex_lock(&log_lock);
+  for (DeletionReader **link = &readers; *link != NULL;
+       link = &(*link)->next) {
+    if (*link == reader) {
+      *link = reader->next;
+      atomic_fetch_sub(&open_readers, 1);
+      break;
+    }
+  }
+  trim();
+  pthread_mutex_unlock(&log_lock);
+}
+
+bool deletions_wanted(void) { return atomic_load(&open_readers) > 0; }
+
+void deletions_record(uint64_t version, const char *key) {
+  if (!deletions_wanted())
+    return;
+
+  char *copy = strdup(key);
+  pthread_mutex_lock(&log_lock);
+  if (readers == NULL) {
+    // The last reader closed meanwhile
+    pthread_mutex_unlock(&log_lock);
+    free(copy);
+    return;
+  }
+  if (copy != NULL && used == capacity) {
+    size_t new_capacity = capacity ? capacity * 2 : 64;
+    Deletion *grown = realloc(entries, new_capacity * sizeof(Deletion));
+    if (grown != NULL) {
+      entries = grown;
+      capacity = new_capacity;
+    }
+  }
+  if (copy != NULL && used < capacity) {
+    entries[used++] = (Deletion){version, copy};
+  } else {
+    // The next delta of every reader would miss the key
+    for (DeletionReader *r = readers; r != NULL; r = r->next)
+      r->lost = true;
+    free(copy);
+    fprintf(stderr, "Failed to log deletion, next backups will be full\n");
+  }
+  pthread_mutex_unlock(&log_lock);
+}
+
+static int compare_keys(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+char **deletions_read(DeletionReader *reader, uint64_t snapshot,
+                      size_t *count) {
+  pthread_mutex_lock(&log_lock);
+  size_t found = 0;
+  for (size_t i = 0; i < used; i++) {
+    if (entries[i].version > reader->version &&
+        entries[i].version <= snapshot)
+      found++;
+  }
+
+  char **keys = NULL;
+  bool failed = reader->lost;
+  if (!failed && found > 0) {
+    keys = malloc(found * sizeof(char *));
+    failed = keys == NULL;
+    for (size_t i = 0, k = 0; !failed && i < used; i++) {
+      if (entries[i].version <= reader->version ||
+          entries[i].version > snapshot)
+        continue;
+      keys[k] = strdup(entries[i].key);
+      if (keys[k] == NULL) {
+        deletions_free(keys, k);
+        keys = NULL;
+        failed = true;
+      }
+      k++;
+    }
+  }
+
+  reader->version = snapshot;
+  reader->lost = false;
+  trim();
+  pthread_mutex_unlock(&log_lock);
+
+  if (failed) {
+    *count = SIZE_MAX;
+    return NULL;
+  }
+
+  // A key deleted again after being written back is listed once
+  if (found > 1)
+    qsort(keys, found, sizeof(char *), compare_keys);
+  size_t unique = 0;
+  for (size_t i = 0; i < found; i++) {
+    if (unique > 0 && strcmp(keys[unique - 1], keys[i]) == 0)
+      free(keys[i]);
+    else
+      keys[unique++] = keys[i];
+  }
+  *count = unique;
+  return keys;
+}
+
+void deletions_free(char **keys, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    free(keys[i]);
+  free(keys);
+}
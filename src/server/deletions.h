@@ -0,0 +1,64 @@
+#ifndef KVS_DELETIONS_H
+#define KVS_DELETIONS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Log of the keys deleted from the KVS, for incremental backups: a delta
+/// lists the keys deleted since the backup it follows, which the table no
+/// longer has anything to say about. Each deletion is logged with the
+/// version of the commit it was made in (see mvcc.h), so a backup taken at a
+/// snapshot knows which deletions it already holds.
+///
+/// Deletions are only logged while some reader is open, and are dropped once
+/// every reader read past them.
+
+/// A consumer of the log, such as the backups of one job. Owned by the
+/// caller, and registered with the log between deletions_open and
+/// deletions_close.
+typedef struct DeletionReader {
+  uint64_t version; // Deletions up to this version were read
+  bool lost;        // A deletion could not be logged since the last read
+  struct DeletionReader *next;
+} DeletionReader;
+
+/// Opens a reader: deletions are logged from now on, until it reads them.
+/// Open it before taking the snapshot of its first read, so no deletion the
+/// snapshot misses goes unlogged.
+/// @param reader The reader.
+void deletions_open(DeletionReader *reader);
+
+/// Closes a reader, dropping the deletions only it needed.
+/// @param reader The reader.
+void deletions_close(DeletionReader *reader);
+
+/// Tells whether deletions are being logged. A deletion checked for after
+/// its commit got its version needs no logging if this is false.
+bool deletions_wanted(void);
+
+/// Logs the deletion of a key. Must be called within the commit of the
+/// deletion, or one opened after it while the key's stripe is still held,
+/// so that a snapshot covering the version has the deletion logged.
+/// @param version Version of the commit.
+/// @param key The key.
+void deletions_record(uint64_t version, const char *key);
+
+/// Reads the keys deleted since the reader's last read, up to a snapshot,
+/// and moves the reader on to it, even on failure: the caller then backs up
+/// the whole table instead.
+/// @param reader The reader.
+/// @param snapshot The snapshot, held by the caller.
+/// @param count Set to the number of keys read, SIZE_MAX on failure (some
+/// deletion since the last read was not logged, or no memory).
+/// @return The keys, sorted by strcmp and without duplicates, to be freed
+/// with deletions_free; NULL if there are none or on failure.
+char **deletions_read(DeletionReader *reader, uint64_t snapshot,
+                      size_t *count);
+
+/// Frees keys returned by deletions_read.
+/// @param keys The keys.
+/// @param count Their number.
+void deletions_free(char **keys, size_t count);
+
+#endif // KVS_DELETIONS_H
@@ -0,0 +1,185 @@
+#include "ebr.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A thread tries to advance the epoch and free its retired objects every
+// EBR_RECLAIM_BATCH retires.
+#define EBR_RECLAIM_BATCH 64
+
+typedef struct Retired {
+  void *ptr;
+  void (*free_fn)(void *);
+  uint64_t epoch; // Global epoch when the object was retired
+} Retired;
+
+typedef struct RetiredList {
+  Retired *items;
+  size_t size;
+  size_t capacity;
+} RetiredList;
+
+// Per thread state. Records are never freed, only reused by new threads.
+typedef struct EbrThread {
+  // (epoch << 1) | 1 while inside a critical section, 0 outside
+  _Alignas(64) atomic_uint_fast64_t state;
+  atomic_bool in_use;
+  unsigned nesting;
+  size_t since_reclaim;
+  RetiredList retired;
+  struct EbrThread *next;
+} EbrThread;
+
+static atomic_uint_fast64_t global_epoch = 1;
+static _Atomic(EbrThread *) threads = NULL;
+
+// Objects retired by threads that exited before they could be freed
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+static RetiredList orphans = {NULL, 0, 0};
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static _Thread_local EbrThread *self = NULL;
+
+// Appends an object to a retired list.
+// @return 0 if successful, 1 if the list could not grow.
+static int retired_push(RetiredList *list, Retired item) {
+  if (list->size == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : EBR_RECLAIM_BATCH;
+    Retired *items = realloc(list->items, capacity * sizeof(Retired));
+    if (items == NULL)
+      return 1;
+    list->items = items;
+    list->capacity = capacity;
+  }
+  list->items[list->size++] = item;
+  return 0;
+}
+
+// Frees the objects of a list retired at least two epochs ago. Lists are
+// ordered by epoch, so this frees a prefix.
+// @param list Retired list.
+// @param epoch Current global epoch.
+static void retired_reclaim(RetiredList *list, uint64_t epoch) {
+  if (list->size == 0)
+    return;
+  size_t i = 0;
+  while (i < list->size && list->items[i].epoch + 2 <= epoch) {
+    list->items[i].free_fn(list->items[i].ptr);
+    i++;
+  }
+  memmove(list->items, list->items + i, (list->size - i) * sizeof(Retired));
+  list->size -= i;
+}
+
+// Hands the objects an exiting thread could not free yet to the orphan list.
+static void thread_exit(void *arg) {
+  EbrThread *thread = arg;
+  pthread_mutex_lock(&orphans_lock);
+  for (size_t i = 0; i < thread->retired.size; i++) {
+    if (retired_push(&orphans, thread->retired.items[i]) != 0) {
+      fprintf(stderr, "Failed to keep retired object, leaking it\n");
+    }
+  }
+  pthread_mutex_unlock(&orphans_lock);
+  thread->retired.size = 0;
+  atomic_store(&thread->in_use, false);
+}
+
+static void make_key(void) { pthread_key_create(&thread_key, thread_exit); }
+
+// Returns this thread's record, registering the thread on first use.
+static EbrThread *get_self(void) {
+  if (self != NULL)
+    return self;
+
+  // Reuse the record of a thread that already exited
+  for (EbrThread *t = atomic_load(&threads); t != NULL; t = t->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&t->in_use, &expected, true)) {
+      self = t;
+      break;
+    }
+  }
+
+  if (self == NULL) {
+    EbrThread *t = aligned_alloc(64, sizeof(EbrThread));
+    if (t == NULL) {
+      fprintf(stderr, "Failed to allocate reclamation state\n");
+      abort();
+    }
+    atomic_init(&t->state, 0);
+    atomic_init(&t->in_use, true);
+    t->retired = (RetiredList){NULL, 0, 0};
+    t->next = atomic_load(&threads);
+    while (!atomic_compare_exchange_weak(&threads, &t->next, t))
+      ;
+    self = t;
+  }
+
+  self->nesting = 0;
+  self->since_reclaim = 0;
+  pthread_once(&key_once, make_key);
+  pthread_setspecific(thread_key, self);
+  return self;
+}
+
+// Advances the global epoch if every thread inside a critical section has
+// already observed the current one.
+// @return The global epoch.
+static uint64_t try_advance(void) {
+  uint64_t epoch = atomic_load(&global_epoch);
+  for (EbrThread *t = atomic_load(&threads); t != NULL; t = t->next) {
+    uint64_t state = atomic_load(&t->state);
+    if ((state & 1) && (state >> 1) != epoch)
+      return epoch;
+  }
+  if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+    return epoch + 1;
+  return epoch; // Someone else advanced it, epoch was reloaded
+}
+
+void ebr_enter(void) {
+  EbrThread *t = get_self();
+  if (t->nesting++ == 0)
+    atomic_store(&t->state, (atomic_load(&global_epoch) << 1) | 1);
+}
+
+void ebr_exit(void) {
+  EbrThread *t = self;
+  if (--t->nesting == 0)
+    atomic_store_explicit(&t->state, 0, memory_order_release);
+}
+
+void ebr_retire(void *ptr, void (*free_fn)(void *)) {
+  EbrThread *t = get_self();
+  Retired item = {ptr, free_fn, atomic_load(&global_epoch)};
+  if (retired_push(&t->retired, item) != 0) {
+    fprintf(stderr, "Failed to retire object, leaking it\n");
+    return;
+  }
+
+  if (++t->since_reclaim < EBR_RECLAIM_BATCH)
+    return;
+  t->since_reclaim = 0;
+
+  uint64_t epoch = try_advance();
+  retired_reclaim(&t->retired, epoch);
+  if (pthread_mutex_trylock(&orphans_lock) == 0) {
+    retired_reclaim(&orphans, epoch);
+    pthread_mutex_unlock(&orphans_lock);
+  }
+}
+
+void ebr_drain(void) {
+  for (EbrThread *t = atomic_load(&threads); t != NULL; t = t->next)
+    retired_reclaim(&t->retired, UINT64_MAX);
+  pthread_mutex_lock(&orphans_lock);
+  retired_reclaim(&orphans, UINT64_MAX);
+  pthread_mutex_unlock(&orphans_lock);
+}
@@ -0,0 +1,24 @@
+#ifndef KVS_EBR_H
+#define KVS_EBR_H
+
+/// Epoch based reclamation. Readers wrap lock-free traversals of shared
+/// structures in ebr_enter/ebr_exit; writers hand whatever they unlink to
+/// ebr_retire, which only frees it once every reader that could still hold a
+/// pointer to it has left its critical section.
+
+/// Enters a read-side critical section. May be nested.
+void ebr_enter(void);
+
+/// Leaves a read-side critical section.
+void ebr_exit(void);
+
+/// Defers freeing an object that is no longer reachable from shared data.
+/// @param ptr Object to free.
+/// @param free_fn Function that frees it.
+void ebr_retire(void *ptr, void (*free_fn)(void *));
+
+/// Frees every retired object. Only safe when no thread is reading, e.g. at
+/// shutdown.
+void ebr_drain(void);
+
+#endif // KVS_EBR_H
@@ -0,0 +1,354 @@
+#include "expiry.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Buckets the key index starts with (must be a power of two).
+#define EXPIRY_INITIAL_BUCKETS 64
+
+// A key's timer. While armed it sits in a slot of the wheel; once due it
+// moves to the due list, and then out of every list while the reaper hands
+// it to the callback. It stays in the key index throughout, until it is
+// disarmed or consumed.
+typedef struct Timer {
+  struct Timer *next;   // Next timer of the same slot, or of the due list
+  struct Timer **pprev; // Link pointing to this timer, NULL if in no list
+  struct Timer *index_next; // Next timer of the same index bucket
+  uint64_t hash;
+  uint64_t deadline;   // Tick it expires on
+  uint64_t generation; // Bumped on every arm, see expiry_consume
+  bool fired;          // Due, waiting to be consumed
+  char key[];
+} Timer;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;   // Signaled when the first timer is armed, or to stop
+  pthread_t reaper;
+  bool running;
+  bool stop;
+  ExpiryReaper reap;
+  size_t max_batch;
+  uint64_t now;          // Last tick processed
+  uint64_t generation;
+  atomic_size_t armed;   // Timers in the index
+  Timer *slots[EXPIRY_WHEEL_LEVELS][EXPIRY_WHEEL_SLOTS];
+  Timer *due;            // Fired timers not handed to the reaper yet
+  Timer **index;         // Every timer, by key
+  size_t index_size;     // Number of index buckets, a power of two
+} wheel = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Returns the current tick of the monotonic clock.
+static uint64_t current_tick(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000) /
+         EXPIRY_TICK_MS;
+}
+
+// Links a timer at the head of a list.
+static void list_push(Timer **head, Timer *timer) {
+  timer->next = *head;
+  if (*head != NULL)
+    (*head)->pprev = &timer->next;
+  *head = timer;
+  timer->pprev = head;
+}
+
+// Unlinks a timer from whatever list it is in.
+static void list_unlink(Timer *timer) {
+  if (timer->pprev == NULL)
+    return;
+  *timer->pprev = timer->next;
+  if (timer->next != NULL)
+    timer->next->pprev = timer->pprev;
+  timer->pprev = NULL;
+}
+
+// Puts a timer in the wheel slot its deadline falls in, relative to the
+// current tick: the lowest level whose slots, counted from now, reach it.
+static void wheel_insert(Timer *timer) {
+  uint64_t deadline = timer->deadline;
+  if (deadline - wheel.now < EXPIRY_WHEEL_SLOTS) {
+    list_push(&wheel.slots[0][deadline & (EXPIRY_WHEEL_SLOTS - 1)], timer);
+    return;
+  }
+  for (unsigned level = 1; level < EXPIRY_WHEEL_LEVELS; level++) {
+    unsigned shift = level * EXPIRY_WHEEL_BITS;
+    if ((deadline >> shift) - (wheel.now >> shift) < EXPIRY_WHEEL_SLOTS) {
+      list_push(&wheel.slots[level][(deadline >> shift) &
+                                    (EXPIRY_WHEEL_SLOTS - 1)],
+                timer);
+      return;
+    }
+  }
+  // Too far away: park it in the furthest slot of the last level
+  unsigned shift = (EXPIRY_WHEEL_LEVELS - 1) * EXPIRY_WHEEL_BITS;
+  list_push(&wheel.slots[EXPIRY_WHEEL_LEVELS - 1]
+                        [((wheel.now >> shift) + EXPIRY_WHEEL_SLOTS - 1) &
+                         (EXPIRY_WHEEL_SLOTS - 1)],
+            timer);
+}
+
+// Advances the wheel by one tick: slots of the upper levels whose turn came
+// are spread over the levels below, then the timers of the current level 0
+// slot move to the due list. The caller holds the wheel lock.
+static void wheel_tick(void) {
+  wheel.now++;
+  for (unsigned level = 1; level < EXPIRY_WHEEL_LEVELS; level++) {
+    unsigned shift = level * EXPIRY_WHEEL_BITS;
+    if ((wheel.now & ((1ULL << shift) - 1)) != 0)
+      break;
+    Timer **slot =
+        &wheel.slots[level][(wheel.now >> shift) & (EXPIRY_WHEEL_SLOTS - 1)];
+    Timer *timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+      Timer *next = timer->next;
+      wheel_insert(timer);
+      timer = next;
+    }
+  }
+
+  Timer **slot = &wheel.slots[0][wheel.now & (EXPIRY_WHEEL_SLOTS - 1)];
+  while (*slot != NULL) {
+    Timer *timer = *slot;
+    list_unlink(timer);
+    timer->fired = true;
+    list_push(&wheel.due, timer);
+  }
+}
+
+// Returns the index bucket of a hash.
+static inline Timer **index_bucket(uint64_t h) {
+  return &wheel.index[h & (wheel.index_size - 1)];
+}
+
+// Searches the index for the timer of a key. The caller holds the wheel lock.
+// @return Link pointing to the timer, NULL if the key has none.
+static Timer **index_find(uint64_t h, const char *key) {
+  if (wheel.index == NULL)
+    return NULL;
+  for (Timer **link = index_bucket(h); *link != NULL;
+       link = &(*link)->index_next) {
+    if ((*link)->hash == h && strcmp((*link)->key, key) == 0)
+      return link;
+  }
+  return NULL;
+}
+
+// Doubles the index once it holds more timers than buckets. Failing to
+// grow only makes the chains longer.
+static void index_grow(void) {
+  size_t size = wheel.index_size ? wheel.index_size * 2
+                                 : EXPIRY_INITIAL_BUCKETS;
+  Timer **index = calloc(size, sizeof(Timer *));
+  if (index == NULL)
+    return;
+  for (size_t i = 0; i < wheel.index_size; i++) {
+    Timer *timer = wheel.index[i];
+    while (timer != NULL) {
+      Timer *next = timer->index_next;
+      Timer **bucket = &index[timer->hash & (size - 1)];
+      timer->index_next = *bucket;
+      *bucket = timer;
+      timer = next;
+    }
+  }
+  free(wheel.index);
+  wheel.index = index;
+  wheel.index_size = size;
+}
+
+// Drops the timer a link of the index points to.
+static void index_remove(Timer **link) {
+  Timer *timer = *link;
+  *link = timer->index_next;
+  list_unlink(timer);
+  free(timer);
+  atomic_fetch_sub(&wheel.armed, 1);
+}
+
+// Hands up to max_batch due timers to the reap callback. The caller holds
+// the wheel lock, which is released during the callback, so that it can
+// take stripes and call expiry_consume.
+static void reap_due(void) {
+  size_t max = wheel.max_batch;
+  char *keys[max];
+  uint64_t hashes[max];
+  uint64_t generations[max];
+  size_t n = 0;
+
+  while (wheel.due != NULL && n < max) {
+    Timer *timer = wheel.due;
+    list_unlink(timer);
+    keys[n] = strdup(timer->key);
+    if (keys[n] == NULL) {
+      // Try again on the next tick
+      list_push(&wheel.due, timer);
+      break;
+    }
+    hashes[n] = timer->hash;
+    generations[n++] = timer->generation;
+  }
+
+  pthread_mutex_unlock(&wheel.lock);
+  if (n > 0)
+    wheel.reap(n, keys, hashes, generations);
+  for (size_t i = 0; i < n; i++)
+    free(keys[i]);
+  pthread_mutex_lock(&wheel.lock);
+}
+
+// Reaper thread: advances the wheel with the clock and reaps what falls
+// due. Sleeps until the next tick, or until a timer is armed if there are
+// none.
+static void *reaper_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&wheel.lock);
+  while (!wheel.stop) {
+    if (wheel.due != NULL) {
+      reap_due();
+      continue;
+    }
+    if (atomic_load(&wheel.armed) == 0) {
+      pthread_cond_wait(&wheel.wake, &wheel.lock);
+      continue;
+    }
+
+    uint64_t target = current_tick();
+    while (wheel.now < target && wheel.due == NULL)
+      wheel_tick();
+    if (wheel.due != NULL)
+      continue;
+
+    uint64_t next_ms = (wheel.now + 1) * EXPIRY_TICK_MS;
+    struct timespec until = {(time_t)(next_ms / 1000),
+                             (long)(next_ms % 1000) * 1000000};
+    pthread_cond_timedwait(&wheel.wake, &wheel.lock, &until);
+  }
+  pthread_mutex_unlock(&wheel.lock);
+  return NULL;
+}
+
+int expiry_init(ExpiryReaper reap, size_t max_batch) {
+  pthread_mutex_lock(&wheel.lock);
+  if (wheel.running) {
+    pthread_mutex_unlock(&wheel.lock);
+    fprintf(stderr, "Expiry already initialized\n");
+    return 1;
+  }
+
+  // The reaper sleeps on the monotonic clock, like the deadlines
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wheel.wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  wheel.reap = reap;
+  wheel.max_batch = max_batch;
+  wheel.stop = false;
+  wheel.now = current_tick();
+  if (pthread_create(&wheel.reaper, NULL, reaper_thread, NULL) != 0) {
+    pthread_cond_destroy(&wheel.wake);
+    pthread_mutex_unlock(&wheel.lock);
+    fprintf(stderr, "Failed to start the expiry thread\n");
+    return 1;
+  }
+  wheel.running = true;
+  pthread_mutex_unlock(&wheel.lock);
+  return 0;
+}
+
+void expiry_terminate(void) {
+  pthread_mutex_lock(&wheel.lock);
+  if (!wheel.running) {
+    pthread_mutex_unlock(&wheel.lock);
+    return;
+  }
+  wheel.stop = true;
+  pthread_cond_signal(&wheel.wake);
+  pthread_mutex_unlock(&wheel.lock);
+  pthread_join(wheel.reaper, NULL);
+
+  for (size_t i = 0; i < wheel.index_size; i++) {
+    while (wheel.index[i] != NULL)
+      index_remove(&wheel.index[i]);
+  }
+  free(wheel.index);
+  wheel.index = NULL;
+  wheel.index_size = 0;
+  pthread_cond_destroy(&wheel.wake);
+  wheel.running = false;
+}
+
+int expiry_arm(uint64_t h, const char *key, unsigned int ttl_ms) {
+  uint64_t deadline =
+      current_tick() + (ttl_ms + EXPIRY_TICK_MS - 1) / EXPIRY_TICK_MS;
+
+  pthread_mutex_lock(&wheel.lock);
+  Timer **link = index_find(h, key);
+  Timer *timer;
+  if (link != NULL) {
+    timer = *link;
+    list_unlink(timer);
+  } else {
+    size_t key_size = strlen(key) + 1;
+    timer = malloc(sizeof(Timer) + key_size);
+    if (timer == NULL) {
+      pthread_mutex_unlock(&wheel.lock);
+      return 1;
+    }
+    memcpy(timer->key, key, key_size);
+    timer->hash = h;
+    timer->pprev = NULL;
+    if (atomic_load(&wheel.armed) >= wheel.index_size)
+      index_grow();
+    if (wheel.index == NULL) {
+      free(timer);
+      pthread_mutex_unlock(&wheel.lock);
+      return 1;
+    }
+    Timer **bucket = index_bucket(h);
+    timer->index_next = *bucket;
+    *bucket = timer;
+    if (atomic_fetch_add(&wheel.armed, 1) == 0) {
+      // The reaper stopped ticking while there were no timers
+      wheel.now = current_tick();
+      pthread_cond_signal(&wheel.wake);
+    }
+  }
+
+  timer->generation = ++wheel.generation;
+  timer->fired = false;
+  timer->deadline = deadline > wheel.now ? deadline : wheel.now + 1;
+  wheel_insert(timer);
+  pthread_mutex_unlock(&wheel.lock);
+  return 0;
+}
+
+void expiry_disarm(uint64_t h, const char *key) {
+  if (atomic_load_explicit(&wheel.armed, memory_order_relaxed) == 0)
+    return;
+  pthread_mutex_lock(&wheel.lock);
+  Timer **link = index_find(h, key);
+  if (link != NULL)
+    index_remove(link);
+  pthread_mutex_unlock(&wheel.lock);
+}
+
+bool expiry_consume(uint64_t h, const char *key, uint64_t generation) {
+  pthread_mutex_lock(&wheel.lock);
+  Timer **link = index_find(h, key);
+  bool expired =
+      link != NULL && (*link)->fired && (*link)->generation == generation;
+  if (expired)
+    index_remove(link);
+  pthread_mutex_unlock(&wheel.lock);
+  return expired;
+}
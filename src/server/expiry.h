@@ -0,0 +1,66 @@
+#ifndef KVS_EXPIRY_H
+#define KVS_EXPIRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Key expiry. Keys given a TTL are kept in a hierarchical timer wheel, and a
+/// reaper thread hands the keys whose time came to a callback, in batches,
+/// so expiring keys never costs a scan of the table.
+///
+/// Timers are kept apart from the table: arming, disarming and consuming a
+/// timer are meant to happen under the stripe of its key, which is what
+/// keeps a key from being reaped right after a writer gave it a new TTL.
+
+/// Granularity of the wheel, in milliseconds.
+#define EXPIRY_TICK_MS 10
+
+/// Slots per level of the wheel (a power of two), and number of levels. A
+/// timer further away than the last level can reach waits on it and is
+/// placed again when it comes around.
+#define EXPIRY_WHEEL_BITS 6
+#define EXPIRY_WHEEL_SLOTS (1u << EXPIRY_WHEEL_BITS)
+#define EXPIRY_WHEEL_LEVELS 4
+
+/// Function the reaper hands expired keys to. For each key, it must lock
+/// the key's stripe and call expiry_consume before deleting it.
+/// @param num_keys Number of keys.
+/// @param keys The keys.
+/// @param hashes Hash of each key.
+/// @param generations Timer generation of each key, for expiry_consume.
+typedef void (*ExpiryReaper)(size_t num_keys, char *keys[],
+                             const uint64_t hashes[],
+                             const uint64_t generations[]);
+
+/// Starts the reaper thread.
+/// @param reap Function called with each batch of expired keys.
+/// @param max_batch Most keys passed to reap at once.
+/// @return 0 if successful, 1 otherwise.
+int expiry_init(ExpiryReaper reap, size_t max_batch);
+
+/// Stops the reaper thread and drops every timer.
+void expiry_terminate(void);
+
+/// Sets the TTL of a key, replacing any TTL it had.
+/// @param h Hash of the key.
+/// @param key The key.
+/// @param ttl_ms Time to live, in milliseconds (more than 0).
+/// @return 0 if successful, 1 otherwise.
+int expiry_arm(uint64_t h, const char *key, unsigned int ttl_ms);
+
+/// Removes the TTL of a key, if it has one. Costs a single atomic load while
+/// no key has a TTL.
+/// @param h Hash of the key.
+/// @param key The key.
+void expiry_disarm(uint64_t h, const char *key);
+
+/// Claims an expired key handed to the reaper callback.
+/// @param h Hash of the key.
+/// @param key The key.
+/// @param generation Generation the callback got for the key.
+/// @return true if the key is still due to expire and should be deleted,
+/// false if it was given a new TTL or had its TTL removed meanwhile.
+bool expiry_consume(uint64_t h, const char *key, uint64_t generation);
+
+#endif // KVS_EXPIRY_H
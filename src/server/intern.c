@@ -0,0 +1,198 @@
+#include "intern.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvs.h"
+#include "stats.h"
+
+// Number of stripes of a pool (a power of two).
+#define INTERN_STRIPES 64
+// Buckets each stripe starts with (a power of two). A stripe doubles its
+// buckets once it holds more values than buckets.
+#define INTERN_INITIAL_BUCKETS 8
+
+struct InternedValue {
+  InternPool *pool;
+  struct InternedValue *next; // Next value of the same bucket
+  uint64_t hash;
+  atomic_size_t refs;
+  size_t len; // Not counting the '\0'
+  char data[];
+};
+
+typedef struct InternStripe {
+  _Alignas(64) pthread_mutex_t lock;
+  size_t size;  // Number of buckets
+  size_t count; // Number of values
+  InternedValue **buckets;
+} InternStripe;
+
+struct InternPool {
+  InternStripe stripes[INTERN_STRIPES];
+  atomic_size_t bytes; // Memory of the interned values
+};
+
+// Returns the stripe of a hash. The bits that pick a stripe are not used
+// again to pick its bucket.
+static inline InternStripe *stripe_of(InternPool *pool, uint64_t h) {
+  return &pool->stripes[h & (INTERN_STRIPES - 1)];
+}
+
+static inline InternedValue **bucket_of(InternStripe *stripe, uint64_t h) {
+  return &stripe->buckets[(h >> 6) & (stripe->size - 1)];
+}
+
+// Returns the memory an interned value accounts for.
+static inline size_t interned_bytes(const InternedValue *interned) {
+  return sizeof(InternedValue) + interned->len + 1;
+}
+
+InternPool *intern_pool_create(void) {
+  InternPool *pool = malloc(sizeof(InternPool));
+  if (pool == NULL)
+    return NULL;
+  for (unsigned s = 0; s < INTERN_STRIPES; s++) {
+    InternStripe *stripe = &pool->stripes[s];
+    stripe->buckets = calloc(INTERN_INITIAL_BUCKETS, sizeof(InternedValue *));
+    if (stripe->buckets == NULL) {
+      while (s-- > 0) {
+        free(pool->stripes[s].buckets);
+        pthread_mutex_destroy(&pool->stripes[s].lock);
+      }
+      free(pool);
+      return NULL;
+    }
+    stripe->size = INTERN_INITIAL_BUCKETS;
+    stripe->count = 0;
+    pthread_mutex_init(&stripe->lock, NULL);
+  }
+  atomic_init(&pool->bytes, 0);
+  return pool;
+}
+
+// Doubles the buckets of a stripe. Failing to grow only makes the chains
+// longer. The caller holds the stripe.
+static void stripe_grow(InternStripe *stripe) {
+  size_t size = stripe->size * 2;
+  InternedValue **buckets = calloc(size, sizeof(InternedValue *));
+  if (buckets == NULL)
+    return;
+  for (size_t i = 0; i < stripe->size; i++) {
+    InternedValue *interned = stripe->buckets[i];
+    while (interned != NULL) {
+      InternedValue *next = interned->next;
+      InternedValue **bucket = &buckets[(interned->hash >> 6) & (size - 1)];
+      interned->next = *bucket;
+      *bucket = interned;
+      interned = next;
+    }
+  }
+  free(stripe->buckets);
+  stripe->buckets = buckets;
+  stripe->size = size;
+}
+
+InternedValue *intern_acquire(InternPool *pool, const char *value,
+                              size_t len) {
+  uint64_t h = hash(value);
+  InternStripe *stripe = stripe_of(pool, h);
+  pthread_mutex_lock(&stripe->lock);
+
+  for (InternedValue *interned = *bucket_of(stripe, h); interned != NULL;
+       interned = interned->next) {
+    if (interned->hash == h && interned->len == len &&
+        memcmp(interned->data, value, len) == 0) {
+      // Never 0 here: the last reference is only dropped under the lock,
+      // and the value leaves the stripe at the same time
+      atomic_fetch_add_explicit(&interned->refs, 1, memory_order_relaxed);
+      pthread_mutex_unlock(&stripe->lock);
+      return interned;
+    }
+  }
+
+  InternedValue *interned = malloc(sizeof(InternedValue) + len + 1);
+  if (interned == NULL) {
+    pthread_mutex_unlock(&stripe->lock);
+    return NULL;
+  }
+  interned->pool = pool;
+  interned->hash = h;
+  interned->len = len;
+  atomic_init(&interned->refs, 1);
+  memcpy(interned->data, value, len);
+  interned->data[len] = '\0';
+
+  if (stripe->count >= stripe->size)
+    stripe_grow(stripe);
+  InternedValue **bucket = bucket_of(stripe, h);
+  interned->next = *bucket;
+  *bucket = interned;
+  stripe->count++;
+  pthread_mutex_unlock(&stripe->lock);
+
+  atomic_fetch_add(&pool->bytes, interned_bytes(interned));
+  stat_add(STAT_INTERNED_VALUES, 1);
+  stat_add(STAT_VALUE_BYTES, (int64_t)len);
+  stat_add(STAT_OVERHEAD_BYTES, (int64_t)(interned_bytes(interned) - len));
+  return interned;
+}
+
+void intern_release(InternedValue *interned) {
+  // Not the last reference: drop it without locking
+  size_t refs = atomic_load_explicit(&interned->refs, memory_order_relaxed);
+  while (refs > 1) {
+    if (atomic_compare_exchange_weak(&interned->refs, &refs, refs - 1))
+      return;
+  }
+
+  // Maybe the last one. Dropping it under the lock keeps intern_acquire
+  // from handing out the value meanwhile.
+  InternPool *pool = interned->pool;
+  InternStripe *stripe = stripe_of(pool, interned->hash);
+  pthread_mutex_lock(&stripe->lock);
+  if (atomic_fetch_sub(&interned->refs, 1) != 1) {
+    pthread_mutex_unlock(&stripe->lock);
+    return;
+  }
+  InternedValue **link = bucket_of(stripe, interned->hash);
+  while (*link != interned)
+    link = &(*link)->next;
+  *link = interned->next;
+  stripe->count--;
+  pthread_mutex_unlock(&stripe->lock);
+
+  atomic_fetch_sub(&pool->bytes, interned_bytes(interned));
+  stat_add(STAT_INTERNED_VALUES, -1);
+  stat_add(STAT_VALUE_BYTES, -(int64_t)interned->len);
+  stat_add(STAT_OVERHEAD_BYTES,
+           -(int64_t)(interned_bytes(interned) - interned->len));
+  free(interned);
+}
+
+const char *intern_str(const InternedValue *interned) {
+  return interned->data;
+}
+
+size_t intern_pool_memory(InternPool *pool) {
+  return atomic_load(&pool->bytes);
+}
+
+void intern_pool_destroy(InternPool *pool) {
+  for (unsigned s = 0; s < INTERN_STRIPES; s++) {
+    InternStripe *stripe = &pool->stripes[s];
+    for (size_t i = 0; i < stripe->size; i++) {
+      InternedValue *interned = stripe->buckets[i];
+      while (interned != NULL) {
+        InternedValue *next = interned->next;
+        free(interned);
+        interned = next;
+      }
+    }
+    free(stripe->buckets);
+    pthread_mutex_destroy(&stripe->lock);
+  }
+  free(pool);
+}
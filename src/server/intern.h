@@ -0,0 +1,52 @@
+#ifndef KVS_INTERN_H
+#define KVS_INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Pool of interned values: every distinct value is stored once, as an
+/// immutable reference counted blob, and every pair holding it points to
+/// that blob. Equal values thus have equal pointers, so comparing two
+/// interned values is a pointer compare.
+///
+/// The pool is split into stripes, each with its own lock and hash table,
+/// picked by the hash of the value. Taking a reference that is not the
+/// first, or dropping one that is not the last, takes no lock at all.
+
+typedef struct InternPool InternPool;
+typedef struct InternedValue InternedValue;
+
+/// Creates an empty pool.
+/// @return The new pool, NULL on failure.
+InternPool *intern_pool_create(void);
+
+/// Returns a reference to the interned copy of a value, creating it if the
+/// pool has none.
+/// @param pool The pool.
+/// @param value The value.
+/// @param len Its length, '\0' not counted.
+/// @return The interned value, NULL on failure.
+InternedValue *intern_acquire(InternPool *pool, const char *value,
+                              size_t len);
+
+/// Drops a reference to an interned value, freeing it with the last one.
+/// @param interned The interned value.
+void intern_release(InternedValue *interned);
+
+/// Returns the characters of an interned value, '\0' terminated. They stay
+/// valid as long as the caller's reference.
+/// @param interned The interned value.
+const char *intern_str(const InternedValue *interned);
+
+/// Returns the memory held by the interned values. Like table_memory, it
+/// leaves out the pool's own bucket arrays. A table drops its references
+/// when it frees its nodes, after readers are done with them, so this lags
+/// deletions a little.
+/// @param pool The pool.
+size_t intern_pool_memory(InternPool *pool);
+
+/// Frees the pool. Every reference must have been dropped.
+/// @param pool The pool.
+void intern_pool_destroy(InternPool *pool);
+
+#endif // KVS_INTERN_H
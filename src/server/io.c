@@ -1,12 +1,25 @@
+// copy_file_range is not POSIX
+#define _GNU_SOURCE
+#include "io.h"
+
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-void write_str(int fd, const char *str) {
-  size_t len = strlen(str);
-  const char *ptr = str;
+// Bytes write_tuple gathers before issuing a write.
+#define TUPLE_BUFFER_SIZE 256
+// Bytes append_file reads at a time, when the kernel cannot copy.
+#define APPEND_BUFFER_SIZE (64 * 1024)
 
+// Writes len bytes to the given file descriptor.
+static void write_bytes(int fd, const char *ptr, size_t len) {
   while (len > 0) {
     ssize_t written = write(fd, ptr, len);
 
@@ -20,6 +33,121 @@ void write_str(int fd, const char *str) {
   }
 }
 
+void write_str(int fd, const char *str) { write_bytes(fd, str, strlen(str)); }
+
+void write_tuple(int fd, const char *key, const char *sep, const char *value,
+                 const char *end) {
+  const char *parts[] = {"(", key, sep, value, end};
+  char buffer[TUPLE_BUFFER_SIZE];
+  size_t used = 0;
+
+  for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+    size_t len = strlen(parts[i]);
+    if (used + len > sizeof(buffer)) {
+      write_bytes(fd, buffer, used);
+      used = 0;
+    }
+    if (len > sizeof(buffer)) {
+      write_bytes(fd, parts[i], len);
+    } else {
+      memcpy(buffer + used, parts[i], len);
+      used += len;
+    }
+  }
+  write_bytes(fd, buffer, used);
+}
+
+struct OutBuffer {
+  int fd;
+  size_t used;
+  size_t size; // 0 if the thread got no buffer
+  char *data;
+};
+
+static pthread_key_t out_key; // Frees the buffers of finishing threads
+static pthread_once_t out_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local OutBuffer local_out = {-1, 0, 0, NULL};
+
+static void create_out_key(void) { pthread_key_create(&out_key, free); }
+
+// Writes every byte an I/O vector points to, consuming the vector.
+static void write_vector(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Error writing string");
+      break;
+    }
+
+    size_t left = (size_t)written;
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+}
+
+OutBuffer *out_open(int fd) {
+  OutBuffer *out = &local_out;
+  if (out->data == NULL) {
+    pthread_once(&out_key_once, create_out_key);
+    out->data = malloc(OUT_BUFFER_SIZE);
+    if (out->data != NULL && pthread_setspecific(out_key, out->data) != 0) {
+      free(out->data);
+      out->data = NULL;
+    }
+    out->size = out->data != NULL ? OUT_BUFFER_SIZE : 0;
+  }
+  out->fd = fd;
+  out->used = 0;
+  return out;
+}
+
+void out_flush(OutBuffer *out) {
+  write_bytes(out->fd, out->data, out->used);
+  out->used = 0;
+}
+
+// Appends len bytes to an output buffer.
+static void out_bytes(OutBuffer *out, const char *ptr, size_t len) {
+  if (len <= out->size - out->used) {
+    memcpy(out->data + out->used, ptr, len);
+    out->used += len;
+    return;
+  }
+  // Pieces of half a buffer or more are not worth copying
+  if (len >= out->size / 2) {
+    struct iovec iov[2] = {{out->data, out->used}, {(void *)ptr, len}};
+    write_vector(out->fd, iov, 2);
+    out->used = 0;
+    return;
+  }
+  out_flush(out);
+  memcpy(out->data, ptr, len);
+  out->used = len;
+}
+
+void out_str(OutBuffer *out, const char *str) {
+  out_bytes(out, str, strlen(str));
+}
+
+void out_tuple(OutBuffer *out, const char *key, const char *sep,
+               const char *value, const char *end) {
+  out_str(out, "(");
+  out_str(out, key);
+  out_str(out, sep);
+  out_str(out, value);
+  out_str(out, end);
+}
+
 void write_uint(int fd, int value) {
   char buffer[16];
   size_t i = 16;
@@ -37,6 +165,52 @@ void write_uint(int fd, int value) {
   }
 }
 
+// Copies part of a file to the current offset of another by reading and
+// writing it.
+// @return Bytes copied, -1 on failure.
+static ssize_t read_write(int fd, int from, off_t offset, size_t bytes) {
+  char buffer[APPEND_BUFFER_SIZE];
+  ssize_t got = pread(from, buffer,
+                      bytes < sizeof(buffer) ? bytes : sizeof(buffer), offset);
+  for (ssize_t put = 0; put < got;) {
+    ssize_t written = write(fd, buffer + put, (size_t)(got - put));
+    if (written < 0 && errno != EINTR)
+      return -1;
+    if (written > 0)
+      put += written;
+  }
+  return got;
+}
+
+int append_file(int fd, int from) {
+  struct stat st;
+  if (fstat(from, &st) != 0)
+    return 1;
+  off_t offset = 0;
+  size_t left = (size_t)st.st_size;
+  bool in_kernel = true;
+  while (left > 0) {
+    ssize_t copied =
+        in_kernel ? copy_file_range(from, &offset, fd, NULL, left, 0)
+                  : read_write(fd, from, offset, left);
+    if (copied < 0 && in_kernel &&
+        (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+         errno == EOPNOTSUPP)) {
+      in_kernel = false;
+      continue;
+    }
+    if (copied < 0 && errno == EINTR)
+      continue;
+    // Nothing copied means the file shrank meanwhile
+    if (copied <= 0)
+      return 1;
+    if (!in_kernel)
+      offset += copied;
+    left -= (size_t)copied;
+  }
+  return 0;
+}
+
 size_t strn_memcpy(char *dest, const char *src, size_t n) {
   // strnlen is async signal safe in recent versions of POSIX
   size_t bytes_to_copy = strnlen(src, n);
@@ -1,6 +1,7 @@
 #ifndef KVS_IO_H
 #define KVS_IO_H
 
+#include <stddef.h>
 #include <unistd.h>
 
 /// Writes a string to the given file descriptor.
@@ -8,11 +9,65 @@
 /// @param str The string to write.
 void write_str(int fd, const char *str);
 
+/// Writes a pair as "(" key sep value end. Short pairs go out in a single
+/// write; longer ones are written piece by piece, so the pair has no length
+/// limit. Allocates nothing, so it is safe in a forked child.
+/// @param fd The file descriptor to write to.
+/// @param key The key.
+/// @param sep Separator written between the key and the value.
+/// @param value The value.
+/// @param end String written after the value.
+void write_tuple(int fd, const char *key, const char *sep, const char *value,
+                 const char *end);
+
 /// Writes an unsigned integer to the given file descriptor.
 /// @param fd The file descriptor to write to.
 /// @param value The value to write.
 void write_uint(int fd, int value);
 
+/// Output buffer of the calling thread. Output is formatted into it and goes
+/// out in large writes, once it fills up and on out_flush, rather than in a
+/// write per pair.
+typedef struct OutBuffer OutBuffer;
+
+/// Bytes of a thread's output buffer.
+#define OUT_BUFFER_SIZE (1 << 20)
+
+/// Points the output buffer of the calling thread at a file descriptor. The
+/// buffer must have been flushed since its last use. Never fails: a thread
+/// that cannot get a buffer writes unbuffered.
+/// @param fd The file descriptor to write to.
+/// @return The buffer, to be flushed with out_flush once done.
+OutBuffer *out_open(int fd);
+
+/// Appends a string to an output buffer.
+/// @param out The buffer.
+/// @param str The string.
+void out_str(OutBuffer *out, const char *str);
+
+/// Appends a pair as "(" key sep value end to an output buffer, like
+/// write_tuple. Values too large to be worth copying are written straight
+/// from where they are, along with the buffered bytes, in a single writev.
+/// @param out The buffer.
+/// @param key The key.
+/// @param sep Separator written between the key and the value.
+/// @param value The value.
+/// @param end String written after the value.
+void out_tuple(OutBuffer *out, const char *key, const char *sep,
+               const char *value, const char *end);
+
+/// Writes out what an output buffer holds.
+/// @param out The buffer.
+void out_flush(OutBuffer *out);
+
+/// Appends a whole file to another, at its current offset. The kernel makes
+/// the copy (copy_file_range), sharing the blocks instead on file systems
+/// that can; where it cannot, the file is read and written.
+/// @param fd File to append to.
+/// @param from File to append, from its start.
+/// @return 0 if successful, 1 otherwise.
+int append_file(int fd, int from);
+
 /// @brief Copies bytes from src to dest, not including the '\0'
 /// @param dest
 /// @param src
@@ -1,142 +1,1136 @@
 #include "kvs.h"
-#include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <stdbool.h> 
+#include <stdbool.h>
+#include "ebr.h"
+#include "intern.h"
+#include "mvcc.h"
+#include "skiplist.h"
+#include "slab.h"
+#include "stats.h"
 #include "string.h"
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of
-// the project
-int hash(const char *key) {
-  int firstLetter = tolower(key[0]);
-  if (firstLetter >= 'a' && firstLetter <= 'z') {
-    return firstLetter - 'a';
-  } else if (firstLetter >= '0' && firstLetter <= '9') {
-    return firstLetter - '0';
+_Static_assert(SLAB_MAX_POOLS >= 2 * KVS_MAX_SHARDS,
+               "every shard needs a slab pool with thread caches");
+
+// Number of buckets a new KVS table starts with (must be a power of two).
+#define KVS_INITIAL_BUCKETS 64
+// The table starts growing once it holds more keys than buckets.
+#define KVS_MAX_LOAD_FACTOR 1
+// Non-empty buckets migrated by each write/delete while a resize is running.
+#define KVS_REHASH_STEP 4
+// Bucket i is protected by stripe i % KVS_LOCK_STRIPES, which requires
+// KVS_LOCK_STRIPES to be no larger than KVS_INITIAL_BUCKETS.
+
+// Readers walk the chains without taking any lock, so every pointer they
+// follow is published atomically, and writers hand what they unlink or
+// replace to the epoch based reclamation in ebr.h instead of freeing it.
+//
+// Nodes come from the table's slab pool with the key and the value stored
+// inline, one after the other, so a lookup touches a single allocation.
+// Since the value is inline, overwriting it replaces the whole node. Pairs
+// too big for the largest slab class keep their value out of line, in its
+// own allocation the node points to; keys too long even for that put the
+// whole node on the heap. Short pairs, by far the common case, never pay for
+// either. A table that interns its values (see table_intern_values) keeps
+// none inline: every node points to the shared copy of its value instead.
+//
+// Each node keeps the full hash of its key: chain walks compare it before
+// the key bytes, so only the node that matches has its key compared, and
+// migrating a node to a new bucket array needs no rehashing.
+//
+// Point reads set the node's reference bit, and nothing else, for the CLOCK
+// eviction below (see evict_pair). New keys start with the bit clear, so a
+// burst of writes evicts keys nobody read before keys that are being read.
+//
+// Each node is one version of a pair, stamped with the version of the commit
+// that wrote it (see mvcc.h). Chains only link the newest version of each
+// key; while a snapshot may still see older ones, they hang off it through
+// the older links, newest first, and a deleted pair leaves a tombstone in
+// its place. Writers trim the versions no snapshot can see anymore as they
+// go, and scan_end sweeps up what a finished scan leaves behind. With no
+// snapshot held, nodes are replaced and unlinked outright, as if the table
+// kept no versions at all.
+typedef struct KeyNode {
+  _Atomic(struct KeyNode *) next;
+  _Atomic(struct KeyNode *) older; // Previous version of the pair
+  uint64_t version;
+  uint64_t hash;
+  uint32_t value_len; // Not counting the '\0'
+  uint16_t key_len;   // Not counting the '\0', see KVS_MAX_KEY_LEN
+  uint8_t flags;      // NODE_* below
+  atomic_bool referenced; // Read since the clock hand last passed
+  char data[];        // key '\0' then value '\0', or a pointer to the value
+} KeyNode;
+
+// The value lives in its own allocation, data holds a pointer to it
+#define NODE_VALUE_OUTLINE 0x1
+// The node itself was allocated with malloc rather than from the slab pool
+#define NODE_HEAP 0x2
+// The value is interned, data holds a pointer to its InternedValue
+#define NODE_VALUE_INTERNED 0x4
+// The pair was deleted; the node holds the key and an empty value
+#define NODE_TOMBSTONE 0x8
+
+// Returns the key stored in a node.
+static inline const char *node_key(const KeyNode *node) { return node->data; }
+
+// Returns the interned value a node points to. The node must have
+// NODE_VALUE_INTERNED set.
+static inline InternedValue *node_interned(const KeyNode *node) {
+  InternedValue *interned;
+  // The pointer may be unaligned
+  memcpy(&interned, node->data + node->key_len + 1, sizeof(interned));
+  return interned;
+}
+
+// Returns the value stored in a node.
+static inline const char *node_value(const KeyNode *node) {
+  const char *value = node->data + node->key_len + 1;
+  if (node->flags & NODE_VALUE_INTERNED)
+    return intern_str(node_interned(node));
+  if (node->flags & NODE_VALUE_OUTLINE)
+    memcpy(&value, value, sizeof(value)); // The pointer may be unaligned
+  return value;
+}
+
+typedef struct BucketArray {
+  size_t size; // Number of buckets, always a power of two
+  // Array the keys are being moved to while resizing, NULL otherwise. Never
+  // cleared, so a reader still holding a retired array finds the keys.
+  _Atomic(struct BucketArray *) rehash_target;
+  _Atomic(KeyNode *) buckets[];
+} BucketArray;
+
+// Lock protecting every bucket whose index is congruent to the stripe number
+// modulo KVS_LOCK_STRIPES, in both bucket arrays.
+typedef struct LockStripe {
+  _Alignas(64) pthread_rwlock_t lock;
+  size_t rehash_index; // Next bucket of the old array this stripe migrates
+  size_t clock_hand;   // Next bucket of this stripe evict_pair looks at
+} LockStripe;
+
+// While the table is being resized, keys are moved a few buckets at a time
+// from buckets to buckets->rehash_target (incremental rehashing), so that no
+// single operation pays for the whole resize. Each stripe migrates its own
+// buckets when it is written to.
+//
+// Locking: writers hold tablelock for reading plus the stripes of the keys
+// they touch. tablelock is only taken for writing to start or finish a
+// resize. Point reads (read_pair, key_exists) and scans take no lock at all.
+struct HashTable {
+  LockStripe stripes[KVS_LOCK_STRIPES];
+  _Atomic(BucketArray *) buckets;
+  SlabPool *nodes; // Allocator of the KeyNodes
+  SkipList *index; // Every key, in order
+  InternPool *values; // Shared copies of the values, NULL if not interning
+  atomic_size_t stripes_rehashed; // Stripes done migrating their buckets
+  atomic_size_t count;     // Number of keys in the table
+  atomic_size_t bytes;     // Memory held by the pairs, see node_bytes
+  atomic_size_t stale;     // Old versions and tombstones kept for snapshots
+  atomic_uint clock_stripe; // Stripe the next eviction starts from
+  atomic_bool maintenance_pending; // A resize must be started or finished
+  pthread_rwlock_t tablelock;
+};
+
+// Returns the stripe protecting a given hash.
+static inline unsigned stripe_of(uint64_t h) {
+  return (unsigned)(h & (KVS_LOCK_STRIPES - 1));
+}
+
+// Builds a key node holding copies of a key and a value, or a reference to
+// the interned value if the table interns them.
+// @param ht The hash table.
+// @param h Hash of the key.
+// @param key The key.
+// @param value The value, NULL for a tombstone.
+// @param version Version of the commit writing the node.
+// @return The node, NULL on failure (or if the key is too long).
+static KeyNode *node_create(HashTable *ht, uint64_t h, const char *key,
+                            const char *value, uint64_t version) {
+  size_t key_len = strlen(key);
+  size_t value_len = value != NULL ? strlen(value) : 0;
+  if (key_len > KVS_MAX_KEY_LEN || value_len > UINT32_MAX)
+    return NULL;
+
+  size_t size = sizeof(KeyNode) + key_len + value_len + 2;
+  uint8_t flags = 0;
+  void *outline = NULL; // What data points to, if the value is not inline
+  if (value == NULL) {
+    flags |= NODE_TOMBSTONE;
+    value = "";
+  } else if (ht->values != NULL) {
+    flags |= NODE_VALUE_INTERNED;
+    size = sizeof(KeyNode) + key_len + 1 + sizeof(outline);
+    outline = intern_acquire(ht->values, value, value_len);
+    if (outline == NULL)
+      return NULL;
+  } else if (size > SLAB_MAX_OBJECT_SIZE) {
+    flags |= NODE_VALUE_OUTLINE;
+    size = sizeof(KeyNode) + key_len + 1 + sizeof(outline);
+    outline = malloc(value_len + 1);
+    if (outline == NULL)
+      return NULL;
+    memcpy(outline, value, value_len + 1);
   }
-  return -1; // Invalid index for non-alphabetic or number strings
+  if (size > SLAB_MAX_OBJECT_SIZE)
+    flags |= NODE_HEAP;
+
+  KeyNode *keyNode =
+      flags & NODE_HEAP ? malloc(size) : slab_alloc(ht->nodes, size);
+  if (keyNode == NULL) {
+    if (flags & NODE_VALUE_INTERNED)
+      intern_release(outline);
+    else
+      free(outline);
+    return NULL;
+  }
+  atomic_init(&keyNode->older, NULL);
+  keyNode->version = version;
+  keyNode->hash = h;
+  keyNode->value_len = (uint32_t)value_len;
+  keyNode->key_len = (uint16_t)key_len;
+  keyNode->flags = flags;
+  atomic_init(&keyNode->referenced, false);
+  memcpy(keyNode->data, key, key_len + 1);
+  if (outline != NULL)
+    memcpy(keyNode->data + key_len + 1, &outline, sizeof(outline));
+  else
+    memcpy(keyNode->data + key_len + 1, value, value_len + 1);
+  return keyNode;
 }
 
+// Returns the memory a node accounts for in the table: the node, its out of
+// line value and the copy of the key in the sorted index. Interned values
+// are accounted for by the pool, once for all the nodes sharing them.
+static size_t node_bytes(const KeyNode *keyNode) {
+  size_t bytes = keyNode->key_len + 1u;
+  if (keyNode->flags & NODE_VALUE_OUTLINE)
+    bytes += keyNode->value_len + 1u;
+  if (keyNode->flags & NODE_HEAP)
+    bytes += sizeof(KeyNode) + keyNode->key_len + 1 + sizeof(char *);
+  else
+    bytes += slab_size(keyNode);
+  return bytes;
+}
 
-bool key_exists(HashTable *ht, const char *key) {
-    int index = hash(key);
-    if (index == -1) {
-        return false; // Invalid key
-    }
+// Adds a node to the server stats, or takes it out of them.
+// @param keyNode The node.
+// @param sign 1 for a node entering the table, -1 for one leaving it.
+static void account_node(const KeyNode *keyNode, int64_t sign) {
+  // Interned values are counted by the pool
+  uint32_t value_len =
+      keyNode->flags & NODE_VALUE_INTERNED ? 0 : keyNode->value_len;
+  size_t payload = (size_t)keyNode->key_len + value_len;
+  stat_add(STAT_KEYS, sign);
+  stat_add(STAT_KEY_BYTES, sign * keyNode->key_len);
+  stat_add(STAT_VALUE_BYTES, sign * value_len);
+  stat_add(STAT_OVERHEAD_BYTES,
+           sign * (int64_t)(node_bytes(keyNode) - payload));
+}
+
+// Marks a node as recently used, for evict_pair. Skips the store when the
+// bit is already set, so hot keys don't keep dirtying their cache line.
+static inline void node_touch(KeyNode *keyNode) {
+  if (!atomic_load_explicit(&keyNode->referenced, memory_order_relaxed))
+    atomic_store_explicit(&keyNode->referenced, true, memory_order_relaxed);
+}
+
+// Tells whether two nodes hold the same value. Interned values are equal
+// exactly when they are the same blob.
+static bool node_same_value(const KeyNode *a, const KeyNode *b) {
+  if (a->flags & b->flags & NODE_VALUE_INTERNED)
+    return node_interned(a) == node_interned(b);
+  return a->value_len == b->value_len &&
+         memcmp(node_value(a), node_value(b), a->value_len) == 0;
+}
+
+// Frees a node and its out of line value, if any, or drops its reference to
+// its interned value.
+// @param ptr The node.
+static void node_free(void *ptr) {
+  KeyNode *keyNode = ptr;
+  if (keyNode->flags & NODE_VALUE_INTERNED)
+    intern_release(node_interned(keyNode));
+  else if (keyNode->flags & NODE_VALUE_OUTLINE)
+    free((char *)node_value(keyNode));
+  if (keyNode->flags & NODE_HEAP)
+    free(keyNode);
+  else
+    slab_free(keyNode);
+}
+
+// Retires a node unlinked from the table; node_free runs once no reader can
+// be standing on it.
+static void retire_node(KeyNode *keyNode) { ebr_retire(keyNode, node_free); }
+
+// Retires a version of a pair and every older one.
+// @return Number of versions retired.
+static size_t retire_versions(KeyNode *keyNode) {
+  size_t retired = 0;
+  while (keyNode != NULL) {
+    KeyNode *older =
+        atomic_load_explicit(&keyNode->older, memory_order_relaxed);
+    retire_node(keyNode);
+    keyNode = older;
+    retired++;
+  }
+  return retired;
+}
+
+// Retires the versions of a pair no snapshot can see anymore: those older
+// than its newest version at or below the horizon. The caller holds the
+// stripe of the pair for writing.
+// @param keyNode Newest version of the pair.
+// @param horizon See mvcc_horizon.
+// @return Number of versions retired.
+static size_t prune_versions(KeyNode *keyNode, uint64_t horizon) {
+  while (keyNode->version > horizon) {
+    keyNode = atomic_load_explicit(&keyNode->older, memory_order_relaxed);
+    if (keyNode == NULL)
+      return 0;
+  }
+  KeyNode *older =
+      atomic_load_explicit(&keyNode->older, memory_order_relaxed);
+  if (older == NULL)
+    return 0;
+  // Snapshots still reading the versions cut off can follow their links
+  atomic_store_explicit(&keyNode->older, NULL, memory_order_release);
+  return retire_versions(older);
+}
+
+// Updates the count of versions kept for snapshots.
+// @param ht The hash table.
+// @param kept Versions that became old, or tombstones.
+// @param retired Such versions retired.
+static void update_stale(HashTable *ht, size_t kept, size_t retired) {
+  if (kept > retired)
+    atomic_fetch_add(&ht->stale, kept - retired);
+  else if (retired > kept)
+    atomic_fetch_sub(&ht->stale, retired - kept);
+}
+
+// Returns the version of a pair a snapshot sees.
+// @param keyNode Newest version of the pair, NULL if none.
+// @param snapshot The snapshot.
+// @return The version, NULL if the pair did not exist as of the snapshot.
+static KeyNode *node_at(KeyNode *keyNode, uint64_t snapshot) {
+  while (keyNode != NULL && keyNode->version > snapshot)
+    keyNode = atomic_load_explicit(&keyNode->older, memory_order_acquire);
+  if (keyNode != NULL && (keyNode->flags & NODE_TOMBSTONE))
+    return NULL;
+  return keyNode;
+}
+
+// Allocates an empty bucket array.
+// @param size Number of buckets (power of two).
+// @return The array, NULL on failure.
+static BucketArray *bucket_array_create(size_t size) {
+  BucketArray *array =
+      calloc(1, sizeof(BucketArray) + size * sizeof(_Atomic(KeyNode *)));
+  if (!array)
+    return NULL;
+  array->size = size;
+  return array;
+}
 
-    pthread_rwlock_rdlock(&ht->tablelock);
+// Returns the bucket of a hash in an array.
+static inline _Atomic(KeyNode *) *bucket_of(BucketArray *array, uint64_t h) {
+  return &array->buckets[h & (array->size - 1)];
+}
+
+// Searches a bucket array for a key. Safe without locks inside an EBR
+// critical section.
+// @param array Array to search.
+// @param h Hash of the key.
+// @param key The key.
+// @return The key node if found, NULL otherwise.
+static KeyNode *bucket_array_find(BucketArray *array, uint64_t h,
+                                  const char *key) {
+  KeyNode *keyNode =
+      atomic_load_explicit(bucket_of(array, h), memory_order_acquire);
+  while (keyNode != NULL) {
+    if (keyNode->hash == h && strcmp(node_key(keyNode), key) == 0)
+      return keyNode;
+    keyNode = atomic_load_explicit(&keyNode->next, memory_order_acquire);
+  }
+  return NULL;
+}
+
+// Searches the table for the newest version of a key, following the chain
+// of arrays keys are being migrated to. Arrays are searched oldest first:
+// keys are published in the new array before being unlinked from the old
+// one, so a concurrent migration can never hide a key. A lock-free reader
+// that started on an array retired since may have to look through more than
+// two of them.
+// @param ht The hash table.
+// @param h Hash of the key.
+// @param key The key.
+// @return The key node if found, NULL otherwise.
+static KeyNode *find_node(HashTable *ht, uint64_t h, const char *key) {
+  for (BucketArray *array =
+           atomic_load_explicit(&ht->buckets, memory_order_acquire);
+       array != NULL; array = atomic_load_explicit(&array->rehash_target,
+                                                   memory_order_acquire)) {
+    KeyNode *keyNode = bucket_array_find(array, h, key);
+    if (keyNode != NULL)
+      return keyNode;
+  }
+  return NULL;
+}
+
+// Searches the table for a key that was not deleted.
+// @param ht The hash table.
+// @param h Hash of the key.
+// @param key The key.
+// @return The key node if found, NULL otherwise.
+static KeyNode *find_live(HashTable *ht, uint64_t h, const char *key) {
+  KeyNode *keyNode = find_node(ht, h, key);
+  if (keyNode != NULL && (keyNode->flags & NODE_TOMBSTONE))
+    return NULL;
+  return keyNode;
+}
+
+// Moves every key of one bucket of the old array to the new one. Nodes are
+// moved tail first: a reader standing on the moved node then just walks on
+// into the new chain, instead of skipping the rest of the old one.
+// @param from Array being migrated.
+// @param to Array being migrated to.
+// @param index Bucket of from to migrate.
+// @return true if the bucket was not empty.
+static bool migrate_bucket(BucketArray *from, BucketArray *to, size_t index) {
+  _Atomic(KeyNode *) *bucket = &from->buckets[index];
+  if (atomic_load_explicit(bucket, memory_order_relaxed) == NULL)
+    return false;
 
-    if (ht->table[index] != NULL && strcmp(ht->table[index]->key, key) == 0) {
-      pthread_rwlock_unlock(&ht->tablelock);
-      return true; // Key found
+  KeyNode *head;
+  while ((head = atomic_load_explicit(bucket, memory_order_relaxed)) != NULL) {
+    _Atomic(KeyNode *) *link = bucket;
+    KeyNode *tail = head;
+    KeyNode *next;
+    while ((next = atomic_load_explicit(&tail->next, memory_order_relaxed)) !=
+           NULL) {
+      link = &tail->next;
+      tail = next;
     }
+    _Atomic(KeyNode *) *newBucket = bucket_of(to, tail->hash);
+    atomic_store_explicit(&tail->next,
+                          atomic_load_explicit(newBucket, memory_order_relaxed),
+                          memory_order_release);
+    atomic_store_explicit(newBucket, tail, memory_order_release);
+    atomic_store_explicit(link, NULL, memory_order_release);
+  }
+  return true;
+}
+
+// Moves up to KVS_REHASH_STEP non-empty buckets of one stripe to the new
+// array. The caller holds the stripe for writing. The last stripe to finish
+// asks for the arrays to be swapped (see table_maintenance).
+// @param ht The hash table.
+// @param from Current bucket array.
+// @param to Array being migrated to.
+// @param stripe Stripe whose buckets to migrate.
+static void rehash_step(HashTable *ht, BucketArray *from, BucketArray *to,
+                        unsigned stripe) {
+  LockStripe *ls = &ht->stripes[stripe];
+  if (ls->rehash_index >= from->size)
+    return; // This stripe is done already
+  size_t moved = 0;
+  // Bounds the empty buckets visited, so a sparse table doesn't stall a write
+  size_t empty_visits = KVS_REHASH_STEP * 10;
 
-    pthread_rwlock_unlock(&ht->tablelock);
-    return false; // Key not found
+  while (moved < KVS_REHASH_STEP && ls->rehash_index < from->size) {
+    if (migrate_bucket(from, to, ls->rehash_index))
+      moved++;
+    else if (--empty_visits == 0)
+      break;
+    ls->rehash_index += KVS_LOCK_STRIPES;
+  }
+
+  if (ls->rehash_index >= from->size &&
+      atomic_fetch_add(&ht->stripes_rehashed, 1) + 1 == KVS_LOCK_STRIPES)
+    atomic_store(&ht->maintenance_pending, true);
+}
+
+// Publishes the new array, migrating whatever some idle stripes left behind.
+// The old array is retired, since lock-free readers may still be on it.
+// The caller holds tablelock for writing.
+// @param ht The hash table.
+static void finish_rehash(HashTable *ht) {
+  BucketArray *from = atomic_load(&ht->buckets);
+  BucketArray *to = atomic_load(&from->rehash_target);
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    LockStripe *ls = &ht->stripes[s];
+    for (; ls->rehash_index < from->size; ls->rehash_index += KVS_LOCK_STRIPES)
+      migrate_bucket(from, to, ls->rehash_index);
+  }
+  atomic_store_explicit(&ht->buckets, to, memory_order_release);
+  ebr_retire(from, free);
+}
+
+// Starts a resize to twice the current size. Failing to allocate the new
+// array is not fatal: the table just keeps its current size and tries again
+// on a later write. The caller holds tablelock for writing.
+// @param ht The hash table.
+static void start_rehash(HashTable *ht) {
+  BucketArray *from = atomic_load(&ht->buckets);
+  BucketArray *to = bucket_array_create(from->size * 2);
+  if (to == NULL)
+    return;
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++)
+    ht->stripes[s].rehash_index = s;
+  atomic_store(&ht->stripes_rehashed, 0);
+  atomic_store_explicit(&from->rehash_target, to, memory_order_release);
+}
+
+// Starts or finishes a pending resize. Called before taking any lock, since
+// it needs tablelock for writing; this only happens once per resize.
+// @param ht The hash table.
+static void table_maintenance(HashTable *ht) {
+  if (!atomic_load(&ht->maintenance_pending))
+    return;
+  pthread_rwlock_wrlock(&ht->tablelock);
+  if (atomic_exchange(&ht->maintenance_pending, false)) {
+    // Either every stripe migrated its buckets, or the table outgrew the new
+    // array before some idle stripes did
+    if (atomic_load(&atomic_load(&ht->buckets)->rehash_target) != NULL)
+      finish_rehash(ht);
+    if (atomic_load(&ht->count) >
+        atomic_load(&ht->buckets)->size * KVS_MAX_LOAD_FACTOR)
+      start_rehash(ht);
+  }
+  pthread_rwlock_unlock(&ht->tablelock);
+}
+
+// Asks for a resize once the load factor of the array new keys go to is
+// exceeded.
+// @param ht The hash table.
+// @param array Array new keys go to.
+static void maybe_grow(HashTable *ht, BucketArray *array) {
+  if (atomic_load(&ht->count) > array->size * KVS_MAX_LOAD_FACTOR)
+    atomic_store(&ht->maintenance_pending, true);
+}
+
+// Locks a set of stripes in ascending order, after tablelock.
+// @param ht The hash table.
+// @param stripes Mask of stripes to lock.
+// @param write Whether to lock for writing.
+static void lock_stripes(HashTable *ht, uint64_t stripes, bool write) {
+  table_maintenance(ht);
+  pthread_rwlock_rdlock(&ht->tablelock);
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    if (!(stripes & (1ULL << s)))
+      continue;
+    if (write)
+      pthread_rwlock_wrlock(&ht->stripes[s].lock);
+    else
+      pthread_rwlock_rdlock(&ht->stripes[s].lock);
+  }
+}
+
+uint64_t lock_keys(HashTable *ht, size_t num_keys, char *keys[],
+                   uint64_t hashes[], bool write) {
+  uint64_t stripes = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    uint64_t h = hash(keys[i]);
+    if (hashes != NULL)
+      hashes[i] = h;
+    stripes |= 1ULL << stripe_of(h);
+  }
+  lock_stripes(ht, stripes, write);
+  return stripes;
+}
+
+uint64_t lock_hashes(HashTable *ht, size_t num_keys, const uint64_t hashes[],
+                     bool write) {
+  uint64_t stripes = 0;
+  for (size_t i = 0; i < num_keys; i++)
+    stripes |= 1ULL << stripe_of(hashes[i]);
+  lock_stripes(ht, stripes, write);
+  return stripes;
+}
+
+uint64_t lock_all_stripes(HashTable *ht) {
+  lock_stripes(ht, UINT64_MAX, false);
+  return UINT64_MAX;
+}
+
+void unlock_stripes(HashTable *ht, uint64_t stripes) {
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    if (stripes & (1ULL << s))
+      pthread_rwlock_unlock(&ht->stripes[s].lock);
+  }
+  pthread_rwlock_unlock(&ht->tablelock);
+}
+
+bool key_exists(HashTable *ht, uint64_t h, const char *key) {
+  ebr_enter();
+  bool found = find_live(ht, h, key) != NULL;
+  ebr_exit();
+  return found;
+}
+
+// Lookups take no lock, so holding the stripe changes nothing
+bool key_exists_locked(HashTable *ht, uint64_t h, const char *key) {
+  return key_exists(ht, h, key);
 }
 
 
 struct HashTable *create_hash_table() {
-  HashTable *ht = malloc(sizeof(HashTable));
+  // Stripes are cache line aligned, so the table must be too
+  size_t size = (sizeof(HashTable) + 63) & ~(size_t)63;
+  HashTable *ht = aligned_alloc(64, size);
   if (!ht)
     return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    ht->table[i] = NULL;
+  BucketArray *array = bucket_array_create(KVS_INITIAL_BUCKETS);
+  if (array == NULL) {
+    free(ht);
+    return NULL;
+  }
+  ht->nodes = slab_pool_create();
+  ht->index = skiplist_create();
+  ht->values = NULL;
+  if (ht->nodes == NULL || ht->index == NULL) {
+    if (ht->nodes != NULL)
+      slab_pool_destroy(ht->nodes);
+    if (ht->index != NULL)
+      skiplist_destroy(ht->index);
+    free(array);
+    free(ht);
+    return NULL;
+  }
+  atomic_init(&ht->buckets, array);
+  atomic_init(&ht->stripes_rehashed, 0);
+  atomic_init(&ht->count, 0);
+  atomic_init(&ht->bytes, 0);
+  atomic_init(&ht->stale, 0);
+  atomic_init(&ht->clock_stripe, 0);
+  atomic_init(&ht->maintenance_pending, false);
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    pthread_rwlock_init(&ht->stripes[s].lock, NULL);
+    ht->stripes[s].rehash_index = 0;
+    ht->stripes[s].clock_hand = s;
   }
   pthread_rwlock_init(&ht->tablelock, NULL);
   return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-  int index = hash(key);
-
-  // Search for the key node
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *previousNode;
+// Searches the arrays a writer has to look at (the current one and, while
+// resizing, the one being migrated to) for a key. The caller holds the key's
+// stripe.
+// @param array Current bucket array.
+// @param target Array being migrated to, NULL if not resizing.
+// @param h Hash of the key.
+// @param key The key.
+// @return The link pointing to the key node, NULL if the key is not found.
+static _Atomic(KeyNode *) *find_link(BucketArray *array, BucketArray *target,
+                                     uint64_t h, const char *key) {
+  BucketArray *arrays[2] = {array, target};
+  for (int i = 0; i < 2 && arrays[i] != NULL; i++) {
+    _Atomic(KeyNode *) *link = bucket_of(arrays[i], h);
+    KeyNode *keyNode;
+    while ((keyNode = atomic_load_explicit(link, memory_order_relaxed)) !=
+           NULL) {
+      if (keyNode->hash == h && strcmp(node_key(keyNode), key) == 0)
+        return link;
+      link = &keyNode->next; // Move to the next node
+    }
+  }
+  return NULL;
+}
 
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      // overwrite value
-      free(keyNode->value);
-      keyNode->value = strdup(value);
+// Links a new version of a pair into the table, in place of the current
+// one if any. Part of write_pair, run inside its commit.
+// @param ht The hash table.
+// @param array Current bucket array.
+// @param target Array being migrated to, NULL if not resizing.
+// @param newNode The new version.
+// @param changed See write_pair.
+// @return 0 if successful.
+static int link_version(HashTable *ht, BucketArray *array, BucketArray *target,
+                        KeyNode *newNode, bool *changed) {
+  uint64_t h = newNode->hash;
+  const char *key = node_key(newNode);
+  _Atomic(KeyNode *) *link = find_link(array, target, h, key);
+  if (changed != NULL)
+    *changed = true;
+  if (link != NULL) {
+    KeyNode *oldNode = atomic_load_explicit(link, memory_order_relaxed);
+    bool deleted = oldNode->flags & NODE_TOMBSTONE;
+    if (!deleted && node_same_value(oldNode, newNode)) {
+      // Nothing to do, the new node was never published
+      node_free(newNode);
+      if (changed != NULL)
+        *changed = false;
       return 0;
     }
-    previousNode = keyNode;
-    keyNode = previousNode->next; // Move to the next node
-  }
-  // Key not found, create a new key node
-  keyNode = malloc(sizeof(KeyNode));
-  keyNode->key = strdup(key);       // Allocate memory for the key
-  keyNode->value = strdup(value);   // Allocate memory for the value
-  keyNode->next = ht->table[index]; // Link to existing nodes
-  ht->table[index] = keyNode; // Place new key node at the start of the list
+
+    // overwrite value: swap in the new node in place of the old one, which
+    // becomes its previous version. Readers standing on the old node can
+    // still follow its next pointer.
+    atomic_init(&newNode->next,
+                atomic_load_explicit(&oldNode->next, memory_order_relaxed));
+    atomic_init(&newNode->older, oldNode);
+    atomic_init(&newNode->referenced,
+                !deleted && atomic_load_explicit(&oldNode->referenced,
+                                                 memory_order_relaxed));
+    atomic_store_explicit(link, newNode, memory_order_release);
+    atomic_fetch_add(&ht->bytes, node_bytes(newNode));
+    account_node(newNode, 1);
+    if (deleted) {
+      atomic_fetch_add(&ht->count, 1); // The tombstone was already stale
+      maybe_grow(ht, target != NULL ? target : array);
+    } else {
+      atomic_fetch_sub(&ht->bytes, node_bytes(oldNode));
+      account_node(oldNode, -1);
+    }
+    update_stale(ht, deleted ? 0 : 1,
+                 prune_versions(newNode, mvcc_horizon()));
+    return 0;
+  }
+
+  // Key not found, index it and link the new node (in the new array while
+  // resizing)
+  if (skiplist_insert(ht->index, key, h) != 0) {
+    node_free(newNode);
+    return 1;
+  }
+  if (target != NULL)
+    array = target;
+  _Atomic(KeyNode *) *bucket = bucket_of(array, h);
+  // Link to existing nodes, then publish the fully built node
+  atomic_init(&newNode->next,
+              atomic_load_explicit(bucket, memory_order_relaxed));
+  atomic_store_explicit(bucket, newNode, memory_order_release);
+  atomic_fetch_add(&ht->count, 1);
+  atomic_fetch_add(&ht->bytes, node_bytes(newNode));
+  account_node(newNode, 1);
+
+  maybe_grow(ht, array);
   return 0;
 }
 
+int write_pair(HashTable *ht, uint64_t h, const char *key, const char *value,
+               bool *changed) {
+  BucketArray *array = atomic_load(&ht->buckets);
+  BucketArray *target = atomic_load(&array->rehash_target);
+
+  if (target != NULL)
+    rehash_step(ht, array, target, stripe_of(h));
+
+  uint64_t version = mvcc_begin();
+  KeyNode *newNode = node_create(ht, h, key, value, version);
+  int result = newNode != NULL
+                   ? link_version(ht, array, target, newNode, changed)
+                   : 1;
+  mvcc_end();
+  return result;
+}
+
 char *read_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
+  char *value = NULL;
+  ebr_enter();
+  KeyNode *keyNode = find_live(ht, hash(key), key);
+  if (keyNode != NULL) {
+    node_touch(keyNode);
+    value = strdup(node_value(keyNode));
+  }
+  ebr_exit();
+  return value; // NULL if the key was not found
+}
 
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *previousNode;
-  char *value;
+int read_pair_with(HashTable *ht, uint64_t h, const char *key,
+                   void (*visit)(const char *key, const char *value, void *arg),
+                   void *arg) {
+  ebr_enter();
+  KeyNode *keyNode = find_live(ht, h, key);
+  if (keyNode != NULL) {
+    node_touch(keyNode);
+    visit(node_key(keyNode), node_value(keyNode), arg);
+  }
+  ebr_exit();
+  return keyNode == NULL;
+}
 
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      value = strdup(keyNode->value);
-      return value; // Return the value if found
+// Removes the node a link points to, and every older version of its pair,
+// from the table and from the index. Readers standing on them can still
+// follow their links, so they are only freed once the readers are gone. The
+// caller holds the stripe of the pair for writing.
+// @param ht The hash table.
+// @param link Link pointing to the node.
+// @return Number of versions removed.
+static size_t unlink_versions(HashTable *ht, _Atomic(KeyNode *) *link) {
+  KeyNode *keyNode = atomic_load_explicit(link, memory_order_relaxed);
+  skiplist_remove(ht->index, node_key(keyNode));
+  atomic_store_explicit(
+      link, atomic_load_explicit(&keyNode->next, memory_order_relaxed),
+      memory_order_release);
+  return retire_versions(keyNode);
+}
+
+// Deletes the pair whose newest version a link points to. While snapshots
+// may still see the pair, a tombstone takes its place; otherwise it leaves
+// the table at once. The caller holds the stripe of the pair for writing.
+// @param ht The hash table.
+// @param link Link pointing to the node, which is not a tombstone.
+// @return 0 if successful, 1 if there was no memory for the tombstone.
+static int remove_pair(HashTable *ht, _Atomic(KeyNode *) *link) {
+  KeyNode *keyNode = atomic_load_explicit(link, memory_order_relaxed);
+  uint64_t version = mvcc_begin();
+  uint64_t horizon = mvcc_horizon();
+  KeyNode *tombstone = NULL;
+  if (horizon != UINT64_MAX) {
+    tombstone =
+        node_create(ht, keyNode->hash, node_key(keyNode), NULL, version);
+    if (tombstone == NULL) {
+      mvcc_end();
+      return 1;
     }
-    previousNode = keyNode;
-    keyNode = previousNode->next; // Move to the next node
   }
 
-  return NULL; // Key not found
+  // Accounted for while the node cannot have been freed yet
+  atomic_fetch_sub(&ht->count, 1);
+  atomic_fetch_sub(&ht->bytes, node_bytes(keyNode));
+  account_node(keyNode, -1);
+  if (tombstone == NULL) {
+    // The node itself was live, not stale
+    update_stale(ht, 1, unlink_versions(ht, link));
+  } else {
+    atomic_init(&tombstone->next,
+                atomic_load_explicit(&keyNode->next, memory_order_relaxed));
+    atomic_init(&tombstone->older, keyNode);
+    atomic_store_explicit(link, tombstone, memory_order_release);
+    update_stale(ht, 2, prune_versions(tombstone, horizon));
+  }
+  mvcc_end();
+  return 0;
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
+int delete_pair(HashTable *ht, uint64_t h, const char *key) {
+  BucketArray *array = atomic_load(&ht->buckets);
+  BucketArray *target = atomic_load(&array->rehash_target);
 
-  // Search for the key node
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *prevNode = NULL;
+  if (target != NULL)
+    rehash_step(ht, array, target, stripe_of(h));
 
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      // Key found; delete this node
-      if (prevNode == NULL) {
-        // Node to delete is the first node in the list
-        ht->table[index] =
-            keyNode->next; // Update the table to point to the next node
-      } else {
-        // Node to delete is not the first; bypass it
-        prevNode->next =
-            keyNode->next; // Link the previous node to the next node
-      }
-      // Free the memory allocated for the key and value
-      free(keyNode->key);
-      free(keyNode->value);
-      free(keyNode); // Free the key node itself
-      return 0;      // Exit the function
+  _Atomic(KeyNode *) *link = find_link(array, target, h, key);
+  if (link == NULL ||
+      (atomic_load_explicit(link, memory_order_relaxed)->flags &
+       NODE_TOMBSTONE))
+    return 1;
+
+  return remove_pair(ht, link);
+}
+
+size_t table_memory(HashTable *ht) {
+  size_t bytes = atomic_load(&ht->bytes);
+  if (ht->values != NULL)
+    bytes += intern_pool_memory(ht->values);
+  return bytes;
+}
+
+int table_intern_values(HashTable *ht) {
+  if (ht->values != NULL)
+    return 0;
+  if (atomic_load(&ht->count) != 0)
+    return 1;
+  ht->values = intern_pool_create();
+  return ht->values == NULL;
+}
+
+int table_reserve(HashTable *ht, size_t keys) {
+  size_t size = KVS_INITIAL_BUCKETS;
+  while (size * KVS_MAX_LOAD_FACTOR < keys && size <= SIZE_MAX / 4)
+    size *= 2;
+
+  int result = 0;
+  pthread_rwlock_wrlock(&ht->tablelock);
+  BucketArray *from = atomic_load(&ht->buckets);
+  // Nodes only live in the array while the table has keys, or versions kept
+  // for snapshots
+  if (size > from->size && atomic_load(&ht->count) == 0 &&
+      atomic_load(&ht->stale) == 0 &&
+      atomic_load(&from->rehash_target) == NULL) {
+    BucketArray *to = bucket_array_create(size);
+    if (to != NULL) {
+      atomic_store_explicit(&ht->buckets, to, memory_order_release);
+      ebr_retire(from, free);
+    } else {
+      result = 1;
     }
-    prevNode = keyNode;      // Move prevNode to current node
-    keyNode = keyNode->next; // Move to the next node
   }
+  pthread_rwlock_unlock(&ht->tablelock);
+  return result;
+}
 
+int table_persist(HashTable *ht, const char *path, bool load,
+                  uint64_t *log_position) {
+  (void)ht;
+  (void)load;
+  *log_position = UINT64_MAX;
+  fprintf(stderr, "%s: this build keeps its tables in memory only, build it "
+                  "with KVS_BACKEND=mmap to keep them in files\n", path);
   return 1;
 }
 
-void free_table(HashTable *ht) {
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = ht->table[i];
+int table_checkpoint(HashTable *ht, uint64_t log_position) {
+  (void)ht;
+  (void)log_position;
+  return 0;
+}
+
+// Moves the clock hand of a stripe over its buckets, in both arrays while
+// resizing, clearing reference bits until it meets a node whose bit was
+// already clear. The caller holds the stripe for writing.
+// @param ht The hash table.
+// @param stripe Stripe to sweep.
+// @return The link pointing to the node to evict, NULL if the stripe is
+// empty.
+static _Atomic(KeyNode *) *clock_sweep(HashTable *ht, unsigned stripe) {
+  BucketArray *array = atomic_load(&ht->buckets);
+  BucketArray *target = atomic_load(&array->rehash_target);
+  size_t total = array->size + (target != NULL ? target->size : 0);
+  LockStripe *ls = &ht->stripes[stripe];
+
+  // Two turns at most: the first one may only clear bits
+  for (size_t visits = 2 * total / KVS_LOCK_STRIPES; visits > 0; visits--) {
+    if (ls->clock_hand >= total)
+      ls->clock_hand = stripe;
+    size_t i = ls->clock_hand;
+    _Atomic(KeyNode *) *link = i < array->size
+                                   ? &array->buckets[i]
+                                   : &target->buckets[i - array->size];
+    KeyNode *keyNode;
+    while ((keyNode = atomic_load_explicit(link, memory_order_relaxed)) !=
+           NULL) {
+      if (!(keyNode->flags & NODE_TOMBSTONE) &&
+          !atomic_exchange_explicit(&keyNode->referenced, false,
+                                    memory_order_relaxed))
+        return link; // The hand stays on this bucket
+      link = &keyNode->next;
+    }
+    ls->clock_hand += KVS_LOCK_STRIPES;
+  }
+  return NULL;
+}
+
+int evict_pair(HashTable *ht,
+               void (*evicted)(const char *key, uint64_t h, void *arg),
+               void *arg) {
+  for (unsigned tries = 0;
+       tries < KVS_LOCK_STRIPES && atomic_load(&ht->count) > 0; tries++) {
+    unsigned s = atomic_fetch_add(&ht->clock_stripe, 1) % KVS_LOCK_STRIPES;
+    uint64_t stripes = 1ULL << s;
+    lock_stripes(ht, stripes, true);
+    _Atomic(KeyNode *) *link = clock_sweep(ht, s);
+    if (link != NULL) {
+      // Keeps the node around for evicted once it is gone
+      ebr_enter();
+      KeyNode *keyNode = atomic_load_explicit(link, memory_order_relaxed);
+      int result = remove_pair(ht, link);
+      if (result == 0)
+        evicted(node_key(keyNode), keyNode->hash, arg);
+      ebr_exit();
+      unlock_stripes(ht, stripes);
+      return result;
+    }
+    unlock_stripes(ht, stripes);
+  }
+  return 1;
+}
+
+// Calls visit for every pair of one bucket array.
+static void bucket_array_foreach(BucketArray *array,
+                                 void (*visit)(const char *key,
+                                               const char *value, void *arg),
+                                 void *arg) {
+  for (size_t i = 0; i < array->size; i++) {
+    for (KeyNode *keyNode = atomic_load(&array->buckets[i]); keyNode != NULL;
+         keyNode = atomic_load(&keyNode->next)) {
+      if (!(keyNode->flags & NODE_TOMBSTONE))
+        visit(node_key(keyNode), node_value(keyNode), arg);
+    }
+  }
+}
+
+void foreach_pair(HashTable *ht,
+                  void (*visit)(const char *key, const char *value, void *arg),
+                  void *arg) {
+  BucketArray *array = atomic_load(&ht->buckets);
+  bucket_array_foreach(array, visit, arg);
+  BucketArray *target = atomic_load(&array->rehash_target);
+  if (target != NULL)
+    bucket_array_foreach(target, visit, arg);
+}
+
+// Adds the buckets of one bucket array to a TableStats.
+static void bucket_array_stats(BucketArray *array, TableStats *stats) {
+  stats->buckets += array->size;
+  stats->table_bytes +=
+      sizeof(BucketArray) + array->size * sizeof(_Atomic(KeyNode *));
+  for (size_t i = 0; i < array->size; i++) {
+    size_t length = 0;
+    for (KeyNode *keyNode = atomic_load(&array->buckets[i]); keyNode != NULL;
+         keyNode = atomic_load(&keyNode->next))
+      length += !(keyNode->flags & NODE_TOMBSTONE);
+    stats->keys += length;
+    stats->chains[length < KVS_CHAIN_HISTOGRAM ? length
+                                               : KVS_CHAIN_HISTOGRAM - 1]++;
+  }
+}
+
+void table_stats(HashTable *ht, TableStats *stats) {
+  *stats = (TableStats){0};
+  BucketArray *array = atomic_load(&ht->buckets);
+  bucket_array_stats(array, stats);
+  BucketArray *target = atomic_load(&array->rehash_target);
+  if (target != NULL)
+    bucket_array_stats(target, stats);
+}
+
+bool scan_locks(void) { return false; }
+
+uint64_t scan_begin(HashTable *ht) {
+  (void)ht;
+  return 0;
+}
+
+// State of a scan_pairs call.
+typedef struct ScanVisit {
+  HashTable *ht;
+  uint64_t snapshot;
+  const char *after;
+  bool inclusive;
+  PairRef *pairs;
+  size_t max;
+  size_t count;
+} ScanVisit;
+
+// Collects the version the snapshot sees of a key handed out by the index,
+// if any. Keys newer than the snapshot may not be in the table yet, and are
+// skipped like deleted ones.
+static bool scan_visit(const char *key, uint64_t h, void *arg) {
+  ScanVisit *scan = arg;
+  if (!scan->inclusive && strcmp(key, scan->after) == 0)
+    return true;
+  KeyNode *keyNode = node_at(find_node(scan->ht, h, key), scan->snapshot);
+  if (keyNode != NULL)
+    scan->pairs[scan->count++] =
+        (PairRef){node_key(keyNode), node_value(keyNode), keyNode->version};
+  return scan->count < scan->max;
+}
+
+size_t scan_pairs(HashTable *ht, uint64_t snapshot, const char *after,
+                  bool inclusive, PairRef pairs[], size_t max) {
+  if (max == 0)
+    return 0;
+  // The versions collected stay put while the snapshot is held, so the
+  // caller goes on using them out of the critical section
+  ScanVisit scan = {ht,    snapshot, after, inclusive || after == NULL,
+                    pairs, max,      0};
+  ebr_enter();
+  skiplist_foreach(ht->index, after, scan_visit, &scan);
+  ebr_exit();
+  return scan.count;
+}
+
+// Retires the versions no snapshot can see anymore in the buckets of one
+// stripe, unlinking the pairs whose tombstone every snapshot sees. The
+// caller holds the stripe for writing.
+// @param ht The hash table.
+// @param array Bucket array to sweep.
+// @param stripe The stripe.
+// @param horizon See mvcc_horizon.
+static void sweep_versions(HashTable *ht, BucketArray *array, unsigned stripe,
+                           uint64_t horizon) {
+  size_t retired = 0;
+  for (size_t i = stripe; i < array->size; i += KVS_LOCK_STRIPES) {
+    _Atomic(KeyNode *) *link = &array->buckets[i];
+    KeyNode *keyNode;
+    while ((keyNode = atomic_load_explicit(link, memory_order_relaxed)) !=
+           NULL) {
+      if ((keyNode->flags & NODE_TOMBSTONE) && keyNode->version <= horizon) {
+        retired += unlink_versions(ht, link);
+        continue;
+      }
+      retired += prune_versions(keyNode, horizon);
+      link = &keyNode->next;
+    }
+  }
+  update_stale(ht, 0, retired);
+}
+
+// State of a sample_keys call.
+typedef struct SampleVisit {
+  void (*visit)(const char *key, void *arg);
+  void *arg;
+} SampleVisit;
+
+// Hands a key picked by the index to the caller of sample_keys.
+static bool sample_visit(const char *key, uint64_t h, void *arg) {
+  (void)h;
+  SampleVisit *sample = arg;
+  sample->visit(key, sample->arg);
+  return true;
+}
+
+void sample_keys(HashTable *ht, size_t count,
+                 void (*visit)(const char *key, void *arg), void *arg) {
+  SampleVisit sample = {visit, arg};
+  // The keys are copied by visit before the nodes holding them can go
+  ebr_enter();
+  skiplist_sample(ht->index, count, sample_visit, &sample);
+  ebr_exit();
+}
+
+void scan_end(HashTable *ht, uint64_t token) {
+  (void)token;
+  // Writers trim the pairs they touch; sweep up the rest, a stripe at a time
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES && atomic_load(&ht->stale) > 0;
+       s++) {
+    uint64_t stripes = 1ULL << s;
+    lock_stripes(ht, stripes, true);
+    uint64_t horizon = mvcc_horizon();
+    BucketArray *array = atomic_load(&ht->buckets);
+    BucketArray *target = atomic_load(&array->rehash_target);
+    sweep_versions(ht, array, s, horizon);
+    if (target != NULL)
+      sweep_versions(ht, target, s, horizon);
+    unlock_stripes(ht, stripes);
+  }
+}
+
+// Frees every node of a bucket array, old versions included, and the array
+// itself.
+static void bucket_array_free(BucketArray *array) {
+  for (size_t i = 0; i < array->size; i++) {
+    KeyNode *keyNode = atomic_load(&array->buckets[i]);
     while (keyNode != NULL) {
-      KeyNode *temp = keyNode;
-      keyNode = keyNode->next;
-      free(temp->key);
-      free(temp->value);
-      free(temp);
+      KeyNode *next = atomic_load(&keyNode->next);
+      while (keyNode != NULL) {
+        KeyNode *older = atomic_load(&keyNode->older);
+        node_free(keyNode);
+        keyNode = older;
+      }
+      keyNode = next;
     }
   }
+  free(array);
+}
+
+void free_table(HashTable *ht) {
+  BucketArray *array = atomic_load(&ht->buckets);
+  BucketArray *target = atomic_load(&array->rehash_target);
+  bucket_array_free(array);
+  if (target != NULL)
+    bucket_array_free(target);
+  // Freeing the nodes dropped every reference to the interned values
+  if (ht->values != NULL)
+    intern_pool_destroy(ht->values);
+  slab_pool_destroy(ht->nodes);
+  skiplist_destroy(ht->index);
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++)
+    pthread_rwlock_destroy(&ht->stripes[s].lock);
   pthread_rwlock_destroy(&ht->tablelock);
   free(ht);
 }
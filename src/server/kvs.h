@@ -2,21 +2,27 @@
 #define KEY_VALUE_STORE_H
 #define TABLE_SIZE 26
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include "src/server/constants.h"
 #include <stdbool.h>
 
+// Number of key locks. Keys are spread over the stripes by their hash, so
+// this must be a power of two. Sets of stripes are passed around as 64-bit
+// masks.
+#define KVS_LOCK_STRIPES 64
 
-typedef struct KeyNode {
-  char *key;
-  char *value;
-  struct KeyNode *next;
-} KeyNode;
+// Longest key the table stores, in bytes. Values have no limit of their own.
+#define KVS_MAX_KEY_LEN UINT16_MAX
 
-typedef struct HashTable {
-  KeyNode *table[TABLE_SIZE];
-  pthread_rwlock_t tablelock;
-} HashTable;
+// The table has three implementations, picked at build time (KVS_BACKEND in
+// the Makefile): kvs.c chains nodes in a resizable bucket array, kvs_flat.c
+// keeps the pairs inline in open addressing tables, and kvs_mmap.c lays the
+// same tables out in a memory mapped file that outlives the server. All of
+// them implement the functions below, so the rest of the server never sees
+// the layout.
+typedef struct HashTable HashTable;
 
 
 
@@ -27,6 +33,7 @@ typedef struct ClientNode {
 } ClientNode;
 
 typedef struct SubscriptionNode {
+    uint64_t hash;                     // Hash of the key, see hash()
     char key[MAX_STRING_SIZE];         // Name of the key
     ClientNode *clients;               // List of subscribed clients
     struct SubscriptionNode *next;     // Next key (in case of collision)
@@ -45,14 +52,68 @@ extern ClientTable *subscription_table;
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
-int hash(const char *key);
+/// Hashes a key (64-bit FNV-1a).
+/// @param key The key.
+/// @return hash.
+static inline uint64_t hash(const char *key) {
+  uint64_t h = 14695981039346656037ULL;
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/// Locks the stripes covering the given keys. Stripes are always acquired in
+/// ascending order, so concurrent multi-key batches cannot deadlock.
+/// @param ht The hash table.
+/// @param num_keys Number of keys.
+/// @param keys Keys to lock.
+/// @param hashes If not NULL, filled with the hash of each key, to be passed
+/// on to the functions below instead of hashing the keys again.
+/// @param write Whether to lock for writing.
+/// @return Mask of the locked stripes, to be passed to unlock_stripes.
+uint64_t lock_keys(HashTable *ht, size_t num_keys, char *keys[],
+                   uint64_t hashes[], bool write);
+
+/// Locks the stripes covering keys whose hashes are already known. Same
+/// ordering guarantees as lock_keys.
+/// @param ht The hash table.
+/// @param num_keys Number of keys.
+/// @param hashes Hash of each key.
+/// @param write Whether to lock for writing.
+/// @return Mask of the locked stripes, to be passed to unlock_stripes.
+uint64_t lock_hashes(HashTable *ht, size_t num_keys, const uint64_t hashes[],
+                     bool write);
+
+/// Locks every stripe for reading, freezing the whole table.
+/// @param ht The hash table.
+/// @return Mask of the locked stripes, to be passed to unlock_stripes.
+uint64_t lock_all_stripes(HashTable *ht);
+
+/// Unlocks stripes locked by lock_keys, lock_hashes or lock_all_stripes.
+/// @param ht The hash table.
+/// @param stripes Mask returned by the lock function.
+void unlock_stripes(HashTable *ht, uint64_t stripes);
+
+// write_pair, delete_pair and key_exists_locked expect the caller to hold
+// the stripe of the key for writing. read_pair, read_pair_with and
+// key_exists need no lock from the caller, and must not be called with the
+// stripe held: the flat and mmap backends take it for reading.
+
+// Both stamp the pair versions they write with the version of the calling
+// thread's commit, opening one of their own if it has none (see mvcc.h).
 
 // Writes a key value pair in the hash table.
 // @param ht The hash table.
-// @param key The key.
+// @param h Hash of the key.
+// @param key The key, at most KVS_MAX_KEY_LEN long.
 // @param value The value.
+// @param changed If not NULL, set to false when the key already held this
+// very value (the table is then left untouched), true otherwise.
 // @return 0 if successful.
-int write_pair(HashTable *ht, const char *key, const char *value);
+int write_pair(HashTable *ht, uint64_t h, const char *key, const char *value,
+               bool *changed);
 
 // Reads the value of a given key.
 // @param ht The hash table.
@@ -60,27 +121,206 @@ int write_pair(HashTable *ht, const char *key, const char *value);
 // return the value if found, NULL otherwise.
 char *read_pair(HashTable *ht, const char *key);
 
+/// Reads the value of a given key without copying it: visit is called with
+/// the value stored in the table, which stays valid until visit returns.
+/// @param ht The hash table.
+/// @param h Hash of the key.
+/// @param key The key.
+/// @param visit Function called with the key, the value and arg.
+/// @param arg Argument passed to visit.
+/// @return 0 if the key was found (and visit called), 1 otherwise.
+int read_pair_with(HashTable *ht, uint64_t h, const char *key,
+                   void (*visit)(const char *key, const char *value, void *arg),
+                   void *arg);
+
 /// Deletes a pair from the table.
 /// @param ht Hash table to read from.
+/// @param h Hash of the key.
 /// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
-int delete_pair(HashTable *ht, const char *key);
+/// @return 0 if the node was deleted successfully, 1 otherwise (the key is
+/// missing, or there was no memory to record a deletion a snapshot must not
+/// see).
+int delete_pair(HashTable *ht, uint64_t h, const char *key);
+
+/// Returns the memory held by the pairs of the table: keys, values and the
+/// per-pair overhead of the table and its index. Empty capacity is not
+/// counted.
+/// @param ht The hash table.
+/// @return Bytes held.
+size_t table_memory(HashTable *ht);
+
+/// Evicts one cold pair, picked with the CLOCK policy: a hand sweeps the
+/// pairs, clearing the reference bit point reads set, and stops at the first
+/// pair that was not read since the hand last passed it. Takes the stripe of
+/// the pair itself, so the caller must hold no stripe.
+/// @param ht The hash table.
+/// @param evicted Function called with the key, its hash and arg as the pair
+/// goes, while its stripe is held.
+/// @param arg Argument passed to evicted.
+/// @return 0 if a pair was evicted, 1 if the table is empty or on failure.
+int evict_pair(HashTable *ht,
+               void (*evicted)(const char *key, uint64_t h, void *arg),
+               void *arg);
+
+/// Makes the table intern its values (see intern.h): pairs holding equal
+/// values share a single copy, and telling whether a write changes a value
+/// is a pointer compare. Pays off when many keys hold the same values. Must
+/// be called before the first write. The flat backend keeps its values in
+/// its slots and ignores this.
+/// @param ht The hash table.
+/// @return 0 if successful, 1 otherwise.
+int table_intern_values(HashTable *ht);
+
+/// Sizes an empty table for a number of keys, so that filling it, as a
+/// restore does, resizes nothing on the way. Does nothing to a table that
+/// holds anything, or is already large enough.
+/// @param ht The hash table.
+/// @param keys Number of keys expected.
+/// @return 0 if successful, 1 otherwise (the table keeps its size).
+int table_reserve(HashTable *ht, size_t keys);
+
+/// Backs a table with a file, so that it outlives the server: what the
+/// table held at its last checkpoint (see table_checkpoint) is mapped back
+/// as it is, without reading the pairs. A file changed since its last
+/// checkpoint, e.g. by a server that crashed, is started over empty, as is
+/// one of another build. Must be called before the first write. Only the
+/// mmap backend keeps its tables in files; the others fail.
+/// @param ht The hash table.
+/// @param path Path of the file, created if missing.
+/// @param load Whether to map back what the file holds; if not, it is
+/// started over empty.
+/// @param log_position Set to the log position of the checkpoint the table
+/// was mapped back from, UINT64_MAX if it starts empty.
+/// @return 0 if successful, 1 otherwise (the table stays in memory).
+int table_persist(HashTable *ht, const char *path, bool load,
+                  uint64_t *log_position);
+
+/// Writes out everything the table changed since table_persist, or its
+/// last checkpoint, and records on disk that the file holds a consistent
+/// table. Does nothing to a table without a file. The caller must hold
+/// every stripe.
+/// @param ht The hash table.
+/// @param log_position Position of the write-ahead log the table is up to
+/// (see wal_position), 0 without a log.
+/// @return 0 if successful, 1 otherwise.
+int table_checkpoint(HashTable *ht, uint64_t log_position);
+
+/// Buckets of the chain length histogram of TableStats; the last one also
+/// counts every longer chain.
+#define KVS_CHAIN_HISTOGRAM 8
+
+/// Shape of a table, for sizing hosts and tuning load factors.
+typedef struct TableStats {
+  size_t keys;
+  size_t buckets; // Buckets (chained) or slots (flat) allocated
+  // Memory of the table itself that no pair accounts for (see table_memory):
+  // the bucket arrays, or the free slots
+  size_t table_bytes;
+  // Chained backend: buckets by number of keys chained in them. Flat backend:
+  // keys by number of groups probed past their first one to reach them.
+  size_t chains[KVS_CHAIN_HISTOGRAM];
+} TableStats;
+
+/// Measures a table. The caller must hold every stripe.
+/// @param ht The hash table.
+/// @param stats Filled with the figures of the table.
+void table_stats(HashTable *ht, TableStats *stats);
+
+/// Calls visit for every pair in the table, in bucket order. The caller must
+/// hold every stripe (see lock_all_stripes).
+/// @param ht Hash table to walk.
+/// @param visit Function called with each key, value and arg.
+/// @param arg Argument passed to visit.
+void foreach_pair(HashTable *ht,
+                  void (*visit)(const char *key, const char *value, void *arg),
+                  void *arg);
+
+// Ordered scans read the table as of a snapshot (see mvcc.h): the chained
+// backend keeps every version of a pair a snapshot may see, so scans take no
+// lock and writers go on meanwhile. The flat backend keeps a single version
+// of each pair, so scan_begin locks it for reading instead.
+
+/// Tells whether scan_begin locks tables, which the thread that called it
+/// must then end the scan from (the flat backend).
+bool scan_locks(void);
+
+/// A pair handed out by scan_pairs.
+typedef struct PairRef {
+  const char *key;
+  const char *value;
+  uint64_t version; // Commit that wrote the value, see mvcc.h
+} PairRef;
+
+/// Readies a table for a scan, once the caller holds its snapshot. Takes
+/// no lock with the chained backend; the flat backend locks every stripe.
+/// @param ht The hash table.
+/// @return Token to pass to scan_end.
+uint64_t scan_begin(HashTable *ht);
+
+/// Collects, in key order (as given by strcmp), the pairs a snapshot sees
+/// from a given key on. Keys are kept in a sorted index, so this costs
+/// O(log n) plus the pairs collected; scanning a whole table is a matter of
+/// calling this again from the last key collected. Tables are scanned batch
+/// by batch so several of them can be walked in step, e.g. to merge them.
+/// @param ht The hash table, readied with scan_begin.
+/// @param snapshot Snapshot of the calling thread (see mvcc_snapshot).
+/// @param after Key to start from, NULL to start from the smallest one.
+/// @param inclusive Whether a pair with key after itself qualifies.
+/// @param pairs Filled with the pairs; the strings stay valid until
+/// scan_end.
+/// @param max Room in pairs.
+/// @return Number of pairs collected, less than max once there are no more.
+size_t scan_pairs(HashTable *ht, uint64_t snapshot, const char *after,
+                  bool inclusive, PairRef pairs[], size_t max);
+
+/// Calls visit, in key order, for keys spread evenly over the sorted index
+/// of a table (see skiplist_sample): at least count of them, unless the
+/// table has fewer keys, and about four times count at most. Keys of pairs
+/// the snapshot of the scan misses may be among them. Meant for splitting a
+/// scan into ranges of about the same size.
+/// @param ht The hash table, readied with scan_begin.
+/// @param count Number of keys wanted at least.
+/// @param visit Function called with each key and arg; the key is only
+/// valid until visit returns.
+/// @param arg Argument passed to visit.
+void sample_keys(HashTable *ht, size_t count,
+                 void (*visit)(const char *key, void *arg), void *arg);
+
+/// Ends a scan, once the caller released its snapshot. With the chained
+/// backend, this is when the versions kept for the snapshot go, unless
+/// another snapshot still needs them.
+/// @param ht The hash table.
+/// @param token Token returned by scan_begin.
+void scan_end(HashTable *ht, uint64_t token);
 
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
 
-bool key_exists(HashTable *ht, const char *key);
+/// Checks if a key is in the table.
+/// @param ht The hash table.
+/// @param h Hash of the key.
+/// @param key The key.
+/// @return true if the key exists, false otherwise.
+bool key_exists(HashTable *ht, uint64_t h, const char *key);
+
+/// Checks if a key is in the table, for a caller that holds its stripe.
+/// @param ht The hash table.
+/// @param h Hash of the key.
+/// @param key The key.
+/// @return true if the key exists, false otherwise.
+bool key_exists_locked(HashTable *ht, uint64_t h, const char *key);
 
 
 
 ClientTable *create_client_table();
 void free_client_table(ClientTable *table);
-unsigned int hash_function(const char *key);
-int add_subscription(ClientTable *table, const char *key, int client_fd, 
-  const char *notif_pipe);
-int remove_subscription(ClientTable *table, const char *key, int client_fd);
+unsigned int hash_function(uint64_t h);
+int add_subscription(ClientTable *table, uint64_t h, const char *key,
+  int client_fd, const char *notif_pipe);
+int remove_subscription(ClientTable *table, uint64_t h, const char *key,
+  int client_fd);
 int subscribe_client(ClientTable *table, int client_fd, const char *key, 
   const char *notif_pipe);
 int subscription_table_init();
@@ -88,10 +328,10 @@ void subscription_table_destroy();
 int remove_client(ClientTable *table, int client_fd);
 int unsubscribe_client(ClientTable *table, int client_fd, const char *key);
 void print_hash_table(ClientTable *table);
-void subscribed_keys(const char *key,const char *value, int opcode);
+void subscribed_keys(uint64_t h, const char *key,const char *value, int opcode);
 void notify_client(const char *notif_pipe, const char *key, const char *value, 
   int opcode);
-int delete_key(ClientTable *table, const char *key);
+int delete_key(ClientTable *table, uint64_t h, const char *key);
 
 
 #endif // KVS_H
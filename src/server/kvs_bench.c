@@ -0,0 +1,173 @@
+// Microbenchmark of the KVS table, linked against whichever backend the
+// Makefile picked (see `make bench`). Every thread works on its own keys,
+// one key per batch, so the numbers measure the table rather than contention.
+// Given a file (mmap backend only), the table is kept in it, and the bench
+// also times a checkpoint and reads after mapping the table back.
+//
+// Usage: kvs_bench [threads] [keys per thread] [table file]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ebr.h"
+#include "kvs.h"
+
+typedef enum { BENCH_INSERT, BENCH_HIT, BENCH_MISS, BENCH_OVERWRITE,
+               BENCH_DELETE } Phase;
+
+static const char *phase_names[] = {"insert", "read hit", "read miss",
+                                    "overwrite", "delete"};
+
+typedef struct BenchThread {
+  pthread_t tid;
+  HashTable *ht;
+  Phase phase;
+  size_t first; // First key of this thread
+  size_t keys;
+  size_t errors;
+} BenchThread;
+
+static void make_key(char key[MAX_STRING_SIZE], size_t i, int miss) {
+  snprintf(key, MAX_STRING_SIZE, "%s%zu", miss ? "miss" : "key", i);
+}
+
+static void count_visit(const char *key, const char *value, void *arg) {
+  (void)key;
+  (void)value;
+  (*(size_t *)arg)++;
+}
+
+static void *bench_thread(void *arg) {
+  BenchThread *bt = arg;
+  char key[MAX_STRING_SIZE];
+  char *keys[1] = {key};
+  size_t visited = 0;
+
+  for (size_t i = bt->first; i < bt->first + bt->keys; i++) {
+    make_key(keys[0], i, bt->phase == BENCH_MISS);
+    uint64_t stripes, h;
+    switch (bt->phase) {
+    case BENCH_INSERT:
+    case BENCH_OVERWRITE:
+      stripes = lock_keys(bt->ht, 1, keys, &h, true);
+      bt->errors +=
+          (size_t)write_pair(bt->ht, h, keys[0],
+                             bt->phase == BENCH_INSERT ? "value" : "other",
+                             NULL);
+      unlock_stripes(bt->ht, stripes);
+      break;
+    case BENCH_HIT:
+      bt->errors += (size_t)read_pair_with(bt->ht, hash(keys[0]), keys[0],
+                                           count_visit, &visited);
+      break;
+    case BENCH_MISS:
+      bt->errors += (size_t)(read_pair_with(bt->ht, hash(keys[0]), keys[0],
+                                            count_visit, &visited) == 0);
+      break;
+    case BENCH_DELETE:
+      stripes = lock_keys(bt->ht, 1, keys, &h, true);
+      bt->errors += (size_t)delete_pair(bt->ht, h, keys[0]);
+      unlock_stripes(bt->ht, stripes);
+      break;
+    }
+  }
+  return NULL;
+}
+
+static double elapsed(const struct timespec *start,
+                      const struct timespec *end) {
+  return (double)(end->tv_sec - start->tv_sec) +
+         (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Runs a phase on every thread and prints its throughput.
+static void run_phase(HashTable *ht, BenchThread *threads, size_t n_threads,
+                      size_t keys, Phase phase, const char *name) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t t = 0; t < n_threads; t++) {
+    threads[t] = (BenchThread){0, ht, phase, t * keys, keys, 0};
+    pthread_create(&threads[t].tid, NULL, bench_thread, &threads[t]);
+  }
+  size_t errors = 0;
+  for (size_t t = 0; t < n_threads; t++) {
+    pthread_join(threads[t].tid, NULL);
+    errors += threads[t].errors;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = elapsed(&start, &end);
+  double ops = (double)(n_threads * keys);
+  printf("%-10s %8.2f Mops/s %8.1f ns/op%s\n", name, ops / seconds / 1e6,
+         seconds * 1e9 * (double)n_threads / ops,
+         errors ? "  (unexpected results)" : "");
+}
+
+// Checkpoints the table, then frees it and maps it back from its file.
+// @return The table mapped back, NULL on failure.
+static HashTable *reopen(HashTable *ht, const char *path) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t stripes = lock_all_stripes(ht);
+  int result = table_checkpoint(ht, 0);
+  unlock_stripes(ht, stripes);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%-10s %8.3f s\n", "checkpoint", elapsed(&start, &end));
+  ebr_drain();
+  free_table(ht);
+  if (result != 0)
+    return NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t position;
+  ht = create_hash_table();
+  if (ht == NULL || table_persist(ht, path, true, &position) != 0 ||
+      position == UINT64_MAX) {
+    if (ht != NULL)
+      free_table(ht);
+    return NULL;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%-10s %8.3f s\n", "reopen", elapsed(&start, &end));
+  return ht;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+  size_t keys = argc > 2 ? strtoul(argv[2], NULL, 10) : 250000;
+  const char *path = argc > 3 ? argv[3] : NULL;
+  if (n_threads == 0 || keys == 0) {
+    fprintf(stderr, "Usage: %s [threads] [keys per thread] [table file]\n",
+            argv[0]);
+    return 1;
+  }
+
+  HashTable *ht = create_hash_table();
+  BenchThread *threads = calloc(n_threads, sizeof(BenchThread));
+  uint64_t position;
+  if (ht == NULL || threads == NULL ||
+      (path != NULL && table_persist(ht, path, false, &position) != 0)) {
+    fprintf(stderr, "Failed to create the table\n");
+    return 1;
+  }
+
+  printf("%zu threads, %zu keys each\n", n_threads, keys);
+  for (Phase phase = BENCH_INSERT; phase <= BENCH_DELETE; phase++) {
+    if (phase == BENCH_DELETE && path != NULL) {
+      ht = reopen(ht, path);
+      if (ht == NULL) {
+        fprintf(stderr, "Failed to map the table back\n");
+        return 1;
+      }
+      run_phase(ht, threads, n_threads, keys, BENCH_HIT, "reread");
+    }
+    run_phase(ht, threads, n_threads, keys, phase, phase_names[phase]);
+  }
+
+  free(threads);
+  ebr_drain();
+  free_table(ht);
+  return 0;
+}
@@ -0,0 +1,371 @@
+// Folds a full backup and the deltas that follow it, in order, into a full
+// backup of the state the last delta was taken at (see kvs_backup). Every
+// file is sorted by key, so each delta is merged into the image in a single
+// pass.
+//
+// Inputs may be text or binary backups (see backup_file.h), mixed in any
+// way; the output is text, or binary with --binary, so this also converts
+// backups from one format to the other.
+//
+// Usage: kvs_compact [--binary] <output> <full backup> [delta...]
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "backup_file.h"
+
+// A line of a backup, pointing into the file read in memory. value is NULL
+// for a deleted key.
+typedef struct Entry {
+  const char *key;
+  const char *value;
+} Entry;
+
+typedef struct Image {
+  Entry *entries;
+  size_t count;
+  size_t capacity; // Room in entries, while a binary backup is listed
+} Image;
+
+// Reads a whole file, '\0' terminated.
+// @param path Path of the file.
+// @param length Set to the length of the file.
+// @return The contents, NULL on failure.
+static char *read_file(const char *path, size_t *length) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return NULL;
+  }
+  char *data = NULL;
+  size_t size = 0, capacity = 0;
+  while (1) {
+    if (size + 1 >= capacity) {
+      capacity = capacity ? capacity * 2 : 1 << 16;
+      char *grown = realloc(data, capacity);
+      if (grown == NULL) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        free(data);
+        fclose(file);
+        return NULL;
+      }
+      data = grown;
+    }
+    size_t n = fread(data + size, 1, capacity - size - 1, file);
+    if (n == 0)
+      break;
+    size += n;
+  }
+  int failed = ferror(file);
+  fclose(file);
+  if (failed) {
+    perror(path);
+    free(data);
+    return NULL;
+  }
+  data[size] = '\0';
+  *length = size;
+  return data;
+}
+
+// Splits the lines of a backup into entries, in place.
+// @param path Path of the file, for errors.
+// @param data Its contents, see read_file.
+// @param deletions Whether "(key)" lines are allowed (deltas).
+// @param image Filled with the entries.
+// @return 0 if successful, 1 otherwise.
+static int parse_backup(const char *path, char *data, int deletions,
+                        Image *image) {
+  size_t lines = 0;
+  for (const char *c = data; *c != '\0'; c++)
+    lines += *c == '\n';
+  image->entries = malloc((lines + 1) * sizeof(Entry));
+  image->count = 0;
+  if (image->entries == NULL) {
+    fprintf(stderr, "%s: out of memory\n", path);
+    return 1;
+  }
+
+  size_t line = 0;
+  for (char *start = data; *start != '\0';) {
+    line++;
+    char *end = strchr(start, '\n');
+    if (end == NULL) {
+      fprintf(stderr, "%s:%zu: truncated line\n", path, line);
+      return 1;
+    }
+    if (start[0] != '(' || end - start < 3 || end[-1] != ')') {
+      fprintf(stderr, "%s:%zu: malformed line\n", path, line);
+      return 1;
+    }
+    // Keys hold no ',', so the first ", " ends the key
+    end[-1] = '\0';
+    Entry entry = {start + 1, NULL};
+    char *sep = strstr(start + 1, ", ");
+    if (sep != NULL) {
+      *sep = '\0';
+      entry.value = sep + 2;
+    } else if (!deletions) {
+      fprintf(stderr, "%s:%zu: deletion in a full backup\n", path, line);
+      return 1;
+    }
+    if (image->count > 0 &&
+        strcmp(image->entries[image->count - 1].key, entry.key) >= 0) {
+      fprintf(stderr, "%s:%zu: keys out of order\n", path, line);
+      return 1;
+    }
+    image->entries[image->count++] = entry;
+    start = end + 1;
+  }
+  return 0;
+}
+
+// Checks a text backup against its checksum file, if it has one.
+// @param path Path of the file.
+// @param data Its contents, see read_file.
+// @param size Its size.
+// @return 0 if successful, 1 if the file is corrupt.
+static int check_text(const char *path, const char *data, size_t size) {
+  char seal_path[PATH_MAX];
+  snprintf(seal_path, sizeof(seal_path), "%s%s", path,
+           BACKUP_TEXT_SEAL_SUFFIX);
+  // Written before backups had one, or the server crashed before renaming
+  // it into place
+  if (access(seal_path, F_OK) != 0) {
+    fprintf(stderr, "%s: no checksum, not verified\n", path);
+    return 0;
+  }
+  size_t seal_size;
+  char *seal = read_file(seal_path, &seal_size);
+  if (seal == NULL)
+    return 1;
+  int result = backup_text_check(data, size, seal, seal_size);
+  free(seal);
+  if (result != 0)
+    fprintf(stderr, "%s: checksum mismatch\n", path);
+  return result;
+}
+
+// Adds an entry of a binary backup to an image. Entries past its capacity
+// are only counted.
+static void add_entry(const char *key, const char *value, void *arg) {
+  Image *image = arg;
+  if (image->count < image->capacity)
+    image->entries[image->count] = (Entry){key, value};
+  image->count++;
+}
+
+// Lists the entries of a binary backup, checking every block on the way.
+// @param path Path of the file, for errors.
+// @param data Its contents, see read_file.
+// @param size Its size.
+// @param delta Whether it must be a delta, rather than a full backup.
+// @param image Filled with the entries.
+// @param snapshot Set to the snapshot the backup holds.
+// @param log_position Set to the log position it holds every change up to.
+// @return 0 if successful, 1 otherwise.
+static int parse_binary(const char *path, const char *data, size_t size,
+                        bool delta, Image *image, uint64_t *snapshot,
+                        uint64_t *log_position) {
+  BackupImage backup;
+  image->entries = NULL;
+  image->count = 0;
+  image->capacity = 0;
+  if (backup_image_open(&backup, path, data, size) != 0)
+    return 1;
+  int result = 0;
+  if (((backup.flags & BACKUP_FLAG_DELTA) != 0) != delta) {
+    fprintf(stderr, "%s: %s\n", path,
+            delta ? "not a delta" : "a delta, not a full backup");
+    result = 1;
+  }
+  if (result == 0) {
+    image->capacity = (size_t)backup.entries;
+    image->entries = malloc((image->capacity + 1) * sizeof(Entry));
+    if (image->entries == NULL) {
+      fprintf(stderr, "%s: out of memory\n", path);
+      result = 1;
+    }
+  }
+  for (size_t b = 0; result == 0 && b < backup.num_blocks; b++)
+    result = backup_block_foreach(&backup, b, add_entry, image);
+  if (result == 0 && image->count != image->capacity) {
+    fprintf(stderr, "%s: entry count mismatch\n", path);
+    result = 1;
+  }
+  for (size_t i = 1; result == 0 && i < image->count; i++) {
+    if (strcmp(image->entries[i - 1].key, image->entries[i].key) >= 0) {
+      fprintf(stderr, "%s: keys out of order\n", path);
+      result = 1;
+    }
+  }
+  *snapshot = backup.snapshot;
+  *log_position = backup.log_position;
+  backup_image_close(&backup);
+  return result;
+}
+
+// Applies a delta to an image: its pairs replace or join those of the image,
+// and its deleted keys leave it.
+// @param image The image, replaced with the result.
+// @param delta The delta.
+// @return 0 if successful, 1 otherwise.
+static int apply_delta(Image *image, const Image *delta) {
+  Entry *merged = malloc((image->count + delta->count + 1) * sizeof(Entry));
+  if (merged == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  size_t i = 0, d = 0, count = 0;
+  while (i < image->count || d < delta->count) {
+    int cmp;
+    if (d == delta->count)
+      cmp = -1;
+    else if (i == image->count)
+      cmp = 1;
+    else
+      cmp = strcmp(image->entries[i].key, delta->entries[d].key);
+
+    if (cmp < 0) {
+      merged[count++] = image->entries[i++];
+      continue;
+    }
+    if (cmp == 0)
+      i++;
+    if (delta->entries[d].value != NULL)
+      merged[count++] = delta->entries[d];
+    d++;
+  }
+  free(image->entries);
+  image->entries = merged;
+  image->count = count;
+  return 0;
+}
+
+// Writes an image as a text backup, and its checksum file.
+// @return 0 if successful, 1 otherwise.
+static int write_text(const char *path, const Image *image) {
+  char seal_path[PATH_MAX];
+  snprintf(seal_path, sizeof(seal_path), "%s%s", path,
+           BACKUP_TEXT_SEAL_SUFFIX);
+  // The checksum of what the file held would not match meanwhile
+  unlink(seal_path);
+  // Read back to checksum it
+  FILE *out = fopen(path, "w+");
+  if (out == NULL) {
+    perror(path);
+    return 1;
+  }
+  for (size_t i = 0; i < image->count; i++)
+    fprintf(out, "(%s, %s)\n", image->entries[i].key, image->entries[i].value);
+  int result = fflush(out) != 0;
+  if (result == 0) {
+    int seal_fd = open(seal_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    result = seal_fd < 0 || backup_text_seal(fileno(out), seal_fd) != 0;
+    if (seal_fd >= 0 && close(seal_fd) != 0)
+      result = 1;
+  }
+  if (fclose(out) != 0 || result != 0) {
+    perror(path);
+    return 1;
+  }
+  return 0;
+}
+
+// Writes an image as a full binary backup.
+// @param snapshot Snapshot the image holds, 0 if unknown.
+// @param log_position Log position it holds every change up to, 0 if
+// unknown.
+// @return 0 if successful, 1 otherwise.
+static int write_binary(const char *path, const Image *image,
+                        uint64_t snapshot, uint64_t log_position) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  BackupWriter writer;
+  int result = backup_writer_open(&writer, fd, 0, snapshot, log_position,
+                                  0);
+  if (result == 0) {
+    for (size_t i = 0; i < image->count; i++)
+      backup_writer_add(&writer, image->entries[i].key,
+                        image->entries[i].value);
+    result = backup_writer_finish(&writer);
+    backup_writer_free(&writer);
+  }
+  if (close(fd) != 0)
+    result = 1;
+  if (result != 0)
+    fprintf(stderr, "%s: failed to write the backup\n", path);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  bool binary = argc > 1 && strcmp(argv[1], "--binary") == 0;
+  if (binary) {
+    argc--;
+    argv++;
+  }
+  if (argc < 3) {
+    fprintf(stderr,
+            "Usage: kvs_compact [--binary] <output> <full backup> "
+            "[delta...]\n");
+    return 1;
+  }
+
+  // Every file is read before the output is opened, which may be one of
+  // them
+  int files = argc - 2;
+  char **data = calloc((size_t)files, sizeof(char *));
+  Image *images = calloc((size_t)files, sizeof(Image));
+  if (data == NULL || images == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  int result = 0;
+  // Snapshot of the last binary input, which the output holds, and the log
+  // position that goes with it: the output can be recovered from
+  uint64_t snapshot = 0;
+  uint64_t log_position = 0;
+  for (int f = 0; f < files && result == 0; f++) {
+    const char *path = argv[f + 2];
+    size_t size;
+    data[f] = read_file(path, &size);
+    if (data[f] == NULL) {
+      result = 1;
+    } else if (backup_is_binary(data[f], size)) {
+      result = parse_binary(path, data[f], size, f > 0, &images[f],
+                            &snapshot, &log_position);
+    } else {
+      snapshot = 0;
+      log_position = 0;
+      result = check_text(path, data[f], size);
+      if (result == 0)
+        result = parse_backup(path, data[f], f > 0, &images[f]);
+    }
+  }
+  for (int f = 1; f < files && result == 0; f++)
+    result = apply_delta(&images[0], &images[f]);
+
+  if (result == 0) {
+    if (binary)
+      result = write_binary(argv[1], &images[0], snapshot,
+                            log_position);
+    else
+      result = write_text(argv[1], &images[0]);
+  }
+
+  for (int f = 0; f < files; f++) {
+    free(images[f].entries);
+    free(data[f]);
+  }
+  free(images);
+  free(data);
+  return result;
+}
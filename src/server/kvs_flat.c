@@ -0,0 +1,732 @@
+#include "kvs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "mvcc.h"
+#include "skiplist.h"
+#include "stats.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Open addressing backend of the KVS table (see kvs.h), in the style of
+// "Swiss tables": every slot has a one byte control word, and control words
+// are grouped by FLAT_GROUP_WIDTH so that a single SSE2 compare tells which
+// slots of a group may hold the key. Pairs are stored inline in a dense slot
+// array, so a hit costs a control group load and one slot. Keys and values
+// too long for a slot are copied to the heap and the slot points to them.
+//
+// The table is split into KVS_LOCK_STRIPES independent sub-tables, one per
+// lock stripe, picked by the low bits of the hash. Each sub-table probes and
+// resizes on its own, under its own lock, so a resize only ever stalls the
+// keys of one stripe. Unlike the chained backend, point reads take the read
+// lock of their stripe; besides that, they only set the reference bit of the
+// slot they hit, for the CLOCK eviction (see evict_pair).
+
+// Slots per control group, the width of an SSE2 register.
+#define FLAT_GROUP_WIDTH 16
+// Groups a sub-table starts with (must be a power of two).
+#define FLAT_INITIAL_GROUPS 1
+// Sub-tables grow once 7/8 of their slots are taken.
+#define FLAT_MAX_LOAD_NUM 7
+#define FLAT_MAX_LOAD_DEN 8
+
+// Control words. Full slots hold the top 7 bits of the hash of their key, so
+// the sign bit alone tells free slots from full ones.
+#define CTRL_EMPTY ((int8_t)-128) // Never used, ends a probe sequence
+#define CTRL_DELETED ((int8_t)-2) // Tombstone, probes go on past it
+
+// Room for a key or a value inside a slot, '\0' included.
+#define FLAT_INLINE_SIZE MAX_STRING_SIZE
+
+// A key or a value: inline if shorter than FLAT_INLINE_SIZE, on the heap
+// otherwise. Which one it is follows from its length, kept in the slot.
+typedef union FlatString {
+  char inline_str[FLAT_INLINE_SIZE];
+  char *heap_str;
+} FlatString;
+
+typedef struct FlatSlot {
+  uint64_t hash;      // Kept so resizes don't hash every key again
+  uint64_t version;   // Commit that wrote the value, see mvcc.h
+  uint32_t value_len; // Not counting the '\0'
+  uint16_t key_len;   // Not counting the '\0', see KVS_MAX_KEY_LEN
+  atomic_bool referenced; // Read since the clock hand last passed
+  FlatString key;
+  FlatString value;
+} FlatSlot;
+
+typedef struct FlatTable {
+  _Alignas(64) pthread_rwlock_t lock;
+  size_t groups;      // Number of control groups, always a power of two
+  size_t used;        // Full slots
+  size_t growth_left; // Empty slots that can still be taken before a resize
+  size_t clock_hand;  // Next slot evict_pair looks at
+  int8_t *ctrl;       // groups * FLAT_GROUP_WIDTH control words
+  FlatSlot *slots;    // groups * FLAT_GROUP_WIDTH slots
+} FlatTable;
+
+struct HashTable {
+  FlatTable tables[KVS_LOCK_STRIPES];
+  SkipList *index; // Every key, in order
+  atomic_size_t bytes; // Memory held by the pairs, see slot_bytes
+  atomic_uint clock_stripe; // Sub-table the next eviction starts from
+};
+
+// Returns the stripe, and so the sub-table, of a given hash.
+static inline unsigned stripe_of(uint64_t h) {
+  return (unsigned)(h & (KVS_LOCK_STRIPES - 1));
+}
+
+// Returns the first group of the probe sequence of a hash. The low bits
+// already picked the sub-table, so they are skipped.
+static inline size_t group_of(const FlatTable *t, uint64_t h) {
+  return (size_t)(h >> 6) & (t->groups - 1);
+}
+
+// Returns the control word of a full slot holding a given hash.
+static inline int8_t tag_of(uint64_t h) { return (int8_t)(h >> 57); }
+
+// Returns a bit mask of the slots of a group whose control word is tag.
+// @param ctrl Control words of the group (FLAT_GROUP_WIDTH aligned).
+// @param tag Control word to look for.
+static inline uint32_t group_match(const int8_t *ctrl, int8_t tag) {
+#ifdef __SSE2__
+  __m128i group = _mm_load_si128((const __m128i *)(const void *)ctrl);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+  uint32_t mask = 0;
+  for (unsigned i = 0; i < FLAT_GROUP_WIDTH; i++) {
+    if (ctrl[i] == tag)
+      mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// Returns a bit mask of the free (empty or deleted) slots of a group.
+static inline uint32_t group_match_free(const int8_t *ctrl) {
+#ifdef __SSE2__
+  __m128i group = _mm_load_si128((const __m128i *)(const void *)ctrl);
+  return (uint32_t)_mm_movemask_epi8(group);
+#else
+  uint32_t mask = 0;
+  for (unsigned i = 0; i < FLAT_GROUP_WIDTH; i++) {
+    if (ctrl[i] < 0)
+      mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// Returns the characters of a string stored in a slot.
+// @param str The string.
+// @param len Its length.
+static inline const char *flat_str(const FlatString *str, uint32_t len) {
+  return len < FLAT_INLINE_SIZE ? str->inline_str : str->heap_str;
+}
+
+// Copies a string into a slot string.
+// @param str Slot string to fill.
+// @param src The string.
+// @param len Its length.
+// @return 0 if successful, 1 otherwise.
+static int flat_str_set(FlatString *str, const char *src, size_t len) {
+  if (len < FLAT_INLINE_SIZE) {
+    memcpy(str->inline_str, src, len + 1);
+    return 0;
+  }
+  char *copy = malloc(len + 1);
+  if (copy == NULL)
+    return 1;
+  memcpy(copy, src, len + 1);
+  str->heap_str = copy;
+  return 0;
+}
+
+// Frees whatever a slot string holds on the heap.
+// @param str The string.
+// @param len Its length.
+static void flat_str_free(FlatString *str, uint32_t len) {
+  if (len >= FLAT_INLINE_SIZE)
+    free(str->heap_str);
+}
+
+// Returns the key stored in a slot.
+static inline const char *slot_key(const FlatSlot *slot) {
+  return flat_str(&slot->key, slot->key_len);
+}
+
+// Returns the value stored in a slot.
+static inline const char *slot_value(const FlatSlot *slot) {
+  return flat_str(&slot->value, slot->value_len);
+}
+
+// Returns the memory a pair accounts for in the table: its slot and control
+// word, whatever of it lives on the heap and the copy of the key in the
+// sorted index.
+static size_t slot_bytes(const FlatSlot *slot) {
+  size_t bytes = sizeof(FlatSlot) + 1 + slot->key_len + 1u;
+  if (slot->key_len >= FLAT_INLINE_SIZE)
+    bytes += slot->key_len + 1u;
+  if (slot->value_len >= FLAT_INLINE_SIZE)
+    bytes += slot->value_len + 1u;
+  return bytes;
+}
+
+// Adds a pair to the server stats, or takes it out of them.
+// @param slot Slot of the pair.
+// @param sign 1 for a pair entering the table, -1 for one leaving it.
+static void account_slot(const FlatSlot *slot, int64_t sign) {
+  size_t payload = (size_t)slot->key_len + slot->value_len;
+  stat_add(STAT_KEYS, sign);
+  stat_add(STAT_KEY_BYTES, sign * slot->key_len);
+  stat_add(STAT_VALUE_BYTES, sign * slot->value_len);
+  stat_add(STAT_OVERHEAD_BYTES, sign * (int64_t)(slot_bytes(slot) - payload));
+}
+
+// Marks a slot as recently used, for evict_pair. Skips the store when the
+// bit is already set, so hot keys don't keep dirtying their cache line.
+static inline void slot_touch(FlatSlot *slot) {
+  if (!atomic_load_explicit(&slot->referenced, memory_order_relaxed))
+    atomic_store_explicit(&slot->referenced, true, memory_order_relaxed);
+}
+
+// Allocates the arrays of a sub-table, every slot empty.
+// @param t The sub-table.
+// @param groups Number of control groups (power of two).
+// @return 0 if successful, 1 otherwise.
+static int flat_table_alloc(FlatTable *t, size_t groups) {
+  size_t capacity = groups * FLAT_GROUP_WIDTH;
+  int8_t *ctrl = aligned_alloc(FLAT_GROUP_WIDTH, capacity);
+  FlatSlot *slots = malloc(capacity * sizeof(FlatSlot));
+  if (ctrl == NULL || slots == NULL) {
+    free(ctrl);
+    free(slots);
+    return 1;
+  }
+  memset(ctrl, CTRL_EMPTY, capacity);
+  t->ctrl = ctrl;
+  t->slots = slots;
+  t->groups = groups;
+  t->used = 0;
+  t->clock_hand = 0;
+  t->growth_left = capacity * FLAT_MAX_LOAD_NUM / FLAT_MAX_LOAD_DEN;
+  return 0;
+}
+
+// Searches a sub-table for a key. Probing visits groups in triangular
+// order, which covers every group of a power of two table, and stops at the
+// first group with an empty slot.
+// @param t The sub-table.
+// @param h Hash of the key.
+// @param key The key.
+// @return Index of the slot holding the key, SIZE_MAX if not found.
+static size_t flat_find(const FlatTable *t, uint64_t h, const char *key) {
+  size_t g = group_of(t, h);
+  int8_t tag = tag_of(h);
+  for (size_t step = 1; step <= t->groups; step++) {
+    const int8_t *ctrl = t->ctrl + g * FLAT_GROUP_WIDTH;
+    for (uint32_t match = group_match(ctrl, tag); match != 0;
+         match &= match - 1) {
+      size_t i = g * FLAT_GROUP_WIDTH + (size_t)__builtin_ctz(match);
+      if (t->slots[i].hash == h && strcmp(slot_key(&t->slots[i]), key) == 0)
+        return i;
+    }
+    if (group_match(ctrl, CTRL_EMPTY) != 0)
+      break;
+    g = (g + step) & (t->groups - 1);
+  }
+  return SIZE_MAX;
+}
+
+// Returns the first free slot of the probe sequence of a hash. The caller
+// made sure there is one (growth_left is never allowed to reach past the
+// last empty slot).
+static size_t flat_find_free(const FlatTable *t, uint64_t h) {
+  size_t g = group_of(t, h);
+  for (size_t step = 1;; step++) {
+    uint32_t free_slots = group_match_free(t->ctrl + g * FLAT_GROUP_WIDTH);
+    if (free_slots != 0)
+      return g * FLAT_GROUP_WIDTH + (size_t)__builtin_ctz(free_slots);
+    g = (g + step) & (t->groups - 1);
+  }
+}
+
+// Rehashes a sub-table whose empty slots ran out: into twice the groups if
+// it is really full, into the same number if it is mostly tombstones. The
+// caller holds the sub-table for writing.
+// @param t The sub-table.
+// @return 0 if successful, 1 otherwise (the sub-table is left as it was).
+static int flat_resize(FlatTable *t) {
+  size_t capacity = t->groups * FLAT_GROUP_WIDTH;
+  size_t groups = t->groups;
+  if (t->used * 2 >= capacity * FLAT_MAX_LOAD_NUM / FLAT_MAX_LOAD_DEN)
+    groups *= 2;
+
+  FlatTable old = *t;
+  if (flat_table_alloc(t, groups) != 0) {
+    *t = old;
+    return 1;
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    if (old.ctrl[i] < 0)
+      continue;
+    size_t j = flat_find_free(t, old.slots[i].hash);
+    t->ctrl[j] = old.ctrl[i];
+    t->slots[j] = old.slots[i];
+  }
+  t->used = old.used;
+  t->growth_left -= old.used;
+  free(old.ctrl);
+  free(old.slots);
+  return 0;
+}
+
+// Locks a set of stripes in ascending order.
+// @param ht The hash table.
+// @param stripes Mask of stripes to lock.
+// @param write Whether to lock for writing.
+static void lock_stripes(HashTable *ht, uint64_t stripes, bool write) {
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    if (!(stripes & (1ULL << s)))
+      continue;
+    if (write)
+      pthread_rwlock_wrlock(&ht->tables[s].lock);
+    else
+      pthread_rwlock_rdlock(&ht->tables[s].lock);
+  }
+}
+
+uint64_t lock_keys(HashTable *ht, size_t num_keys, char *keys[],
+                   uint64_t hashes[], bool write) {
+  uint64_t stripes = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    uint64_t h = hash(keys[i]);
+    if (hashes != NULL)
+      hashes[i] = h;
+    stripes |= 1ULL << stripe_of(h);
+  }
+  lock_stripes(ht, stripes, write);
+  return stripes;
+}
+
+uint64_t lock_hashes(HashTable *ht, size_t num_keys, const uint64_t hashes[],
+                     bool write) {
+  uint64_t stripes = 0;
+  for (size_t i = 0; i < num_keys; i++)
+    stripes |= 1ULL << stripe_of(hashes[i]);
+  lock_stripes(ht, stripes, write);
+  return stripes;
+}
+
+uint64_t lock_all_stripes(HashTable *ht) {
+  lock_stripes(ht, UINT64_MAX, false);
+  return UINT64_MAX;
+}
+
+void unlock_stripes(HashTable *ht, uint64_t stripes) {
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    if (stripes & (1ULL << s))
+      pthread_rwlock_unlock(&ht->tables[s].lock);
+  }
+}
+
+bool key_exists(HashTable *ht, uint64_t h, const char *key) {
+  FlatTable *t = &ht->tables[stripe_of(h)];
+  pthread_rwlock_rdlock(&t->lock);
+  bool found = flat_find(t, h, key) != SIZE_MAX;
+  pthread_rwlock_unlock(&t->lock);
+  return found;
+}
+
+bool key_exists_locked(HashTable *ht, uint64_t h, const char *key) {
+  return flat_find(&ht->tables[stripe_of(h)], h, key) != SIZE_MAX;
+}
+
+struct HashTable *create_hash_table() {
+  HashTable *ht = aligned_alloc(64, sizeof(HashTable));
+  if (!ht)
+    return NULL;
+  ht->index = skiplist_create();
+  if (ht->index == NULL) {
+    free(ht);
+    return NULL;
+  }
+  atomic_init(&ht->bytes, 0);
+  atomic_init(&ht->clock_stripe, 0);
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    if (flat_table_alloc(&ht->tables[s], FLAT_INITIAL_GROUPS) != 0) {
+      while (s-- > 0) {
+        free(ht->tables[s].ctrl);
+        free(ht->tables[s].slots);
+        pthread_rwlock_destroy(&ht->tables[s].lock);
+      }
+      skiplist_destroy(ht->index);
+      free(ht);
+      return NULL;
+    }
+    pthread_rwlock_init(&ht->tables[s].lock, NULL);
+  }
+  return ht;
+}
+
+// Returns the version a write made now is stamped with: that of the calling
+// thread's commit. The flat table keeps no old versions, so this only tells
+// incremental backups which pairs changed.
+static uint64_t write_version(void) {
+  uint64_t version = mvcc_begin();
+  mvcc_end();
+  return version;
+}
+
+int write_pair(HashTable *ht, uint64_t h, const char *key, const char *value,
+               bool *changed) {
+  size_t key_len = strlen(key);
+  size_t value_len = strlen(value);
+  if (key_len > KVS_MAX_KEY_LEN || value_len > UINT32_MAX)
+    return 1;
+
+  FlatTable *t = &ht->tables[stripe_of(h)];
+  size_t i = flat_find(t, h, key);
+  // Rewriting the same value leaves the slot alone
+  bool same = i != SIZE_MAX && t->slots[i].value_len == value_len &&
+              memcmp(slot_value(&t->slots[i]), value, value_len) == 0;
+  if (changed != NULL)
+    *changed = !same;
+  if (same)
+    return 0;
+
+  FlatString new_value;
+  if (flat_str_set(&new_value, value, value_len) != 0)
+    return 1;
+
+  if (i != SIZE_MAX) {
+    // overwrite value, readers are kept out by the stripe lock
+    FlatSlot *slot = &t->slots[i];
+    size_t old_bytes = slot_bytes(slot);
+    account_slot(slot, -1);
+    flat_str_free(&slot->value, slot->value_len);
+    slot->value = new_value;
+    slot->value_len = (uint32_t)value_len;
+    slot->version = write_version();
+    atomic_fetch_add(&ht->bytes, slot_bytes(slot));
+    atomic_fetch_sub(&ht->bytes, old_bytes);
+    account_slot(slot, 1);
+    return 0;
+  }
+
+  // Key not found, take the first free slot of its probe sequence
+  FlatString new_key;
+  if (flat_str_set(&new_key, key, key_len) != 0) {
+    flat_str_free(&new_value, (uint32_t)value_len);
+    return 1;
+  }
+  i = flat_find_free(t, h);
+  bool full = t->ctrl[i] == CTRL_EMPTY && t->growth_left == 0;
+  if (full && flat_resize(t) == 0) {
+    full = false;
+    i = flat_find_free(t, h);
+  }
+  if (full || skiplist_insert(ht->index, key, h) != 0) {
+    flat_str_free(&new_key, (uint32_t)key_len);
+    flat_str_free(&new_value, (uint32_t)value_len);
+    return 1;
+  }
+  if (t->ctrl[i] == CTRL_EMPTY)
+    t->growth_left--;
+  t->ctrl[i] = tag_of(h);
+  FlatSlot *slot = &t->slots[i];
+  slot->hash = h;
+  slot->version = write_version();
+  slot->value_len = (uint32_t)value_len;
+  slot->key_len = (uint16_t)key_len;
+  atomic_init(&slot->referenced, false);
+  slot->key = new_key;
+  slot->value = new_value;
+  t->used++;
+  atomic_fetch_add(&ht->bytes, slot_bytes(slot));
+  account_slot(slot, 1);
+  return 0;
+}
+
+char *read_pair(HashTable *ht, const char *key) {
+  char *value = NULL;
+  uint64_t h = hash(key);
+  FlatTable *t = &ht->tables[stripe_of(h)];
+  pthread_rwlock_rdlock(&t->lock);
+  size_t i = flat_find(t, h, key);
+  if (i != SIZE_MAX) {
+    slot_touch(&t->slots[i]);
+    value = strdup(slot_value(&t->slots[i]));
+  }
+  pthread_rwlock_unlock(&t->lock);
+  return value; // NULL if the key was not found
+}
+
+int read_pair_with(HashTable *ht, uint64_t h, const char *key,
+                   void (*visit)(const char *key, const char *value, void *arg),
+                   void *arg) {
+  FlatTable *t = &ht->tables[stripe_of(h)];
+  pthread_rwlock_rdlock(&t->lock);
+  size_t i = flat_find(t, h, key);
+  if (i != SIZE_MAX) {
+    slot_touch(&t->slots[i]);
+    visit(slot_key(&t->slots[i]), slot_value(&t->slots[i]), arg);
+  }
+  pthread_rwlock_unlock(&t->lock);
+  return i == SIZE_MAX;
+}
+
+// Empties a full slot, dropping its key from the index. The caller holds
+// the sub-table for writing.
+// @param ht The hash table.
+// @param t The sub-table.
+// @param i Index of the slot.
+static void flat_erase(HashTable *ht, FlatTable *t, size_t i) {
+  FlatSlot *slot = &t->slots[i];
+  // A group that still has an empty slot never made a probe go past it, so
+  // the slot can go back to empty. Otherwise it must stay a tombstone.
+  const int8_t *ctrl = t->ctrl + (i & ~(size_t)(FLAT_GROUP_WIDTH - 1));
+  if (group_match(ctrl, CTRL_EMPTY) != 0) {
+    t->ctrl[i] = CTRL_EMPTY;
+    t->growth_left++;
+  } else {
+    t->ctrl[i] = CTRL_DELETED;
+  }
+  t->used--;
+  atomic_fetch_sub(&ht->bytes, slot_bytes(slot));
+  account_slot(slot, -1);
+  skiplist_remove(ht->index, slot_key(slot));
+  flat_str_free(&slot->key, slot->key_len);
+  flat_str_free(&slot->value, slot->value_len);
+}
+
+int delete_pair(HashTable *ht, uint64_t h, const char *key) {
+  FlatTable *t = &ht->tables[stripe_of(h)];
+  size_t i = flat_find(t, h, key);
+  if (i == SIZE_MAX)
+    return 1;
+
+  flat_erase(ht, t, i);
+  return 0;
+}
+
+size_t table_memory(HashTable *ht) { return atomic_load(&ht->bytes); }
+
+int table_intern_values(HashTable *ht) {
+  (void)ht;
+  return 0;
+}
+
+int table_reserve(HashTable *ht, size_t keys) {
+  // Stripes get an even share of the keys give or take a few, hence the
+  // eighth on top
+  size_t share = keys / KVS_LOCK_STRIPES;
+  share += share / 8 + FLAT_GROUP_WIDTH;
+  size_t groups = FLAT_INITIAL_GROUPS;
+  while (groups * FLAT_GROUP_WIDTH * FLAT_MAX_LOAD_NUM / FLAT_MAX_LOAD_DEN <
+             share &&
+         groups <= SIZE_MAX / (4 * FLAT_GROUP_WIDTH))
+    groups *= 2;
+
+  int result = 0;
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES && result == 0; s++) {
+    FlatTable *t = &ht->tables[s];
+    pthread_rwlock_wrlock(&t->lock);
+    // Only empty sub-tables, which have nothing to move, are resized here
+    if (t->used == 0 && t->groups < groups) {
+      FlatTable old = *t;
+      if (flat_table_alloc(t, groups) == 0) {
+        free(old.ctrl);
+        free(old.slots);
+      } else {
+        *t = old;
+        result = 1;
+      }
+    }
+    pthread_rwlock_unlock(&t->lock);
+  }
+  return result;
+}
+
+int table_persist(HashTable *ht, const char *path, bool load,
+                  uint64_t *log_position) {
+  (void)ht;
+  (void)load;
+  *log_position = UINT64_MAX;
+  fprintf(stderr, "%s: this build keeps its tables in memory only, build it "
+                  "with KVS_BACKEND=mmap to keep them in files\n", path);
+  return 1;
+}
+
+int table_checkpoint(HashTable *ht, uint64_t log_position) {
+  (void)ht;
+  (void)log_position;
+  return 0;
+}
+
+// Returns how many groups past its first one the probe sequence of a slot's
+// hash goes before it reaches the slot's group.
+static size_t probe_distance(const FlatTable *t, size_t i) {
+  size_t g = group_of(t, t->slots[i].hash);
+  size_t target = i / FLAT_GROUP_WIDTH;
+  size_t step = 1;
+  while (g != target && step <= t->groups) {
+    g = (g + step) & (t->groups - 1);
+    step++;
+  }
+  return step - 1;
+}
+
+void table_stats(HashTable *ht, TableStats *stats) {
+  *stats = (TableStats){0};
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    const FlatTable *t = &ht->tables[s];
+    size_t capacity = t->groups * FLAT_GROUP_WIDTH;
+    stats->keys += t->used;
+    stats->buckets += capacity;
+    stats->table_bytes += (capacity - t->used) * (sizeof(FlatSlot) + 1);
+    for (size_t i = 0; i < capacity; i++) {
+      if (t->ctrl[i] < 0)
+        continue;
+      size_t distance = probe_distance(t, i);
+      stats->chains[distance < KVS_CHAIN_HISTOGRAM ? distance
+                                                   : KVS_CHAIN_HISTOGRAM - 1]++;
+    }
+  }
+}
+
+// Moves the clock hand of a sub-table over its slots, clearing reference
+// bits until it meets a full slot whose bit was already clear. The caller
+// holds the sub-table for writing.
+// @param t The sub-table.
+// @return Index of the slot to evict, SIZE_MAX if the sub-table is empty.
+static size_t clock_sweep(FlatTable *t) {
+  size_t capacity = t->groups * FLAT_GROUP_WIDTH;
+  if (t->used == 0)
+    return SIZE_MAX;
+  // Two turns at most: the first one may only clear bits
+  for (size_t visits = 2 * capacity; visits > 0; visits--) {
+    size_t i = t->clock_hand;
+    t->clock_hand = (i + 1) & (capacity - 1);
+    if (t->ctrl[i] >= 0 &&
+        !atomic_exchange_explicit(&t->slots[i].referenced, false,
+                                  memory_order_relaxed))
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+int evict_pair(HashTable *ht,
+               void (*evicted)(const char *key, uint64_t h, void *arg),
+               void *arg) {
+  for (unsigned tries = 0; tries < KVS_LOCK_STRIPES; tries++) {
+    unsigned s = atomic_fetch_add(&ht->clock_stripe, 1) % KVS_LOCK_STRIPES;
+    FlatTable *t = &ht->tables[s];
+    pthread_rwlock_wrlock(&t->lock);
+    size_t i = clock_sweep(t);
+    if (i != SIZE_MAX) {
+      evicted(slot_key(&t->slots[i]), t->slots[i].hash, arg);
+      flat_erase(ht, t, i);
+      pthread_rwlock_unlock(&t->lock);
+      return 0;
+    }
+    pthread_rwlock_unlock(&t->lock);
+  }
+  return 1;
+}
+
+void foreach_pair(HashTable *ht,
+                  void (*visit)(const char *key, const char *value, void *arg),
+                  void *arg) {
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    FlatTable *t = &ht->tables[s];
+    size_t capacity = t->groups * FLAT_GROUP_WIDTH;
+    for (size_t i = 0; i < capacity; i++) {
+      if (t->ctrl[i] >= 0)
+        visit(slot_key(&t->slots[i]), slot_value(&t->slots[i]), arg);
+    }
+  }
+}
+
+// Pairs live in their slots, where writers overwrite them, so there are no
+// old versions to scan: a scan locks the table for its whole length.
+bool scan_locks(void) { return true; }
+
+uint64_t scan_begin(HashTable *ht) { return lock_all_stripes(ht); }
+
+// State of a scan_pairs call.
+typedef struct ScanVisit {
+  HashTable *ht;
+  const char *after;
+  bool inclusive;
+  PairRef *pairs;
+  size_t max;
+  size_t count;
+} ScanVisit;
+
+// Collects the pair of a key handed out by the index.
+static bool scan_visit(const char *key, uint64_t h, void *arg) {
+  ScanVisit *scan = arg;
+  if (!scan->inclusive && strcmp(key, scan->after) == 0)
+    return true;
+  FlatTable *t = &scan->ht->tables[stripe_of(h)];
+  size_t i = flat_find(t, h, key);
+  if (i != SIZE_MAX)
+    scan->pairs[scan->count++] = (PairRef){
+        slot_key(&t->slots[i]), slot_value(&t->slots[i]), t->slots[i].version};
+  return scan->count < scan->max;
+}
+
+size_t scan_pairs(HashTable *ht, uint64_t snapshot, const char *after,
+                  bool inclusive, PairRef pairs[], size_t max) {
+  (void)snapshot; // Locked, the table is seen as of scan_begin
+  if (max == 0)
+    return 0;
+  ScanVisit scan = {ht, after, inclusive || after == NULL, pairs, max, 0};
+  skiplist_foreach(ht->index, after, scan_visit, &scan);
+  return scan.count;
+}
+
+// State of a sample_keys call.
+typedef struct SampleVisit {
+  void (*visit)(const char *key, void *arg);
+  void *arg;
+} SampleVisit;
+
+// Hands a key picked by the index to the caller of sample_keys.
+static bool sample_visit(const char *key, uint64_t h, void *arg) {
+  (void)h;
+  SampleVisit *sample = arg;
+  sample->visit(key, sample->arg);
+  return true;
+}
+
+void sample_keys(HashTable *ht, size_t count,
+                 void (*visit)(const char *key, void *arg), void *arg) {
+  SampleVisit sample = {visit, arg};
+  // Locked by scan_begin, the index has no writer
+  skiplist_sample(ht->index, count, sample_visit, &sample);
+}
+
+void scan_end(HashTable *ht, uint64_t token) { unlock_stripes(ht, token); }
+
+void free_table(HashTable *ht) {
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    FlatTable *t = &ht->tables[s];
+    size_t capacity = t->groups * FLAT_GROUP_WIDTH;
+    for (size_t i = 0; i < capacity; i++) {
+      if (t->ctrl[i] >= 0) {
+        flat_str_free(&t->slots[i].key, t->slots[i].key_len);
+        flat_str_free(&t->slots[i].value, t->slots[i].value_len);
+      }
+    }
+    free(ht->tables[s].ctrl);
+    free(ht->tables[s].slots);
+    pthread_rwlock_destroy(&ht->tables[s].lock);
+  }
+  skiplist_destroy(ht->index);
+  free(ht);
+}
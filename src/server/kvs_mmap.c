@@ -0,0 +1,1218 @@
+// MAP_ANONYMOUS and MAP_NORESERVE are not POSIX
+#define _DEFAULT_SOURCE
+#include "kvs.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mvcc.h"
+#include "skiplist.h"
+#include "stats.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Memory mapped backend of the KVS table (see kvs.h). The layout is that of
+// kvs_flat.c, one open addressing sub-table per lock stripe, but the control
+// words, the slots and the keys and values too long for a slot all live in a
+// single region of memory that table_persist backs with a file: the table
+// outlives the server, and a restart maps it back instead of reading it in.
+// Nothing in the region points to anything by address, only by offset from
+// its start, so the file can be mapped anywhere.
+//
+// The region is a range of MMAP_RESERVE bytes of address space reserved up
+// front, of which only the part in use is backed, by the file or, until the
+// table is persisted, by anonymous memory. Growing it extends the mapping in
+// place, so nothing ever moves and readers keep their pointers. Space in it
+// comes from power of two size classes, with a free list per class and a
+// bump pointer past the last block handed out.
+//
+// The file only holds a consistent table at checkpoints (table_checkpoint):
+// the first change after one marks the file dirty, and syncs that mark,
+// before anything else is written, and a dirty file is never loaded. The
+// reference bits of the CLOCK eviction and the sorted index stay on the
+// heap, so reads never dirty a page of the file; the index is only built by
+// the first scan.
+
+// Slots per control group, the width of an SSE2 register.
+#define MMAP_GROUP_WIDTH 16
+// Groups a sub-table starts with (must be a power of two).
+#define MMAP_INITIAL_GROUPS 1
+// Sub-tables grow once 7/8 of their slots are taken.
+#define MMAP_MAX_LOAD_NUM 7
+#define MMAP_MAX_LOAD_DEN 8
+
+// Control words, as in kvs_flat.c.
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+// Room for a key or a value inside a slot, '\0' included.
+#define MMAP_INLINE_SIZE MAX_STRING_SIZE
+
+// Address space reserved for a table, the most its file can grow to.
+#define MMAP_RESERVE ((size_t)1 << 38)
+// Room for the header at the start of the region, a page.
+#define MMAP_HEADER_SIZE 4096
+// The region grows by half its size, and by at least this much (a multiple
+// of the page size).
+#define MMAP_MIN_GROWTH ((size_t)1 << 20)
+// Smallest size class, a cache line: blocks of class c are 2^c bytes.
+#define MMAP_MIN_CLASS 6
+#define MMAP_NUM_CLASSES 39
+
+#define MMAP_MAGIC "KVSTABLE"
+#define MMAP_FORMAT_VERSION 1
+
+// States of a file, see the header.
+#define MMAP_CLEAN 1
+#define MMAP_DIRTY 2
+
+// A key or a value: inline if shorter than MMAP_INLINE_SIZE, elsewhere in
+// the region otherwise.
+typedef union MmapString {
+  char inline_str[MMAP_INLINE_SIZE];
+  uint64_t offset;
+} MmapString;
+
+typedef struct MmapSlot {
+  uint64_t hash;      // Kept so resizes don't hash every key again
+  uint64_t version;   // Commit that wrote the value, see mvcc.h
+  uint32_t value_len; // Not counting the '\0'
+  uint16_t key_len;   // Not counting the '\0', see KVS_MAX_KEY_LEN
+  MmapString key;
+  MmapString value;
+} MmapSlot;
+
+// A sub-table, in the header. Changed under the lock of its stripe.
+typedef struct MmapTable {
+  uint64_t groups;      // Number of control groups, always a power of two
+  uint64_t used;        // Full slots
+  uint64_t growth_left; // Empty slots that can still be taken
+  uint64_t clock_hand;  // Next slot evict_pair looks at
+  uint64_t ctrl;        // Offset of groups * MMAP_GROUP_WIDTH control words
+  uint64_t slots;       // Offset of as many slots
+} MmapTable;
+
+// Start of the region, and of the file. Numbers are in host byte order: a
+// file is only meant to be mapped back on the machine that wrote it.
+typedef struct MmapHeader {
+  char magic[8];      // MMAP_MAGIC
+  uint32_t version;   // MMAP_FORMAT_VERSION
+  uint32_t state;     // MMAP_CLEAN or MMAP_DIRTY
+  uint32_t slot_size; // sizeof(MmapSlot)
+  uint32_t stripes;   // KVS_LOCK_STRIPES
+  uint64_t top;       // End of the last block handed out
+  // First free block of each size class; free blocks are linked by their
+  // first 8 bytes, 0 ends the list
+  uint64_t free_lists[MMAP_NUM_CLASSES];
+  uint64_t log_position; // Of the last checkpoint, see table_checkpoint
+  _Atomic uint64_t max_version; // Newest commit that wrote a pair
+  // What the pairs account for, so a table loaded back adds it to the server
+  // stats without reading them (see account_slot)
+  _Atomic uint64_t keys;
+  _Atomic uint64_t key_bytes;
+  _Atomic uint64_t value_bytes;
+  _Atomic uint64_t bytes;
+  MmapTable tables[KVS_LOCK_STRIPES];
+} MmapHeader;
+
+_Static_assert(sizeof(MmapHeader) <= MMAP_HEADER_SIZE,
+               "the header must fit in its page");
+
+// What the heap holds of a sub-table.
+typedef struct MmapStripe {
+  _Alignas(64) pthread_rwlock_t lock;
+  // Reference bit of every slot, read since the clock hand last passed
+  atomic_bool *referenced;
+} MmapStripe;
+
+struct HashTable {
+  MmapStripe stripes[KVS_LOCK_STRIPES];
+  unsigned char *base;  // Start of the reserved range
+  MmapHeader *header;   // At base
+  size_t mapped;        // Bytes of the range backed by memory or the file
+  int fd;               // The file, -1 until table_persist
+  char *path;           // Its path, for errors
+  pthread_mutex_t alloc_lock; // Protects the allocator and the file state
+  atomic_bool dirty;    // Whether the file changed since its last checkpoint
+  SkipList *index;      // Every key, in order, once indexed is set
+  atomic_bool indexed;
+  pthread_mutex_t index_lock; // Held while the index is built
+  atomic_uint clock_stripe;   // Sub-table the next eviction starts from
+};
+
+// Returns the stripe, and so the sub-table, of a given hash.
+static inline unsigned stripe_of(uint64_t h) {
+  return (unsigned)(h & (KVS_LOCK_STRIPES - 1));
+}
+
+// Returns the first group of the probe sequence of a hash. The low bits
+// already picked the sub-table, so they are skipped.
+static inline size_t group_of(const MmapTable *t, uint64_t h) {
+  return (size_t)(h >> 6) & (t->groups - 1);
+}
+
+// Returns the control word of a full slot holding a given hash.
+static inline int8_t tag_of(uint64_t h) { return (int8_t)(h >> 57); }
+
+// Returns a bit mask of the slots of a group whose control word is tag.
+// @param ctrl Control words of the group (MMAP_GROUP_WIDTH aligned).
+// @param tag Control word to look for.
+static inline uint32_t group_match(const int8_t *ctrl, int8_t tag) {
+#ifdef __SSE2__
+  __m128i group = _mm_load_si128((const __m128i *)(const void *)ctrl);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+  uint32_t mask = 0;
+  for (unsigned i = 0; i < MMAP_GROUP_WIDTH; i++) {
+    if (ctrl[i] == tag)
+      mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// Returns a bit mask of the free (empty or deleted) slots of a group.
+static inline uint32_t group_match_free(const int8_t *ctrl) {
+#ifdef __SSE2__
+  __m128i group = _mm_load_si128((const __m128i *)(const void *)ctrl);
+  return (uint32_t)_mm_movemask_epi8(group);
+#else
+  uint32_t mask = 0;
+  for (unsigned i = 0; i < MMAP_GROUP_WIDTH; i++) {
+    if (ctrl[i] < 0)
+      mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// Returns the control words of a sub-table.
+static inline int8_t *table_ctrl(const HashTable *ht, const MmapTable *t) {
+  return (int8_t *)(void *)(ht->base + t->ctrl);
+}
+
+// Returns the slots of a sub-table.
+static inline MmapSlot *table_slots(const HashTable *ht, const MmapTable *t) {
+  return (MmapSlot *)(void *)(ht->base + t->slots);
+}
+
+// Backs more of the region, extending the file if there is one. The region
+// never moves, so nothing has to be told.
+// @param ht The hash table.
+// @param size Bytes from the start of the region that must be backed.
+// @return 0 if successful, 1 otherwise (the region is left as it was).
+static int region_grow(HashTable *ht, size_t size) {
+  if (size <= ht->mapped)
+    return 0;
+  if (size > MMAP_RESERVE)
+    return 1;
+  size_t growth = ht->mapped / 2;
+  if (growth < MMAP_MIN_GROWTH)
+    growth = MMAP_MIN_GROWTH;
+  size_t grown = ht->mapped + growth;
+  if (grown < size)
+    grown = size;
+  grown = (grown + MMAP_MIN_GROWTH - 1) & ~(MMAP_MIN_GROWTH - 1);
+  if (grown > MMAP_RESERVE)
+    grown = MMAP_RESERVE;
+
+  unsigned char *start = ht->base + ht->mapped;
+  size_t extent = grown - ht->mapped;
+  if (ht->fd < 0) {
+    if (mprotect(start, extent, PROT_READ | PROT_WRITE) != 0)
+      return 1;
+  } else {
+    // Allocated for real, so a full disk fails here and not as a SIGBUS on
+    // the first store to the new pages
+    int error = posix_fallocate(ht->fd, (off_t)ht->mapped, (off_t)extent);
+    if (error != 0) {
+      fprintf(stderr, "%s: %s\n", ht->path, strerror(error));
+      return 1;
+    }
+    if (mmap(start, extent, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             ht->fd, (off_t)ht->mapped) == MAP_FAILED) {
+      perror(ht->path);
+      return 1;
+    }
+  }
+  ht->mapped = grown;
+  return 0;
+}
+
+// Returns the size class of the blocks that hold a number of bytes.
+static unsigned size_class(size_t size) {
+  unsigned c = MMAP_MIN_CLASS;
+  while (((size_t)1 << c) < size)
+    c++;
+  return c;
+}
+
+// Allocates a block of the region.
+// @param ht The hash table.
+// @param size Bytes wanted.
+// @return Offset of the block, aligned to 64 bytes, 0 on failure.
+static uint64_t region_alloc(HashTable *ht, size_t size) {
+  if (size > MMAP_RESERVE / 2)
+    return 0;
+  unsigned c = size_class(size);
+  MmapHeader *header = ht->header;
+  pthread_mutex_lock(&ht->alloc_lock);
+  uint64_t offset = header->free_lists[c];
+  if (offset != 0) {
+    header->free_lists[c] = *(uint64_t *)(void *)(ht->base + offset);
+  } else if (region_grow(ht, header->top + ((size_t)1 << c)) == 0) {
+    offset = header->top;
+    header->top += (size_t)1 << c;
+  }
+  pthread_mutex_unlock(&ht->alloc_lock);
+  return offset;
+}
+
+// Gives a block back to its size class. The caller holds the stripe whose
+// readers could see the block for writing.
+// @param ht The hash table.
+// @param offset Offset of the block.
+// @param size Bytes it was allocated for.
+static void region_free(HashTable *ht, uint64_t offset, size_t size) {
+  unsigned c = size_class(size);
+  MmapHeader *header = ht->header;
+  pthread_mutex_lock(&ht->alloc_lock);
+  *(uint64_t *)(void *)(ht->base + offset) = header->free_lists[c];
+  header->free_lists[c] = offset;
+  pthread_mutex_unlock(&ht->alloc_lock);
+}
+
+// Marks the file dirty, and makes sure the mark is on disk, before the
+// first change made since its last checkpoint. The caller holds the stripe
+// of the change for writing.
+// @param ht The hash table.
+static void mark_dirty(HashTable *ht) {
+  if (ht->fd < 0 || atomic_load_explicit(&ht->dirty, memory_order_acquire))
+    return;
+  pthread_mutex_lock(&ht->alloc_lock);
+  if (!atomic_load_explicit(&ht->dirty, memory_order_relaxed)) {
+    ht->header->state = MMAP_DIRTY;
+    if (msync(ht->base, MMAP_HEADER_SIZE, MS_SYNC) != 0)
+      perror(ht->path);
+    atomic_store_explicit(&ht->dirty, true, memory_order_release);
+  }
+  pthread_mutex_unlock(&ht->alloc_lock);
+}
+
+// Returns the characters of a string stored in a slot.
+// @param ht The hash table.
+// @param str The string.
+// @param len Its length.
+static inline const char *mmap_str(const HashTable *ht, const MmapString *str,
+                                   uint32_t len) {
+  return len < MMAP_INLINE_SIZE ? str->inline_str
+                                : (const char *)ht->base + str->offset;
+}
+
+// Copies a string into a slot string.
+// @param ht The hash table.
+// @param str Slot string to fill.
+// @param src The string.
+// @param len Its length.
+// @return 0 if successful, 1 otherwise.
+static int mmap_str_set(HashTable *ht, MmapString *str, const char *src,
+                        size_t len) {
+  if (len < MMAP_INLINE_SIZE) {
+    memcpy(str->inline_str, src, len + 1);
+    return 0;
+  }
+  uint64_t offset = region_alloc(ht, len + 1);
+  if (offset == 0)
+    return 1;
+  memcpy(ht->base + offset, src, len + 1);
+  str->offset = offset;
+  return 0;
+}
+
+// Frees whatever a slot string holds out of its slot.
+// @param ht The hash table.
+// @param str The string.
+// @param len Its length.
+static void mmap_str_free(HashTable *ht, const MmapString *str, uint32_t len) {
+  if (len >= MMAP_INLINE_SIZE)
+    region_free(ht, str->offset, len + 1u);
+}
+
+// Returns the key stored in a slot.
+static inline const char *slot_key(const HashTable *ht, const MmapSlot *slot) {
+  return mmap_str(ht, &slot->key, slot->key_len);
+}
+
+// Returns the value stored in a slot.
+static inline const char *slot_value(const HashTable *ht,
+                                     const MmapSlot *slot) {
+  return mmap_str(ht, &slot->value, slot->value_len);
+}
+
+// Returns the memory a pair accounts for in the table: its slot, control
+// word and reference bit, and whatever of it lives out of its slot. The
+// sorted index, only built for scans, is not counted.
+static size_t slot_bytes(const MmapSlot *slot) {
+  size_t bytes = sizeof(MmapSlot) + 1 + sizeof(atomic_bool);
+  if (slot->key_len >= MMAP_INLINE_SIZE)
+    bytes += (size_t)1 << size_class(slot->key_len + 1u);
+  if (slot->value_len >= MMAP_INLINE_SIZE)
+    bytes += (size_t)1 << size_class(slot->value_len + 1u);
+  return bytes;
+}
+
+// Adds a pair to the server stats and to the figures of the file, or takes
+// it out of them.
+// @param ht The hash table.
+// @param slot Slot of the pair.
+// @param sign 1 for a pair entering the table, -1 for one leaving it.
+static void account_slot(HashTable *ht, const MmapSlot *slot, int64_t sign) {
+  size_t bytes = slot_bytes(slot);
+  size_t payload = (size_t)slot->key_len + slot->value_len;
+  stat_add(STAT_KEYS, sign);
+  stat_add(STAT_KEY_BYTES, sign * slot->key_len);
+  stat_add(STAT_VALUE_BYTES, sign * slot->value_len);
+  stat_add(STAT_OVERHEAD_BYTES, sign * (int64_t)(bytes - payload));
+  // Wrapping around subtracts
+  MmapHeader *header = ht->header;
+  atomic_fetch_add(&header->keys, (uint64_t)sign);
+  atomic_fetch_add(&header->key_bytes, (uint64_t)(sign * slot->key_len));
+  atomic_fetch_add(&header->value_bytes, (uint64_t)(sign * slot->value_len));
+  atomic_fetch_add(&header->bytes, (uint64_t)(sign * (int64_t)bytes));
+}
+
+// Adds the pairs of a table to the server stats, or takes them out of
+// them, from the figures of its file.
+// @param ht The hash table.
+// @param sign 1 for a table loaded, -1 for one dropped.
+static void account_table(HashTable *ht, int64_t sign) {
+  MmapHeader *header = ht->header;
+  int64_t keys = (int64_t)atomic_load(&header->keys);
+  int64_t key_bytes = (int64_t)atomic_load(&header->key_bytes);
+  int64_t value_bytes = (int64_t)atomic_load(&header->value_bytes);
+  int64_t bytes = (int64_t)atomic_load(&header->bytes);
+  stat_add(STAT_KEYS, sign * keys);
+  stat_add(STAT_KEY_BYTES, sign * key_bytes);
+  stat_add(STAT_VALUE_BYTES, sign * value_bytes);
+  stat_add(STAT_OVERHEAD_BYTES, sign * (bytes - key_bytes - value_bytes));
+}
+
+// Marks a slot as recently used, for evict_pair. Skips the store when the
+// bit is already set, so hot keys don't keep dirtying their cache line.
+static inline void slot_touch(MmapStripe *stripe, size_t i) {
+  if (!atomic_load_explicit(&stripe->referenced[i], memory_order_relaxed))
+    atomic_store_explicit(&stripe->referenced[i], true, memory_order_relaxed);
+}
+
+// Allocates the arrays of a sub-table, every slot empty. The caller frees
+// the previous ones.
+// @param ht The hash table.
+// @param s The stripe of the sub-table.
+// @param groups Number of control groups (power of two).
+// @return 0 if successful, 1 otherwise (the sub-table is left as it was).
+static int mmap_table_alloc(HashTable *ht, unsigned s, size_t groups) {
+  size_t capacity = groups * MMAP_GROUP_WIDTH;
+  uint64_t ctrl = region_alloc(ht, capacity);
+  uint64_t slots =
+      ctrl != 0 ? region_alloc(ht, capacity * sizeof(MmapSlot)) : 0;
+  atomic_bool *referenced =
+      slots != 0 ? calloc(capacity, sizeof(atomic_bool)) : NULL;
+  if (referenced == NULL) {
+    if (slots != 0)
+      region_free(ht, slots, capacity * sizeof(MmapSlot));
+    if (ctrl != 0)
+      region_free(ht, ctrl, capacity);
+    return 1;
+  }
+  memset(ht->base + ctrl, CTRL_EMPTY, capacity);
+  MmapTable *t = &ht->header->tables[s];
+  t->ctrl = ctrl;
+  t->slots = slots;
+  t->groups = groups;
+  t->used = 0;
+  t->clock_hand = 0;
+  t->growth_left = capacity * MMAP_MAX_LOAD_NUM / MMAP_MAX_LOAD_DEN;
+  ht->stripes[s].referenced = referenced;
+  return 0;
+}
+
+// Frees the arrays of a sub-table.
+// @param ht The hash table.
+// @param t The sub-table, as it was when they were allocated.
+// @param referenced Its reference bits.
+static void mmap_table_free(HashTable *ht, const MmapTable *t,
+                            atomic_bool *referenced) {
+  size_t capacity = t->groups * MMAP_GROUP_WIDTH;
+  region_free(ht, t->ctrl, capacity);
+  region_free(ht, t->slots, capacity * sizeof(MmapSlot));
+  free(referenced);
+}
+
+// Searches a sub-table for a key, probing as kvs_flat.c does.
+// @param ht The hash table.
+// @param t The sub-table.
+// @param h Hash of the key.
+// @param key The key.
+// @return Index of the slot holding the key, SIZE_MAX if not found.
+static size_t mmap_find(const HashTable *ht, const MmapTable *t, uint64_t h,
+                        const char *key) {
+  const int8_t *ctrl = table_ctrl(ht, t);
+  const MmapSlot *slots = table_slots(ht, t);
+  size_t g = group_of(t, h);
+  int8_t tag = tag_of(h);
+  for (size_t step = 1; step <= t->groups; step++) {
+    const int8_t *group = ctrl + g * MMAP_GROUP_WIDTH;
+    for (uint32_t match = group_match(group, tag); match != 0;
+         match &= match - 1) {
+      size_t i = g * MMAP_GROUP_WIDTH + (size_t)__builtin_ctz(match);
+      if (slots[i].hash == h && strcmp(slot_key(ht, &slots[i]), key) == 0)
+        return i;
+    }
+    if (group_match(group, CTRL_EMPTY) != 0)
+      break;
+    g = (g + step) & (t->groups - 1);
+  }
+  return SIZE_MAX;
+}
+
+// Returns the first free slot of the probe sequence of a hash. The caller
+// made sure there is one.
+static size_t mmap_find_free(const HashTable *ht, const MmapTable *t,
+                             uint64_t h) {
+  const int8_t *ctrl = table_ctrl(ht, t);
+  size_t g = group_of(t, h);
+  for (size_t step = 1;; step++) {
+    uint32_t free_slots = group_match_free(ctrl + g * MMAP_GROUP_WIDTH);
+    if (free_slots != 0)
+      return g * MMAP_GROUP_WIDTH + (size_t)__builtin_ctz(free_slots);
+    g = (g + step) & (t->groups - 1);
+  }
+}
+
+// Rehashes a sub-table whose empty slots ran out, as kvs_flat.c does. The
+// reference bits of its pairs are lost. The caller holds the sub-table for
+// writing.
+// @param ht The hash table.
+// @param s The stripe of the sub-table.
+// @return 0 if successful, 1 otherwise (the sub-table is left as it was).
+static int mmap_resize(HashTable *ht, unsigned s) {
+  MmapTable *t = &ht->header->tables[s];
+  size_t capacity = t->groups * MMAP_GROUP_WIDTH;
+  size_t groups = t->groups;
+  if (t->used * 2 >= capacity * MMAP_MAX_LOAD_NUM / MMAP_MAX_LOAD_DEN)
+    groups *= 2;
+
+  MmapTable old = *t;
+  atomic_bool *old_referenced = ht->stripes[s].referenced;
+  if (mmap_table_alloc(ht, s, groups) != 0)
+    return 1;
+  const int8_t *old_ctrl = table_ctrl(ht, &old);
+  const MmapSlot *old_slots = table_slots(ht, &old);
+  int8_t *ctrl = table_ctrl(ht, t);
+  MmapSlot *slots = table_slots(ht, t);
+  for (size_t i = 0; i < capacity; i++) {
+    if (old_ctrl[i] < 0)
+      continue;
+    size_t j = mmap_find_free(ht, t, old_slots[i].hash);
+    ctrl[j] = old_ctrl[i];
+    slots[j] = old_slots[i];
+  }
+  t->used = old.used;
+  t->growth_left -= old.used;
+  mmap_table_free(ht, &old, old_referenced);
+  return 0;
+}
+
+// Locks a set of stripes in ascending order.
+// @param ht The hash table.
+// @param stripes Mask of stripes to lock.
+// @param write Whether to lock for writing.
+static void lock_stripes(HashTable *ht, uint64_t stripes, bool write) {
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    if (!(stripes & (1ULL << s)))
+      continue;
+    if (write)
+      pthread_rwlock_wrlock(&ht->stripes[s].lock);
+    else
+      pthread_rwlock_rdlock(&ht->stripes[s].lock);
+  }
+}
+
+uint64_t lock_keys(HashTable *ht, size_t num_keys, char *keys[],
+                   uint64_t hashes[], bool write) {
+  uint64_t stripes = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    uint64_t h = hash(keys[i]);
+    if (hashes != NULL)
+      hashes[i] = h;
+    stripes |= 1ULL << stripe_of(h);
+  }
+  lock_stripes(ht, stripes, write);
+  return stripes;
+}
+
+uint64_t lock_hashes(HashTable *ht, size_t num_keys, const uint64_t hashes[],
+                     bool write) {
+  uint64_t stripes = 0;
+  for (size_t i = 0; i < num_keys; i++)
+    stripes |= 1ULL << stripe_of(hashes[i]);
+  lock_stripes(ht, stripes, write);
+  return stripes;
+}
+
+uint64_t lock_all_stripes(HashTable *ht) {
+  lock_stripes(ht, UINT64_MAX, false);
+  return UINT64_MAX;
+}
+
+void unlock_stripes(HashTable *ht, uint64_t stripes) {
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    if (stripes & (1ULL << s))
+      pthread_rwlock_unlock(&ht->stripes[s].lock);
+  }
+}
+
+bool key_exists(HashTable *ht, uint64_t h, const char *key) {
+  unsigned s = stripe_of(h);
+  pthread_rwlock_rdlock(&ht->stripes[s].lock);
+  bool found = mmap_find(ht, &ht->header->tables[s], h, key) != SIZE_MAX;
+  pthread_rwlock_unlock(&ht->stripes[s].lock);
+  return found;
+}
+
+bool key_exists_locked(HashTable *ht, uint64_t h, const char *key) {
+  return mmap_find(ht, &ht->header->tables[stripe_of(h)], h, key) !=
+         SIZE_MAX;
+}
+
+// Frees the reference bits of every sub-table.
+static void free_referenced(HashTable *ht) {
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    free(ht->stripes[s].referenced);
+    ht->stripes[s].referenced = NULL;
+  }
+}
+
+// Lays out an empty table in the region, whose first MMAP_MIN_GROWTH bytes
+// must be backed and zeroed. The file, if any, is left dirty.
+// @param ht The hash table.
+// @return 0 if successful, 1 otherwise.
+static int region_format(HashTable *ht) {
+  MmapHeader *header = ht->header;
+  memcpy(header->magic, MMAP_MAGIC, sizeof(header->magic));
+  header->version = MMAP_FORMAT_VERSION;
+  header->state = MMAP_DIRTY;
+  header->slot_size = sizeof(MmapSlot);
+  header->stripes = KVS_LOCK_STRIPES;
+  header->top = MMAP_HEADER_SIZE;
+  atomic_store(&ht->dirty, true);
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    if (mmap_table_alloc(ht, s, MMAP_INITIAL_GROUPS) != 0) {
+      free_referenced(ht);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Drops whatever backs the region, back to a bare reservation.
+// @return 0 if successful, 1 otherwise.
+static int region_reserve(HashTable *ht) {
+  ht->mapped = 0;
+  void *base = mmap(ht->base, MMAP_RESERVE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                        (ht->base != NULL ? MAP_FIXED : 0),
+                    -1, 0);
+  if (base == MAP_FAILED)
+    return 1;
+  ht->base = base;
+  ht->header = base;
+  return 0;
+}
+
+// Backs the region with anonymous memory and lays out an empty table in it.
+// @param ht The hash table, its file closed.
+// @return 0 if successful, 1 otherwise.
+static int region_init(HashTable *ht) {
+  if (region_reserve(ht) != 0 || region_grow(ht, MMAP_MIN_GROWTH) != 0)
+    return 1;
+  return region_format(ht);
+}
+
+struct HashTable *create_hash_table() {
+  HashTable *ht = aligned_alloc(64, sizeof(HashTable));
+  if (!ht)
+    return NULL;
+  memset(ht, 0, sizeof(*ht));
+  ht->fd = -1;
+  pthread_mutex_init(&ht->alloc_lock, NULL);
+  pthread_mutex_init(&ht->index_lock, NULL);
+  ht->index = skiplist_create();
+  if (ht->index == NULL || region_init(ht) != 0) {
+    if (ht->index != NULL)
+      skiplist_destroy(ht->index);
+    if (ht->base != NULL)
+      munmap(ht->base, MMAP_RESERVE);
+    pthread_mutex_destroy(&ht->alloc_lock);
+    pthread_mutex_destroy(&ht->index_lock);
+    free(ht);
+    return NULL;
+  }
+  atomic_init(&ht->indexed, true); // An empty table is indexed already
+  atomic_init(&ht->clock_stripe, 0);
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++)
+    pthread_rwlock_init(&ht->stripes[s].lock, NULL);
+  return ht;
+}
+
+// Tells whether a file holds a table this build can map back as it is.
+// @param header Header read from the file.
+// @param size Size of the file.
+static bool header_valid(const MmapHeader *header, size_t size) {
+  if (memcmp(header->magic, MMAP_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != MMAP_FORMAT_VERSION ||
+      header->slot_size != sizeof(MmapSlot) ||
+      header->stripes != KVS_LOCK_STRIPES || size > MMAP_RESERVE ||
+      size % MMAP_MIN_GROWTH != 0 || header->top > size ||
+      header->top < MMAP_HEADER_SIZE)
+    return false;
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    const MmapTable *t = &header->tables[s];
+    if (t->groups == 0 || (t->groups & (t->groups - 1)) != 0 ||
+        t->groups > header->top / MMAP_GROUP_WIDTH)
+      return false;
+    size_t capacity = t->groups * MMAP_GROUP_WIDTH;
+    if (t->used > capacity || t->ctrl > header->top - capacity ||
+        capacity > header->top / sizeof(MmapSlot) ||
+        t->slots > header->top - capacity * sizeof(MmapSlot))
+      return false;
+  }
+  return true;
+}
+
+// Maps back the table a file holds.
+// @param ht The hash table, its region a bare reservation.
+// @param size Size of the file.
+// @return 0 if successful, 1 otherwise.
+static int region_load(HashTable *ht, size_t size) {
+  if (mmap(ht->base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+           ht->fd, 0) == MAP_FAILED) {
+    perror(ht->path);
+    return 1;
+  }
+  ht->mapped = size;
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    size_t capacity = ht->header->tables[s].groups * MMAP_GROUP_WIDTH;
+    ht->stripes[s].referenced = calloc(capacity, sizeof(atomic_bool));
+    if (ht->stripes[s].referenced == NULL) {
+      free_referenced(ht);
+      return 1;
+    }
+  }
+  atomic_store(&ht->dirty, false);
+  // Only the first scan needs the index
+  atomic_store(&ht->indexed, atomic_load(&ht->header->keys) == 0);
+  account_table(ht, 1);
+  mvcc_advance(atomic_load(&ht->header->max_version));
+  return 0;
+}
+
+// Starts a file over with an empty table.
+// @param ht The hash table, its region a bare reservation.
+// @return 0 if successful, 1 otherwise.
+static int region_create(HashTable *ht) {
+  if (ftruncate(ht->fd, 0) != 0) {
+    perror(ht->path);
+    return 1;
+  }
+  if (region_grow(ht, MMAP_MIN_GROWTH) != 0)
+    return 1;
+  return region_format(ht);
+}
+
+int table_persist(HashTable *ht, const char *path, bool load,
+                  uint64_t *log_position) {
+  *log_position = UINT64_MAX;
+  if (ht->fd >= 0 || atomic_load(&ht->header->keys) != 0) {
+    fprintf(stderr, "%s: only an empty table can be persisted\n", path);
+    return 1;
+  }
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  struct stat st;
+  MmapHeader header;
+  if (fstat(fd, &st) != 0 ||
+      (st.st_size >= (off_t)sizeof(header) &&
+       pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))) {
+    perror(path);
+    close(fd);
+    return 1;
+  }
+  size_t size = (size_t)st.st_size;
+  bool ours = size >= sizeof(header) &&
+              memcmp(header.magic, MMAP_MAGIC, sizeof(header.magic)) == 0;
+  if (size != 0 && !ours) {
+    fprintf(stderr, "%s: not a table file, leaving it alone\n", path);
+    close(fd);
+    return 1;
+  }
+  bool valid = ours && header_valid(&header, size);
+  if (load && ours && !valid)
+    fprintf(stderr, "%s: table file of another build or garbled, starting "
+                    "empty\n", path);
+  else if (load && valid && header.state != MMAP_CLEAN)
+    fprintf(stderr, "%s: table changed since its last checkpoint, starting "
+                    "empty\n", path);
+  load = load && valid && header.state == MMAP_CLEAN;
+
+  ht->path = strdup(path);
+  ht->fd = fd;
+  free_referenced(ht);
+  int result = ht->path == NULL || region_reserve(ht) != 0;
+  if (result == 0)
+    result = load ? region_load(ht, size) : region_create(ht);
+  if (result != 0) {
+    // Back to an empty table in memory, if anything
+    close(fd);
+    ht->fd = -1;
+    free(ht->path);
+    ht->path = NULL;
+    free_referenced(ht);
+    if (region_init(ht) != 0)
+      fprintf(stderr, "%s: out of memory, the table is unusable\n", path);
+    return 1;
+  }
+  if (load)
+    *log_position = ht->header->log_position;
+  return 0;
+}
+
+int table_checkpoint(HashTable *ht, uint64_t log_position) {
+  if (ht->fd < 0)
+    return 0;
+  MmapHeader *header = ht->header;
+  bool dirty = atomic_load(&ht->dirty);
+  if (!dirty && header->log_position == log_position)
+    return 0;
+  // The pairs first, then the header that vouches for them
+  if (dirty && msync(ht->base, ht->mapped, MS_SYNC) != 0) {
+    perror(ht->path);
+    return 1;
+  }
+  header->log_position = log_position;
+  header->state = MMAP_CLEAN;
+  if (msync(ht->base, MMAP_HEADER_SIZE, MS_SYNC) != 0) {
+    perror(ht->path);
+    return 1;
+  }
+  atomic_store(&ht->dirty, false);
+  return 0;
+}
+
+// Returns the version a write made now is stamped with: that of the calling
+// thread's commit, as in kvs_flat.c. The newest one is kept in the header,
+// so commits made after the table is loaded back come after it.
+static uint64_t write_version(HashTable *ht) {
+  uint64_t version = mvcc_begin();
+  mvcc_end();
+  uint64_t newest = atomic_load_explicit(&ht->header->max_version,
+                                         memory_order_relaxed);
+  while (newest < version &&
+         !atomic_compare_exchange_weak(&ht->header->max_version, &newest,
+                                       version))
+    ;
+  return version;
+}
+
+int write_pair(HashTable *ht, uint64_t h, const char *key, const char *value,
+               bool *changed) {
+  size_t key_len = strlen(key);
+  size_t value_len = strlen(value);
+  if (key_len > KVS_MAX_KEY_LEN || value_len > UINT32_MAX)
+    return 1;
+
+  unsigned s = stripe_of(h);
+  MmapTable *t = &ht->header->tables[s];
+  size_t i = mmap_find(ht, t, h, key);
+  // Rewriting the same value leaves the slot alone
+  bool same = i != SIZE_MAX && table_slots(ht, t)[i].value_len == value_len &&
+              memcmp(slot_value(ht, &table_slots(ht, t)[i]), value,
+                     value_len) == 0;
+  if (changed != NULL)
+    *changed = !same;
+  if (same)
+    return 0;
+
+  mark_dirty(ht);
+  MmapString new_value;
+  if (mmap_str_set(ht, &new_value, value, value_len) != 0)
+    return 1;
+
+  if (i != SIZE_MAX) {
+    // overwrite value, readers are kept out by the stripe lock
+    MmapSlot *slot = &table_slots(ht, t)[i];
+    account_slot(ht, slot, -1);
+    mmap_str_free(ht, &slot->value, slot->value_len);
+    slot->value = new_value;
+    slot->value_len = (uint32_t)value_len;
+    slot->version = write_version(ht);
+    account_slot(ht, slot, 1);
+    return 0;
+  }
+
+  // Key not found, take the first free slot of its probe sequence
+  MmapString new_key;
+  if (mmap_str_set(ht, &new_key, key, key_len) != 0) {
+    mmap_str_free(ht, &new_value, (uint32_t)value_len);
+    return 1;
+  }
+  i = mmap_find_free(ht, t, h);
+  bool full = table_ctrl(ht, t)[i] == CTRL_EMPTY && t->growth_left == 0;
+  if (full && mmap_resize(ht, s) == 0) {
+    full = false;
+    i = mmap_find_free(ht, t, h);
+  }
+  // Until the first scan builds the index, nothing needs it
+  if (full || (atomic_load_explicit(&ht->indexed, memory_order_acquire) &&
+               skiplist_insert(ht->index, key, h) != 0)) {
+    mmap_str_free(ht, &new_key, (uint32_t)key_len);
+    mmap_str_free(ht, &new_value, (uint32_t)value_len);
+    return 1;
+  }
+  int8_t *ctrl = table_ctrl(ht, t);
+  if (ctrl[i] == CTRL_EMPTY)
+    t->growth_left--;
+  ctrl[i] = tag_of(h);
+  MmapSlot *slot = &table_slots(ht, t)[i];
+  slot->hash = h;
+  slot->version = write_version(ht);
+  slot->value_len = (uint32_t)value_len;
+  slot->key_len = (uint16_t)key_len;
+  slot->key = new_key;
+  slot->value = new_value;
+  atomic_store_explicit(&ht->stripes[s].referenced[i], false,
+                        memory_order_relaxed);
+  t->used++;
+  account_slot(ht, slot, 1);
+  return 0;
+}
+
+char *read_pair(HashTable *ht, const char *key) {
+  char *value = NULL;
+  uint64_t h = hash(key);
+  unsigned s = stripe_of(h);
+  const MmapTable *t = &ht->header->tables[s];
+  pthread_rwlock_rdlock(&ht->stripes[s].lock);
+  size_t i = mmap_find(ht, t, h, key);
+  if (i != SIZE_MAX) {
+    slot_touch(&ht->stripes[s], i);
+    value = strdup(slot_value(ht, &table_slots(ht, t)[i]));
+  }
+  pthread_rwlock_unlock(&ht->stripes[s].lock);
+  return value; // NULL if the key was not found
+}
+
+int read_pair_with(HashTable *ht, uint64_t h, const char *key,
+                   void (*visit)(const char *key, const char *value, void *arg),
+                   void *arg) {
+  unsigned s = stripe_of(h);
+  const MmapTable *t = &ht->header->tables[s];
+  pthread_rwlock_rdlock(&ht->stripes[s].lock);
+  size_t i = mmap_find(ht, t, h, key);
+  if (i != SIZE_MAX) {
+    const MmapSlot *slot = &table_slots(ht, t)[i];
+    slot_touch(&ht->stripes[s], i);
+    visit(slot_key(ht, slot), slot_value(ht, slot), arg);
+  }
+  pthread_rwlock_unlock(&ht->stripes[s].lock);
+  return i == SIZE_MAX;
+}
+
+// Empties a full slot, dropping its key from the index. The caller holds
+// the sub-table for writing.
+// @param ht The hash table.
+// @param t The sub-table.
+// @param i Index of the slot.
+static void mmap_erase(HashTable *ht, MmapTable *t, size_t i) {
+  mark_dirty(ht);
+  int8_t *ctrl = table_ctrl(ht, t);
+  MmapSlot *slot = &table_slots(ht, t)[i];
+  // As in kvs_flat.c: a group with an empty slot never made a probe go past
+  // it, so the slot can go back to empty
+  if (group_match(ctrl + (i & ~(size_t)(MMAP_GROUP_WIDTH - 1)),
+                  CTRL_EMPTY) != 0) {
+    ctrl[i] = CTRL_EMPTY;
+    t->growth_left++;
+  } else {
+    ctrl[i] = CTRL_DELETED;
+  }
+  t->used--;
+  account_slot(ht, slot, -1);
+  if (atomic_load_explicit(&ht->indexed, memory_order_acquire))
+    skiplist_remove(ht->index, slot_key(ht, slot));
+  mmap_str_free(ht, &slot->key, slot->key_len);
+  mmap_str_free(ht, &slot->value, slot->value_len);
+}
+
+int delete_pair(HashTable *ht, uint64_t h, const char *key) {
+  MmapTable *t = &ht->header->tables[stripe_of(h)];
+  size_t i = mmap_find(ht, t, h, key);
+  if (i == SIZE_MAX)
+    return 1;
+
+  mmap_erase(ht, t, i);
+  return 0;
+}
+
+size_t table_memory(HashTable *ht) {
+  return (size_t)atomic_load(&ht->header->bytes);
+}
+
+int table_intern_values(HashTable *ht) {
+  (void)ht;
+  return 0;
+}
+
+int table_reserve(HashTable *ht, size_t keys) {
+  // Stripes get an even share of the keys give or take a few, hence the
+  // eighth on top
+  size_t share = keys / KVS_LOCK_STRIPES;
+  share += share / 8 + MMAP_GROUP_WIDTH;
+  size_t groups = MMAP_INITIAL_GROUPS;
+  while (groups * MMAP_GROUP_WIDTH * MMAP_MAX_LOAD_NUM / MMAP_MAX_LOAD_DEN <
+             share &&
+         groups <= MMAP_RESERVE / (4 * MMAP_GROUP_WIDTH * sizeof(MmapSlot)))
+    groups *= 2;
+
+  int result = 0;
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES && result == 0; s++) {
+    MmapTable *t = &ht->header->tables[s];
+    pthread_rwlock_wrlock(&ht->stripes[s].lock);
+    // Only empty sub-tables, which have nothing to move, are resized here
+    if (t->used == 0 && t->groups < groups) {
+      mark_dirty(ht);
+      MmapTable old = *t;
+      atomic_bool *old_referenced = ht->stripes[s].referenced;
+      if (mmap_table_alloc(ht, s, groups) == 0)
+        mmap_table_free(ht, &old, old_referenced);
+      else
+        result = 1;
+    }
+    pthread_rwlock_unlock(&ht->stripes[s].lock);
+  }
+  return result;
+}
+
+// Returns how many groups past its first one the probe sequence of a slot's
+// hash goes before it reaches the slot's group.
+static size_t probe_distance(const HashTable *ht, const MmapTable *t,
+                             size_t i) {
+  size_t g = group_of(t, table_slots(ht, t)[i].hash);
+  size_t target = i / MMAP_GROUP_WIDTH;
+  size_t step = 1;
+  while (g != target && step <= t->groups) {
+    g = (g + step) & (t->groups - 1);
+    step++;
+  }
+  return step - 1;
+}
+
+void table_stats(HashTable *ht, TableStats *stats) {
+  *stats = (TableStats){0};
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    const MmapTable *t = &ht->header->tables[s];
+    const int8_t *ctrl = table_ctrl(ht, t);
+    size_t capacity = t->groups * MMAP_GROUP_WIDTH;
+    stats->keys += t->used;
+    stats->buckets += capacity;
+    stats->table_bytes +=
+        (capacity - t->used) * (sizeof(MmapSlot) + 1 + sizeof(atomic_bool));
+    for (size_t i = 0; i < capacity; i++) {
+      if (ctrl[i] < 0)
+        continue;
+      size_t distance = probe_distance(ht, t, i);
+      stats->chains[distance < KVS_CHAIN_HISTOGRAM ? distance
+                                                   : KVS_CHAIN_HISTOGRAM - 1]++;
+    }
+  }
+}
+
+// Moves the clock hand of a sub-table over its slots, as kvs_flat.c does.
+// The hand is not worth marking the file dirty for, and a table loaded back
+// starts with every reference bit clear anyway. The caller holds the
+// sub-table for writing.
+// @param ht The hash table.
+// @param s The stripe of the sub-table.
+// @return Index of the slot to evict, SIZE_MAX if the sub-table is empty.
+static size_t clock_sweep(HashTable *ht, unsigned s) {
+  MmapTable *t = &ht->header->tables[s];
+  const int8_t *ctrl = table_ctrl(ht, t);
+  size_t capacity = t->groups * MMAP_GROUP_WIDTH;
+  if (t->used == 0)
+    return SIZE_MAX;
+  // Two turns at most: the first one may only clear bits
+  for (size_t visits = 2 * capacity; visits > 0; visits--) {
+    size_t i = t->clock_hand;
+    t->clock_hand = (i + 1) & (capacity - 1);
+    if (ctrl[i] >= 0 &&
+        !atomic_exchange_explicit(&ht->stripes[s].referenced[i], false,
+                                  memory_order_relaxed))
+      return i;
+  }
+  return SIZE_MAX;
+}
+
+int evict_pair(HashTable *ht,
+               void (*evicted)(const char *key, uint64_t h, void *arg),
+               void *arg) {
+  for (unsigned tries = 0; tries < KVS_LOCK_STRIPES; tries++) {
+    unsigned s = atomic_fetch_add(&ht->clock_stripe, 1) % KVS_LOCK_STRIPES;
+    MmapTable *t = &ht->header->tables[s];
+    pthread_rwlock_wrlock(&ht->stripes[s].lock);
+    size_t i = clock_sweep(ht, s);
+    if (i != SIZE_MAX) {
+      const MmapSlot *slot = &table_slots(ht, t)[i];
+      evicted(slot_key(ht, slot), slot->hash, arg);
+      mmap_erase(ht, t, i);
+      pthread_rwlock_unlock(&ht->stripes[s].lock);
+      return 0;
+    }
+    pthread_rwlock_unlock(&ht->stripes[s].lock);
+  }
+  return 1;
+}
+
+void foreach_pair(HashTable *ht,
+                  void (*visit)(const char *key, const char *value, void *arg),
+                  void *arg) {
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++) {
+    const MmapTable *t = &ht->header->tables[s];
+    const int8_t *ctrl = table_ctrl(ht, t);
+    const MmapSlot *slots = table_slots(ht, t);
+    size_t capacity = t->groups * MMAP_GROUP_WIDTH;
+    for (size_t i = 0; i < capacity; i++) {
+      if (ctrl[i] >= 0)
+        visit(slot_key(ht, &slots[i]), slot_value(ht, &slots[i]), arg);
+    }
+  }
+}
+
+// Builds the index of a table loaded back, on its first scan. The caller
+// holds every stripe, so no writer runs meanwhile.
+// @param ht The hash table.
+static void build_index(HashTable *ht) {
+  pthread_mutex_lock(&ht->index_lock);
+  bool failed = false;
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES && !failed &&
+                       !atomic_load(&ht->indexed); s++) {
+    const MmapTable *t = &ht->header->tables[s];
+    const int8_t *ctrl = table_ctrl(ht, t);
+    const MmapSlot *slots = table_slots(ht, t);
+    size_t capacity = t->groups * MMAP_GROUP_WIDTH;
+    for (size_t i = 0; i < capacity && !failed; i++) {
+      if (ctrl[i] >= 0)
+        failed = skiplist_insert(ht->index, slot_key(ht, &slots[i]),
+                                 slots[i].hash) != 0;
+    }
+  }
+  // Keys already in the index are skipped next time
+  if (failed)
+    fprintf(stderr, "Out of memory indexing the table, scans miss keys\n");
+  else
+    atomic_store_explicit(&ht->indexed, true, memory_order_release);
+  pthread_mutex_unlock(&ht->index_lock);
+}
+
+// Pairs live in their slots, where writers overwrite them, so there are no
+// old versions to scan: a scan locks the table for its whole length.
+bool scan_locks(void) { return true; }
+
+uint64_t scan_begin(HashTable *ht) {
+  uint64_t stripes = lock_all_stripes(ht);
+  if (!atomic_load_explicit(&ht->indexed, memory_order_acquire))
+    build_index(ht);
+  return stripes;
+}
+
+// State of a scan_pairs call.
+typedef struct ScanVisit {
+  HashTable *ht;
+  const char *after;
+  bool inclusive;
+  PairRef *pairs;
+  size_t max;
+  size_t count;
+} ScanVisit;
+
+// Collects the pair of a key handed out by the index.
+static bool scan_visit(const char *key, uint64_t h, void *arg) {
+  ScanVisit *scan = arg;
+  if (!scan->inclusive && strcmp(key, scan->after) == 0)
+    return true;
+  HashTable *ht = scan->ht;
+  const MmapTable *t = &ht->header->tables[stripe_of(h)];
+  size_t i = mmap_find(ht, t, h, key);
+  if (i != SIZE_MAX) {
+    const MmapSlot *slot = &table_slots(ht, t)[i];
+    scan->pairs[scan->count++] = (PairRef){
+        slot_key(ht, slot), slot_value(ht, slot), slot->version};
+  }
+  return scan->count < scan->max;
+}
+
+size_t scan_pairs(HashTable *ht, uint64_t snapshot, const char *after,
+                  bool inclusive, PairRef pairs[], size_t max) {
+  (void)snapshot; // Locked, the table is seen as of scan_begin
+  if (max == 0)
+    return 0;
+  ScanVisit scan = {ht, after, inclusive || after == NULL, pairs, max, 0};
+  skiplist_foreach(ht->index, after, scan_visit, &scan);
+  return scan.count;
+}
+
+// State of a sample_keys call.
+typedef struct SampleVisit {
+  void (*visit)(const char *key, void *arg);
+  void *arg;
+} SampleVisit;
+
+// Hands a key picked by the index to the caller of sample_keys.
+static bool sample_visit(const char *key, uint64_t h, void *arg) {
+  (void)h;
+  SampleVisit *sample = arg;
+  sample->visit(key, sample->arg);
+  return true;
+}
+
+void sample_keys(HashTable *ht, size_t count,
+                 void (*visit)(const char *key, void *arg), void *arg) {
+  SampleVisit sample = {visit, arg};
+  // Locked and indexed by scan_begin, the index has no writer
+  skiplist_sample(ht->index, count, sample_visit, &sample);
+}
+
+void scan_end(HashTable *ht, uint64_t token) { unlock_stripes(ht, token); }
+
+void free_table(HashTable *ht) {
+  // The pairs stay in the file, if any, but leave the server
+  account_table(ht, -1);
+  free_referenced(ht);
+  for (unsigned s = 0; s < KVS_LOCK_STRIPES; s++)
+    pthread_rwlock_destroy(&ht->stripes[s].lock);
+  munmap(ht->base, MMAP_RESERVE);
+  if (ht->fd >= 0)
+    close(ht->fd);
+  free(ht->path);
+  pthread_mutex_destroy(&ht->alloc_lock);
+  pthread_mutex_destroy(&ht->index_lock);
+  skiplist_destroy(ht->index);
+  free(ht);
+}
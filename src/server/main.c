@@ -12,6 +12,7 @@
 #include "../common/protocol.h"
 #include "operations.h"
 #include "parser.h"
+#include "wal.h"
 #include "pthread.h"
 #include <sys/stat.h>
 #include "kvs.h"
@@ -28,7 +29,6 @@ struct SharedData {
 };
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 sigset_t set;
@@ -36,7 +36,6 @@ volatile sig_atomic_t sigusr1_received = 0;
 
 int clients[MANAGING_THREADS];
 
-size_t active_backups = 0; // Number of active backups
 size_t max_backups;        // Maximum allowed simultaneous backups
 size_t max_threads;        // Maximum allowed simultaneous threads
 char *registration_pipe_name = NULL;  
@@ -54,6 +53,18 @@ void handle_sigusr1(int sig) {
   }
 }
 
+// Writes the stats report to stdout whenever SIGUSR2 arrives. The signal is
+// blocked in every other thread, so it is taken here with sigwait rather than
+// in a handler, and the report can use any function.
+static void *stats_signal_thread(void *arg) {
+  sigset_t *signals = arg;
+  int sig;
+  while (sigwait(signals, &sig) == 0) {
+    kvs_stats(STDOUT_FILENO, &client_queue);
+  }
+  return NULL;
+}
+
 
 int filter_job_files(const struct dirent *entry) {
   const char *dot = strrchr(entry->d_name, '.');
@@ -94,32 +105,33 @@ static int run_job(int in_fd, int out_fd, char *filename) {
     perror("sigmask\n");
   }
 
-  size_t file_backups = 0;
+  BackupChain backups = {0};
+  CommandBuffer buffer = {0};
+  char *keys[MAX_WRITE_SIZE];
+  char *values[MAX_WRITE_SIZE];
+  unsigned int ttls[MAX_WRITE_SIZE];
   while (1) {
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
     unsigned int delay;
     size_t num_pairs;
 
     switch (get_next(in_fd)) {
     case CMD_WRITE:
 
-      num_pairs =
-          parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      num_pairs = parse_write(in_fd, &buffer, keys, values, ttls,
+                              MAX_WRITE_SIZE);
 
       if (num_pairs == 0) {
         write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
         continue;
       }
 
-      if (kvs_write(num_pairs, keys, values)) {
+      if (kvs_write(num_pairs, keys, values, ttls)) {
         write_str(STDERR_FILENO, "Failed to write pair\n");
       }
       break;
 
     case CMD_READ:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      num_pairs = parse_read_delete(in_fd, &buffer, keys, MAX_WRITE_SIZE);
 
       if (num_pairs == 0) {
         write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
@@ -132,8 +144,7 @@ static int run_job(int in_fd, int out_fd, char *filename) {
       break;
 
     case CMD_DELETE:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      num_pairs = parse_read_delete(in_fd, &buffer, keys, MAX_WRITE_SIZE);
 
       if (num_pairs == 0) {
         write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
@@ -145,10 +156,25 @@ static int run_job(int in_fd, int out_fd, char *filename) {
       }
       break;
 
+    case CMD_RANGE:
+      if (parse_range(in_fd, &buffer, &keys[0], &keys[1]) == 0) {
+        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_range(keys[0], keys[1], out_fd)) {
+        write_str(STDERR_FILENO, "Failed to read range\n");
+      }
+      break;
+
     case CMD_SHOW:
       kvs_show(out_fd);
       break;
 
+    case CMD_STATS:
+      kvs_stats(out_fd, &client_queue);
+      break;
+
     case CMD_WAIT:
       if (parse_wait(in_fd, &delay, NULL) == -1) {
         write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
@@ -162,19 +188,10 @@ static int run_job(int in_fd, int out_fd, char *filename) {
       break;
 
     case CMD_BACKUP:
-      pthread_mutex_lock(&n_current_backups_lock);
-      if (active_backups >= max_backups) {
-        wait(NULL);
-      } else {
-        active_backups++;
-      }
-      pthread_mutex_unlock(&n_current_backups_lock);
-      int aux = kvs_backup(++file_backups, filename, jobs_directory);
-
-      if (aux < 0) {
+      // Returns as soon as the backup has its snapshot, even past
+      // max_backups (see kvs_backup)
+      if (kvs_backup(&backups, filename, jobs_directory) < 0) {
         write_str(STDERR_FILENO, "Failed to do backup\n");
-      } else if (aux == 1) {
-        return 1;
       }
       break;
 
@@ -185,10 +202,12 @@ static int run_job(int in_fd, int out_fd, char *filename) {
     case CMD_HELP:
       write_str(STDOUT_FILENO,
                 "Available commands:\n"
-                "  WRITE [(key,value)(key2,value2),...]\n"
+                "  WRITE [(key,value[,ttl_ms])(key2,value2),...]\n"
                 "  READ [key,key2,...]\n"
                 "  DELETE [key,key2,...]\n"
+                "  RANGE [start,end]\n"
                 "  SHOW\n"
+                "  STATS\n"
                 "  WAIT <delay_ms>\n"
                 "  BACKUP\n" // Not implemented
                 "  HELP\n");
@@ -200,6 +219,8 @@ static int run_job(int in_fd, int out_fd, char *filename) {
 
     case EOC:
       printf("EOF\n");
+      kvs_backup_chain_end(&backups);
+      command_buffer_free(&buffer);
       return 0;
     }
   }
@@ -289,6 +310,11 @@ void process_client_commands(int client_fd) {
         char notif_pipe[40];
       } connect;
       char key[40];
+      struct {
+        char key[40];
+        char resp_pipe[40];
+        uint32_t ttl_ms; // 0 clears the TTL
+      } expire;
     } data;
   } message;
   int resp_fd;
@@ -346,6 +372,21 @@ void process_client_commands(int client_fd) {
         }
         break;
 
+      case OP_CODE_EXPIRE:
+        resp_fd = open(message.data.expire.resp_pipe, O_WRONLY);
+        if (resp_fd == -1) {
+          fprintf(stderr, "Failed to open client response pipe for expire");
+        } else {
+          message.data.expire.key[sizeof(message.data.expire.key) - 1] = '\0';
+          int success = kvs_expire(message.data.expire.key,
+                                   message.data.expire.ttl_ms) != 0;
+          if (write(resp_fd, &success, sizeof(success)) == -1) {
+            fprintf(stderr, "Failed to write expire to client");
+          }
+          close(resp_fd);
+        }
+        break;
+
       case OP_CODE_DISCONNECT:
         resp_fd = open(message.data.connect.resp_pipe, O_WRONLY);
         if (resp_fd == -1) {
@@ -455,6 +496,11 @@ void *init_server_pipes() {
           char notif_pipe[40];
         } connect;
         char key[40]; // Field for subscribe/unsubscribe
+        struct {
+          char key[40];
+          char resp_pipe[40];
+          uint32_t ttl_ms;
+        } expire; // Same layout as in process_client_commands
       } data;
     } message;
 
@@ -621,7 +667,20 @@ int main(int argc, char **argv) {
     write_str(STDERR_FILENO, " <jobs_dir>");
     write_str(STDERR_FILENO, " <max_threads>");
     write_str(STDERR_FILENO, " <max_backups>");
-    write_str(STDERR_FILENO, " <FIFO_de_registo>\n");
+    write_str(STDERR_FILENO, " <FIFO_de_registo>");
+    write_str(STDERR_FILENO, " [--shards <n>]");
+    write_str(STDERR_FILENO, " [--max-memory <bytes>[K|M|G]]");
+    write_str(STDERR_FILENO, " [--intern-values]");
+    write_str(STDERR_FILENO, " [--backup-mode fork|thread]");
+    write_str(STDERR_FILENO, " [--full-backup-every <n>]");
+    write_str(STDERR_FILENO, " [--backup-format text|binary]");
+    write_str(STDERR_FILENO, " [--backup-threads <n>]");
+    write_str(STDERR_FILENO, " [--restore <backup>]");
+    write_str(STDERR_FILENO, " [--wal <log>]");
+    write_str(STDERR_FILENO, " [--durability none|batched|per-op]");
+    write_str(STDERR_FILENO, " [--wal-window <ms>]");
+    write_str(STDERR_FILENO, " [--data-dir <dir>]");
+    write_str(STDERR_FILENO, " [--checkpoint-every <s>]\n");
     return 1;
   }
 
@@ -655,7 +714,141 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  if (kvs_init()) {
+  // Options after the positional arguments
+  size_t num_shards = 1;
+  size_t max_memory = 0;
+  bool intern_values = false;
+  BackupMode backup_mode = BACKUP_FORK;
+  bool backup_mode_given = false;
+  size_t full_backup_every = 1;
+  size_t backup_threads = 1;
+  BackupFormat backup_format = BACKUP_TEXT;
+  const char *restore_path = NULL;
+  const char *wal_path = NULL;
+  WalDurability durability = WAL_BATCHED;
+  unsigned int wal_window = 10;
+  const char *data_dir = NULL;
+  unsigned int checkpoint_every = 60;
+  for (int i = 5; i < argc; i++) {
+    if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+      num_shards = strtoul(argv[++i], &endptr, 10);
+      if (*endptr != '\0' || num_shards == 0 ||
+          num_shards > KVS_MAX_SHARDS) {
+        fprintf(stderr, "Invalid number of shards\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+      max_memory = strtoul(argv[++i], &endptr, 10);
+      unsigned shift = 0;
+      if (*endptr == 'K' || *endptr == 'k') {
+        shift = 10;
+      } else if (*endptr == 'M' || *endptr == 'm') {
+        shift = 20;
+      } else if (*endptr == 'G' || *endptr == 'g') {
+        shift = 30;
+      }
+      if (shift != 0) {
+        endptr++;
+      }
+      if (*endptr != '\0' || max_memory == 0 ||
+          max_memory > (SIZE_MAX >> shift)) {
+        fprintf(stderr, "Invalid memory limit\n");
+        return 1;
+      }
+      max_memory <<= shift;
+    } else if (strcmp(argv[i], "--intern-values") == 0) {
+      intern_values = true;
+    } else if (strcmp(argv[i], "--backup-mode") == 0 && i + 1 < argc) {
+      i++;
+      backup_mode_given = true;
+      if (strcmp(argv[i], "fork") == 0) {
+        backup_mode = BACKUP_FORK;
+      } else if (strcmp(argv[i], "thread") == 0) {
+        backup_mode = BACKUP_THREAD;
+      } else {
+        fprintf(stderr, "Invalid backup mode\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--full-backup-every") == 0 && i + 1 < argc) {
+      full_backup_every = strtoul(argv[++i], &endptr, 10);
+      if (*endptr != '\0' || full_backup_every == 0) {
+        fprintf(stderr, "Invalid full backup interval\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--backup-format") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "text") == 0) {
+        backup_format = BACKUP_TEXT;
+      } else if (strcmp(argv[i], "binary") == 0) {
+        backup_format = BACKUP_BINARY;
+      } else {
+        fprintf(stderr, "Invalid backup format\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--backup-threads") == 0 && i + 1 < argc) {
+      backup_threads = strtoul(argv[++i], &endptr, 10);
+      if (*endptr != '\0' || backup_threads == 0 ||
+          backup_threads > KVS_MAX_BACKUP_THREADS) {
+        fprintf(stderr, "Invalid number of backup threads\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      restore_path = argv[++i];
+    } else if (strcmp(argv[i], "--wal") == 0 && i + 1 < argc) {
+      wal_path = argv[++i];
+    } else if (strcmp(argv[i], "--durability") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "none") == 0) {
+        durability = WAL_NONE;
+      } else if (strcmp(argv[i], "batched") == 0) {
+        durability = WAL_BATCHED;
+      } else if (strcmp(argv[i], "per-op") == 0) {
+        durability = WAL_PER_OP;
+      } else {
+        fprintf(stderr, "Invalid durability\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--wal-window") == 0 && i + 1 < argc) {
+      unsigned long window = strtoul(argv[++i], &endptr, 10);
+      if (*endptr != '\0' || window == 0 || window > 60000) {
+        fprintf(stderr, "Invalid log window\n");
+        return 1;
+      }
+      wal_window = (unsigned int)window;
+    } else if (strcmp(argv[i], "--data-dir") == 0 && i + 1 < argc) {
+      data_dir = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+      unsigned long every = strtoul(argv[++i], &endptr, 10);
+      if (*endptr != '\0' || every > 86400) {
+        fprintf(stderr, "Invalid checkpoint interval\n");
+        return 1;
+      }
+      checkpoint_every = (unsigned int)every;
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  // A forked child would share the mapped files with the server, so the
+  // backups of a KVS kept in a directory are taken by a thread
+  if (data_dir != NULL) {
+    if (backup_mode_given && backup_mode == BACKUP_FORK) {
+      fprintf(stderr, "--data-dir needs --backup-mode thread\n");
+      return 1;
+    }
+    backup_mode = BACKUP_THREAD;
+  }
+
+  // Blocked before any thread is created, so every thread inherits the mask
+  static sigset_t stats_signals;
+  sigemptyset(&stats_signals);
+  sigaddset(&stats_signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+
+  if (kvs_init(num_shards, max_memory, intern_values, backup_mode,
+               backup_format, full_backup_every, backup_threads,
+               max_backups)) {
     write_str(STDERR_FILENO, "Failed to initialize KVS\n");
     return 1;
   }
@@ -667,6 +860,33 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // Writes notify subscribers, so this needs their table. Before any job or
+  // client can touch the KVS. With a log, the backup, or the shards mapped
+  // back from the data directory, are only where the recovery starts from.
+  // A backup given replaces what the data directory holds
+  int restored = 0;
+  if (data_dir != NULL &&
+      kvs_persist(data_dir, restore_path == NULL, checkpoint_every) != 0)
+    restored = 1;
+  else if (wal_path != NULL)
+    restored = kvs_recover(wal_path, restore_path, jobs_directory);
+  else if (restore_path != NULL)
+    restored = kvs_restore(restore_path);
+  if (restored != 0) {
+    write_str(STDERR_FILENO, "Failed to restore KVS\n");
+    subscription_table_destroy();
+    kvs_terminate();
+    return 1;
+  }
+
+  // Opened once recovered, so neither the restore nor the replay is logged
+  if (wal_path != NULL && wal_open(wal_path, durability, wal_window) != 0) {
+    write_str(STDERR_FILENO, "Failed to open the write-ahead log\n");
+    subscription_table_destroy();
+    kvs_terminate();
+    return 1;
+  }
+
   sem_init(&empty_slots, 0, MANAGING_THREADS);
   sem_init(&filled_slots, 0, 0);
 
@@ -677,6 +897,14 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  pthread_t stats_thread;
+  if (pthread_create(&stats_thread, NULL, stats_signal_thread,
+                     &stats_signals) != 0) {
+    fprintf(stderr, "Failed to create stats thread\n");
+  } else {
+    pthread_detach(stats_thread);
+  }
+
   DIR *dir = opendir(argv[1]);
   if (dir == NULL) {
     fprintf(stderr, "Failed to open directory: %s\n", argv[1]);
@@ -690,11 +918,12 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  while (active_backups > 0) {
-    wait(NULL);
-    active_backups--;
-  }
+  kvs_wait_backups();
 
+  // Checkpointed at the end of the log, so that nothing is replayed
+  if (data_dir != NULL)
+    kvs_persist_end();
+  wal_close();
   subscription_table_destroy();
   kvs_terminate();
 
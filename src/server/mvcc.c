@@ -0,0 +1,164 @@
+#include "mvcc.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// A thread holds no snapshot
+#define NO_SNAPSHOT UINT64_MAX
+// Commit of a thread that is still picking its version: no version is lower,
+// so a snapshot waits for the commit as if it were below it
+#define PICKING_VERSION 1
+
+// Per thread state, or that of a pinned snapshot (see mvcc_pin). Records are
+// never freed, only reused.
+typedef struct MvccThread {
+  _Alignas(64) atomic_uint_fast64_t commit; // Open commit, 0 if none
+  atomic_uint_fast64_t snapshot;            // Snapshot held, see NO_SNAPSHOT
+  atomic_bool in_use;
+  unsigned nesting;
+  struct MvccThread *next;
+} MvccThread;
+
+// Version of the last commit opened; versions start at 1
+static atomic_uint_fast64_t last_version = 0;
+static _Atomic(MvccThread *) threads = NULL;
+
+// Serializes taking and releasing snapshots, which move the horizon
+static pthread_mutex_t snapshots_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint_fast64_t horizon = NO_SNAPSHOT;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static _Thread_local MvccThread *self = NULL;
+
+// Recomputes the horizon from the snapshots held. The caller holds
+// snapshots_lock.
+static void update_horizon(void) {
+  uint64_t oldest = NO_SNAPSHOT;
+  for (MvccThread *t = atomic_load(&threads); t != NULL; t = t->next) {
+    uint64_t snapshot = atomic_load(&t->snapshot);
+    if (snapshot < oldest)
+      oldest = snapshot;
+  }
+  atomic_store(&horizon, oldest);
+}
+
+// Releases the snapshot of an exiting thread and frees its record for reuse.
+static void thread_exit(void *arg) {
+  MvccThread *thread = arg;
+  if (atomic_load(&thread->snapshot) != NO_SNAPSHOT) {
+    pthread_mutex_lock(&snapshots_lock);
+    atomic_store(&thread->snapshot, NO_SNAPSHOT);
+    update_horizon();
+    pthread_mutex_unlock(&snapshots_lock);
+  }
+  atomic_store(&thread->in_use, false);
+}
+
+static void make_key(void) { pthread_key_create(&thread_key, thread_exit); }
+
+// Takes a record no thread or pin uses, allocating one if there is none.
+static MvccThread *take_record(void) {
+  // Reuse the record of a thread that already exited
+  for (MvccThread *t = atomic_load(&threads); t != NULL; t = t->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&t->in_use, &expected, true))
+      return t;
+  }
+
+  MvccThread *t = aligned_alloc(64, sizeof(MvccThread));
+  if (t == NULL) {
+    fprintf(stderr, "Failed to allocate version state\n");
+    abort();
+  }
+  atomic_init(&t->commit, 0);
+  atomic_init(&t->snapshot, NO_SNAPSHOT);
+  atomic_init(&t->in_use, true);
+  t->next = atomic_load(&threads);
+  while (!atomic_compare_exchange_weak(&threads, &t->next, t))
+    ;
+  return t;
+}
+
+// Returns this thread's record, registering the thread on first use.
+static MvccThread *get_self(void) {
+  if (self != NULL)
+    return self;
+
+  self = take_record();
+  self->nesting = 0;
+  pthread_once(&key_once, make_key);
+  pthread_setspecific(thread_key, self);
+  return self;
+}
+
+uint64_t mvcc_begin(void) {
+  MvccThread *t = get_self();
+  if (t->nesting++ > 0)
+    return atomic_load_explicit(&t->commit, memory_order_relaxed);
+  // Announced before the version is drawn, so a snapshot that could cover
+  // the version cannot miss the commit
+  atomic_store(&t->commit, PICKING_VERSION);
+  uint64_t version = atomic_fetch_add(&last_version, 1) + 1;
+  atomic_store(&t->commit, version);
+  return version;
+}
+
+void mvcc_end(void) {
+  MvccThread *t = self;
+  if (--t->nesting == 0)
+    atomic_store_explicit(&t->commit, 0, memory_order_release);
+}
+
+void mvcc_advance(uint64_t version) {
+  uint64_t last = atomic_load(&last_version);
+  while (last < version &&
+         !atomic_compare_exchange_weak(&last_version, &last, version))
+    ;
+}
+
+// Takes a snapshot held by a record.
+static uint64_t take_snapshot(MvccThread *me) {
+  pthread_mutex_lock(&snapshots_lock);
+  // Writers that miss the new snapshot keep every old version meanwhile;
+  // those that drew their version before it are waited for below
+  atomic_store(&horizon, 0);
+  uint64_t snapshot = atomic_load(&last_version);
+  for (MvccThread *t = atomic_load(&threads); t != NULL; t = t->next) {
+    uint64_t commit;
+    while ((commit = atomic_load(&t->commit)) != 0 && commit <= snapshot)
+      sched_yield();
+  }
+  atomic_store(&me->snapshot, snapshot);
+  update_horizon();
+  pthread_mutex_unlock(&snapshots_lock);
+  return snapshot;
+}
+
+uint64_t mvcc_snapshot(void) { return take_snapshot(get_self()); }
+
+// Releases the snapshot a record holds.
+static void release_snapshot(MvccThread *me) {
+  pthread_mutex_lock(&snapshots_lock);
+  atomic_store(&me->snapshot, NO_SNAPSHOT);
+  update_horizon();
+  pthread_mutex_unlock(&snapshots_lock);
+}
+
+void mvcc_release(void) { release_snapshot(self); }
+
+uint64_t mvcc_pin(MvccPin **pin) {
+  *pin = take_record();
+  return take_snapshot(*pin);
+}
+
+void mvcc_unpin(MvccPin *pin) {
+  release_snapshot(pin);
+  atomic_store(&pin->in_use, false);
+}
+
+uint64_t mvcc_horizon(void) { return atomic_load(&horizon); }
@@ -0,0 +1,58 @@
+#ifndef KVS_MVCC_H
+#define KVS_MVCC_H
+
+#include <stdint.h>
+
+/// Multi-version concurrency control. Writers wrap their changes in a commit,
+/// which gets its version from a global clock; the table stamps every pair
+/// version it writes with it. A scan takes a snapshot, the version of the
+/// last commit that finished, and only looks at pair versions up to it, so
+/// it sees the table as it was when it started without keeping writers out.
+/// The table keeps the old versions of a pair for as long as a snapshot may
+/// see them (see mvcc_horizon).
+
+/// Opens a commit, or joins the one the calling thread already has open:
+/// every change up to the matching mvcc_end gets the same version, so a
+/// snapshot sees all of them or none. Must not block on other writers while
+/// open, since mvcc_snapshot waits for it.
+/// @return Version of the commit.
+uint64_t mvcc_begin(void);
+
+/// Closes the commit opened by the matching mvcc_begin.
+void mvcc_end(void);
+
+/// Takes a snapshot for the calling thread, which may hold one at a time and
+/// must have no commit open. Waits for the commits already running to
+/// finish, which is short, since they hold no lock a snapshot needs.
+/// @return Version of the snapshot: it sees the commits up to it.
+uint64_t mvcc_snapshot(void);
+
+/// Releases the snapshot of the calling thread.
+void mvcc_release(void);
+
+/// Holder of a snapshot that belongs to no thread, see mvcc_pin.
+typedef struct MvccThread MvccPin;
+
+/// Takes a snapshot held apart from the calling thread, which can go on
+/// taking snapshots of its own, and which any thread may release: one taken
+/// for work that starts later, elsewhere. Waits as mvcc_snapshot does.
+/// @param pin Set to the holder of the snapshot, to pass to mvcc_unpin.
+/// @return Version of the snapshot.
+uint64_t mvcc_pin(MvccPin **pin);
+
+/// Releases a snapshot taken with mvcc_pin.
+/// @param pin Its holder, which is then reused.
+void mvcc_unpin(MvccPin *pin);
+
+/// Moves the clock on to a version, unless it is past it already, so that
+/// the commits made from then on get higher versions, as those replayed
+/// from a log must (see kvs_recover).
+/// @param version The version.
+void mvcc_advance(uint64_t version);
+
+/// Returns the oldest version a snapshot may still see. Of the versions of a
+/// pair at or below it, only the newest one is still needed. UINT64_MAX if
+/// no snapshot is held, 0 while one is being taken.
+uint64_t mvcc_horizon(void);
+
+#endif // KVS_MVCC_H
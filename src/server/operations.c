@@ -1,16 +1,37 @@
+// syscall is not POSIX
+#define _DEFAULT_SOURCE
 #include "operations.h"
 #include <pthread.h> 
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include "src/common/constants.h"
+#include "src/common/io.h"
+#include "src/common/protocol.h"
+#include "backup_file.h"
 #include "constants.h"
+#include "crc32c.h"
+#include "deletions.h"
+#include "ebr.h"
+#include "expiry.h"
 #include "io.h"
 #include "kvs.h"
+#include "mvcc.h"
+#include "stats.h"
+#include "wal.h"
 #include <stdbool.h>
 
 
@@ -35,19 +56,16 @@ ClientTable *create_client_table() {
     return table;
 }
 
-// Hash function
-unsigned int hash_function(const char *key) {
-    unsigned int hash = 0;
-    while (*key) {
-        hash = (hash * 31) + (unsigned int)*key++;
-    }
-    return hash % TABLE_SIZE;
+// Bucket of a key, from the hash the KVS table uses (see hash()), so a key
+// is only hashed once per operation.
+unsigned int hash_function(uint64_t h) {
+    return (unsigned int)(h % TABLE_SIZE);
 }
 
 // Add a subscription
-int add_subscription(ClientTable *table, const char *key, int client_fd, 
-                     const char *notif_pipe) {
-    unsigned int index = hash_function(key);
+int add_subscription(ClientTable *table, uint64_t h, const char *key,
+                     int client_fd, const char *notif_pipe) {
+    unsigned int index = hash_function(h);
 
     pthread_rwlock_wrlock(&table->lock);
 
@@ -55,7 +73,7 @@ int add_subscription(ClientTable *table, const char *key, int client_fd,
 
     // Search for the key
     while (current) {
-        if (strcmp(current->key, key) == 0) {
+        if (current->hash == h && strcmp(current->key, key) == 0) {
             // Key already exists, check if the client is already subscribed
             ClientNode *client_current = current->clients;
             while (client_current) {
@@ -90,6 +108,7 @@ int add_subscription(ClientTable *table, const char *key, int client_fd,
         pthread_rwlock_unlock(&table->lock);
         return 1;
     }
+    new_key->hash = h;
     strncpy(new_key->key, key, MAX_STRING_SIZE);
     new_key->clients = malloc(sizeof(ClientNode));
     if (!new_key->clients) {
@@ -108,8 +127,9 @@ int add_subscription(ClientTable *table, const char *key, int client_fd,
     return 0;
 }
 // Remove a subscription
-int remove_subscription(ClientTable *table, const char *key, int client_fd) {
-    unsigned int index = hash_function(key);
+int remove_subscription(ClientTable *table, uint64_t h, const char *key,
+                        int client_fd) {
+    unsigned int index = hash_function(h);
 
     pthread_rwlock_wrlock(&table->lock);
 
@@ -117,7 +137,7 @@ int remove_subscription(ClientTable *table, const char *key, int client_fd) {
     SubscriptionNode *prev_key = NULL;
 
     while (current) {
-        if (strcmp(current->key, key) == 0) {
+        if (current->hash == h && strcmp(current->key, key) == 0) {
             // Encontrou a key
             ClientNode **indirect = &current->clients;
             while (*indirect) {
@@ -232,11 +252,93 @@ int remove_client(ClientTable *table, int client_fd) {
 }
 
 
-static struct HashTable *kvs_table = NULL;
+// The KVS is split in num_shards independent tables, each with its own
+// locks, allocator and index, and every key lives in the shard its hash
+// routes it to (see shard_of). With a single shard this is the plain table.
+static HashTable *kvs_shards[KVS_MAX_SHARDS];
+static size_t num_shards = 0;
+// Memory each shard may hold before writes evict cold pairs (its share of
+// --max-memory), 0 for no limit.
+static size_t shard_memory_limit = 0;
+static BackupMode backup_mode = BACKUP_FORK;
+static BackupFormat backup_format = BACKUP_TEXT;
+// Every how many backups of a job one is full, see kvs_init
+static size_t full_backup_every = 1;
+// Threads that write a backup, at most, see kvs_init
+static size_t backup_threads = 1;
+
+// Backups being written, at most max_backups, and those waiting for one of
+// them to end, oldest first (see kvs_backup). backups_cond is signaled when
+// one ends, when one has taken its snapshot, and when a child is forked.
+typedef struct PendingBackup PendingBackup;
+static pthread_mutex_t backups_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backups_cond = PTHREAD_COND_INITIALIZER;
+static size_t max_backups = 1;
+static size_t running_backups = 0;
+static PendingBackup *pending_first = NULL;
+static PendingBackup *pending_last = NULL;
+// Reaper of the forked backup children (BACKUP_FORK), see reap_backups
+static pthread_t reaper_thread;
+static bool reaping = false; // Whether the thread runs
+static bool reaper_stop = false;
+static size_t forked_backups = 0; // Children not reaped yet
+// Epoll instance the pidfds of the children are watched with
+static int reaper_epoll = -1;
+// Exits of children the reaper handles per epoll_wait, at most
+#define BACKUP_REAP_EVENTS 16
+// A backup child not reaped yet, and the directory it renames the backup
+// into (see backup_publish)
+typedef struct ForkedBackup {
+  pid_t pid;
+  int pidfd; // Readable once the child exits, -1 if waited for in place
+  const char *directory;
+  bool exited;    // Whether it was waited for
+  bool published; // Whether it exited with 0, once waited for
+  struct ForkedBackup *next;
+} ForkedBackup;
+static ForkedBackup *forked_children = NULL;
+
+// Directories backups were renamed into since they were last synced. The
+// sync thread syncs them a window after the first one, so that backups
+// that end together share a sync of their directory. syncs_cond is
+// signaled when one is added, and when a round of syncs is done.
+#define BACKUP_SYNC_WINDOW_MS 10
+static pthread_mutex_t syncs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t syncs_cond = PTHREAD_COND_INITIALIZER;
+static char **unsynced = NULL;
+static size_t num_unsynced = 0;
+static size_t unsynced_capacity = 0;
+static bool syncs_running = false; // Whether a round is under way
+static pthread_t sync_thread;
+static bool syncing = false; // Whether the thread runs
+static bool syncs_stop = false;
+
+static void *reap_backups(void *arg);
+static void stop_reaping(void);
+
+// Log position the shards were mapped back at, see kvs_persist; UINT64_MAX
+// if they started empty.
+static uint64_t persisted_position = UINT64_MAX;
+// Checkpoint thread, see kvs_persist. checkpoints_cond is signaled to stop
+// it.
+static pthread_t checkpoint_thread;
+static bool checkpointing = false; // Whether the thread runs
+static bool checkpoints_stop = false;
+static unsigned int checkpoint_every_s = 0;
+static pthread_mutex_t checkpoints_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoints_cond = PTHREAD_COND_INITIALIZER;
+
+// Returns the shard a key belongs to. The low bits of the hash already pick
+// the stripe inside a table, so shards are chosen from the high ones.
+static inline HashTable *shard_of(uint64_t h) {
+  return kvs_shards[(h >> 32) % num_shards];
+}
+
 // Subscribe client
 int subscribe_client(ClientTable *table, int client_fd, const char *key, 
                      const char *notif_pipe) {
-    if (!key_exists(kvs_table, key)){
+    uint64_t h = hash(key);
+    if (!key_exists(shard_of(h), h, key)){
       return 1;
     }
     if (!table || !key || !notif_pipe) {
@@ -244,7 +346,7 @@ int subscribe_client(ClientTable *table, int client_fd, const char *key,
         return 1;
     }
 
-    if (add_subscription(table, key, client_fd, notif_pipe) != 0) {
+    if (add_subscription(table, h, key, client_fd, notif_pipe) != 0) {
         fprintf(stderr, "Failed to subscribe client_fd %d to key %s\n", 
             client_fd, key);
         return 1;
@@ -256,7 +358,8 @@ int subscribe_client(ClientTable *table, int client_fd, const char *key,
 
 
 int unsubscribe_client(ClientTable *table, int client_fd, const char *key) {
-    if (!key_exists(kvs_table, key)){
+    uint64_t h = hash(key);
+    if (!key_exists(shard_of(h), h, key)){
       return 1;
     }
     if (!table || !key) {
@@ -264,7 +367,7 @@ int unsubscribe_client(ClientTable *table, int client_fd, const char *key) {
         return 1;
     }
 
-    if (remove_subscription(table, key, client_fd) != 0) {
+    if (remove_subscription(table, h, key, client_fd) != 0) {
         fprintf(stderr, "Failed to unsubscribe client_fd %d to key %s\n", client_fd, key);
         return 1;
     }
@@ -299,13 +402,50 @@ void print_hash_table(ClientTable *table) {
 
     pthread_rwlock_unlock(&table->lock);
 }
-int delete_key(ClientTable *table, const char *key) {
+// Figures of the subscription table, for kvs_stats.
+typedef struct SubscriptionStats {
+    size_t keys;          // Keys with at least one subscriber
+    size_t subscriptions; // Subscribed (key, client) pairs
+    size_t max_fanout;    // Most clients subscribed to a single key
+    size_t bytes;         // Memory of the table and its nodes
+} SubscriptionStats;
+
+// Measures the subscription table.
+static void subscription_stats(ClientTable *table, SubscriptionStats *stats) {
+    *stats = (SubscriptionStats){0};
+    if (!table) {
+        return;
+    }
+    stats->bytes = sizeof(ClientTable);
+
+    pthread_rwlock_rdlock(&table->lock);
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        for (SubscriptionNode *current = table->table[i]; current;
+             current = current->next) {
+            size_t fanout = 0;
+            for (ClientNode *client = current->clients; client;
+                 client = client->next) {
+                fanout++;
+            }
+            stats->keys++;
+            stats->subscriptions += fanout;
+            if (fanout > stats->max_fanout) {
+                stats->max_fanout = fanout;
+            }
+            stats->bytes +=
+                sizeof(SubscriptionNode) + fanout * sizeof(ClientNode);
+        }
+    }
+    pthread_rwlock_unlock(&table->lock);
+}
+
+int delete_key(ClientTable *table, uint64_t h, const char *key) {
     if (!table || !key) {
         fprintf(stderr, "Invalid table or key\n");
         return 1;
     }
 
-    unsigned int index = hash_function(key);
+    unsigned int index = hash_function(h);
 
     pthread_rwlock_wrlock(&table->lock);
 
@@ -313,7 +453,7 @@ int delete_key(ClientTable *table, const char *key) {
     SubscriptionNode *prev = NULL;
 
     while (current) {
-        if (strcmp(current->key, key) == 0) {
+        if (current->hash == h && strcmp(current->key, key) == 0) {
             // Found the key, remove it
             if (prev) {
                 prev->next = current->next;
@@ -345,7 +485,7 @@ int delete_key(ClientTable *table, const char *key) {
 
 
 
-void subscribed_keys(const char *key,const char *value, int opcode) {
+void subscribed_keys(uint64_t h, const char *key,const char *value, int opcode) {
     int found=0;
     if (!subscription_table || !key) {
         fprintf(stderr, "Invalid table or key\n");
@@ -353,13 +493,13 @@ void subscribed_keys(const char *key,const char *value, int opcode) {
     }
     
     
-    unsigned int index = hash_function(key);
+    unsigned int index = hash_function(h);
 
     pthread_rwlock_rdlock(&subscription_table->lock);
 
     SubscriptionNode *current = subscription_table->table[index];
     while (current) {
-        if (strcmp(current->key, key) == 0) {
+        if (current->hash == h && strcmp(current->key, key) == 0) {
             found=1;
             ClientNode *client = current->clients;
             while (client) {
@@ -371,41 +511,54 @@ void subscribed_keys(const char *key,const char *value, int opcode) {
         current = current->next;
     }
     pthread_rwlock_unlock(&subscription_table->lock);
-    if (opcode == 6 && found != 0){
-      delete_key(subscription_table,key);
+    if (opcode == OP_CODE_NOTIFY_DELETE && found != 0){
+      delete_key(subscription_table,h,key);
     }
 }
 
 
 
 void notify_client(const char *notif_pipe, const char *key, const char *value, int opcode) {
-    struct {
-        int opcode;
-        char key[MAX_STRING_SIZE];
-        char value[MAX_STRING_SIZE];
-    } message;
-
-    message.opcode = opcode;
-    strncpy(message.key, key, MAX_STRING_SIZE);
-    if (opcode!=6){
-      strncpy(message.value, value, MAX_STRING_SIZE);
+    NotificationHeader header;
+    header.opcode = opcode;
+    header.key_len = (uint32_t)strlen(key);
+    header.value_len =
+        opcode != OP_CODE_NOTIFY_DELETE ? (uint32_t)strlen(value) : 0;
+
+    // Short pairs, the usual case, are assembled on the stack
+    char small[sizeof(header) + 2 * MAX_STRING_SIZE];
+    size_t size = sizeof(header) + header.key_len + header.value_len;
+    char *message = size <= sizeof(small) ? small : malloc(size);
+    if (message == NULL) {
+        perror("Failed to allocate notification");
+        return;
     }
-    
+    memcpy(message, &header, sizeof(header));
+    memcpy(message + sizeof(header), key, header.key_len);
+    if (header.value_len > 0) {
+        memcpy(message + sizeof(header) + header.key_len, value,
+               header.value_len);
+    }
+
+    // One notification at a time, so long ones are never interleaved
     pthread_mutex_lock(&notif_pipe_mutex);
 
     int notif_fd = open(notif_pipe, O_WRONLY);
     if (notif_fd == -1) {
         perror("Failed to open notification pipe");
-        return;
-    }
-
-
-    if (write(notif_fd, &message, sizeof(message)) == -1) {
-        perror("Failed to write to notification pipe");
+    } else {
+        if (write_all(notif_fd, message, size) == -1) {
+            perror("Failed to write to notification pipe");
+        } else {
+            stat_add(STAT_NOTIFICATIONS, 1);
+        }
+        close(notif_fd);
     }
 
-    close(notif_fd);
     pthread_mutex_unlock(&notif_pipe_mutex);
+    if (message != small) {
+        free(message);
+    }
 }
 
 //void cleanup_and_disconnect_clients() {
@@ -453,170 +606,2421 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
-int kvs_init() {
-  if (kvs_table != NULL) {
-    fprintf(stderr, "KVS state has already been initialized\n");
+// Groups the keys of a batch by shard, keeping batch order within a shard.
+// @param num_keys Number of keys.
+// @param hashes Hash of each key.
+// @param order Filled with the indices of the keys, grouped by shard.
+// @param first Filled with where the group of each shard starts in order;
+// first[num_shards] is num_keys.
+static void split_by_shard(size_t num_keys, const uint64_t hashes[],
+                           size_t order[], size_t first[]) {
+  size_t next[KVS_MAX_SHARDS] = {0};
+  for (size_t i = 0; i < num_keys; i++)
+    next[(hashes[i] >> 32) % num_shards]++;
+  size_t total = 0;
+  for (size_t s = 0; s < num_shards; s++) {
+    first[s] = total;
+    total += next[s];
+    next[s] = first[s];
+  }
+  first[num_shards] = num_keys;
+  for (size_t i = 0; i < num_keys; i++)
+    order[next[(hashes[i] >> 32) % num_shards]++] = i;
+}
+
+// Locks the stripes of one shard covering a group of keys of a batch.
+// @param s The shard.
+// @param order Indices of the keys, grouped by shard (see split_by_shard).
+// @param first Where the group of each shard starts in order.
+// @param hashes Hash of each key of the batch.
+// @return Mask of the locked stripes.
+static uint64_t lock_shard_keys(size_t s, const size_t order[],
+                                const size_t first[], const uint64_t hashes[]) {
+  uint64_t group[MAX_WRITE_SIZE];
+  for (size_t j = first[s]; j < first[s + 1]; j++)
+    group[j - first[s]] = hashes[order[j]];
+  return lock_hashes(kvs_shards[s], first[s + 1] - first[s], group, true);
+}
+
+// Locks every stripe of every shard for reading, shard by shard. Batches
+// never hold two shards at once, so this order cannot deadlock.
+// @param stripes Filled with the masks to pass to unlock_all_shards.
+static void lock_all_shards(uint64_t stripes[]) {
+  for (size_t s = 0; s < num_shards; s++)
+    stripes[s] = lock_all_stripes(kvs_shards[s]);
+}
+
+// Unlocks what lock_all_shards locked.
+static void unlock_all_shards(const uint64_t stripes[]) {
+  for (size_t s = 0; s < num_shards; s++)
+    unlock_stripes(kvs_shards[s], stripes[s]);
+}
+
+// Takes a snapshot and readies every shard for a scan at it (see
+// scan_begin). With the chained table, this takes no lock.
+// @param tokens Filled with the tokens to pass to end_scan.
+// @return The snapshot.
+static uint64_t begin_scan(uint64_t tokens[]) {
+  uint64_t snapshot = mvcc_snapshot();
+  for (size_t s = 0; s < num_shards; s++)
+    tokens[s] = scan_begin(kvs_shards[s]);
+  return snapshot;
+}
+
+// Releases the snapshot of begin_scan and ends the scan of every shard.
+static void end_scan(const uint64_t tokens[]) {
+  mvcc_release();
+  for (size_t s = 0; s < num_shards; s++)
+    scan_end(kvs_shards[s], tokens[s]);
+}
+
+// Pairs a merged walk fetches from a shard at a time.
+#define SCAN_BATCH 32
+
+// Position of one shard in a merged walk: a batch of its pairs, in order.
+// The strings are the ones stored in the shard, which stay put until the
+// scan ends.
+typedef struct ShardCursor {
+  PairRef pairs[SCAN_BATCH];
+  size_t next;  // Next pair of the batch to visit
+  size_t count; // Pairs in the batch, 0 once the shard has no pairs left
+} ShardCursor;
+
+// Fetches the next batch of a shard's pairs.
+// @param cursor The cursor of the shard.
+// @param s The shard.
+// @param snapshot Snapshot of the scan.
+// @param start First key of the range, for the first batch.
+static void fill_cursor(ShardCursor *cursor, size_t s, uint64_t snapshot,
+                        const char *start) {
+  bool first = cursor->count == 0;
+  const char *after = first ? start : cursor->pairs[cursor->count - 1].key;
+  cursor->count = scan_pairs(kvs_shards[s], snapshot, after, first,
+                             cursor->pairs, SCAN_BATCH);
+  cursor->next = 0;
+}
+
+// Calls visit for every pair whose key lies in [start, end], in key order,
+// across every shard, as of a snapshot. With several shards, their ordered
+// indexes are merged a batch at a time; nothing is allocated, so the forked
+// backup child can call this. The caller readied the scan with begin_scan.
+// @param snapshot Snapshot of the scan.
+// @param start First key of the range, NULL for no lower bound.
+// @param end Bound of the range, NULL for no upper bound.
+// @param with_end Whether end itself lies in the range.
+// @param visit Function called with each pair and arg.
+// @param arg Argument passed to visit.
+static void foreach_sorted_pair(uint64_t snapshot, const char *start,
+                                const char *end, bool with_end,
+                                void (*visit)(const PairRef *pair, void *arg),
+                                void *arg) {
+  ShardCursor cursors[KVS_MAX_SHARDS];
+  for (size_t s = 0; s < num_shards; s++) {
+    cursors[s].count = 0;
+    fill_cursor(&cursors[s], s, snapshot, start);
+  }
+
+  while (1) {
+    size_t min = num_shards;
+    for (size_t s = 0; s < num_shards; s++) {
+      if (cursors[s].next < cursors[s].count &&
+          (min == num_shards ||
+           strcmp(cursors[s].pairs[cursors[s].next].key,
+                  cursors[min].pairs[cursors[min].next].key) < 0))
+        min = s;
+    }
+    if (min == num_shards)
+      break;
+    ShardCursor *cursor = &cursors[min];
+    PairRef *pair = &cursor->pairs[cursor->next];
+    if (end != NULL && strcmp(pair->key, end) >= (with_end ? 1 : 0))
+      break;
+
+    visit(pair, arg);
+    // A short batch was the shard's last one
+    if (++cursor->next == cursor->count && cursor->count == SCAN_BATCH)
+      fill_cursor(cursor, min, snapshot, start);
+  }
+}
+
+// Logs the deletion of a key for incremental backups (see deletions.h). The
+// caller holds the stripe of the key, and made the deletion in the commit it
+// has open, if any.
+static void log_deletion(const char *key) {
+  if (!deletions_wanted())
+    return;
+  deletions_record(mvcc_begin(), key);
+  mvcc_end();
+}
+
+// Deletes the keys whose TTL ran out, as handed over by the expiry reaper,
+// and notifies their subscribers like kvs_delete. A key that was given a new
+// TTL, or lost its TTL, after it fell due is left alone.
+static void reap_expired(size_t num_keys, char *keys[], const uint64_t hashes[],
+                         const uint64_t generations[]) {
+  size_t order[MAX_WRITE_SIZE];
+  size_t first[KVS_MAX_SHARDS + 1];
+  split_by_shard(num_keys, hashes, order, first);
+
+  for (size_t s = 0; s < num_shards; s++) {
+    if (first[s] == first[s + 1])
+      continue;
+    HashTable *shard = kvs_shards[s];
+    uint64_t stripes = lock_shard_keys(s, order, first, hashes);
+
+    bool deleted[MAX_WRITE_SIZE];
+    wal_begin(mvcc_begin());
+    for (size_t j = first[s]; j < first[s + 1]; j++) {
+      size_t i = order[j];
+      deleted[i] = expiry_consume(hashes[i], keys[i], generations[i]) &&
+                   delete_pair(shard, hashes[i], keys[i]) == 0;
+      if (deleted[i]) {
+        stat_add(STAT_EXPIRATIONS, 1);
+        log_deletion(keys[i]);
+        wal_add(keys[i], NULL);
+      }
+    }
+    // Nobody waits for these to be durable
+    wal_commit();
+    mvcc_end();
+
+    for (size_t j = first[s]; j < first[s + 1]; j++) {
+      size_t i = order[j];
+      if (deleted[i])
+        subscribed_keys(hashes[i], keys[i], NULL, OP_CODE_NOTIFY_DELETE);
+    }
+
+    unlock_stripes(shard, stripes);
+  }
+}
+
+int kvs_checkpoint(void) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  uint64_t stripes[KVS_MAX_SHARDS];
+  lock_all_shards(stripes);
+  // Commits append their record while holding their stripes, so the log
+  // holds every change the shards do, and nothing past them
+  uint64_t position = wal_position();
+  int result = 0;
+  for (size_t s = 0; s < num_shards; s++) {
+    if (table_checkpoint(kvs_shards[s], position) != 0)
+      result = 1;
+  }
+  unlock_all_shards(stripes);
+  return result;
+}
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+// Checkpoints the shards every checkpoint_every_s seconds, until told to
+// stop.
+static void *checkpoint_loop(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&checkpoints_lock);
+  while (!checkpoints_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += checkpoint_every_s;
+    while (!checkpoints_stop &&
+           pthread_cond_timedwait(&checkpoints_cond, &checkpoints_lock,
+                                  &deadline) != ETIMEDOUT)
+      ;
+    if (checkpoints_stop)
+      break;
+    pthread_mutex_unlock(&checkpoints_lock);
+    kvs_checkpoint();
+    pthread_mutex_lock(&checkpoints_lock);
+  }
+  pthread_mutex_unlock(&checkpoints_lock);
+  return NULL;
 }
 
-int kvs_terminate() {
-  if (kvs_table == NULL) {
+// Stops the checkpoint thread, if it runs.
+static void stop_checkpoints(void) {
+  if (!checkpointing)
+    return;
+  pthread_mutex_lock(&checkpoints_lock);
+  checkpoints_stop = true;
+  pthread_cond_signal(&checkpoints_cond);
+  pthread_mutex_unlock(&checkpoints_lock);
+  pthread_join(checkpoint_thread, NULL);
+  checkpointing = false;
+}
+
+// Syncs a directory, so that the names of the files renamed into it last.
+static void sync_directory(const char *directory) {
+  int fd = open(directory, O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || fsync(fd) != 0)
+    perror("Failed to sync backup directory");
+  if (fd >= 0)
+    close(fd);
+}
+
+// Has a directory synced, within BACKUP_SYNC_WINDOW_MS.
+// @param directory The directory, copied.
+static void sync_later(const char *directory) {
+  pthread_mutex_lock(&syncs_lock);
+  for (size_t i = 0; i < num_unsynced; i++) {
+    if (strcmp(unsynced[i], directory) == 0) {
+      pthread_mutex_unlock(&syncs_lock);
+      return;
+    }
+  }
+  char *copy = strdup(directory);
+  if (copy != NULL && num_unsynced == unsynced_capacity) {
+    size_t capacity = unsynced_capacity > 0 ? unsynced_capacity * 2 : 4;
+    char **grown = realloc(unsynced, capacity * sizeof(char *));
+    if (grown != NULL) {
+      unsynced = grown;
+      unsynced_capacity = capacity;
+    }
+  }
+  bool queued = copy != NULL && num_unsynced < unsynced_capacity;
+  if (queued) {
+    unsynced[num_unsynced++] = copy;
+    pthread_cond_broadcast(&syncs_cond);
+  }
+  pthread_mutex_unlock(&syncs_lock);
+  if (!queued) {
+    free(copy);
+    sync_directory(directory);
+  }
+}
+
+// Syncs the directories sync_later was given, a window after the first of
+// a round, until told to stop and none is left.
+static void *sync_loop(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&syncs_lock);
+  while (1) {
+    while (num_unsynced == 0 && !syncs_stop)
+      pthread_cond_wait(&syncs_cond, &syncs_lock);
+    if (num_unsynced == 0)
+      break;
+    syncs_running = true;
+    pthread_mutex_unlock(&syncs_lock);
+    // Lets the backups ending meanwhile join the round
+    struct timespec window = delay_to_timespec(BACKUP_SYNC_WINDOW_MS);
+    nanosleep(&window, NULL);
+
+    pthread_mutex_lock(&syncs_lock);
+    char **directories = unsynced;
+    size_t count = num_unsynced;
+    unsynced = NULL;
+    num_unsynced = 0;
+    unsynced_capacity = 0;
+    pthread_mutex_unlock(&syncs_lock);
+    for (size_t i = 0; i < count; i++) {
+      sync_directory(directories[i]);
+      free(directories[i]);
+    }
+    free(directories);
+
+    pthread_mutex_lock(&syncs_lock);
+    syncs_running = false;
+    pthread_cond_broadcast(&syncs_cond);
+  }
+  pthread_mutex_unlock(&syncs_lock);
+  return NULL;
+}
+
+// Waits until every directory given to sync_later so far is synced.
+static void wait_syncs(void) {
+  pthread_mutex_lock(&syncs_lock);
+  while (num_unsynced > 0 || syncs_running)
+    pthread_cond_wait(&syncs_cond, &syncs_lock);
+  pthread_mutex_unlock(&syncs_lock);
+}
+
+// Stops the sync thread, if it runs, once it synced every directory left.
+static void stop_syncs(void) {
+  if (!syncing)
+    return;
+  pthread_mutex_lock(&syncs_lock);
+  syncs_stop = true;
+  pthread_cond_broadcast(&syncs_cond);
+  pthread_mutex_unlock(&syncs_lock);
+  pthread_join(sync_thread, NULL);
+  syncing = false;
+}
+
+// Returns the path of the file of a shard.
+// @return 0 if successful, 1 if the path is too long.
+static int shard_path(char *path, size_t size, const char *directory,
+                      size_t s) {
+  int length = snprintf(path, size, "%s/shard-%zu-of-%zu.kvs", directory, s,
+                        num_shards);
+  if (length < 0 || (size_t)length >= size) {
+    fprintf(stderr, "%s: path too long\n", directory);
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_persist(const char *directory, bool load, unsigned int every_s) {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  char path[PATH_MAX];
+  uint64_t positions[KVS_MAX_SHARDS];
+  size_t loaded = 0;
+  for (size_t s = 0; s < num_shards; s++) {
+    if (shard_path(path, sizeof(path), directory, s) != 0 ||
+        table_persist(kvs_shards[s], path, load, &positions[s]) != 0)
+      return 1;
+    if (positions[s] != UINT64_MAX)
+      loaded++;
+  }
+  if (loaded != 0 && loaded != num_shards) {
+    fprintf(stderr, "%s: only %zu of %zu shards were checkpointed, starting "
+                    "them all over\n", directory, loaded, num_shards);
+    for (size_t s = 0; s < num_shards; s++) {
+      if (positions[s] == UINT64_MAX)
+        continue;
+      HashTable *empty = create_hash_table();
+      if (empty == NULL)
+        return 1;
+      free_table(kvs_shards[s]);
+      kvs_shards[s] = empty;
+      if (shard_path(path, sizeof(path), directory, s) != 0 ||
+          table_persist(empty, path, false, &positions[s]) != 0)
+        return 1;
+    }
+    loaded = 0;
+  }
+  if (loaded != 0) {
+    // Replaying the log from the oldest checkpoint on redoes changes some
+    // shards already hold, which leaves them as they were
+    persisted_position = UINT64_MAX;
+    for (size_t s = 0; s < num_shards; s++) {
+      if (positions[s] < persisted_position)
+        persisted_position = positions[s];
+    }
+    size_t pairs = 0;
+    uint64_t stripes[KVS_MAX_SHARDS];
+    lock_all_shards(stripes);
+    for (size_t s = 0; s < num_shards; s++) {
+      TableStats stats;
+      table_stats(kvs_shards[s], &stats);
+      pairs += stats.keys;
+    }
+    unlock_all_shards(stripes);
+    printf("Mapped back %zu pairs from %s, checkpointed at log position "
+           "%" PRIu64 "\n", pairs, directory, persisted_position);
+    fflush(stdout);
+  }
+  backup_mode = BACKUP_THREAD;
+
+  if (every_s > 0) {
+    checkpoint_every_s = every_s;
+    checkpoints_stop = false;
+    if (pthread_create(&checkpoint_thread, NULL, checkpoint_loop, NULL) !=
+        0) {
+      fprintf(stderr, "Failed to create the checkpoint thread\n");
+      return 1;
+    }
+    checkpointing = true;
+  }
+  return 0;
+}
+
+int kvs_persist_end(void) {
+  stop_checkpoints();
+  return kvs_checkpoint();
+}
+
+int kvs_init(size_t shards, size_t max_memory, bool intern_values,
+             BackupMode mode, BackupFormat format, size_t full_every,
+             size_t max_backup_threads, size_t backups) {
+  if (num_shards != 0) {
+    fprintf(stderr, "KVS state has already been initialized\n");
+    return 1;
+  }
+  if (shards == 0 || shards > KVS_MAX_SHARDS) {
+    fprintf(stderr, "Invalid number of shards\n");
+    return 1;
+  }
 
-  free_table(kvs_table);
-  kvs_table = NULL;
+  for (size_t s = 0; s < shards; s++) {
+    kvs_shards[s] = create_hash_table();
+    if (kvs_shards[s] != NULL && intern_values &&
+        table_intern_values(kvs_shards[s]) != 0) {
+      free_table(kvs_shards[s]);
+      kvs_shards[s] = NULL;
+    }
+    if (kvs_shards[s] == NULL) {
+      while (s-- > 0)
+        free_table(kvs_shards[s]);
+      return 1;
+    }
+  }
+  num_shards = shards;
+  shard_memory_limit = max_memory / shards;
+  if (max_memory != 0 && shard_memory_limit == 0)
+    shard_memory_limit = 1;
+  backup_mode = mode;
+  backup_format = format;
+  full_backup_every = full_every > 0 ? full_every : 1;
+  backup_threads = max_backup_threads > 0 ? max_backup_threads : 1;
+  max_backups = backups > 0 ? backups : 1;
+
+  if (expiry_init(reap_expired, MAX_WRITE_SIZE) != 0) {
+    kvs_terminate();
+    return 1;
+  }
+  syncs_stop = false;
+  if (pthread_create(&sync_thread, NULL, sync_loop, NULL) != 0) {
+    fprintf(stderr, "Failed to create backup sync thread\n");
+    kvs_terminate();
+    return 1;
+  }
+  syncing = true;
+  if (backup_mode == BACKUP_FORK) {
+    reaper_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (reaper_epoll < 0) {
+      fprintf(stderr, "Failed to create backup reaper epoll: %s\n",
+              strerror(errno));
+      kvs_terminate();
+      return 1;
+    }
+    reaper_stop = false;
+    if (pthread_create(&reaper_thread, NULL, reap_backups, NULL) != 0) {
+      fprintf(stderr, "Failed to create backup reaper thread\n");
+      close(reaper_epoll);
+      reaper_epoll = -1;
+      kvs_terminate();
+      return 1;
+    }
+    reaping = true;
+  }
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
-  if (kvs_table == NULL) {
+int kvs_terminate() {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  // The reaper deletes from the shards, so stop it before they go
+  expiry_terminate();
+  stop_checkpoints();
+  stop_reaping();
+  stop_syncs();
+  // Retired nodes go back to the table's slab pool, so free them first
+  ebr_drain();
+  for (size_t s = 0; s < num_shards; s++) {
+    free_table(kvs_shards[s]);
+    kvs_shards[s] = NULL;
+  }
+  num_shards = 0;
+  return 0;
+}
+
+// Tells the subscribers of an evicted key that it is gone.
+static void notify_evicted(const char *key, uint64_t h, void *arg) {
+  (void)arg;
+  expiry_disarm(h, key);
+  log_deletion(key);
+  if (wal_enabled()) {
+    // Evictions are made outside of any commit, so this is one of its own
+    wal_begin(mvcc_begin());
+    wal_add(key, NULL);
+    wal_commit();
+    mvcc_end();
+  }
+  stat_add(STAT_EVICTIONS, 1);
+  subscribed_keys(h, key, NULL, OP_CODE_NOTIFY_DELETE);
+}
 
+// Evicts cold pairs from a shard until it is back within its memory limit.
+// @param shard The shard, none of whose stripes may be held.
+static void enforce_memory_limit(HashTable *shard) {
+  while (table_memory(shard) > shard_memory_limit &&
+         evict_pair(shard, notify_evicted, NULL) == 0)
+    ;
+}
 
-  for (size_t i = 0; i < num_pairs; i++) {
-    
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+int kvs_write(size_t num_pairs, char *keys[], char *values[],
+              const unsigned int ttls[]) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  uint64_t hashes[MAX_WRITE_SIZE];
+  for (size_t i = 0; i < num_pairs; i++)
+    hashes[i] = hash(keys[i]);
+  size_t order[MAX_WRITE_SIZE];
+  size_t first[KVS_MAX_SHARDS + 1];
+  split_by_shard(num_pairs, hashes, order, first);
+
+  // The batch runs shard by shard, holding one shard at a time. The writes
+  // to a shard make up one commit, so a snapshot sees all of them or none.
+  // Subscribers are told once it is closed: a snapshot being taken waits for
+  // open commits, and must not wait on a notification pipe. Each commit is
+  // logged as one record (see wal.h)
+  bool changed[MAX_WRITE_SIZE];
+  uint64_t logged = 0;
+  for (size_t s = 0; s < num_shards; s++) {
+    if (first[s] == first[s + 1])
       continue;
+    HashTable *shard = kvs_shards[s];
+    uint64_t stripes = lock_shard_keys(s, order, first, hashes);
+
+    wal_begin(mvcc_begin());
+    for (size_t j = first[s]; j < first[s + 1]; j++) {
+      size_t i = order[j];
+      if (write_pair(shard, hashes[i], keys[i], values[i], &changed[i]) != 0) {
+        fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i],
+                values[i]);
+        changed[i] = false;
+        continue;
+      }
+      stat_add(STAT_WRITES, 1);
+      if (changed[i])
+        wal_add(keys[i], values[i]);
+      // A write without a TTL makes the key permanent again
+      if (ttls != NULL && ttls[i] > 0) {
+        if (expiry_arm(hashes[i], keys[i], ttls[i]) != 0)
+          fprintf(stderr, "Failed to set the TTL of key %s\n", keys[i]);
+      } else {
+        expiry_disarm(hashes[i], keys[i]);
+      }
+    }
+    uint64_t position = wal_commit();
+    if (position != 0)
+      logged = position;
+    mvcc_end();
+
+    // Subscribers only hear about writes that change the value
+    for (size_t j = first[s]; j < first[s + 1]; j++) {
+      size_t i = order[j];
+      if (changed[i])
+        subscribed_keys(hashes[i],keys[i],values[i],OP_CODE_NOTIFY_WRITE);
     }
-    //TODO: if new key to write == old key then dont notify and continue do that function 
-    subscribed_keys(keys[i],values[i],5);
-  }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+    unlock_stripes(shard, stripes);
+    if (shard_memory_limit != 0)
+      enforce_memory_limit(shard);
+  }
+  // The batch is durable once its last record is
+  wal_sync(logged);
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  if (kvs_table == NULL) {
+int kvs_expire(const char *key, unsigned int ttl_ms) {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  uint64_t h = hash(key);
+  HashTable *shard = shard_of(h);
+  uint64_t stripes = lock_hashes(shard, 1, &h, true);
+  int result = 1;
+  if (key_exists_locked(shard, h, key)) {
+    result = 0;
+    if (ttl_ms > 0)
+      result = expiry_arm(h, key, ttl_ms);
+    else
+      expiry_disarm(h, key);
+  }
+  unlock_stripes(shard, stripes);
+  return result;
+}
 
-  write_str(fd, "[");
+// Appends one "(key,value)" pair of the READ or RANGE output to the output
+// buffer passed as arg, straight from the value stored in the table.
+static void write_read_pair(const char *key, const char *value, void *arg) {
+  out_tuple(arg, key, ",", value, ")");
+}
+
+int kvs_read(size_t num_pairs, char *keys[], int fd) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  // read_pair_with is lock-free and copies nothing
+  int64_t misses = 0;
+  OutBuffer *out = out_open(fd);
+  out_str(out, "[");
   for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
-    } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+    uint64_t h = hash(keys[i]);
+    if (read_pair_with(shard_of(h), h, keys[i], write_read_pair, out) != 0) {
+      out_tuple(out, keys[i], ",", "KVSERROR", ")");
+      misses++;
     }
-    write_str(fd, aux);
-    free(result);
   }
-  write_str(fd, "]\n");
-
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  out_str(out, "]\n");
+  out_flush(out);
+  stat_add(STAT_READS, (int64_t)num_pairs);
+  stat_add(STAT_READ_MISSES, misses);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  if (kvs_table == NULL) {
+int kvs_delete(size_t num_pairs, char *keys[], int fd) {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  uint64_t hashes[MAX_WRITE_SIZE];
+  for (size_t i = 0; i < num_pairs; i++)
+    hashes[i] = hash(keys[i]);
+  size_t order[MAX_WRITE_SIZE];
+  size_t first[KVS_MAX_SHARDS + 1];
+  split_by_shard(num_pairs, hashes, order, first);
+
+  bool missing[MAX_WRITE_SIZE];
+  uint64_t logged = 0;
+  for (size_t s = 0; s < num_shards; s++) {
+    if (first[s] == first[s + 1])
+      continue;
+    HashTable *shard = kvs_shards[s];
+    uint64_t stripes = lock_shard_keys(s, order, first, hashes);
+
+    // One commit per shard, logged as one record, as in kvs_write
+    wal_begin(mvcc_begin());
+    for (size_t j = first[s]; j < first[s + 1]; j++) {
+      size_t i = order[j];
+      missing[i] = delete_pair(shard, hashes[i], keys[i]) != 0;
+      if (!missing[i]) {
+        stat_add(STAT_DELETES, 1);
+        expiry_disarm(hashes[i], keys[i]);
+        log_deletion(keys[i]);
+        wal_add(keys[i], NULL);
+      }
+    }
+    uint64_t position = wal_commit();
+    if (position != 0)
+      logged = position;
+    mvcc_end();
+
+    for (size_t j = first[s]; j < first[s + 1]; j++) {
+      size_t i = order[j];
+      if (!missing[i])
+        subscribed_keys(hashes[i],keys[i],NULL,OP_CODE_NOTIFY_DELETE);
+    }
+
+    unlock_stripes(shard, stripes);
+  }
+
+  wal_sync(logged);
 
+  // Missing keys are reported in batch order
   int aux = 0;
+  OutBuffer *out = out_open(fd);
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (missing[i]) {
       if (!aux) {
-        write_str(fd, "[");
+        out_str(out, "[");
         aux = 1;
       }
-      char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
+      out_tuple(out, keys[i], ",", "KVSMISSING", ")");
       //O pois o delete nao precisa de moistrar value
-    }else{
-      subscribed_keys(keys[i],NULL,6);
     }
   }
   if (aux) {
-    write_str(fd, "]\n");
+    out_str(out, "]\n");
   }
-  
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  out_flush(out);
   return 0;
 }
 
+// Appends one "(key, value)" line of the SHOW output to the output buffer
+// passed as arg.
+static void show_pair(const PairRef *pair, void *arg) {
+  out_tuple(arg, pair->key, ", ", pair->value, ")\n");
+}
+
 void kvs_show(int fd) {
-  if (kvs_table == NULL) {
+  if (num_shards == 0) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
+  // The table is read as of a snapshot, so writers go on meanwhile
+  OutBuffer *out = out_open(fd);
+  uint64_t tokens[KVS_MAX_SHARDS];
+  uint64_t snapshot = begin_scan(tokens);
+  foreach_sorted_pair(snapshot, NULL, NULL, false, show_pair, out);
+  end_scan(tokens);
+  out_flush(out);
+}
 
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key,
-               keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
+// Appends one "(key,value)" pair of the RANGE output to the output buffer
+// passed as arg.
+static void range_pair(const PairRef *pair, void *arg) {
+  write_read_pair(pair->key, pair->value, arg);
+}
+
+int kvs_range(const char *start, const char *end, int fd) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  OutBuffer *out = out_open(fd);
+  uint64_t tokens[KVS_MAX_SHARDS];
+  uint64_t snapshot = begin_scan(tokens);
+  out_str(out, "[");
+  foreach_sorted_pair(snapshot, start[0] ? start : NULL, end[0] ? end : NULL,
+                      true, range_pair, out);
+  end_scan(tokens);
+  out_str(out, "]\n");
+  out_flush(out);
+  return 0;
+}
+
+// Room for the STATS report, which has a fixed number of lines.
+#define STATS_REPORT_SIZE 2048
+
+// Appends a "name value" line to the STATS report.
+// @param report The report.
+// @param used Bytes of the report used so far, updated.
+// @param name Name of the figure.
+// @param value The figure.
+static void report_line(char *report, size_t *used, const char *name,
+                        int64_t value) {
+  int n = snprintf(report + *used, STATS_REPORT_SIZE - *used,
+                   "%s %" PRId64 "\n", name, value);
+  if (n < 0 || (size_t)n >= STATS_REPORT_SIZE - *used)
+    *used = STATS_REPORT_SIZE - 1; // Truncated
+  else
+    *used += (size_t)n;
+}
+
+void kvs_stats(int fd, Queue *queue) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return;
+  }
+
+  int64_t counters[STAT_COUNTERS];
+  stats_sum(counters);
+
+  // table_stats must hold every stripe: it walks the chains and slots, which
+  // writers relink and move
+  TableStats table = {0};
+  uint64_t stripes[KVS_MAX_SHARDS];
+  lock_all_shards(stripes);
+  for (size_t s = 0; s < num_shards; s++) {
+    TableStats shard;
+    table_stats(kvs_shards[s], &shard);
+    table.keys += shard.keys;
+    table.buckets += shard.buckets;
+    table.table_bytes += shard.table_bytes;
+    for (size_t c = 0; c < KVS_CHAIN_HISTOGRAM; c++)
+      table.chains[c] += shard.chains[c];
+  }
+  unlock_all_shards(stripes);
+
+  SubscriptionStats subscriptions;
+  subscription_stats(subscription_table, &subscriptions);
+
+  size_t queued = 0, capacity = 0;
+  if (queue != NULL) {
+    pthread_mutex_lock(&queue_mutex);
+    queued = queue->size;
+    capacity = queue->capacity;
+    pthread_mutex_unlock(&queue_mutex);
+  }
+
+  char report[STATS_REPORT_SIZE];
+  size_t used = 0;
+  for (int c = 0; c < STAT_COUNTERS; c++)
+    report_line(report, &used, stat_name((StatCounter)c), counters[c]);
+  report_line(report, &used, "table_buckets", (int64_t)table.buckets);
+  report_line(report, &used, "table_bytes", (int64_t)table.table_bytes);
+  // Load factor in hundredths, integer like every other figure
+  report_line(report, &used, "load_factor_pct",
+              table.buckets ? (int64_t)(table.keys * 100 / table.buckets) : 0);
+  for (size_t c = 0; c < KVS_CHAIN_HISTOGRAM; c++) {
+    char name[32];
+    snprintf(name, sizeof(name), "chains_%zu%s", c,
+             c == KVS_CHAIN_HISTOGRAM - 1 ? "_or_more" : "");
+    report_line(report, &used, name, (int64_t)table.chains[c]);
+  }
+  report_line(report, &used, "subscribed_keys", (int64_t)subscriptions.keys);
+  report_line(report, &used, "subscriptions",
+              (int64_t)subscriptions.subscriptions);
+  report_line(report, &used, "max_fanout", (int64_t)subscriptions.max_fanout);
+  report_line(report, &used, "subscription_bytes",
+              (int64_t)subscriptions.bytes);
+  report_line(report, &used, "queued_clients", (int64_t)queued);
+  report_line(report, &used, "queue_capacity", (int64_t)capacity);
+  report_line(report, &used, "queue_bytes",
+              (int64_t)(sizeof(Queue) + capacity * sizeof(QueueNode)));
+  write_str(fd, report);
+}
+
+// A backup being taken, from its snapshot on.
+// Bytes of strings a BackupCopy allocates at a time, at least.
+#define COPY_CHUNK_SIZE (1 << 20)
+
+// Strings of a BackupCopy, packed together.
+typedef struct CopyChunk {
+  struct CopyChunk *next;
+  size_t used;
+  size_t size;
+  char data[];
+} CopyChunk;
+
+// Pairs of a backup's snapshot, copied out of a table whose scans lock it
+// (see scan_locks), so that its scan can end before the backup is written.
+typedef struct BackupCopy {
+  PairRef *pairs; // In key order, pointing into chunks
+  size_t count;
+  size_t capacity;
+  CopyChunk *chunks;
+  bool failed; // Some pair could not be copied
+} BackupCopy;
+
+typedef struct Backup {
+  uint64_t snapshot;
+  // Holder of the snapshot if pinned, NULL if the thread that began the
+  // backup holds it, or it was copied (see backup_begin)
+  MvccPin *pin;
+  uint64_t tokens[KVS_MAX_SHARDS]; // See begin_scan
+  bool copied; // Whether the pairs are in copy, the scan already ended
+  BackupCopy copy;
+  uint64_t since; // Pairs written up to this version are left out (delta)
+  char **deleted; // Keys deleted since, sorted (delta)
+  size_t num_deleted;
+  size_t next_deleted; // Next of them to write
+  int fd; // Open on temp, for reading and writing
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  // Where the file is written, renamed to path once whole and synced, so
+  // that path never holds a torn backup
+  char temp[MAX_JOB_FILE_NAME_SIZE + 8];
+  // Checksum file of a text backup (see backup_text_seal), written to
+  // seal_temp and renamed to seal once the backup is in place
+  char seal[MAX_JOB_FILE_NAME_SIZE + 8];
+  char seal_temp[MAX_JOB_FILE_NAME_SIZE + 16];
+  const char *directory; // Of path, synced once renamed (see sync_loop)
+  // Output buffer of the backup thread, NULL in the forked child, which
+  // must not allocate and writes straight to fd
+  OutBuffer *out;
+  bool binary;
+  BackupWriter writer; // If binary, set up before any fork
+} Backup;
+
+// Copies a string into the chunks of a BackupCopy.
+// @return The copy, NULL if it could not be allocated.
+static const char *copy_string(BackupCopy *copy, const char *string) {
+  size_t length = strlen(string) + 1;
+  CopyChunk *chunk = copy->chunks;
+  if (chunk == NULL || chunk->size - chunk->used < length) {
+    size_t size = length > COPY_CHUNK_SIZE ? length : COPY_CHUNK_SIZE;
+    chunk = malloc(sizeof(CopyChunk) + size);
+    if (chunk == NULL)
+      return NULL;
+    chunk->next = copy->chunks;
+    chunk->used = 0;
+    chunk->size = size;
+    copy->chunks = chunk;
+  }
+  char *copied = chunk->data + chunk->used;
+  memcpy(copied, string, length);
+  chunk->used += length;
+  return copied;
+}
+
+// Adds a copy of a pair the backup passed as arg holds to its BackupCopy.
+static void copy_pair(const PairRef *pair, void *arg) {
+  Backup *backup = arg;
+  BackupCopy *copy = &backup->copy;
+  // A delta leaves the others out, see backup_pair
+  if (copy->failed || pair->version <= backup->since)
+    return;
+  if (copy->count == copy->capacity) {
+    size_t capacity = copy->capacity > 0 ? copy->capacity * 2 : 1024;
+    PairRef *pairs = realloc(copy->pairs, capacity * sizeof(PairRef));
+    if (pairs == NULL) {
+      copy->failed = true;
+      return;
     }
+    copy->pairs = pairs;
+    copy->capacity = capacity;
   }
+  PairRef *copied = &copy->pairs[copy->count];
+  copied->key = copy_string(copy, pair->key);
+  copied->value = copy_string(copy, pair->value);
+  copied->version = pair->version;
+  if (copied->key == NULL || copied->value == NULL)
+    copy->failed = true;
+  else
+    copy->count++;
+}
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+// Frees the pairs of a BackupCopy.
+static void copy_free(BackupCopy *copy) {
+  while (copy->chunks != NULL) {
+    CopyChunk *next = copy->chunks->next;
+    free(copy->chunks);
+    copy->chunks = next;
+  }
+  free(copy->pairs);
 }
 
-int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
-  pid_t pid;
-  char bck_name[50];
-  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory,
-           strtok(job_filename, "."), num_backup);
+// Index of the first pair of a BackupCopy whose key does not sort before a
+// key.
+static size_t first_copied(const BackupCopy *copy, const char *key) {
+  size_t low = 0, high = copy->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (strcmp(copy->pairs[mid].key, key) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+// Ends the scan of a backup, or frees its copy of the pairs. One whose
+// snapshot is pinned or copied can be ended from any thread.
+static void backup_end_scan(Backup *backup) {
+  if (backup->copied) {
+    copy_free(&backup->copy);
+    return;
+  }
+  if (backup->pin == NULL) {
+    end_scan(backup->tokens);
+    return;
+  }
+  mvcc_unpin(backup->pin);
+  for (size_t s = 0; s < num_shards; s++)
+    scan_end(kvs_shards[s], backup->tokens[s]);
+}
+
+// Takes the snapshot of a job's next backup and opens its file. Whether it
+// is a delta is only settled once the deletions since the last one are in.
+// @param backup Filled with the backup.
+// @param chain The backups of the job.
+// @param job Name of the job, without extension.
+// @param directory Directory of the job.
+// @param pin Whether another thread may write the backup later, while the
+// caller goes on: the snapshot is then pinned (see mvcc_pin) or, if scans
+// lock the tables (see scan_locks), its pairs copied and the scan ended
+// before returning.
+// @return 0 if successful, 1 otherwise (nothing is then held).
+static int backup_begin(Backup *backup, BackupChain *chain, const char *job,
+                        const char *directory, bool pin) {
+  size_t num_backup = ++chain->count;
+  // Opened before the first snapshot, see deletions_open
+  if (full_backup_every > 1 && !chain->logging) {
+    deletions_open(&chain->deletions);
+    chain->logging = true;
+  }
+
+  // Read first: every record before it is then of a commit the snapshot
+  // sees, so recovering from the backup replays the log from there on
+  uint64_t log_position = wal_position();
+  backup->copied = pin && scan_locks();
+  if (pin && !backup->copied) {
+    backup->snapshot = mvcc_pin(&backup->pin);
+    for (size_t s = 0; s < num_shards; s++)
+      backup->tokens[s] = scan_begin(kvs_shards[s]);
+  } else {
+    backup->pin = NULL;
+    backup->snapshot = begin_scan(backup->tokens);
+  }
+  backup->since = 0;
+  backup->deleted = NULL;
+  backup->num_deleted = 0;
+  backup->next_deleted = 0;
+  backup->out = NULL;
+  if (chain->logging) {
+    size_t count;
+    char **deleted =
+        deletions_read(&chain->deletions, backup->snapshot, &count);
+    if (chain->base != 0 && count != SIZE_MAX &&
+        (num_backup - 1) % full_backup_every != 0) {
+      backup->since = chain->base;
+      backup->deleted = deleted;
+      backup->num_deleted = count;
+    } else {
+      deletions_free(deleted, count == SIZE_MAX ? 0 : count);
+    }
+  }
+  if (backup->copied) {
+    backup->copy = (BackupCopy){NULL, 0, 0, NULL, false};
+    foreach_sorted_pair(backup->snapshot, NULL, NULL, false, copy_pair,
+                        backup);
+    end_scan(backup->tokens);
+    if (backup->copy.failed) {
+      fprintf(stderr, "Failed to copy backup pairs\n");
+      copy_free(&backup->copy);
+      deletions_free(backup->deleted, backup->num_deleted);
+      chain->base = 0;
+      return 1;
+    }
+  }
+
+  snprintf(backup->path, sizeof(backup->path), "%s/%s-%zu.%s", directory,
+           job, num_backup, backup->since != 0 ? "delta" : "bck");
+  snprintf(backup->temp, sizeof(backup->temp), "%s.tmp", backup->path);
+  snprintf(backup->seal, sizeof(backup->seal), "%s%s", backup->path,
+           BACKUP_TEXT_SEAL_SUFFIX);
+  snprintf(backup->seal_temp, sizeof(backup->seal_temp), "%s.tmp",
+           backup->seal);
+  backup->directory = directory;
+  backup->fd = open(backup->temp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (backup->fd < 0)
+    perror("Failed to open backup file");
+
+  backup->binary = backup_format == BACKUP_BINARY;
+  if (backup->fd >= 0 && backup->binary) {
+    // Sizes the index of the file, which the forked child cannot grow
+    size_t bytes = 0;
+    for (size_t s = 0; s < num_shards; s++)
+      bytes += table_memory(kvs_shards[s]);
+    uint32_t flags = backup->since != 0 ? BACKUP_FLAG_DELTA : 0;
+    if (backup_writer_open(&backup->writer, backup->fd, flags,
+                           backup->snapshot, log_position, bytes) != 0) {
+      fprintf(stderr, "Failed to start backup file\n");
+      close(backup->fd);
+      unlink(backup->temp);
+      backup->fd = -1;
+    }
+  }
+
+  if (backup->fd < 0) {
+    deletions_free(backup->deleted, backup->num_deleted);
+    backup_end_scan(backup);
+    // The next delta would have nothing to follow
+    chain->base = 0;
+    return 1;
+  }
+  chain->base = backup->snapshot;
+  return 0;
+}
+
+// Writes one entry of a backup: a pair, or the deletion of a key if value
+// is NULL. As text, "(key, value)" or "(key)".
+static void backup_entry(Backup *backup, const char *key, const char *value) {
+  if (backup->binary) {
+    backup_writer_add(&backup->writer, key, value);
+    return;
+  }
+  const char *sep = value != NULL ? ", " : "";
+  if (value == NULL)
+    value = "";
+  if (backup->out != NULL)
+    out_tuple(backup->out, key, sep, value, ")\n");
+  else
+    write_tuple(backup->fd, key, sep, value, ")\n");
+}
+
+// Writes the deleted keys of a delta that sort before a key, all that are
+// left if it is NULL. A key the snapshot has again is left out, the pair
+// takes its place.
+static void backup_deletions(Backup *backup, const char *key) {
+  while (backup->next_deleted < backup->num_deleted) {
+    const char *deleted = backup->deleted[backup->next_deleted];
+    int cmp = key == NULL ? -1 : strcmp(deleted, key);
+    if (cmp > 0)
+      break;
+    if (cmp < 0)
+      backup_entry(backup, deleted, NULL);
+    backup->next_deleted++;
+  }
+}
+
+// Writes a pair of the snapshot, if the backup holds it, and the deletions
+// before it.
+static void backup_pair(const PairRef *pair, void *arg) {
+  Backup *backup = arg;
+  backup_deletions(backup, pair->key);
+  if (pair->version > backup->since)
+    backup_entry(backup, pair->key, pair->value);
+}
+
+// Writes the entries of a backup whose keys lie in [start, end): its pairs,
+// and every deletion it has left.
+// @param start First key of the range, NULL for no lower bound.
+// @param end Bound of the range, NULL for no upper bound.
+static void backup_range(Backup *backup, const char *start,
+                         const char *end) {
+  if (backup->copied) {
+    const BackupCopy *copy = &backup->copy;
+    size_t first = start != NULL ? first_copied(copy, start) : 0;
+    for (size_t i = first; i < copy->count; i++) {
+      if (end != NULL && strcmp(copy->pairs[i].key, end) >= 0)
+        break;
+      backup_pair(&copy->pairs[i], backup);
+    }
+  } else {
+    foreach_sorted_pair(backup->snapshot, start, end, false, backup_pair,
+                        backup);
+  }
+  backup_deletions(backup, NULL);
+}
+
+// Writes the backup out. Allocates nothing if the backup has no output
+// buffer, so the forked child can call it.
+// @return 0 if successful, 1 if the binary file could not be written whole.
+static int backup_write(Backup *backup) {
+  backup_range(backup, NULL, NULL);
+  return backup->binary ? backup_writer_finish(&backup->writer) : 0;
+}
+
+// Bytes of table a backup thread is given at least: smaller tables are
+// written by fewer threads, down to one.
+#define BACKUP_SEGMENT_MIN_BYTES (8 << 20)
+
+// Keys sampled per backup thread to split the keys among them.
+#define SPLIT_SAMPLES 16
+
+// Keys sampled from the shards, copied.
+typedef struct KeySample {
+  char **keys;
+  size_t count;
+  size_t capacity;
+  bool failed; // Some key could not be copied
+} KeySample;
+
+// Adds a copy of a key to the KeySample passed as arg.
+static void sample_key(const char *key, void *arg) {
+  KeySample *sample = arg;
+  if (sample->failed)
+    return;
+  if (sample->count == sample->capacity) {
+    size_t capacity = sample->capacity > 0 ? sample->capacity * 2 : 64;
+    char **keys = realloc(sample->keys, capacity * sizeof(char *));
+    if (keys == NULL) {
+      sample->failed = true;
+      return;
+    }
+    sample->keys = keys;
+    sample->capacity = capacity;
+  }
+  char *copy = strdup(key);
+  if (copy == NULL) {
+    sample->failed = true;
+    return;
+  }
+  sample->keys[sample->count++] = copy;
+}
+
+// Frees the keys of a KeySample.
+static void free_sample(KeySample *sample) {
+  for (size_t i = 0; i < sample->count; i++)
+    free(sample->keys[i]);
+  free(sample->keys);
+}
+
+static int compare_keys(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Splits the keys of a backup into ranges holding about as many pairs each,
+// from a sample of the keys of every shard, or from its copied pairs. The
+// caller holds the scan of the backup.
+// @param backup The backup.
+// @param parts Ranges wanted.
+// @param sample Filled with the sampled keys, sorted, to free with
+// free_sample once the bounds are no longer needed.
+// @param bounds Filled with the first key of every range but the first,
+// strictly increasing, which point into the sample or the copy.
+// @return Number of ranges, at most parts; 1 if the keys are too few to
+// split, or the sample could not be taken.
+static size_t split_keys(const Backup *backup, size_t parts,
+                         KeySample *sample, const char *bounds[]) {
+  *sample = (KeySample){NULL, 0, 0, false};
+  size_t count = backup->copy.count;
+  if (!backup->copied) {
+    for (size_t s = 0; s < num_shards; s++)
+      sample_keys(kvs_shards[s], parts * SPLIT_SAMPLES / num_shards + 1,
+                  sample_key, sample);
+    if (sample->failed)
+      return 1;
+    qsort(sample->keys, sample->count, sizeof(char *), compare_keys);
+    count = sample->count;
+  }
+  if (count == 0)
+    return 1;
+
+  size_t ranges = 1;
+  for (size_t p = 1; p < parts; p++) {
+    size_t i = p * count / parts;
+    const char *key =
+        backup->copied ? backup->copy.pairs[i].key : sample->keys[i];
+    if (ranges == 1 || strcmp(key, bounds[ranges - 2]) > 0)
+      bounds[ranges++ - 1] = key;
+  }
+  return ranges;
+}
+
+// Index of the first of a backup's deleted keys that does not sort before
+// a key.
+static size_t first_deleted(const Backup *backup, const char *key) {
+  size_t low = 0, high = backup->num_deleted;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (strcmp(backup->deleted[mid], key) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+// Range of the keys of a backup one of its threads writes, to a file of its
+// own but for the first one, which writes to the backup file.
+typedef struct BackupSegment {
+  Backup backup; // A copy of the backup, with its own file, buffer and
+                 // deletions
+  const char *start;
+  const char *end; // Not in the range
+  pthread_t thread;
+  bool started; // Whether it runs in a thread of its own
+  int result;
+} BackupSegment;
+
+// Writes a segment of a backup, ending it on a block if binary.
+// @param arg The BackupSegment.
+static void *segment_thread(void *arg) {
+  BackupSegment *segment = arg;
+  Backup *backup = &segment->backup;
+  if (!backup->binary)
+    backup->out = out_open(backup->fd);
+  backup_range(backup, segment->start, segment->end);
+  if (backup->binary) {
+    segment->result = backup_writer_end_segment(&backup->writer);
+  } else {
+    out_flush(backup->out);
+    segment->result = 0;
+  }
+  return NULL;
+}
+
+// Closes the files of the segments of a backup but the first, and frees
+// their writers.
+static void free_segments(BackupSegment segments[], size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    if (segments[i].backup.binary)
+      backup_writer_free(&segments[i].backup.writer);
+    close(segments[i].backup.fd);
+  }
+}
+
+// Opens a file for a segment of a backup, next to the backup file and
+// unlinked right away: it is only read back to append it.
+// @return The file descriptor, -1 on failure.
+static int open_segment_file(const Backup *backup) {
+  char path[MAX_JOB_FILE_NAME_SIZE + 16];
+  snprintf(path, sizeof(path), "%s.partXXXXXX", backup->path);
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("Failed to open backup segment");
+    return -1;
+  }
+  unlink(path);
+  return fd;
+}
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  pid = fork();
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+// Sets up a segment of a backup.
+// @return 0 if successful, 1 otherwise (nothing is then held).
+static int segment_begin(BackupSegment *segment, const Backup *backup,
+                         size_t index, size_t bytes) {
+  segment->backup = *backup;
+  segment->started = false;
+  segment->result = 0;
+  if (index == 0)
+    return 0;
+  segment->backup.fd = open_segment_file(backup);
+  if (segment->backup.fd < 0)
+    return 1;
+  if (backup->binary &&
+      backup_writer_open_segment(&segment->backup.writer,
+                                 segment->backup.fd, bytes) != 0) {
+    close(segment->backup.fd);
+    return 1;
+  }
+  return 0;
+}
+
+// Writes a backup out from a backup thread (BACKUP_THREAD). A large one is
+// split among up to backup_threads threads, each writing a range of its keys
+// to a segment, and the segments are then appended to the backup file, in
+// order.
+// @return 0 if successful, 1 if the file could not be written whole.
+static int backup_write_threads(Backup *backup) {
+  size_t bytes = 0;
+  for (size_t s = 0; s < num_shards; s++)
+    bytes += table_memory(kvs_shards[s]);
+  size_t parts = 1 + bytes / BACKUP_SEGMENT_MIN_BYTES;
+  if (parts > backup_threads)
+    parts = backup_threads;
+
+  KeySample sample = {NULL, 0, 0, false};
+  const char *bounds[KVS_MAX_BACKUP_THREADS];
+  size_t count = parts > 1 ? split_keys(backup, parts, &sample, bounds) : 1;
+  BackupSegment segments[KVS_MAX_BACKUP_THREADS];
+  for (size_t i = 0; i < count; i++) {
+    if (segment_begin(&segments[i], backup, i, bytes) != 0) {
+      free_segments(segments, i);
+      count = 1;
+      break;
+    }
+    segments[i].start = i > 0 ? bounds[i - 1] : NULL;
+    segments[i].end = i + 1 < count ? bounds[i] : NULL;
+    size_t first = i > 0 ? first_deleted(backup, segments[i].start) : 0;
+    size_t last = i + 1 < count ? first_deleted(backup, segments[i].end)
+                                : backup->num_deleted;
+    segments[i].backup.deleted = backup->deleted + first;
+    segments[i].backup.num_deleted = last - first;
+  }
+  if (count == 1) {
+    free_sample(&sample);
+    // The binary writer has a buffer of its own
+    if (!backup->binary)
+      backup->out = out_open(backup->fd);
+    int result = backup_write(backup);
+    if (!backup->binary)
+      out_flush(backup->out);
+    return result;
+  }
+
+  for (size_t i = 1; i < count; i++)
+    segments[i].started = pthread_create(&segments[i].thread, NULL,
+                                         segment_thread, &segments[i]) == 0;
+  segment_thread(&segments[0]);
+  for (size_t i = 1; i < count; i++) {
+    if (segments[i].started)
+      pthread_join(segments[i].thread, NULL);
+    else
+      segment_thread(&segments[i]);
+  }
+  free_sample(&sample);
+
+  // The first segment wrote on from where the header ended
+  if (backup->binary)
+    backup->writer = segments[0].backup.writer;
+  int result = segments[0].result;
+  for (size_t i = 1; i < count; i++) {
+    bool failed = segments[i].result != 0 ||
+                  append_file(backup->fd, segments[i].backup.fd) != 0;
+    if (backup->binary)
+      backup_writer_join(&backup->writer, &segments[i].backup.writer,
+                         failed);
+    else if (failed)
+      result = 1;
+  }
+  free_segments(segments, count);
+  if (backup->binary)
+    result = backup_writer_finish(&backup->writer);
+  return result;
+}
+
+// Lets go of what a backup holds: its snapshot, file and buffers.
+static void backup_release(Backup *backup) {
+  backup_end_scan(backup);
+  if (backup->binary)
+    backup_writer_free(&backup->writer);
+  close(backup->fd);
+  deletions_free(backup->deleted, backup->num_deleted);
+}
+
+// Writes the checksum file of a text backup to its temporary name, and
+// syncs it. Only calls async signal safe functions.
+// @return 0 if successful, 1 otherwise (the file is then removed).
+static int backup_seal(Backup *backup) {
+  int seal_fd =
+      open(backup->seal_temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (seal_fd < 0)
+    return 1;
+  int result = backup_text_seal(backup->fd, seal_fd) != 0 ||
+               fsync(seal_fd) != 0;
+  if (close(seal_fd) != 0)
+    result = 1;
+  if (result != 0)
+    unlink(backup->seal_temp);
+  return result;
+}
+
+// Gives a written backup its name: seals a text one (see backup_seal),
+// syncs the file and renames it into place, then its checksum file. The
+// checksum file of an older backup of that name is removed first, so that a
+// crash in between leaves a backup without checksum, never one that fails
+// its check. The file is removed if it could not be written whole. Only
+// calls async signal safe functions, so the forked child can call it.
+// @param written Result of writing the file.
+// @return 0 if the backup was renamed into place, 1 otherwise.
+static int backup_publish(Backup *backup, int written) {
+  int result = written;
+  bool sealed = false;
+  if (result == 0 && !backup->binary) {
+    result = backup_seal(backup);
+    sealed = result == 0;
+  }
+  if (result == 0 && fsync(backup->fd) != 0)
+    result = 1;
+  if (result == 0 && unlink(backup->seal) != 0 && errno != ENOENT)
+    result = 1;
+  if (result == 0 && rename(backup->temp, backup->path) != 0)
+    result = 1;
+  if (result != 0) {
+    unlink(backup->temp);
+    if (sealed)
+      unlink(backup->seal_temp);
+    return result;
+  }
+  // The backup is whole without it, and only goes unchecked
+  if (sealed && rename(backup->seal_temp, backup->seal) != 0)
+    unlink(backup->seal_temp);
+  return 0;
+}
+
+// Writes out a backup begun earlier from the calling thread, and lets go of
+// it.
+static void backup_run(Backup *backup) {
+  if (backup_publish(backup, backup_write_threads(backup)) == 0)
+    sync_later(backup->directory);
+  else
+    fprintf(stderr, "Failed to write backup file\n");
+  backup_release(backup);
+}
+
+// Opens a pidfd of a child, which the C library has no wrapper for.
+// @return The pidfd, or -1 on error.
+static int open_pidfd(pid_t pid) {
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Waits for a backup child to exit, and marks it as exited.
+// @param child The child, which is not in forked_children yet, or is only
+// there for the reaper to take off.
+static void wait_backup_child(ForkedBackup *child) {
+  siginfo_t info;
+  info.si_pid = 0;
+  int result;
+  do {
+    result = waitid(P_PID, (id_t)child->pid, &info, WEXITED);
+  } while (result != 0 && errno == EINTR);
+  if (result != 0) {
+    // Not a child of ours any more: count it as ended all the same
+    fprintf(stderr, "Failed to wait for backup child %d: %s\n",
+            (int)child->pid, strerror(errno));
+  } else {
+    // The child renamed the backup into place if it exited with 0
+    child->published = info.si_code == CLD_EXITED && info.si_status == 0;
+  }
+  child->exited = true;
+}
+
+// Forks the child that writes out a backup begun earlier (BACKUP_FORK), and
+// lets go of the backup in the parent.
+// @return 0 if the child was forked, 1 otherwise (the backup is then left
+// as is).
+static int backup_fork(Backup *backup) {
+  // The child walks the snapshot of the backup, whatever the writers were
+  // doing when it forked. Registering with EBR up front spares it the
+  // allocation of doing so on its first scan, as running crc32c does for
+  // sealing the file
+  ForkedBackup *child = malloc(sizeof(ForkedBackup));
+  if (child == NULL)
+    return 1;
+  crc32c(0, NULL, 0);
+  ebr_enter();
+  pid_t pid = fork();
+  ebr_exit();
   if (pid == 0) {
     // functions used here have to be async signal safe, since this
     // fork happens in a multi thread context (see man fork)
-    int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-      KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-      while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
-        aux[0] = '(';
-        size_t num_bytes_copied = 1; // the "("
-        // the - 1 are all to leave space for the '/0'
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->key,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ", ",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->value,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ")\n",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        aux[num_bytes_copied] = '\0';
-        write_str(fd, aux);
-        keyNode = keyNode->next; // Move to the next node of the list
+    if (backup_publish(backup, backup_write(backup)) != 0) {
+      write_str(STDERR_FILENO, "Failed to write backup file\n");
+      exit(1);
+    }
+    exit(0);
+  }
+  if (pid < 0) {
+    free(child);
+    return 1;
+  }
+  backup_release(backup);
+
+  child->pid = pid;
+  child->directory = backup->directory;
+  child->exited = false;
+  child->published = false;
+  child->pidfd = open_pidfd(pid);
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = child};
+  if (child->pidfd < 0 ||
+      epoll_ctl(reaper_epoll, EPOLL_CTL_ADD, child->pidfd, &event) != 0) {
+    // The reaper cannot tell when it exits, so it is waited for here, and
+    // taken off the list along with the next child to exit
+    fprintf(stderr, "Failed to watch backup child %d, waiting for it: %s\n",
+            (int)pid, strerror(errno));
+    if (child->pidfd >= 0)
+      close(child->pidfd);
+    child->pidfd = -1;
+    wait_backup_child(child);
+  }
+  pthread_mutex_lock(&backups_lock);
+  child->next = forked_children;
+  forked_children = child;
+  forked_backups++;
+  pthread_cond_broadcast(&backups_cond);
+  pthread_mutex_unlock(&backups_lock);
+  return 0;
+}
+
+// A backup waiting for a slot, begun with its snapshot pinned.
+struct PendingBackup {
+  Backup backup;
+  PendingBackup *next;
+};
+
+// Writes out a pending backup (BACKUP_THREAD).
+// @param arg The PendingBackup, freed once done.
+static void *pending_thread(void *arg);
+
+// Starts writing a pending backup, which has been given a slot.
+// @return 0 if it was started, 1 otherwise (it is then left as is).
+static int start_pending(PendingBackup *pending) {
+  if (backup_mode == BACKUP_FORK) {
+    if (backup_fork(&pending->backup) != 0)
+      return 1;
+    free(pending);
+    return 0;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, pending_thread, pending) != 0)
+    return 1;
+  pthread_detach(thread);
+  return 0;
+}
+
+// Counts a backup as ended, and hands its slot to the oldest pending one,
+// if any. Ended means written by its thread, or its child reaped.
+static void backup_ended(void) {
+  while (1) {
+    pthread_mutex_lock(&backups_lock);
+    PendingBackup *next = pending_first;
+    if (next != NULL) {
+      pending_first = next->next;
+      if (pending_first == NULL)
+        pending_last = NULL;
+    } else {
+      running_backups--;
+      pthread_cond_broadcast(&backups_cond);
+    }
+    pthread_mutex_unlock(&backups_lock);
+
+    if (next == NULL || start_pending(next) == 0)
+      return;
+    // Written here instead, since the next delta of its job may follow it;
+    // which ends it all the same
+    fprintf(stderr, "Failed to start backup, writing it in place\n");
+    backup_run(&next->backup);
+    free(next);
+  }
+}
+
+static void *pending_thread(void *arg) {
+  PendingBackup *pending = arg;
+  backup_run(&pending->backup);
+  free(pending);
+  backup_ended();
+  return NULL;
+}
+
+// Reaps the forked backup children as they exit (BACKUP_FORK), so that
+// their slots go to the pending backups. The reaper blocks on the pidfds of
+// the children in forked_children, and waits for those by pid, so that any
+// other child of the process is left to whoever forked it.
+static void *reap_backups(void *arg) {
+  (void)arg;
+  while (1) {
+    pthread_mutex_lock(&backups_lock);
+    while (forked_backups == 0 && !reaper_stop)
+      pthread_cond_wait(&backups_cond, &backups_lock);
+    if (forked_backups == 0) {
+      pthread_mutex_unlock(&backups_lock);
+      return NULL;
+    }
+    ForkedBackup *reaped = NULL;
+    ForkedBackup **link = &forked_children;
+    while (*link != NULL) {
+      ForkedBackup *child = *link;
+      if (!child->exited) {
+        link = &child->next;
+        continue;
       }
+      *link = child->next;
+      child->next = reaped;
+      reaped = child;
+      forked_backups--;
     }
-    exit(1);
-  } else if (pid < 0) {
+    pthread_mutex_unlock(&backups_lock);
+
+    if (reaped == NULL) {
+      // Children are only taken off the list here, so those the events
+      // point to are still there. Children forked meanwhile are added to
+      // the epoll instance as they are, and wake it all the same
+      struct epoll_event events[BACKUP_REAP_EVENTS];
+      int ready = epoll_wait(reaper_epoll, events, BACKUP_REAP_EVENTS, -1);
+      if (ready < 0 && errno != EINTR) {
+        fprintf(stderr, "Failed to wait for backup children: %s\n",
+                strerror(errno));
+        return NULL;
+      }
+      for (int i = 0; i < ready; i++) {
+        ForkedBackup *child = events[i].data.ptr;
+        // Later children hold the pidfd too, so closing it is not enough
+        // to take it off the epoll instance
+        epoll_ctl(reaper_epoll, EPOLL_CTL_DEL, child->pidfd, NULL);
+        close(child->pidfd);
+        child->pidfd = -1;
+        wait_backup_child(child);
+      }
+    }
+    while (reaped != NULL) {
+      ForkedBackup *child = reaped;
+      reaped = child->next;
+      if (child->published)
+        sync_later(child->directory);
+      free(child);
+      backup_ended();
+    }
+  }
+}
+
+// Stops the reaper, once every child forked was reaped.
+static void stop_reaping(void) {
+  if (!reaping)
+    return;
+  pthread_mutex_lock(&backups_lock);
+  reaper_stop = true;
+  pthread_cond_broadcast(&backups_cond);
+  pthread_mutex_unlock(&backups_lock);
+  pthread_join(reaper_thread, NULL);
+  close(reaper_epoll);
+  reaper_epoll = -1;
+  reaping = false;
+}
+
+// Handed to a backup thread by kvs_backup, which waits for started.
+typedef struct BackupTask {
+  BackupChain *chain;
+  const char *job;
+  const char *directory;
+  bool started; // Set once the thread holds its snapshot, or failed to
+  int result;   // Result of backup_begin
+} BackupTask;
+
+// Writes a backup from a snapshot of the table (BACKUP_THREAD).
+// @param arg The BackupTask, which lives only until started is set.
+static void *backup_thread(void *arg) {
+  BackupTask *task = arg;
+  Backup backup;
+  int result =
+      backup_begin(&backup, task->chain, task->job, task->directory, false);
+  pthread_mutex_lock(&backups_lock);
+  task->result = result;
+  task->started = true;
+  pthread_cond_broadcast(&backups_cond);
+  pthread_mutex_unlock(&backups_lock);
+
+  if (result == 0)
+    backup_run(&backup);
+  // Even a failed one, which held a slot all the same
+  backup_ended();
+  return NULL;
+}
+
+// Starts a backup thread, returning once it holds its snapshot, so the
+// backup has every write made before the call. The backup holds a slot.
+// @return 0 if the backup was started, -1 otherwise.
+static int start_backup_thread(BackupChain *chain, const char *job,
+                               const char *directory) {
+  BackupTask task = {chain, job, directory, false, 0};
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, backup_thread, &task) != 0) {
+    fprintf(stderr, "Failed to create backup thread\n");
+    backup_ended();
+    return -1;
+  }
+  pthread_detach(thread);
+
+  pthread_mutex_lock(&backups_lock);
+  while (!task.started)
+    pthread_cond_wait(&backups_cond, &backups_lock);
+  pthread_mutex_unlock(&backups_lock);
+  return task.result == 0 ? 0 : -1;
+}
+
+// Begins a backup that has no slot yet, with its snapshot pinned or its
+// pairs copied (see backup_begin), and queues it; or starts it, if a slot
+// freed up meanwhile.
+// @return 0 if the backup was queued or started, -1 otherwise.
+static int queue_backup(BackupChain *chain, const char *job,
+                        const char *directory) {
+  PendingBackup *pending = malloc(sizeof(PendingBackup));
+  if (pending == NULL) {
+    perror("Failed to queue backup");
     return -1;
   }
+  if (backup_begin(&pending->backup, chain, job, directory, true) != 0) {
+    free(pending);
+    return -1;
+  }
+  pending->next = NULL;
+
+  pthread_mutex_lock(&backups_lock);
+  bool start = running_backups < max_backups;
+  if (start) {
+    running_backups++;
+  } else if (pending_last != NULL) {
+    pending_last->next = pending;
+    pending_last = pending;
+  } else {
+    pending_first = pending_last = pending;
+  }
+  pthread_mutex_unlock(&backups_lock);
+
+  if (start && start_pending(pending) != 0) {
+    fprintf(stderr, "Failed to start backup, writing it in place\n");
+    backup_run(&pending->backup);
+    free(pending);
+    backup_ended();
+  }
   return 0;
 }
 
+int kvs_backup(BackupChain *chain, char *job_filename, char *directory) {
+  char *saveptr;
+  const char *job = strtok_r(job_filename, ".", &saveptr);
+
+  // Past max_backups, a backup waits for a slot, so the job goes on: with
+  // its snapshot pinned, or its pairs copied if scans lock the tables
+  pthread_mutex_lock(&backups_lock);
+  bool queue = running_backups >= max_backups;
+  if (!queue)
+    running_backups++;
+  pthread_mutex_unlock(&backups_lock);
+  if (queue)
+    return queue_backup(chain, job, directory);
+
+  if (backup_mode == BACKUP_THREAD)
+    return start_backup_thread(chain, job, directory);
+  Backup backup;
+  if (backup_begin(&backup, chain, job, directory, false) != 0) {
+    backup_ended();
+    return -1;
+  }
+  if (backup_fork(&backup) != 0) {
+    backup_release(&backup);
+    unlink(backup.temp);
+    // The next delta would have nothing to follow
+    chain->base = 0;
+    backup_ended();
+    return -1;
+  }
+  return 0;
+}
+
+void kvs_backup_chain_end(BackupChain *chain) {
+  if (chain->logging)
+    deletions_close(&chain->deletions);
+  chain->logging = false;
+}
+
+// Threads kvs_restore inserts with, at most.
+#define RESTORE_MAX_THREADS 16
+
+// A restore in progress, shared by its threads.
+typedef struct Restore {
+  BackupImage image;
+  atomic_size_t next_block; // Next block a thread may claim
+  atomic_bool failed;       // Some block was corrupt, the others are skipped
+} Restore;
+
+// Pairs of a restore thread waiting to be inserted, a batch at a time. The
+// strings lie in the mapped file.
+typedef struct RestoreBatch {
+  char *keys[MAX_WRITE_SIZE];
+  char *values[MAX_WRITE_SIZE];
+  size_t count;
+} RestoreBatch;
+
+// Inserts the pairs of a batch.
+static void restore_flush(RestoreBatch *batch) {
+  if (batch->count > 0)
+    kvs_write(batch->count, batch->keys, batch->values, NULL);
+  batch->count = 0;
+}
+
+// Adds a pair of the backup to the batch of the thread. Full backups hold
+// no deletions, so value is never NULL.
+static void restore_pair(const char *key, const char *value, void *arg) {
+  RestoreBatch *batch = arg;
+  batch->keys[batch->count] = (char *)key;
+  batch->values[batch->count] = (char *)value;
+  if (++batch->count == MAX_WRITE_SIZE)
+    restore_flush(batch);
+}
+
+// Claims blocks of the backup and inserts their pairs until none are left.
+// @param arg The Restore.
+static void *restore_thread(void *arg) {
+  Restore *restore = arg;
+  RestoreBatch batch;
+  batch.count = 0;
+  while (!atomic_load(&restore->failed)) {
+    size_t block = atomic_fetch_add(&restore->next_block, 1);
+    if (block >= restore->image.num_blocks)
+      break;
+    if (backup_block_foreach(&restore->image, block, restore_pair, &batch) !=
+        0)
+      atomic_store(&restore->failed, true);
+    restore_flush(&batch);
+  }
+  return NULL;
+}
+
+// Seconds elapsed since a time read from CLOCK_MONOTONIC.
+static double seconds_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Maps a whole file for reading. Errors are reported on stderr.
+// @param path Path of the file.
+// @param size Set to its size.
+// @return The file, NULL on failure or if it is empty.
+static void *map_file(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  *size = (size_t)st.st_size;
+  void *data = MAP_FAILED;
+  if (*size > 0)
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    if (*size > 0)
+      perror(path);
+    else
+      fprintf(stderr, "%s: empty file\n", path);
+    return NULL;
+  }
+  return data;
+}
+
+// Restores a full binary backup, see kvs_restore.
+// @param path Path of the backup.
+// @param snapshot If not NULL, set to the snapshot the backup holds.
+// @param log_position If not NULL, set to the log position it records.
+// @return 0 if every pair was restored, 1 otherwise.
+static int restore_backup(const char *path, uint64_t *snapshot,
+                          uint64_t *log_position) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t size;
+  void *data = map_file(path, &size);
+  if (data == NULL)
+    return 1;
+  // Blocks are read in about file order, by several threads: have the
+  // kernel read ahead of all of them
+  posix_madvise(data, size, POSIX_MADV_WILLNEED);
+
+  Restore restore;
+  atomic_init(&restore.next_block, 0);
+  atomic_init(&restore.failed, false);
+  int result = backup_image_open(&restore.image, path, data, size);
+  if (result == 0 && (restore.image.flags & BACKUP_FLAG_DELTA)) {
+    fprintf(stderr, "%s: a delta, fold it into its full backup with "
+                    "kvs_compact first\n", path);
+    backup_image_close(&restore.image);
+    result = 1;
+  }
+  if (result == 0) {
+    // Keys spread evenly over the shards. A shard that cannot be sized
+    // up front only resizes on the way
+    size_t keys = (size_t)restore.image.entries / num_shards;
+    for (size_t s = 0; s < num_shards; s++)
+      table_reserve(kvs_shards[s], keys + keys / 16);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num_threads = cpus > 0 ? (size_t)cpus : 1;
+    if (num_threads > RESTORE_MAX_THREADS)
+      num_threads = RESTORE_MAX_THREADS;
+    if (num_threads > restore.image.num_blocks)
+      num_threads = restore.image.num_blocks;
+    pthread_t threads[RESTORE_MAX_THREADS];
+    size_t started = 0;
+    // The calling thread is one of them
+    while (started + 1 < num_threads &&
+           pthread_create(&threads[started], NULL, restore_thread,
+                          &restore) == 0)
+      started++;
+    restore_thread(&restore);
+    for (size_t t = 0; t < started; t++)
+      pthread_join(threads[t], NULL);
+
+    if (atomic_load(&restore.failed))
+      result = 1;
+    else
+      printf("Restored %zu pairs from %s in %.2f s\n",
+             (size_t)restore.image.entries, path, seconds_since(&start));
+    if (snapshot != NULL)
+      *snapshot = restore.image.snapshot;
+    if (log_position != NULL)
+      *log_position = restore.image.log_position;
+    backup_image_close(&restore.image);
+  }
+  munmap(data, size);
+  return result;
+}
+
+int kvs_restore(const char *path) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  return restore_backup(path, NULL, NULL);
+}
+
+// Threads kvs_recover replays the log with, at most. Each owns the keys of
+// some stripes, so there can be no more of them.
+#define REPLAY_MAX_THREADS KVS_LOCK_STRIPES
+
+// Changes a replay thread makes between checks of the memory limit.
+#define REPLAY_BATCH 256
+
+// A change read from the log. The strings lie in the mapped log.
+typedef struct Change {
+  const char *key;
+  const char *value; // NULL for a deletion
+} Change;
+
+typedef struct ChangeList {
+  Change *changes;
+  size_t count;
+  size_t capacity;
+} ChangeList;
+
+// A replay in progress, shared by its threads. It runs in two phases, each
+// with one task per thread: every thread first reads a range of records,
+// sorting their changes by the thread that owns their key, then makes the
+// changes to its keys, range by range, so in log order.
+typedef struct Replay {
+  WalImage image;
+  uint64_t snapshot; // Commits up to it are in the backup restored
+  size_t num_threads;
+  // num_threads lists per range of records, one per owner
+  ChangeList *lists;
+  atomic_size_t garbled;  // First record found garbled, num_records if none
+  atomic_uint_fast64_t last_version; // Of the records read
+  atomic_size_t done;     // Records read, then changes made, for progress
+  atomic_bool failed;     // Out of memory
+  pthread_mutex_t lock;
+  pthread_cond_t finished_cond; // Signaled as tasks finish
+  size_t finished;              // Tasks finished in the current phase
+} Replay;
+
+typedef struct ReplayTask {
+  Replay *replay;
+  size_t index;
+  uint64_t last_version;
+} ReplayTask;
+
+// Thread that owns a key: its stripe decides, so no two threads ever want
+// the same stripe.
+static inline size_t change_owner(const Replay *replay, uint64_t h) {
+  return (size_t)(h & (KVS_LOCK_STRIPES - 1)) % replay->num_threads;
+}
+
+// First record of a range of the log.
+static inline size_t range_start(const Replay *replay, size_t range) {
+  return replay->image.num_records * range / replay->num_threads;
+}
+
+// Sorts a change read from the log into the list of its owner, unless the
+// backup restored already holds it.
+static void sort_change(uint64_t version, const char *key, const char *value,
+                        void *arg) {
+  ReplayTask *task = arg;
+  Replay *replay = task->replay;
+  if (version > task->last_version)
+    task->last_version = version;
+  if (version <= replay->snapshot)
+    return;
+  size_t owner = change_owner(replay, hash(key));
+  ChangeList *list = &replay->lists[task->index * replay->num_threads + owner];
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+    Change *grown = realloc(list->changes, capacity * sizeof(Change));
+    if (grown == NULL) {
+      atomic_store(&replay->failed, true);
+      return;
+    }
+    list->changes = grown;
+    list->capacity = capacity;
+  }
+  list->changes[list->count++] = (Change){key, value};
+}
+
+// Tells the thread running a phase that a task of it finished.
+static void task_finished(Replay *replay) {
+  pthread_mutex_lock(&replay->lock);
+  replay->finished++;
+  pthread_cond_signal(&replay->finished_cond);
+  pthread_mutex_unlock(&replay->lock);
+}
+
+// First phase: reads the records of a range, up to the first garbled one.
+// @param arg The ReplayTask.
+static void *read_records(void *arg) {
+  ReplayTask *task = arg;
+  Replay *replay = task->replay;
+  size_t end = range_start(replay, task->index + 1);
+  size_t read = 0;
+  for (size_t r = range_start(replay, task->index); r < end; r++) {
+    // Past a garbled record, nothing is replayed
+    if (r > atomic_load(&replay->garbled) || atomic_load(&replay->failed))
+      break;
+    if (wal_record_foreach(&replay->image, r, sort_change, task) != 0) {
+      size_t garbled = atomic_load(&replay->garbled);
+      while (r < garbled &&
+             !atomic_compare_exchange_weak(&replay->garbled, &garbled, r))
+        ;
+      break;
+    }
+    if (++read == 1024) {
+      atomic_fetch_add(&replay->done, read);
+      read = 0;
+    }
+  }
+  atomic_fetch_add(&replay->done, read);
+  uint64_t last = atomic_load(&replay->last_version);
+  while (last < task->last_version &&
+         !atomic_compare_exchange_weak(&replay->last_version, &last,
+                                       task->last_version))
+    ;
+  task_finished(replay);
+  return NULL;
+}
+
+// Makes a change to a key the calling thread owns, in a commit of its own.
+// The commit is opened once the stripe is held, like kvs_write does, since
+// mvcc_snapshot waits for it.
+// @return 0 if successful, 1 otherwise.
+static int replay_change(const Change *change) {
+  uint64_t h = hash(change->key);
+  HashTable *shard = shard_of(h);
+  uint64_t stripes = lock_hashes(shard, 1, &h, true);
+  mvcc_begin();
+  int result = 0;
+  if (change->value != NULL)
+    result = write_pair(shard, h, change->key, change->value, NULL);
+  else if (delete_pair(shard, h, change->key) == 0)
+    log_deletion(change->key);
+  mvcc_end();
+  unlock_stripes(shard, stripes);
+  return result;
+}
+
+// Second phase: makes the changes to the keys a thread owns, range by
+// range, checking the memory limit after each batch.
+// @param arg The ReplayTask.
+static void *replay_changes(void *arg) {
+  ReplayTask *task = arg;
+  Replay *replay = task->replay;
+  size_t garbled = atomic_load(&replay->garbled);
+  for (size_t range = 0; range < replay->num_threads; range++) {
+    // Ranges past the garbled record were read, or not, for nothing
+    if (range_start(replay, range) > garbled)
+      break;
+    ChangeList *list =
+        &replay->lists[range * replay->num_threads + task->index];
+    for (size_t i = 0; i < list->count && !atomic_load(&replay->failed);
+         i += REPLAY_BATCH) {
+      size_t end = i + REPLAY_BATCH < list->count ? i + REPLAY_BATCH
+                                                  : list->count;
+      for (size_t j = i; j < end; j++) {
+        if (replay_change(&list->changes[j]) != 0)
+          atomic_store(&replay->failed, true);
+      }
+      if (shard_memory_limit != 0) {
+        for (size_t s = 0; s < num_shards; s++)
+          enforce_memory_limit(kvs_shards[s]);
+      }
+      atomic_fetch_add(&replay->done, end - i);
+    }
+  }
+  task_finished(replay);
+  return NULL;
+}
+
+// Runs a phase of a replay, one task per thread, reporting its progress on
+// stdout every second meanwhile.
+// @param replay The replay.
+// @param phase Function of the phase.
+// @param what What the phase goes through, for progress.
+// @param total How many of them there are.
+static void replay_phase(Replay *replay, void *(*phase)(void *),
+                         const char *what, size_t total) {
+  ReplayTask tasks[REPLAY_MAX_THREADS];
+  pthread_t threads[REPLAY_MAX_THREADS];
+  bool started[REPLAY_MAX_THREADS];
+  atomic_store(&replay->done, 0);
+  replay->finished = 0;
+  for (size_t t = 0; t < replay->num_threads; t++) {
+    tasks[t] = (ReplayTask){replay, t, 0};
+    started[t] = pthread_create(&threads[t], NULL, phase, &tasks[t]) == 0;
+  }
+  // Tasks no thread could be started for are run here
+  for (size_t t = 0; t < replay->num_threads; t++) {
+    if (!started[t])
+      phase(&tasks[t]);
+  }
+
+  pthread_mutex_lock(&replay->lock);
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec++;
+  while (replay->finished < replay->num_threads) {
+    if (pthread_cond_timedwait(&replay->finished_cond, &replay->lock,
+                               &deadline) == ETIMEDOUT) {
+      size_t done = atomic_load(&replay->done);
+      printf("Recovery: %zu of %zu %s (%zu%%)\n", done, total, what,
+             total > 0 ? done * 100 / total : 100);
+      fflush(stdout);
+      deadline.tv_sec++;
+    }
+  }
+  pthread_mutex_unlock(&replay->lock);
+  for (size_t t = 0; t < replay->num_threads; t++) {
+    if (started[t])
+      pthread_join(threads[t], NULL);
+  }
+}
+
+// Looks for the backup to recover from: of the full binary backups in a
+// directory that record a position of the log, the one with the latest
+// snapshot. Backups a crash left unfinished fail to open, and are passed
+// over.
+// @param directory The directory.
+// @param log_size Size of the log, which positions must be within.
+// @param path Filled with the path of the backup.
+// @param size Room in path.
+// @return 0 if one was found, 1 otherwise.
+static int find_backup(const char *directory, size_t log_size, char *path,
+                       size_t size) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    perror(directory);
+    return 1;
+  }
+  uint64_t latest = 0;
+  bool found = false;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t len = strlen(entry->d_name);
+    if (len < 4 || strcmp(entry->d_name + len - 4, ".bck") != 0)
+      continue;
+    char candidate[PATH_MAX];
+    if (snprintf(candidate, sizeof(candidate), "%s/%s", directory,
+                 entry->d_name) >= (int)sizeof(candidate))
+      continue;
+    size_t file_size;
+    void *data = map_file(candidate, &file_size);
+    if (data == NULL)
+      continue;
+    BackupImage image;
+    if (backup_is_binary(data, file_size) &&
+        backup_image_open(&image, candidate, data, file_size) == 0) {
+      if (!(image.flags & BACKUP_FLAG_DELTA) && image.log_position != 0 &&
+          image.log_position <= log_size &&
+          (!found || image.snapshot > latest) &&
+          strlen(candidate) < size) {
+        strcpy(path, candidate);
+        latest = image.snapshot;
+        found = true;
+      }
+      backup_image_close(&image);
+    }
+    munmap(data, file_size);
+  }
+  closedir(dir);
+  return found ? 0 : 1;
+}
+
+// Cuts off the end of the log, which a crash left garbled, so that the
+// records appended from now on follow the sound ones.
+// @param log Path of the log.
+// @param length Length to keep.
+// @return 0 if successful, 1 otherwise.
+static int cut_log(const char *log, uint64_t length) {
+  int fd = open(log, O_WRONLY);
+  if (fd < 0 || ftruncate(fd, (off_t)length) != 0 || fsync(fd) != 0) {
+    perror(log);
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
+
+int kvs_recover(const char *log, const char *backup, const char *directory) {
+  if (num_shards == 0) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct stat st;
+  bool missing = stat(log, &st) != 0;
+  if (missing && errno != ENOENT) {
+    perror(log);
+    return 1;
+  }
+  if (missing || st.st_size == 0) {
+    // A new log: there is nothing to replay
+    return backup != NULL ? restore_backup(backup, NULL, NULL) : 0;
+  }
+
+  char found[PATH_MAX];
+  uint64_t snapshot = 0;
+  uint64_t log_position = 0;
+  if (persisted_position != UINT64_MAX) {
+    // The shards hold every change before their checkpoint, whatever its
+    // version, so every record from it on is replayed
+    if (persisted_position > (uint64_t)st.st_size) {
+      // The log lost records a crash kept it from writing out, which the
+      // shards hold already
+      printf("%s: the shards were checkpointed past the end of the log, "
+             "nothing to replay\n", log);
+      return 0;
+    }
+    log_position = persisted_position;
+  } else {
+    if (backup == NULL && find_backup(directory, (size_t)st.st_size, found,
+                                      sizeof(found)) == 0)
+      backup = found;
+    if (backup != NULL &&
+        restore_backup(backup, &snapshot, &log_position) != 0)
+      return 1;
+  }
+  // Without a position, every record may hold something the backup misses
+  if (log_position == 0)
+    snapshot = 0;
+
+  size_t size;
+  void *data = map_file(log, &size);
+  if (data == NULL)
+    return 1;
+  posix_madvise(data, size, POSIX_MADV_WILLNEED);
+  Replay replay;
+  if (wal_image_open(&replay.image, log, data, size, log_position) != 0) {
+    munmap(data, size);
+    return 1;
+  }
+  size_t num_records = replay.image.num_records;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  replay.num_threads = cpus > 0 ? (size_t)cpus : 1;
+  if (replay.num_threads > REPLAY_MAX_THREADS)
+    replay.num_threads = REPLAY_MAX_THREADS;
+  if (replay.num_threads > num_records)
+    replay.num_threads = num_records > 0 ? num_records : 1;
+  replay.snapshot = snapshot;
+  replay.lists = calloc(replay.num_threads * replay.num_threads,
+                        sizeof(ChangeList));
+  atomic_init(&replay.garbled, num_records);
+  atomic_init(&replay.last_version, 0);
+  atomic_init(&replay.done, 0);
+  atomic_init(&replay.failed, replay.lists == NULL);
+  pthread_mutex_init(&replay.lock, NULL);
+  pthread_cond_init(&replay.finished_cond, NULL);
+
+  int result = 0;
+  if (!atomic_load(&replay.failed) && num_records > 0) {
+    struct timespec phase;
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    replay_phase(&replay, read_records, "records read", num_records);
+    size_t changes = 0;
+    size_t garbled = atomic_load(&replay.garbled);
+    for (size_t range = 0; range < replay.num_threads; range++) {
+      if (range_start(&replay, range) > garbled)
+        break;
+      for (size_t t = 0; t < replay.num_threads; t++)
+        changes += replay.lists[range * replay.num_threads + t].count;
+    }
+    printf("Read %zu log records from %s in %.2f s, %zu changes to "
+           "replay\n", garbled, log, seconds_since(&phase), changes);
+
+    // Sizes the shards if no backup filled them, as kvs_restore does
+    for (size_t s = 0; s < num_shards; s++)
+      table_reserve(kvs_shards[s], changes / num_shards);
+
+    clock_gettime(CLOCK_MONOTONIC, &phase);
+    if (!atomic_load(&replay.failed))
+      replay_phase(&replay, replay_changes, "changes replayed", changes);
+    if (!atomic_load(&replay.failed))
+      printf("Replayed %zu changes with %zu threads in %.2f s\n", changes,
+             replay.num_threads, seconds_since(&phase));
+  }
+  if (atomic_load(&replay.failed)) {
+    fprintf(stderr, "%s: out of memory replaying the log\n", log);
+    result = 1;
+  }
+
+  if (result == 0) {
+    // New commits must come after those of the log, as must their records
+    uint64_t last = atomic_load(&replay.last_version);
+    mvcc_advance(last > snapshot ? last : snapshot);
+
+    size_t garbled = atomic_load(&replay.garbled);
+    uint64_t end = garbled < num_records ? replay.image.records[garbled]
+                                         : replay.image.end;
+    if (end < size) {
+      fprintf(stderr, "%s: cutting off %llu garbled bytes at offset %llu, "
+                      "left by a crash\n", log,
+              (unsigned long long)(size - end), (unsigned long long)end);
+      result = cut_log(log, end);
+    }
+  }
+  if (result == 0) {
+    printf("Recovered in %.2f s\n", seconds_since(&start));
+    fflush(stdout);
+  }
+
+  if (replay.lists != NULL) {
+    for (size_t l = 0; l < replay.num_threads * replay.num_threads; l++)
+      free(replay.lists[l].changes);
+    free(replay.lists);
+  }
+  pthread_cond_destroy(&replay.finished_cond);
+  pthread_mutex_destroy(&replay.lock);
+  wal_image_close(&replay.image);
+  munmap(data, size);
+  return result;
+}
+
+void kvs_wait_backups(void) {
+  pthread_mutex_lock(&backups_lock);
+  while (running_backups > 0)
+    pthread_cond_wait(&backups_cond, &backups_lock);
+  pthread_mutex_unlock(&backups_lock);
+  wait_syncs();
+}
+
 void kvs_wait(unsigned int delay_ms) {
   struct timespec delay = delay_to_timespec(delay_ms);
   nanosleep(&delay, NULL);
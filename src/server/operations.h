@@ -1,8 +1,11 @@
 #ifndef KVS_OPERATIONS_H
 #define KVS_OPERATIONS_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include "constants.h"
+#include "deletions.h"
 
 typedef struct {
     int client_fd;  // Client file descriptor.
@@ -16,9 +19,47 @@ typedef struct {
     size_t rear;          // Index of the rear element.
 } Queue;
 
+/// How BACKUP writes out the KVS.
+typedef enum BackupMode {
+  // A forked child walks its copy of the table. The fork itself stalls the
+  // server for as long as copying its page tables takes, and pages written
+  // while the child runs are duplicated.
+  BACKUP_FORK,
+  // A background thread walks a snapshot of the table (see mvcc.h). Costs a
+  // thread, and keeps the old versions of the pairs written meanwhile until
+  // it is done.
+  BACKUP_THREAD
+} BackupMode;
+
+/// How backup files are laid out.
+typedef enum BackupFormat {
+  // "(key, value)" lines, see kvs_backup
+  BACKUP_TEXT,
+  // Length prefixed, checksummed blocks, see backup_file.h. What kvs_restore
+  // reads.
+  BACKUP_BINARY
+} BackupFormat;
+
 /// Initializes the KVS state.
+/// @param shards Number of independent tables the keys are spread over, at
+/// most KVS_MAX_SHARDS.
+/// @param max_memory Bytes the pairs may take (see table_memory), split
+/// evenly among the shards; past it, writes evict cold pairs. 0 for no
+/// limit.
+/// @param intern_values Whether pairs holding equal values share one copy
+/// (see table_intern_values).
+/// @param mode How BACKUP writes out the KVS.
+/// @param format How backup files are laid out.
+/// @param full_every Every how many backups of a job one is a full image;
+/// the ones in between only hold what changed since the previous one (see
+/// kvs_backup). 1 for full backups only.
+/// @param backup_threads Threads that write each backup, at most, each a
+/// range of the keys (BACKUP_THREAD only). Small tables get fewer.
+/// @param backups Backups written at once, at most (see kvs_backup).
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-int kvs_init();
+int kvs_init(size_t shards, size_t max_memory, bool intern_values,
+             BackupMode mode, BackupFormat format, size_t full_every,
+             size_t backup_threads, size_t backups);
 
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
@@ -28,34 +69,150 @@ int kvs_terminate();
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
+/// @param ttls Time to live of each pair, in milliseconds, after which the
+/// key is deleted; 0 for none. A write clears any TTL it does not set. NULL
+/// if no pair has one.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, char *keys[], char *values[],
+              const unsigned int ttls[]);
+
+/// Sets or clears the time to live of a key.
+/// @param key The key.
+/// @param ttl_ms Milliseconds until the key is deleted, 0 to keep it.
+/// @return 0 if successful, 1 if the key does not exist or on failure.
+int kvs_expire(const char *key, unsigned int ttl_ms);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @param fd File descriptor to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, char *keys[], int fd);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, char *keys[], int fd);
 
-/// Writes the state of the KVS.
+/// Writes the state of the KVS, sorted by key.
 /// @param fd File descriptor to write the output.
 void kvs_show(int fd);
 
+/// Writes a report of the memory the server uses and of what it did, one
+/// "name value" line per figure: pairs and their bytes, table shape and
+/// chain lengths, subscriptions and their fan-out, the client queue, and
+/// operation counts since start.
+/// @param fd File descriptor to write the report.
+/// @param queue Queue of waiting clients, NULL to leave it out.
+void kvs_stats(int fd, Queue *queue);
+
+/// Writes the pairs whose keys lie in [start, end], sorted by key.
+/// @param start First key of the range, empty for no lower bound.
+/// @param end Last key of the range, empty for no upper bound.
+/// @param fd File descriptor to write the output.
+/// @return 0 if successful, 1 otherwise.
+int kvs_range(const char *start, const char *end, int fd);
+
+/// The backups of one job, numbered from 1. Zeroed before the first one.
+typedef struct BackupChain {
+  size_t count;  // Backups taken so far
+  uint64_t base; // Snapshot of the last backup, 0 if the next must be full
+  bool logging;  // Whether deletions are logged for it
+  DeletionReader deletions;
+} BackupChain;
+
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(size_t num_backup, char *job_filename, char *directory);
+/// backup file. The backup holds the state as of the call, and is written
+/// out in the background; kvs_wait_backups tells when all are done.
+///
+/// At most max_backups (see kvs_init) are written at once. Past that, the
+/// backup waits for one of them to end: it takes its snapshot right away
+/// and is queued, so the job goes on meanwhile, keeping the old versions
+/// of the pairs it needs. Only the chained table can keep a snapshot
+/// without locking the table; the others copy the pairs of the backup
+/// instead, with the table locked for reading meanwhile.
+///
+/// Full backups go to <job>-<n>.bck, as "(key, value)" lines sorted by key.
+/// Deltas go to <job>-<n>.delta, and list, sorted by key, the pairs written
+/// since the previous backup of the job as "(key, value)" lines, and the
+/// keys deleted since as "(key)" lines. The checksum of a text file goes to
+/// <file>.crc (see backup_text_seal). kvs_compact folds a full backup and the
+/// deltas that follow it into a full backup. In the binary format (see
+/// kvs_init), the files hold the same entries laid out as in backup_file.h.
+///
+/// A backup is written to <file>.tmp, synced, and renamed into place once
+/// whole, so a crash never leaves a torn backup under its name. The
+/// directory is synced a few milliseconds later, once for all the backups
+/// renamed into it meanwhile.
+/// @param chain The backups of the job so far.
+/// @param job_filename Name of the job file.
+/// @param directory Directory of the job.
+/// @return 0 if the backup was started, -1 on failure.
+int kvs_backup(BackupChain *chain, char *job_filename, char *directory);
+
+/// Ends the backups of a job, once it took its last one. Its backups may
+/// still be in progress.
+/// @param chain The backups of the job.
+void kvs_backup_chain_end(BackupChain *chain);
+
+/// Keeps the shards of the KVS in files of a directory, shard-<s>-of-<n>.kvs,
+/// which needs the mmap backend (see table_persist): what the shards held
+/// at their last checkpoint is mapped back, and from then on they are
+/// checkpointed every so often. Call it as the server starts, before
+/// anything is written. If only some of the files were checkpointed, they
+/// are all started over empty, as their checkpoints may be of different
+/// times. Backups are then taken by a thread, as a forked child would share
+/// the files with the server.
+/// @param directory Directory of the files, which must exist.
+/// @param load Whether to map back what the files hold; if not, they are
+/// started over empty.
+/// @param every_s Seconds between checkpoints, 0 to only checkpoint in
+/// kvs_persist_end.
+/// @return 0 if successful, 1 otherwise.
+int kvs_persist(const char *directory, bool load, unsigned int every_s);
+
+/// Checkpoints every shard kept in a file (see table_checkpoint) at the
+/// current position of the write-ahead log. Writers wait meanwhile.
+/// @return 0 if successful, 1 otherwise.
+int kvs_checkpoint(void);
+
+/// Stops the checkpoints kvs_persist started, and takes a last one. Call it
+/// before the write-ahead log is closed.
+/// @return 0 if successful, 1 otherwise.
+int kvs_persist_end(void);
+
+/// Loads a full binary backup into the KVS, which must be empty, as the
+/// server starts. The file is mapped rather than read, the shards are sized
+/// for its pairs up front, and its blocks are checked and inserted by
+/// several threads at once. Deltas must be folded into their full backup
+/// with kvs_compact first.
+/// @param path Path of the backup.
+/// @return 0 if every pair was restored, 1 otherwise.
+int kvs_restore(const char *path);
+
+/// Recovers the KVS, which must be empty, from its write-ahead log (see
+/// wal.h) as the server starts, before the log is opened: restores a
+/// backup, then replays the changes the log holds past it. The backup is
+/// the one given or, failing that, the full binary backup in a directory
+/// with the latest snapshot among those taken while the log was kept; with
+/// none, or one that records no log position, the whole log is replayed.
+/// Shards mapped back by kvs_persist take the place of the backup: only the
+/// records past their checkpoint are replayed.
+/// The changes are read and checked a range of records per thread, then
+/// replayed by as many threads, each owning the keys of some stripes. A
+/// tail a crash left garbled is cut off the log. Progress and timings are
+/// reported on stdout.
+/// @param log Path of the log. If there is none, only the given backup is
+/// restored.
+/// @param backup Backup to restore, NULL to look for one in directory.
+/// @param directory Directory to look for backups in.
+/// @return 0 if successful, 1 otherwise.
+int kvs_recover(const char *log, const char *backup, const char *directory);
 
-/// Waits for the last backup to be called.
-void kvs_wait_backup();
+/// Waits until every backup started or queued so far is written out, and
+/// its name synced.
+void kvs_wait_backups(void);
 
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
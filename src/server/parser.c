@@ -8,18 +8,39 @@
 #include "constants.h"
 #include "io.h"
 
+// Makes room for at least one more character in a command buffer.
+// @param buffer The buffer.
+// @return 0 if successful, 1 otherwise.
+static int buffer_reserve(CommandBuffer *buffer) {
+  if (buffer->used < buffer->capacity)
+    return 0;
+  size_t capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+  char *data = realloc(buffer->data, capacity);
+  if (data == NULL)
+    return 1;
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return 0;
+}
+
+void command_buffer_free(CommandBuffer *buffer) {
+  free(buffer->data);
+  *buffer = (CommandBuffer){0};
+}
+
 // Reads a string and indicates the position from where it was
 // extracted, based on the KVS specification.
 // @param fd File to read from.
-// @param buffer To write the string in.
-// @param max Maximum string size.
-static int read_string(int fd, char *buffer, size_t max) {
+// @param buffer To append the string to, '\0' included.
+// @param offset Set to the offset of the string in the buffer. Offsets rather
+// than pointers, since the buffer may move while it grows.
+static int read_string(int fd, CommandBuffer *buffer, size_t *offset) {
   ssize_t bytes_read;
   char ch;
-  size_t i = 0;
   int value = -1;
 
-  while (i < max) {
+  *offset = buffer->used;
+  while (1) {
     bytes_read = read(fd, &ch, 1);
 
     if (bytes_read <= 0) {
@@ -41,14 +62,32 @@ static int read_string(int fd, char *buffer, size_t max) {
       break;
     }
 
-    buffer[i++] = ch;
+    if (buffer_reserve(buffer) != 0) {
+      return -1;
+    }
+    buffer->data[buffer->used++] = ch;
   }
 
-  buffer[i] = '\0';
+  if (buffer_reserve(buffer) != 0) {
+    return -1;
+  }
+  buffer->data[buffer->used++] = '\0';
 
   return value;
 }
 
+// Turns the offsets read_string handed out into pointers, once the buffer is
+// done growing.
+// @param buffer The buffer.
+// @param strings Array to store the pointers in.
+// @param offsets Offsets of the strings in the buffer.
+// @param n Number of strings.
+static void resolve_strings(CommandBuffer *buffer, char *strings[],
+                            const size_t offsets[], size_t n) {
+  for (size_t i = 0; i < n; i++)
+    strings[i] = buffer->data + offsets[i];
+}
+
 // Reads a number and stores it in an unsigned integer
 // variable.
 // @param fd File to read from.
@@ -112,12 +151,22 @@ enum Command get_next(int fd) {
     return CMD_WAIT;
 
   case 'R':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+    if (read(fd, buf + 1, 4) != 4) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    return CMD_READ;
+    if (strncmp(buf, "READ ", 5) == 0) {
+      return CMD_READ;
+    }
+
+    if (strncmp(buf, "RANGE", 5) != 0 || read(fd, buf + 5, 1) != 1 ||
+        buf[5] != ' ') {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_RANGE;
 
   case 'D':
     if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
@@ -128,7 +177,21 @@ enum Command get_next(int fd) {
     return CMD_DELETE;
 
   case 'S':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+    if (read(fd, buf + 1, 3) != 3) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    if (strncmp(buf, "STAT", 4) == 0) {
+      if (read(fd, buf + 4, 1) != 1 || buf[4] != 'S' ||
+          (read(fd, buf + 5, 1) != 0 && buf[5] != '\n')) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      return CMD_STATS;
+    }
+
+    if (strncmp(buf, "SHOW", 4) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -179,18 +242,29 @@ enum Command get_next(int fd) {
   }
 }
 
-// Parses a key value pair.
+// Parses a key value pair, with an optional TTL: (key,value[,ttl_ms]).
 // @param fd File decriptor to read from.
-// @param key Pointer where the key will be stored
-// @param value Pointer where the value will be stored
+// @param buffer Buffer to store the strings in.
+// @param key Set to the offset of the key in the buffer.
+// @param value Set to the offset of the value in the buffer.
+// @param ttl Set to the TTL in milliseconds, 0 if the pair has none.
 // @return 1 if successful, 0 otherwise.
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
+static int parse_pair(int fd, CommandBuffer *buffer, size_t *key,
+                      size_t *value, unsigned int *ttl) {
+  if (read_string(fd, buffer, key) != 0) {
     cleanup(fd);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
+  *ttl = 0;
+  int end = read_string(fd, buffer, value);
+  if (end == 0) {
+    char ch;
+    if (read_uint(fd, ttl, &ch) != 0 || ch != ')' || *ttl == 0) {
+      cleanup(fd);
+      return 0;
+    }
+  } else if (end != 1) {
     cleanup(fd);
     return 0;
   }
@@ -198,11 +272,11 @@ int parse_pair(int fd, char *key, char *value) {
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
-                   size_t max_string_size) {
+size_t parse_write(int fd, CommandBuffer *buffer, char *keys[],
+                   char *values[], unsigned int ttls[], size_t max_pairs) {
   char ch;
 
+  buffer->used = 0;
   if (read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
@@ -214,16 +288,14 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
+  size_t key_offsets[max_pairs];
+  size_t value_offsets[max_pairs];
   while (num_pairs < max_pairs) {
-    if (parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+    if (parse_pair(fd, buffer, &key_offsets[num_pairs],
+                   &value_offsets[num_pairs], &ttls[num_pairs]) == 0) {
       return 0;
     }
-
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
+    num_pairs++;
 
     if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
       cleanup(fd);
@@ -245,28 +317,31 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
     return 0;
   }
 
+  resolve_strings(buffer, keys, key_offsets, num_pairs);
+  resolve_strings(buffer, values, value_offsets, num_pairs);
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size) {
+size_t parse_read_delete(int fd, CommandBuffer *buffer, char *keys[],
+                         size_t max_keys) {
   char ch;
 
+  buffer->used = 0;
   if (read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
+  size_t key_offsets[max_keys];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_string(fd, buffer, &key_offsets[num_keys]);
     if (output < 0 || output == 1) {
       cleanup(fd);
       return 0;
     }
 
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2) {
       break;
@@ -283,9 +358,36 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
     return 0;
   }
 
+  resolve_strings(buffer, keys, key_offsets, num_keys);
   return num_keys;
 }
 
+int parse_range(int fd, CommandBuffer *buffer, char **start, char **end) {
+  char ch;
+  size_t offsets[2];
+
+  buffer->used = 0;
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read_string(fd, buffer, &offsets[0]) != 0 ||
+      read_string(fd, buffer, &offsets[1]) != 2) {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  *start = buffer->data + offsets[0];
+  *end = buffer->data + offsets[1];
+  return 1;
+}
+
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
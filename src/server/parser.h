@@ -9,7 +9,9 @@ enum Command {
   CMD_WRITE,
   CMD_READ,
   CMD_DELETE,
+  CMD_RANGE,
   CMD_SHOW,
+  CMD_STATS,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -18,33 +20,57 @@ enum Command {
   EOC // End of commands
 };
 
+/// Storage for the strings of the command being parsed. Keys and values have
+/// no length limit, so the parse functions copy them in here and hand out
+/// pointers into it, valid until the buffer is used for the next command.
+/// Start from a zeroed buffer and release it with command_buffer_free.
+typedef struct CommandBuffer {
+  char *data;
+  size_t used;
+  size_t capacity;
+} CommandBuffer;
+
+/// Frees the memory held by a command buffer.
+/// @param buffer The buffer.
+void command_buffer_free(CommandBuffer *buffer);
+
 // Parses input from the given file descriptor, according to
 // KVS specification.
 // @param fd File descriptor of input.
 // @return enum Command Command code.
 enum Command get_next(int fd);
 
-/// Parses a WRITE command.
+/// Parses a WRITE command. Each pair may carry a TTL: (key,value,ttl_ms).
 /// @param fd File descriptor to read from.
+/// @param buffer Buffer to store the strings in.
 /// @param keys Array to store the keys
 /// @param values Array to store the values
+/// @param ttls Array to store the TTLs, in milliseconds (0 for none)
 /// @param max_pairs Maximum number of pairs it will write.
-/// @param max_string_size Maximum string size allowed.
 /// @return 0 if the command was not parsed successfully, otherwise return the
 //          of pairs parsed.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
-                   size_t max_string_size);
+size_t parse_write(int fd, CommandBuffer *buffer, char *keys[],
+                   char *values[], unsigned int ttls[], size_t max_pairs);
 
 // Parses a READ or a DELETE command.
 // @param fd File descriptor to read from.
+// @param buffer Buffer to store the strings in.
 // @param keys Array to store the keys
 // @param max_pairs Maximum number of pairs it will write.
-// @param max_string_size Maximum string size allowed.
 // @return 0 if the command was not parsed successfully, otherwise return the
 //          of keys parsed
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size);
+size_t parse_read_delete(int fd, CommandBuffer *buffer, char *keys[],
+                         size_t max_keys);
+
+/// Parses a RANGE command.
+/// @param fd File descriptor to read from.
+/// @param buffer Buffer to store the strings in.
+/// @param start Set to the first key of the range, empty if the range has no
+/// lower bound.
+/// @param end Set to the last key of the range, empty if the range has no
+/// upper bound.
+/// @return 1 if successful, 0 otherwise.
+int parse_range(int fd, CommandBuffer *buffer, char **start, char **end);
 
 /// Parses a WAIT command.
 /// @param fd File descriptor to read from.
@@ -0,0 +1,187 @@
+#include "skiplist.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ebr.h"
+
+// Walks run alongside insertions and removals, so links are published with
+// release stores: a walk that reaches a node sees it fully built.
+typedef struct SkipNode {
+  uint64_t hash;
+  unsigned level;                    // Number of next pointers
+  _Atomic(struct SkipNode *) next[]; // Followed by the key and its '\0'
+} SkipNode;
+
+struct SkipList {
+  pthread_mutex_t lock; // Serializes insertions and removals
+  uint64_t seed;        // State of the level generator, under lock
+  SkipNode *head;       // Sentinel, SKIPLIST_MAX_LEVEL tall
+};
+
+// Returns the key stored in a node.
+static inline const char *node_key(const SkipNode *node) {
+  return (const char *)&node->next[node->level];
+}
+
+// Allocates a node with room for a key.
+// @param level Number of next pointers.
+// @param key The key, NULL for the head.
+// @param h Hash of the key.
+// @return The node, NULL on failure.
+static SkipNode *node_create(unsigned level, const char *key, uint64_t h) {
+  size_t key_size = key != NULL ? strlen(key) + 1 : 0;
+  SkipNode *node = malloc(sizeof(SkipNode) +
+                          level * sizeof(_Atomic(SkipNode *)) + key_size);
+  if (node == NULL)
+    return NULL;
+  node->hash = h;
+  node->level = level;
+  for (unsigned i = 0; i < level; i++)
+    atomic_init(&node->next[i], NULL);
+  if (key != NULL)
+    memcpy((char *)&node->next[level], key, key_size);
+  return node;
+}
+
+// Draws the level of a new node: each level is reached by one node in four
+// of the level below. The caller holds the list lock.
+static unsigned random_level(SkipList *list) {
+  // xorshift64
+  list->seed ^= list->seed << 13;
+  list->seed ^= list->seed >> 7;
+  list->seed ^= list->seed << 17;
+  uint64_t bits = list->seed;
+  unsigned level = 1;
+  while (level < SKIPLIST_MAX_LEVEL && (bits & 3) == 0) {
+    level++;
+    bits >>= 2;
+  }
+  return level;
+}
+
+// Returns the node following another one on a level.
+static inline SkipNode *next_node(SkipNode *node, unsigned level) {
+  return atomic_load_explicit(&node->next[level], memory_order_acquire);
+}
+
+// Finds, on every level, the last node whose key is smaller than key.
+// @param list The list.
+// @param key The key.
+// @param preds Filled with the predecessors, from level 0 up.
+// @return The first node whose key is not smaller than key, NULL if none.
+static SkipNode *find_preds(SkipList *list, const char *key,
+                            SkipNode *preds[SKIPLIST_MAX_LEVEL]) {
+  SkipNode *node = list->head;
+  for (unsigned i = SKIPLIST_MAX_LEVEL; i-- > 0;) {
+    SkipNode *next;
+    while ((next = next_node(node, i)) != NULL &&
+           strcmp(node_key(next), key) < 0)
+      node = next;
+    if (preds != NULL)
+      preds[i] = node;
+  }
+  return next_node(node, 0);
+}
+
+SkipList *skiplist_create(void) {
+  SkipList *list = malloc(sizeof(SkipList));
+  if (list == NULL)
+    return NULL;
+  list->head = node_create(SKIPLIST_MAX_LEVEL, NULL, 0);
+  if (list->head == NULL) {
+    free(list);
+    return NULL;
+  }
+  pthread_mutex_init(&list->lock, NULL);
+  list->seed = 0x9E3779B97F4A7C15ULL;
+  return list;
+}
+
+int skiplist_insert(SkipList *list, const char *key, uint64_t h) {
+  SkipNode *preds[SKIPLIST_MAX_LEVEL];
+  pthread_mutex_lock(&list->lock);
+  SkipNode *next = find_preds(list, key, preds);
+  if (next != NULL && strcmp(node_key(next), key) == 0) {
+    pthread_mutex_unlock(&list->lock);
+    return 0; // Already indexed
+  }
+
+  SkipNode *node = node_create(random_level(list), key, h);
+  if (node == NULL) {
+    pthread_mutex_unlock(&list->lock);
+    return 1;
+  }
+  // Fully linked before being published, bottom up, so searches that reach
+  // it from above find it on the levels below too
+  for (unsigned i = 0; i < node->level; i++)
+    atomic_init(&node->next[i], next_node(preds[i], i));
+  for (unsigned i = 0; i < node->level; i++)
+    atomic_store_explicit(&preds[i]->next[i], node, memory_order_release);
+  pthread_mutex_unlock(&list->lock);
+  return 0;
+}
+
+int skiplist_remove(SkipList *list, const char *key) {
+  SkipNode *preds[SKIPLIST_MAX_LEVEL];
+  pthread_mutex_lock(&list->lock);
+  SkipNode *node = find_preds(list, key, preds);
+  if (node == NULL || strcmp(node_key(node), key) != 0) {
+    pthread_mutex_unlock(&list->lock);
+    return 1;
+  }
+  // Top down, so searches stop reaching the node from above first. Walks
+  // standing on it can still follow its links.
+  for (unsigned i = node->level; i-- > 0;)
+    atomic_store_explicit(&preds[i]->next[i], next_node(node, i),
+                          memory_order_release);
+  pthread_mutex_unlock(&list->lock);
+  ebr_retire(node, free);
+  return 0;
+}
+
+void skiplist_foreach(SkipList *list, const char *start,
+                      bool (*visit)(const char *key, uint64_t h, void *arg),
+                      void *arg) {
+  SkipNode *node =
+      start != NULL ? find_preds(list, start, NULL) : next_node(list->head, 0);
+  for (; node != NULL; node = next_node(node, 0)) {
+    if (!visit(node_key(node), node->hash, arg))
+      break;
+  }
+}
+
+void skiplist_sample(SkipList *list, size_t count,
+                     bool (*visit)(const char *key, uint64_t h, void *arg),
+                     void *arg) {
+  // Each level holds about a quarter of the keys of the one below, picked
+  // at random, so the first one from the top with count keys has fewer than
+  // four times as many
+  unsigned level = SKIPLIST_MAX_LEVEL;
+  while (level-- > 1) {
+    size_t found = 0;
+    for (SkipNode *node = next_node(list->head, level);
+         node != NULL && found < count; node = next_node(node, level))
+      found++;
+    if (found >= count)
+      break;
+  }
+  for (SkipNode *node = next_node(list->head, level); node != NULL;
+       node = next_node(node, level)) {
+    if (!visit(node_key(node), node->hash, arg))
+      break;
+  }
+}
+
+void skiplist_destroy(SkipList *list) {
+  SkipNode *node = list->head;
+  while (node != NULL) {
+    SkipNode *next = next_node(node, 0);
+    free(node);
+    node = next;
+  }
+  pthread_mutex_destroy(&list->lock);
+  free(list);
+}
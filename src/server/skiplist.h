@@ -0,0 +1,65 @@
+#ifndef KVS_SKIPLIST_H
+#define KVS_SKIPLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Ordered set of keys (in strcmp order), each tagged with its hash, used by
+/// the KVS table as its sorted index. Insertions and removals are serialized
+/// by the list's own lock; walks take no lock and may run alongside them,
+/// inside an EBR critical section (see ebr.h), since removed nodes are only
+/// freed once no walk can be standing on them.
+
+/// Tallest a node can be. With one node in four promoted to the next level,
+/// this keeps searches logarithmic well past 4^16 keys.
+#define SKIPLIST_MAX_LEVEL 16
+
+typedef struct SkipList SkipList;
+
+/// Creates an empty skip list.
+/// @return The new list, NULL on failure.
+SkipList *skiplist_create(void);
+
+/// Adds a key to the list. Adding a key that is already there does nothing.
+/// @param list The list.
+/// @param key The key (copied).
+/// @param h Hash of the key, handed back by skiplist_foreach.
+/// @return 0 if successful, 1 otherwise.
+int skiplist_insert(SkipList *list, const char *key, uint64_t h);
+
+/// Removes a key from the list.
+/// @param list The list.
+/// @param key The key.
+/// @return 0 if the key was removed, 1 if it was not there.
+int skiplist_remove(SkipList *list, const char *key);
+
+/// Calls visit for every key from a given one on, in order, until visit
+/// asks to stop. Keys added or removed meanwhile may or may not be visited.
+/// @param list The list.
+/// @param start First key, NULL to start from the smallest one.
+/// @param visit Function called with each key, its hash and arg; returns
+/// whether to go on.
+/// @param arg Argument passed to visit.
+void skiplist_foreach(SkipList *list, const char *start,
+                      bool (*visit)(const char *key, uint64_t h, void *arg),
+                      void *arg);
+
+/// Calls visit, in order, for keys spread evenly over the list: those of
+/// the highest level that holds at least count keys, so count to about four
+/// times count of them, or every key if there are fewer. Runs alongside
+/// insertions and removals as skiplist_foreach does.
+/// @param list The list.
+/// @param count Number of keys wanted at least.
+/// @param visit Function called with each key, its hash and arg; returns
+/// whether to go on.
+/// @param arg Argument passed to visit.
+void skiplist_sample(SkipList *list, size_t count,
+                     bool (*visit)(const char *key, uint64_t h, void *arg),
+                     void *arg);
+
+/// Frees the list and every key in it.
+/// @param list The list.
+void skiplist_destroy(SkipList *list);
+
+#endif // KVS_SKIPLIST_H
@@ -0,0 +1,266 @@
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const size_t class_sizes[SLAB_NUM_CLASSES] = SLAB_CLASS_SIZES;
+
+// Free objects are linked through their first word.
+typedef struct FreeObject {
+  struct FreeObject *next;
+} FreeObject;
+
+// Header stored in the first object slot of every chunk. Chunks are aligned
+// to their size, so any object finds its header by masking its address.
+typedef struct SlabChunk {
+  SlabPool *pool;
+  unsigned size_class;
+  struct SlabChunk *next;
+} SlabChunk;
+
+typedef struct SlabClass {
+  pthread_mutex_t lock;
+  FreeObject *free_list;
+} SlabClass;
+
+struct SlabPool {
+  unsigned id; // Index in the per-thread caches, SLAB_MAX_POOLS if none
+  unsigned generation; // Of the id, see SlabCache
+  SlabClass classes[SLAB_NUM_CLASSES];
+  pthread_mutex_t chunks_lock;
+  SlabChunk *chunks;
+};
+
+// Objects of a pool cached by a thread. A cache whose generation is not
+// that of the pool holding its id now is of a destroyed pool, and is
+// dropped: its objects were freed with their chunks.
+typedef struct SlabCache {
+  FreeObject *head;
+  unsigned count;
+  unsigned generation;
+} SlabCache;
+
+// Ids never given out start at next_pool_id; those of destroyed pools are
+// stacked in free_ids, with their generation bumped
+static pthread_mutex_t ids_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned next_pool_id = 0;
+static unsigned free_ids[SLAB_MAX_POOLS];
+static unsigned num_free_ids = 0;
+static unsigned generations[SLAB_MAX_POOLS];
+// Live pools by id, so exiting threads know where to return their caches
+static _Atomic(SlabPool *) pools[SLAB_MAX_POOLS];
+
+static _Thread_local SlabCache caches[SLAB_MAX_POOLS][SLAB_NUM_CLASSES];
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static _Thread_local int key_set = 0;
+
+// Returns the size class that fits size, SLAB_NUM_CLASSES if none does.
+static unsigned class_of(size_t size) {
+  unsigned c = 0;
+  while (c < SLAB_NUM_CLASSES && class_sizes[c] < size)
+    c++;
+  return c;
+}
+
+static inline SlabChunk *chunk_of(const void *ptr) {
+  return (SlabChunk *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+}
+
+// Carves a new chunk into objects and pushes them to a class free list. The
+// caller holds the class lock.
+// @return 0 if successful, 1 otherwise.
+static int grow_class(SlabPool *pool, unsigned c) {
+  SlabChunk *chunk = aligned_alloc(SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE);
+  if (chunk == NULL)
+    return 1;
+  chunk->pool = pool;
+  chunk->size_class = c;
+
+  pthread_mutex_lock(&pool->chunks_lock);
+  chunk->next = pool->chunks;
+  pool->chunks = chunk;
+  pthread_mutex_unlock(&pool->chunks_lock);
+
+  // The first slot holds the header
+  char *base = (char *)chunk;
+  size_t size = class_sizes[c];
+  for (size_t offset = size; offset + size <= SLAB_CHUNK_SIZE;
+       offset += size) {
+    FreeObject *object = (FreeObject *)(void *)(base + offset);
+    object->next = pool->classes[c].free_list;
+    pool->classes[c].free_list = object;
+  }
+  return 0;
+}
+
+// Moves up to SLAB_BATCH objects from a pool to a thread cache.
+// @return 0 if at least one object was moved, 1 otherwise.
+static int cache_refill(SlabPool *pool, unsigned c, SlabCache *cache) {
+  SlabClass *sc = &pool->classes[c];
+  pthread_mutex_lock(&sc->lock);
+  if (sc->free_list == NULL && grow_class(pool, c) != 0) {
+    pthread_mutex_unlock(&sc->lock);
+    return 1;
+  }
+  for (unsigned i = 0; i < SLAB_BATCH && sc->free_list != NULL; i++) {
+    FreeObject *object = sc->free_list;
+    sc->free_list = object->next;
+    object->next = cache->head;
+    cache->head = object;
+    cache->count++;
+  }
+  pthread_mutex_unlock(&sc->lock);
+  return 0;
+}
+
+// Returns up to max objects of a thread cache to their pool.
+static void cache_flush(SlabPool *pool, unsigned c, SlabCache *cache,
+                        unsigned max) {
+  SlabClass *sc = &pool->classes[c];
+  pthread_mutex_lock(&sc->lock);
+  for (unsigned i = 0; i < max && cache->head != NULL; i++) {
+    FreeObject *object = cache->head;
+    cache->head = object->next;
+    cache->count--;
+    object->next = sc->free_list;
+    sc->free_list = object;
+  }
+  pthread_mutex_unlock(&sc->lock);
+}
+
+// Returns every cached object of an exiting thread to its pool.
+static void thread_exit(void *arg) {
+  (void)arg;
+  for (unsigned p = 0; p < SLAB_MAX_POOLS; p++) {
+    SlabPool *pool = atomic_load(&pools[p]);
+    if (pool == NULL)
+      continue;
+    for (unsigned c = 0; c < SLAB_NUM_CLASSES; c++) {
+      if (caches[p][c].generation == pool->generation)
+        cache_flush(pool, c, &caches[p][c], UINT32_MAX);
+    }
+  }
+}
+
+static void make_key(void) { pthread_key_create(&thread_key, thread_exit); }
+
+// Returns this thread's cache of a class, making sure it is flushed back to
+// the pool when the thread exits.
+static SlabCache *thread_cache(const SlabPool *pool, unsigned c) {
+  if (!key_set) {
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(thread_key, caches);
+    key_set = 1;
+  }
+  SlabCache *cache = &caches[pool->id][c];
+  if (cache->generation != pool->generation)
+    *cache = (SlabCache){NULL, 0, pool->generation};
+  return cache;
+}
+
+SlabPool *slab_pool_create(void) {
+  SlabPool *pool = malloc(sizeof(SlabPool));
+  if (pool == NULL)
+    return NULL;
+  for (unsigned c = 0; c < SLAB_NUM_CLASSES; c++) {
+    pthread_mutex_init(&pool->classes[c].lock, NULL);
+    pool->classes[c].free_list = NULL;
+  }
+  pthread_mutex_init(&pool->chunks_lock, NULL);
+  pool->chunks = NULL;
+
+  pthread_mutex_lock(&ids_lock);
+  if (num_free_ids > 0)
+    pool->id = free_ids[--num_free_ids];
+  else if (next_pool_id < SLAB_MAX_POOLS)
+    pool->id = next_pool_id++;
+  else
+    pool->id = SLAB_MAX_POOLS;
+  if (pool->id < SLAB_MAX_POOLS) {
+    pool->generation = generations[pool->id];
+    atomic_store(&pools[pool->id], pool);
+  }
+  pthread_mutex_unlock(&ids_lock);
+  return pool;
+}
+
+void *slab_alloc(SlabPool *pool, size_t size) {
+  unsigned c = class_of(size);
+  if (c == SLAB_NUM_CLASSES)
+    return NULL;
+
+  if (pool->id == SLAB_MAX_POOLS) {
+    // No thread cache for this pool
+    SlabClass *sc = &pool->classes[c];
+    pthread_mutex_lock(&sc->lock);
+    FreeObject *object = NULL;
+    if (sc->free_list != NULL || grow_class(pool, c) == 0) {
+      object = sc->free_list;
+      sc->free_list = object->next;
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return object;
+  }
+
+  SlabCache *cache = thread_cache(pool, c);
+  if (cache->head == NULL && cache_refill(pool, c, cache) != 0)
+    return NULL;
+  FreeObject *object = cache->head;
+  cache->head = object->next;
+  cache->count--;
+  return object;
+}
+
+void slab_free(void *ptr) {
+  if (ptr == NULL)
+    return;
+  SlabChunk *chunk = chunk_of(ptr);
+  SlabPool *pool = chunk->pool;
+  unsigned c = chunk->size_class;
+  FreeObject *object = ptr;
+
+  if (pool->id == SLAB_MAX_POOLS) {
+    SlabClass *sc = &pool->classes[c];
+    pthread_mutex_lock(&sc->lock);
+    object->next = sc->free_list;
+    sc->free_list = object;
+    pthread_mutex_unlock(&sc->lock);
+    return;
+  }
+
+  SlabCache *cache = thread_cache(pool, c);
+  object->next = cache->head;
+  cache->head = object;
+  if (++cache->count > 2 * SLAB_BATCH)
+    cache_flush(pool, c, cache, SLAB_BATCH);
+}
+
+size_t slab_size(const void *ptr) {
+  return class_sizes[chunk_of(ptr)->size_class];
+}
+
+void slab_pool_destroy(SlabPool *pool) {
+  if (pool->id < SLAB_MAX_POOLS) {
+    // Objects cached by any thread point into the chunks freed below: the
+    // new generation has the next pool of this id drop them
+    pthread_mutex_lock(&ids_lock);
+    atomic_store(&pools[pool->id], NULL);
+    generations[pool->id]++;
+    free_ids[num_free_ids++] = pool->id;
+    pthread_mutex_unlock(&ids_lock);
+  }
+  SlabChunk *chunk = pool->chunks;
+  while (chunk != NULL) {
+    SlabChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  for (unsigned c = 0; c < SLAB_NUM_CLASSES; c++)
+    pthread_mutex_destroy(&pool->classes[c].lock);
+  pthread_mutex_destroy(&pool->chunks_lock);
+  free(pool);
+}
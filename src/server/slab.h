@@ -0,0 +1,49 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stddef.h>
+
+/// Size classes served by the slab allocator, in bytes. Every class is a
+/// multiple of the cache line size, so objects never share a line.
+#define SLAB_CLASS_SIZES {64, 128, 256}
+#define SLAB_NUM_CLASSES 3
+#define SLAB_MAX_OBJECT_SIZE 256
+
+/// Objects are carved from chunks of this size, aligned to it.
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+/// Objects moved between a thread cache and its pool at a time.
+#define SLAB_BATCH 32
+
+/// Pools that get per-thread caches at once: every shard of the KVS, with
+/// room for the tables created while others still live (see kvs.c). The ids
+/// of destroyed pools are reused. Pools created past this limit still work,
+/// but every allocation goes through the pool lock.
+#define SLAB_MAX_POOLS 128
+
+typedef struct SlabPool SlabPool;
+
+/// Creates a pool of fixed size objects.
+/// @return The new pool, NULL on failure.
+SlabPool *slab_pool_create(void);
+
+/// Allocates an object of at least the given size. Served from the calling
+/// thread's cache whenever possible, so most calls take no lock.
+/// @param pool Pool to allocate from.
+/// @param size Object size, at most SLAB_MAX_OBJECT_SIZE.
+/// @return The object (cache line aligned), NULL on failure.
+void *slab_alloc(SlabPool *pool, size_t size);
+
+/// Returns an object to the pool it came from.
+/// @param ptr Object returned by slab_alloc.
+void slab_free(void *ptr);
+
+/// Returns the usable size of an object (its size class).
+/// @param ptr Object returned by slab_alloc.
+size_t slab_size(const void *ptr);
+
+/// Frees a pool and every object allocated from it.
+/// @param pool Pool to destroy.
+void slab_pool_destroy(SlabPool *pool);
+
+#endif // KVS_SLAB_H
@@ -0,0 +1,95 @@
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// One thread's copy of the counters. Only its thread writes to it; the
+// atomics let stats_sum read it meanwhile without tearing.
+typedef struct StatBlock {
+  _Alignas(64) _Atomic int64_t counters[STAT_COUNTERS];
+  struct StatBlock *next;
+} StatBlock;
+
+static const char *stat_names[STAT_COUNTERS] = {
+    "keys",        "key_bytes",   "value_bytes", "overhead_bytes",
+    "interned_values",            "writes",      "reads",
+    "read_misses", "deletes",     "evictions",   "expirations",
+    "notifications"};
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static StatBlock *blocks = NULL; // Blocks of the running threads
+// What finished threads counted, and updates that found no block
+static int64_t retired[STAT_COUNTERS];
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local StatBlock *local_block = NULL;
+
+// Folds the block of a finishing thread into the retired counters.
+static void retire_block(void *ptr) {
+  StatBlock *block = ptr;
+  pthread_mutex_lock(&blocks_lock);
+  for (StatBlock **link = &blocks; *link != NULL; link = &(*link)->next) {
+    if (*link == block) {
+      *link = block->next;
+      break;
+    }
+  }
+  for (int c = 0; c < STAT_COUNTERS; c++)
+    retired[c] += atomic_load_explicit(&block->counters[c],
+                                       memory_order_relaxed);
+  pthread_mutex_unlock(&blocks_lock);
+  free(block);
+}
+
+static void create_block_key(void) {
+  pthread_key_create(&block_key, retire_block);
+}
+
+// Gives the calling thread its block.
+// @return The block, NULL on failure.
+static StatBlock *register_block(void) {
+  pthread_once(&block_key_once, create_block_key);
+  StatBlock *block = calloc(1, sizeof(StatBlock));
+  if (block == NULL)
+    return NULL;
+  if (pthread_setspecific(block_key, block) != 0) {
+    free(block);
+    return NULL;
+  }
+  pthread_mutex_lock(&blocks_lock);
+  block->next = blocks;
+  blocks = block;
+  pthread_mutex_unlock(&blocks_lock);
+  local_block = block;
+  return block;
+}
+
+void stat_add(StatCounter counter, int64_t delta) {
+  StatBlock *block = local_block;
+  if (block == NULL && (block = register_block()) == NULL) {
+    pthread_mutex_lock(&blocks_lock);
+    retired[counter] += delta;
+    pthread_mutex_unlock(&blocks_lock);
+    return;
+  }
+  // Single writer: a load and a store, no locked instruction
+  _Atomic int64_t *value = &block->counters[counter];
+  atomic_store_explicit(
+      value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+      memory_order_relaxed);
+}
+
+void stats_sum(int64_t totals[STAT_COUNTERS]) {
+  pthread_mutex_lock(&blocks_lock);
+  for (int c = 0; c < STAT_COUNTERS; c++)
+    totals[c] = retired[c];
+  for (StatBlock *block = blocks; block != NULL; block = block->next) {
+    for (int c = 0; c < STAT_COUNTERS; c++)
+      totals[c] += atomic_load_explicit(&block->counters[c],
+                                        memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+const char *stat_name(StatCounter counter) { return stat_names[counter]; }
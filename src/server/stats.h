@@ -0,0 +1,43 @@
+#ifndef KVS_STATS_H
+#define KVS_STATS_H
+
+#include <stdint.h>
+
+/// Server-wide counters. Every thread bumps its own copy, with plain relaxed
+/// stores and no shared cache line, so counting costs next to nothing on the
+/// write path; the copies are only summed when a report asks for them.
+
+typedef enum StatCounter {
+  STAT_KEYS,            // Keys in the KVS
+  STAT_KEY_BYTES,       // Characters of those keys, '\0' not counted
+  STAT_VALUE_BYTES,     // Characters of their values, '\0' not counted
+  STAT_OVERHEAD_BYTES,  // Rest of the memory the pairs take (nodes or slots,
+                        // terminators, allocator rounding), see table_memory
+  STAT_INTERNED_VALUES, // Distinct values shared by pairs (see intern.h);
+                        // each counts once in the value and overhead bytes
+  STAT_WRITES,          // Pairs written
+  STAT_READS,           // Keys read
+  STAT_READ_MISSES,     // Keys read that were not there
+  STAT_DELETES,         // Keys deleted by DELETE
+  STAT_EVICTIONS,       // Keys evicted to stay within --max-memory
+  STAT_EXPIRATIONS,     // Keys deleted when their TTL ran out
+  STAT_NOTIFICATIONS,   // Notifications sent to subscribers
+  STAT_COUNTERS         // Number of counters
+} StatCounter;
+
+/// Adds to a counter, in the calling thread's copy.
+/// @param counter The counter.
+/// @param delta Amount to add, negative to subtract.
+void stat_add(StatCounter counter, int64_t delta);
+
+/// Sums the copies of every counter, of running and finished threads alike.
+/// Counters other threads update meanwhile may be off by their latest
+/// updates, but never torn.
+/// @param totals Filled with the sum of each counter.
+void stats_sum(int64_t totals[STAT_COUNTERS]);
+
+/// Returns the name a counter is reported under.
+/// @param counter The counter.
+const char *stat_name(StatCounter counter);
+
+#endif // KVS_STATS_H
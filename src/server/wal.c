@@ -0,0 +1,503 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "crc32c.h"
+
+#define WAL_MAGIC_LEN 8
+#define WAL_FORMAT_VERSION 1
+#define WAL_HEADER_SIZE 12
+// Length and CRC of a record, then its version and number of entries
+#define RECORD_HEADER_SIZE 8
+#define PAYLOAD_HEADER_SIZE 12
+#define ENTRY_HEADER_SIZE 7
+
+#define ENTRY_WRITE 1
+#define ENTRY_DELETION 2
+
+// Bytes a record buffer starts with.
+#define RECORD_INITIAL_SIZE 4096
+
+// The record a thread is building, see wal_begin.
+typedef struct Record {
+  unsigned char *data; // Header room included
+  size_t used;
+  size_t capacity;
+  uint32_t count;
+  bool failed; // Out of memory, the record is dropped
+} Record;
+
+static pthread_key_t record_key; // Frees the buffers of finishing threads
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local Record record = {NULL, 0, 0, 0, false};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t appended; // Signaled when a record is appended, or to stop
+  pthread_cond_t synced;   // Broadcast when durable moves on
+  pthread_t thread;
+  bool running;
+  bool stop;
+  int fd;
+  WalDurability durability;
+  unsigned int window_ms;
+  // Records appended and not handed to the log thread yet
+  unsigned char *pending;
+  size_t pending_used;
+  size_t pending_capacity;
+  uint64_t end;     // Position past the last record appended
+  uint64_t durable; // Position up to which the log was written out
+} wal = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+// Whether the log is open, read by writers without the lock
+static atomic_bool enabled = false;
+
+static void create_record_key(void) { pthread_key_create(&record_key, free); }
+
+static inline void put_u16(unsigned char *p, uint16_t v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+static inline void put_u32(unsigned char *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline uint16_t get_u16(const unsigned char *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static inline uint32_t get_u32(const unsigned char *p) {
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+static inline uint64_t get_u64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+// Makes room for more bytes in the calling thread's record.
+// @return 0 if successful, 1 otherwise.
+static int record_reserve(size_t bytes) {
+  if (record.capacity - record.used >= bytes)
+    return 0;
+  size_t capacity = record.capacity ? record.capacity : RECORD_INITIAL_SIZE;
+  while (capacity - record.used < bytes)
+    capacity *= 2;
+  unsigned char *data = realloc(record.data, capacity);
+  if (data == NULL)
+    return 1;
+  pthread_once(&record_key_once, create_record_key);
+  pthread_setspecific(record_key, data);
+  record.data = data;
+  record.capacity = capacity;
+  return 0;
+}
+
+// Writes out a buffer whole.
+// @return 0 if successful, 1 otherwise.
+static int write_out(int fd, const unsigned char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    data += written;
+    size -= (size_t)written;
+  }
+  return 0;
+}
+
+// Writes out the records appended, a batch at a time: every window, or as
+// soon as there are any with WAL_PER_OP.
+static void *log_thread(void *arg) {
+  (void)arg;
+  unsigned char *batch = NULL; // Buffer swapped with pending
+  size_t batch_capacity = 0;
+  bool failed = false;
+
+  pthread_mutex_lock(&wal.lock);
+  while (1) {
+    if (wal.durability == WAL_PER_OP) {
+      while (wal.pending_used == 0 && !wal.stop)
+        pthread_cond_wait(&wal.appended, &wal.lock);
+    } else if (!wal.stop) {
+      struct timespec until;
+      clock_gettime(CLOCK_MONOTONIC, &until);
+      until.tv_sec += wal.window_ms / 1000;
+      until.tv_nsec += (long)(wal.window_ms % 1000) * 1000000;
+      if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+      }
+      // Appenders do not signal in these modes; only stopping does
+      while (!wal.stop &&
+             pthread_cond_timedwait(&wal.appended, &wal.lock, &until) !=
+                 ETIMEDOUT)
+        ;
+    }
+    if (wal.pending_used == 0) {
+      if (wal.stop)
+        break;
+      continue;
+    }
+
+    // Appenders go on filling the other buffer meanwhile
+    unsigned char *data = wal.pending;
+    size_t capacity = wal.pending_capacity;
+    size_t size = wal.pending_used;
+    uint64_t end = wal.end;
+    wal.pending = batch;
+    wal.pending_capacity = batch_capacity;
+    wal.pending_used = 0;
+    pthread_mutex_unlock(&wal.lock);
+
+    if (!failed) {
+      failed = write_out(wal.fd, data, size) != 0 ||
+               (wal.durability != WAL_NONE && fdatasync(wal.fd) != 0);
+      if (failed)
+        perror("Failed to write the log, changes are no longer logged");
+    }
+    batch = data;
+    batch_capacity = capacity;
+
+    pthread_mutex_lock(&wal.lock);
+    // Writers waiting on a log that fails are let go all the same
+    wal.durable = end;
+    pthread_cond_broadcast(&wal.synced);
+  }
+  pthread_mutex_unlock(&wal.lock);
+  free(batch);
+  return NULL;
+}
+
+int wal_open(const char *path, WalDurability durability,
+             unsigned int window_ms) {
+  if (wal.fd >= 0) {
+    fprintf(stderr, "The log is already open\n");
+    return 1;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  if (st.st_size > 0) {
+    // Appending to anything but a log would ruin it
+    char magic[WAL_MAGIC_LEN];
+    if (pread(fd, magic, WAL_MAGIC_LEN, 0) != WAL_MAGIC_LEN ||
+        memcmp(magic, WAL_MAGIC, WAL_MAGIC_LEN) != 0) {
+      fprintf(stderr, "%s: not a log\n", path);
+      close(fd);
+      return 1;
+    }
+  } else {
+    unsigned char header[WAL_HEADER_SIZE];
+    memcpy(header, WAL_MAGIC, WAL_MAGIC_LEN);
+    put_u32(header + WAL_MAGIC_LEN, WAL_FORMAT_VERSION);
+    if (write_out(fd, header, sizeof(header)) != 0 || fdatasync(fd) != 0) {
+      perror(path);
+      close(fd);
+      return 1;
+    }
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wal.appended, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&wal.synced, NULL);
+
+  pthread_mutex_lock(&wal.lock);
+  wal.fd = fd;
+  wal.durability = durability;
+  wal.window_ms = window_ms > 0 ? window_ms : 1;
+  wal.stop = false;
+  wal.end = wal.durable = (uint64_t)st.st_size;
+  if (wal.end == 0)
+    wal.end = wal.durable = WAL_HEADER_SIZE;
+  if (pthread_create(&wal.thread, NULL, log_thread, NULL) != 0) {
+    wal.fd = -1;
+    pthread_mutex_unlock(&wal.lock);
+    close(fd);
+    fprintf(stderr, "Failed to start the log thread\n");
+    return 1;
+  }
+  wal.running = true;
+  atomic_store(&enabled, true);
+  pthread_mutex_unlock(&wal.lock);
+  return 0;
+}
+
+void wal_close(void) {
+  pthread_mutex_lock(&wal.lock);
+  if (!wal.running) {
+    pthread_mutex_unlock(&wal.lock);
+    return;
+  }
+  atomic_store(&enabled, false);
+  wal.stop = true;
+  pthread_cond_signal(&wal.appended);
+  pthread_mutex_unlock(&wal.lock);
+  // The log thread writes out what is left before it goes
+  pthread_join(wal.thread, NULL);
+
+  pthread_mutex_lock(&wal.lock);
+  wal.running = false;
+  pthread_cond_broadcast(&wal.synced);
+  if (wal.durability == WAL_NONE && fdatasync(wal.fd) != 0)
+    perror("Failed to sync the log");
+  close(wal.fd);
+  wal.fd = -1;
+  free(wal.pending);
+  wal.pending = NULL;
+  wal.pending_capacity = 0;
+  pthread_mutex_unlock(&wal.lock);
+  pthread_cond_destroy(&wal.appended);
+  pthread_cond_destroy(&wal.synced);
+}
+
+bool wal_enabled(void) { return atomic_load(&enabled); }
+
+void wal_begin(uint64_t version) {
+  record.used = 0;
+  record.count = 0;
+  record.failed = !wal_enabled() ||
+                  record_reserve(RECORD_HEADER_SIZE + PAYLOAD_HEADER_SIZE) != 0;
+  if (record.failed)
+    return;
+  put_u64(record.data + RECORD_HEADER_SIZE, version);
+  record.used = RECORD_HEADER_SIZE + PAYLOAD_HEADER_SIZE;
+}
+
+void wal_add(const char *key, const char *value) {
+  if (record.failed)
+    return;
+  size_t key_len = strlen(key);
+  size_t value_len = value != NULL ? strlen(value) : 0;
+  size_t bytes = ENTRY_HEADER_SIZE + key_len + 1;
+  if (value != NULL)
+    bytes += value_len + 1;
+  if (key_len > UINT16_MAX || value_len >= UINT32_MAX ||
+      record_reserve(bytes) != 0) {
+    record.failed = true;
+    fprintf(stderr, "Failed to log the change of key %s\n", key);
+    return;
+  }
+  unsigned char *p = record.data + record.used;
+  p[0] = value != NULL ? ENTRY_WRITE : ENTRY_DELETION;
+  put_u16(p + 1, (uint16_t)key_len);
+  put_u32(p + 3, (uint32_t)value_len);
+  memcpy(p + ENTRY_HEADER_SIZE, key, key_len + 1);
+  if (value != NULL)
+    memcpy(p + ENTRY_HEADER_SIZE + key_len + 1, value, value_len + 1);
+  record.used += bytes;
+  record.count++;
+}
+
+uint64_t wal_commit(void) {
+  if (record.failed || record.count == 0)
+    return 0;
+  size_t payload = record.used - RECORD_HEADER_SIZE;
+  if (payload > UINT32_MAX) {
+    fprintf(stderr, "Commit too large to be logged\n");
+    return 0;
+  }
+  put_u32(record.data + RECORD_HEADER_SIZE + 8, record.count);
+  put_u32(record.data, (uint32_t)payload);
+  put_u32(record.data + 4,
+          crc32c(0, record.data + RECORD_HEADER_SIZE, payload));
+
+  uint64_t position = 0;
+  pthread_mutex_lock(&wal.lock);
+  if (wal.running && !wal.stop) {
+    size_t needed = wal.pending_used + record.used;
+    if (needed > wal.pending_capacity) {
+      size_t capacity = wal.pending_capacity ? wal.pending_capacity : 1;
+      while (capacity < needed)
+        capacity *= 2;
+      unsigned char *grown = realloc(wal.pending, capacity);
+      if (grown != NULL) {
+        wal.pending = grown;
+        wal.pending_capacity = capacity;
+      }
+    }
+    if (needed <= wal.pending_capacity) {
+      memcpy(wal.pending + wal.pending_used, record.data, record.used);
+      wal.pending_used = needed;
+      wal.end += record.used;
+      position = wal.end;
+      if (wal.durability == WAL_PER_OP)
+        pthread_cond_signal(&wal.appended);
+    } else {
+      fprintf(stderr, "Failed to log a commit\n");
+    }
+  }
+  pthread_mutex_unlock(&wal.lock);
+  return position;
+}
+
+void wal_sync(uint64_t position) {
+  if (position == 0 || wal.durability != WAL_PER_OP)
+    return;
+  pthread_mutex_lock(&wal.lock);
+  while (wal.durable < position && wal.running)
+    pthread_cond_wait(&wal.synced, &wal.lock);
+  pthread_mutex_unlock(&wal.lock);
+}
+
+uint64_t wal_position(void) {
+  pthread_mutex_lock(&wal.lock);
+  uint64_t position = wal.running ? wal.end : 0;
+  pthread_mutex_unlock(&wal.lock);
+  return position;
+}
+
+int wal_image_open(WalImage *image, const char *path, const void *data,
+                   size_t size, uint64_t from) {
+  image->path = path;
+  image->data = data;
+  image->size = size;
+  image->num_records = 0;
+  image->records = NULL;
+  image->end = 0;
+  // A crash as the log was created may have left part of its header
+  if (size < WAL_HEADER_SIZE) {
+    if (memcmp(data, WAL_MAGIC, size < WAL_MAGIC_LEN ? size
+                                                     : WAL_MAGIC_LEN) != 0) {
+      fprintf(stderr, "%s: not a log\n", path);
+      return 1;
+    }
+    if (from > WAL_HEADER_SIZE) {
+      fprintf(stderr, "%s: no record starts at position %llu\n", path,
+              (unsigned long long)from);
+      return 1;
+    }
+    return 0;
+  }
+  const unsigned char *p = data;
+  if (memcmp(p, WAL_MAGIC, WAL_MAGIC_LEN) != 0) {
+    fprintf(stderr, "%s: not a log\n", path);
+    return 1;
+  }
+  if (get_u32(p + WAL_MAGIC_LEN) != WAL_FORMAT_VERSION) {
+    fprintf(stderr, "%s: unsupported format version %u\n", path,
+            get_u32(p + WAL_MAGIC_LEN));
+    return 1;
+  }
+  if (from < WAL_HEADER_SIZE)
+    from = WAL_HEADER_SIZE;
+
+  // Records are found from the start, so that a position that is not where
+  // a record starts, as one from another log would be, is caught. Only the
+  // lengths are read
+  uint64_t offset = WAL_HEADER_SIZE;
+  size_t capacity = 0;
+  while (size - offset >= RECORD_HEADER_SIZE + PAYLOAD_HEADER_SIZE) {
+    uint64_t bytes = RECORD_HEADER_SIZE + (uint64_t)get_u32(p + offset);
+    if (bytes < RECORD_HEADER_SIZE + PAYLOAD_HEADER_SIZE ||
+        bytes > size - offset)
+      break;
+    if (offset >= from) {
+      if (image->num_records == capacity) {
+        capacity = capacity ? capacity * 2 : 1024;
+        uint64_t *grown = realloc(image->records, capacity * sizeof(uint64_t));
+        if (grown == NULL) {
+          fprintf(stderr, "%s: out of memory\n", path);
+          wal_image_close(image);
+          return 1;
+        }
+        image->records = grown;
+      }
+      image->records[image->num_records++] = offset;
+    }
+    offset += bytes;
+  }
+  image->end = offset;
+  if (from > offset || (from < offset && image->records[0] != from)) {
+    fprintf(stderr, "%s: no record starts at position %llu\n", path,
+            (unsigned long long)from);
+    wal_image_close(image);
+    return 1;
+  }
+  return 0;
+}
+
+int wal_record_foreach(const WalImage *image, size_t index,
+                       void (*visit)(uint64_t version, const char *key,
+                                     const char *value, void *arg),
+                       void *arg) {
+  const unsigned char *p = image->data + image->records[index];
+  uint32_t payload = get_u32(p);
+  p += RECORD_HEADER_SIZE;
+  if (get_u32(p - 4) != crc32c(0, p, payload))
+    return 1;
+  uint64_t version = get_u64(p);
+  uint32_t count = get_u32(p + 8);
+
+  // Every entry is checked before any is visited
+  size_t at = PAYLOAD_HEADER_SIZE;
+  for (uint32_t i = 0; i < count; i++) {
+    if (payload - at < ENTRY_HEADER_SIZE)
+      return 1;
+    unsigned kind = p[at];
+    size_t key_len = get_u16(p + at + 1);
+    size_t value_len = get_u32(p + at + 3);
+    size_t bytes = ENTRY_HEADER_SIZE + key_len + 1;
+    if (kind == ENTRY_WRITE)
+      bytes += value_len + 1;
+    else if (kind != ENTRY_DELETION || value_len != 0)
+      return 1;
+    if (payload - at < bytes || p[at + ENTRY_HEADER_SIZE + key_len] != '\0' ||
+        p[at + bytes - 1] != '\0')
+      return 1;
+    at += bytes;
+  }
+  if (at != payload)
+    return 1;
+
+  at = PAYLOAD_HEADER_SIZE;
+  for (uint32_t i = 0; i < count; i++) {
+    size_t key_len = get_u16(p + at + 1);
+    const char *key = (const char *)p + at + ENTRY_HEADER_SIZE;
+    const char *value = NULL;
+    size_t bytes = ENTRY_HEADER_SIZE + key_len + 1;
+    if (p[at] == ENTRY_WRITE) {
+      value = key + key_len + 1;
+      bytes += get_u32(p + at + 3) + 1;
+    }
+    visit(version, key, value, arg);
+    at += bytes;
+  }
+  return 0;
+}
+
+void wal_image_close(WalImage *image) {
+  free(image->records);
+  image->records = NULL;
+  image->num_records = 0;
+}
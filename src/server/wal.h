@@ -0,0 +1,133 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Write-ahead log: every change made to the KVS is appended to a file, so
+/// that the state a crash loses can be rebuilt from it.
+///
+/// Writers build a record of their commit in a buffer of their own, then
+/// append it to the log in memory while still holding the stripes of its
+/// keys, so records of the same key are in commit order. A log thread
+/// writes out whatever was appended meanwhile in a single write, followed by
+/// a single fdatasync: concurrent commits share the cost of making them
+/// durable (group commit).
+///
+/// The file starts with WAL_MAGIC and a format version (u32), and is then a
+/// sequence of records, numbers little endian:
+///
+///   payload bytes (u32), payload CRC-32C (u32), then the payload: version
+///   of the commit (u64, see mvcc.h), entries (u32), and the entries, each
+///   as in a binary backup (see backup_file.h): kind (u8, 1 for a write,
+///   2 for a deletion), key length (u16), value length (u32), the key and
+///   the value, each followed by a '\0' (deletions have no value).
+///
+/// Time to live settings are not logged.
+///
+/// A crash may leave the last records written cut short or garbled: the log
+/// ends before the first record that is, which recovery cuts off before
+/// anything is appended (see kvs_recover).
+
+#define WAL_MAGIC "KVSWALOG"
+
+/// When the changes made to the KVS are on disk.
+typedef enum WalDurability {
+  // Written out every window, never synced: survives the server crashing,
+  // not the machine.
+  WAL_NONE,
+  // Written out and synced every window. Writers never wait: a crash loses
+  // at most the last window.
+  WAL_BATCHED,
+  // Written out and synced as soon as possible. Writers wait until their
+  // changes are durable, sharing each sync with every writer that committed
+  // while the previous one ran.
+  WAL_PER_OP
+} WalDurability;
+
+/// Opens the log, appending to the file if it exists, and starts the log
+/// thread. Until then, nothing is logged.
+/// @param path Path of the log file.
+/// @param durability When changes are on disk.
+/// @param window_ms Time between writes of the log (WAL_NONE, WAL_BATCHED).
+/// @return 0 if successful, 1 otherwise.
+int wal_open(const char *path, WalDurability durability,
+             unsigned int window_ms);
+
+/// Writes out and syncs whatever was logged, and closes the log.
+void wal_close(void);
+
+/// Tells whether changes are being logged.
+bool wal_enabled(void);
+
+/// Starts the record of a commit, in the calling thread's buffer.
+/// @param version Version of the commit.
+void wal_begin(uint64_t version);
+
+/// Adds a change to the record started by wal_begin.
+/// @param key The key.
+/// @param value Its new value, NULL if it was deleted.
+void wal_add(const char *key, const char *value);
+
+/// Appends the record built since wal_begin to the log, if it has any
+/// change. Call it within the commit, holding the stripes of its keys.
+/// @return Position to pass to wal_sync, 0 if nothing was appended.
+uint64_t wal_commit(void);
+
+/// Waits until the log is durable up to a position, if writers wait for
+/// their changes (WAL_PER_OP). Call it once the stripes are released, so
+/// that other writers can join the same sync.
+/// @param position Position returned by wal_commit.
+void wal_sync(uint64_t position);
+
+/// Returns the position past the last record appended. Read before taking
+/// a snapshot, it tells where the records of the commits the snapshot may
+/// miss start: every record before it is of a commit the snapshot sees.
+/// @return The position, 0 if the log is not open.
+uint64_t wal_position(void);
+
+/// A log read back for recovery, usually mapped. Only the lengths of the
+/// records are looked at when it is opened; records are checked as they are
+/// read.
+typedef struct WalImage {
+  const char *path; // For errors
+  const unsigned char *data;
+  size_t size;
+  size_t num_records;
+  uint64_t *records; // Offset of every record from the position on
+  uint64_t end;      // Where the last whole record ends
+} WalImage;
+
+/// Opens a log held in memory and finds its records from a position on.
+/// The log ends at the first record cut short. Reports errors on stderr.
+/// @param image Filled with the log.
+/// @param path Path of the file, for errors.
+/// @param data The file, which must outlive the image.
+/// @param size Its size.
+/// @param from Position of the first record wanted, 0 for the first one.
+/// @return 0 if successful, 1 if the file is not a log, or no record of it
+/// starts at the position.
+int wal_image_open(WalImage *image, const char *path, const void *data,
+                   size_t size, uint64_t from);
+
+/// Checks a record and calls visit for each of its changes, in order. Safe
+/// to call from several threads at once.
+/// @param image The log.
+/// @param index Index of the record, below image->num_records.
+/// @param visit Function called with the version of the commit, the key,
+/// its new value (NULL if it was deleted) and arg. The strings lie in the
+/// image.
+/// @param arg Argument passed to visit.
+/// @return 0 if successful, 1 if the record is garbled (visit is then not
+/// called for any of its changes).
+int wal_record_foreach(const WalImage *image, size_t index,
+                       void (*visit)(uint64_t version, const char *key,
+                                     const char *value, void *arg),
+                       void *arg);
+
+/// Frees what wal_image_open allocated. The file itself is left alone.
+/// @param image The log.
+void wal_image_close(WalImage *image);
+
+#endif // KVS_WAL_H